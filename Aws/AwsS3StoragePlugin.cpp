@@ -19,18 +19,26 @@
  **/
 
 #include "AwsS3StoragePlugin.h"
+#include "../Common/ParallelRangeReader.h"
 #include <Logging.h>
 
 #include <aws/core/Aws.h>
 #include <aws/s3/S3Client.h>
 #include <aws/s3/model/PutObjectRequest.h>
+#include <aws/s3/model/CreateMultipartUploadRequest.h>
+#include <aws/s3/model/UploadPartRequest.h>
+#include <aws/s3/model/CompleteMultipartUploadRequest.h>
+#include <aws/s3/model/AbortMultipartUploadRequest.h>
+#include <aws/s3/model/CompletedMultipartUpload.h>
+#include <aws/s3/model/CompletedPart.h>
 #include <aws/s3/model/GetObjectRequest.h>
 #include <aws/s3/model/ListObjectsRequest.h>
 #include <aws/s3/model/DeleteObjectRequest.h>
-#include <aws/s3/model/PutObjectTaggingRequest.h>
-#include <aws/s3/model/Tag.h>
+#include <aws/s3/model/DeleteObjectsRequest.h>
 #include <aws/core/auth/AWSCredentialsProvider.h>
 #include <aws/core/client/DefaultRetryStrategy.h>
+#include <aws/core/http/HttpRequest.h>
+#include <aws/core/http/HttpResponse.h>
 #include <aws/core/utils/HashingUtils.h>
 #include <aws/core/utils/logging/DefaultLogSystem.h>
 #include <aws/core/utils/logging/DefaultCRTLogSystem.h>
@@ -47,11 +55,38 @@
 
 #include <boost/lexical_cast.hpp>
 #include <boost/interprocess/streams/bufferstream.hpp>
+#include <deque>
 #include <iostream>
 #include <fstream>
 
 const char* ALLOCATION_TAG = "OrthancS3";
 
+static const size_t MIN_MULTIPART_PART_SIZE = 5 * 1024 * 1024;  // imposed by S3 (except for the last part)
+static const size_t MAX_MULTIPART_PARTS_COUNT = 10000;           // imposed by S3
+
+struct UploadConfiguration
+{
+  size_t                             multipartThreshold_;    // objects larger than this size are uploaded in multiple parts (0 = disabled)
+  size_t                             multipartPartSize_;
+  unsigned int                       multipartConcurrency_;  // number of parts that are uploaded in parallel
+  bool                               contentMD5_;            // legacy checksum, computed in a separate pass over the data
+  Aws::S3::Model::ChecksumAlgorithm  checksumAlgorithm_;     // flexible checksum computed by the SDK (NOT_SET = none)
+};
+
+
+template <typename Request>
+static void SetChecksum(Request& request, Aws::IOStream& body, const UploadConfiguration& configuration)
+{
+  if (configuration.contentMD5_)
+  {
+    request.SetContentMD5(Aws::Utils::HashingUtils::Base64Encode(Aws::Utils::HashingUtils::CalculateMD5(body)));
+  }
+  else if (configuration.checksumAlgorithm_ != Aws::S3::Model::ChecksumAlgorithm::NOT_SET)
+  {
+    request.SetChecksumAlgorithm(configuration.checksumAlgorithm_);
+  }
+}
+
 class AwsS3StoragePlugin : public BaseStorage
 {
 public:
@@ -63,7 +98,9 @@ public:
   std::shared_ptr<Aws::Utils::Threading::Executor> executor_;
   std::shared_ptr<Aws::Transfer::TransferManager>  transferManager_;
   Aws::S3::Model::StorageClass                     storageClass_;
-  std::map<std::string, std::string> tags_;
+  std::string                                      tagging_;  // URL-encoded tags, sent with every upload
+  UploadConfiguration                              uploadConfiguration_;
+  ParallelRangeReader                              parallelReader_;
 
 public:
 
@@ -76,13 +113,16 @@ public:
                      unsigned int transferThreadPoolSize, 
                      unsigned int transferBufferSizeMB, 
                      Aws::S3::Model::StorageClass storageClass,
-                     const std::map<std::string, std::string>& tags);
+                     const std::map<std::string, std::string>& tags,
+                     const UploadConfiguration& uploadConfiguration,
+                     const ParallelRangeReader& parallelReader);
 
   virtual ~AwsS3StoragePlugin() ORTHANC_OVERRIDE;
 
   virtual IWriter* GetWriterForObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE;
   virtual IReader* GetReaderForObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE;
   virtual void DeleteObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE;
+  virtual void DeleteObjects(const std::vector<ObjectIdentifier>& objects, bool encryptionEnabled) ORTHANC_OVERRIDE;
 
   virtual bool HasFileExists() ORTHANC_OVERRIDE
   {
@@ -90,32 +130,22 @@ public:
   }
 };
 
-static void SetTags(std::shared_ptr<Aws::S3::S3Client> client, const std::string& bucketName, const std::string& path, const std::map<std::string, std::string>& tags)
+// e.g. "key1=value1&key2=value2", as expected by the x-amz-tagging header
+static std::string GetTaggingString(const std::map<std::string, std::string>& tags)
 {
-  if (tags.size() > 0)
-  {
-    Aws::S3::Model::PutObjectTaggingRequest taggingRequest;
-    taggingRequest.SetBucket(bucketName.c_str());
-    taggingRequest.SetKey(path.c_str());
+  std::string tagging;
 
-    Aws::S3::Model::Tagging tagging;
-
-    for (std::map<std::string, std::string>::const_iterator it = tags.begin(); it != tags.end(); ++it)
+  for (std::map<std::string, std::string>::const_iterator it = tags.begin(); it != tags.end(); ++it)
+  {
+    if (!tagging.empty())
     {
-      Aws::S3::Model::Tag tag;
-      tag.SetKey(it->first);
-      tag.SetValue(it->second);
-      tagging.AddTagSet(tag);
+      tagging += "&";
     }
-    
-    taggingRequest.SetTagging(tagging);
-    auto taggingResult = client->PutObjectTagging(taggingRequest);
 
-    if (!taggingResult.IsSuccess())
-    {
-      throw StoragePluginException(std::string("error while tagging file ") + path + ": response code = " + boost::lexical_cast<std::string>((int)taggingResult.GetError().GetResponseCode()) + " " + taggingResult.GetError().GetExceptionName().c_str() + " " + taggingResult.GetError().GetMessage().c_str());
-    }
+    tagging += std::string(Aws::Utils::StringUtils::URLEncode(it->first.c_str()).c_str()) + "=" + Aws::Utils::StringUtils::URLEncode(it->second.c_str()).c_str();
   }
+
+  return tagging;
 }
 
 
@@ -125,19 +155,227 @@ class DirectWriter : public IStorage::IWriter
   std::shared_ptr<Aws::S3::S3Client>    client_;
   std::string                           bucketName_;
   Aws::S3::Model::StorageClass          storageClass_;
-  std::map<std::string, std::string>    tags_;
+  std::string                           tagging_;
+  UploadConfiguration                   uploadConfiguration_;
 
-public:
-  DirectWriter(std::shared_ptr<Aws::S3::S3Client> client, const std::string& bucketName, const std::string& path, Aws::S3::Model::StorageClass storageClass, const std::map<std::string, std::string>& tags)
-    : path_(path),
-      client_(client),
-      bucketName_(bucketName),
-      storageClass_(storageClass),
-      tags_(tags)
+  // a part that is being uploaded.  The request and the stream must persist until the upload is complete.
+  struct PendingPart
+  {
+    int                                                        partNumber_;
+    std::unique_ptr<char[]>                                    buffer_;  // only if the part is produced by a content source
+    std::unique_ptr<Aws::Utils::Stream::PreallocatedStreamBuf> streamBuffer_;
+    std::unique_ptr<Aws::S3::Model::UploadPartRequest>         request_;
+    Aws::S3::Model::UploadPartOutcomeCallable                  outcome_;
+  };
+
+  void AbortMultipartUpload(const Aws::String& uploadId)
+  {
+    Aws::S3::Model::AbortMultipartUploadRequest abortRequest;
+    abortRequest.SetBucket(bucketName_.c_str());
+    abortRequest.SetKey(path_.c_str());
+    abortRequest.SetUploadId(uploadId);
+
+    auto result = client_->AbortMultipartUpload(abortRequest);
+
+    if (!result.IsSuccess())
+    {
+      LOG(WARNING) << "AWS S3 Storage: error while aborting the multipart upload of " << path_ << ": " << result.GetError().GetMessage();
+    }
+  }
+
+  // returns an empty string in case of success
+  std::string WaitPart(PendingPart& part, Aws::Vector<Aws::S3::Model::CompletedPart>& completedParts)
+  {
+    Aws::S3::Model::UploadPartOutcome result = part.outcome_.get();
+
+    if (!result.IsSuccess())
+    {
+      return std::string("error while writing part ") + boost::lexical_cast<std::string>(part.partNumber_) + " of file " + path_ + ": response code = " + boost::lexical_cast<std::string>((int)result.GetError().GetResponseCode()) + " " + result.GetError().GetExceptionName().c_str() + " " + result.GetError().GetMessage().c_str();
+    }
+
+    Aws::S3::Model::CompletedPart completedPart;
+    completedPart.SetPartNumber(part.partNumber_);
+    completedPart.SetETag(result.GetResult().GetETag());
+
+    switch (uploadConfiguration_.checksumAlgorithm_)
+    {
+      case Aws::S3::Model::ChecksumAlgorithm::CRC32:
+        completedPart.SetChecksumCRC32(result.GetResult().GetChecksumCRC32());
+        break;
+
+      case Aws::S3::Model::ChecksumAlgorithm::CRC32C:
+        completedPart.SetChecksumCRC32C(result.GetResult().GetChecksumCRC32C());
+        break;
+
+      case Aws::S3::Model::ChecksumAlgorithm::SHA1:
+        completedPart.SetChecksumSHA1(result.GetResult().GetChecksumSHA1());
+        break;
+
+      case Aws::S3::Model::ChecksumAlgorithm::SHA256:
+        completedPart.SetChecksumSHA256(result.GetResult().GetChecksumSHA256());
+        break;
+
+      default:
+        break;
+    }
+    completedParts[part.partNumber_ - 1] = completedPart;
+
+    return std::string();
+  }
+
+  // the parts are either read from "data" or produced by "source" just before being uploaded.  In the latter case,
+  // at most "MultipartUploadConcurrency" parts are in memory and their production overlaps the upload of the previous ones.
+  bool IsMultipart(size_t size) const
   {
+    return (uploadConfiguration_.multipartThreshold_ > 0 &&
+            size > uploadConfiguration_.multipartThreshold_);
   }
 
-  virtual void Write(const char* data, size_t size) ORTHANC_OVERRIDE
+  size_t GetPartSize(size_t size) const
+  {
+    size_t partSize = std::max(uploadConfiguration_.multipartPartSize_, MIN_MULTIPART_PART_SIZE);
+    if (size > partSize * MAX_MULTIPART_PARTS_COUNT)
+    {
+      partSize = (size + MAX_MULTIPART_PARTS_COUNT - 1) / MAX_MULTIPART_PARTS_COUNT;
+    }
+
+    return partSize;
+  }
+
+  void WriteMultipart(const char* data, IStorage::IContentSource* source, size_t size)
+  {
+    const size_t partSize = GetPartSize(size);
+    const size_t partsCount = (size + partSize - 1) / partSize;
+    const size_t concurrency = std::max(1u, uploadConfiguration_.multipartConcurrency_);
+
+    Aws::S3::Model::CreateMultipartUploadRequest createRequest;
+    createRequest.SetBucket(bucketName_.c_str());
+    createRequest.SetKey(path_.c_str());
+
+    if (storageClass_ != Aws::S3::Model::StorageClass::NOT_SET)
+    {
+      createRequest.SetStorageClass(storageClass_);
+    }
+
+    if (!tagging_.empty())
+    {
+      createRequest.SetTagging(tagging_.c_str());
+    }
+
+    if (uploadConfiguration_.checksumAlgorithm_ != Aws::S3::Model::ChecksumAlgorithm::NOT_SET)
+    {
+      createRequest.SetChecksumAlgorithm(uploadConfiguration_.checksumAlgorithm_);
+    }
+
+    auto createResult = client_->CreateMultipartUpload(createRequest);
+
+    if (!createResult.IsSuccess())
+    {
+      throw StoragePluginException(std::string("error while writing file ") + path_ + ": response code = " + boost::lexical_cast<std::string>((int)createResult.GetError().GetResponseCode()) + " " + createResult.GetError().GetExceptionName().c_str() + " " + createResult.GetError().GetMessage().c_str());
+    }
+
+    const Aws::String uploadId = createResult.GetResult().GetUploadId();
+
+    Aws::Vector<Aws::S3::Model::CompletedPart> completedParts(partsCount);
+    std::deque<PendingPart> pendingParts;
+    std::string firstExceptionMessage;
+
+    for (size_t i = 0; i < partsCount; i++)
+    {
+      if (pendingParts.size() >= concurrency)
+      {
+        firstExceptionMessage = WaitPart(pendingParts.front(), completedParts);
+        pendingParts.pop_front();
+
+        if (!firstExceptionMessage.empty())
+        {
+          break;
+        }
+      }
+
+      const size_t offset = i * partSize;
+      const size_t thisPartSize = std::min(partSize, size - offset);
+
+      pendingParts.push_back(PendingPart());
+      PendingPart& part = pendingParts.back();
+      part.partNumber_ = static_cast<int>(i + 1);
+
+      const char* partData;
+
+      if (source == NULL)
+      {
+        // the part is read directly from the buffer provided by Orthanc
+        partData = data + offset;
+      }
+      else
+      {
+        try
+        {
+          part.buffer_.reset(new char[thisPartSize]);
+          source->Read(part.buffer_.get(), thisPartSize, offset);
+          partData = part.buffer_.get();
+        }
+        catch (std::exception& ex)
+        {
+          firstExceptionMessage = std::string("error while producing part ") + boost::lexical_cast<std::string>(part.partNumber_) + " of file " + path_ + ": " + ex.what();
+          pendingParts.pop_back();
+          break;
+        }
+      }
+
+      part.streamBuffer_.reset(new Aws::Utils::Stream::PreallocatedStreamBuf(reinterpret_cast<unsigned char*>(const_cast<char*>(partData)), thisPartSize));
+      std::shared_ptr<Aws::IOStream> body = Aws::MakeShared<Aws::IOStream>(ALLOCATION_TAG, part.streamBuffer_.get());
+
+      part.request_.reset(new Aws::S3::Model::UploadPartRequest);
+      part.request_->SetBucket(bucketName_.c_str());
+      part.request_->SetKey(path_.c_str());
+      part.request_->SetUploadId(uploadId);
+      part.request_->SetPartNumber(part.partNumber_);
+      part.request_->SetContentLength(thisPartSize);
+      part.request_->SetBody(body);
+      SetChecksum(*part.request_, *body, uploadConfiguration_);
+
+      part.outcome_ = client_->UploadPartCallable(*part.request_);
+    }
+
+    // wait for all the parts, even in case of error since they are reading the Orthanc buffer or the buffers of the parts
+    while (!pendingParts.empty())
+    {
+      std::string message = WaitPart(pendingParts.front(), completedParts);
+      pendingParts.pop_front();
+
+      if (firstExceptionMessage.empty())
+      {
+        firstExceptionMessage = message;
+      }
+    }
+
+    if (firstExceptionMessage.empty())
+    {
+      Aws::S3::Model::CompletedMultipartUpload completedUpload;
+      completedUpload.SetParts(completedParts);
+
+      Aws::S3::Model::CompleteMultipartUploadRequest completeRequest;
+      completeRequest.SetBucket(bucketName_.c_str());
+      completeRequest.SetKey(path_.c_str());
+      completeRequest.SetUploadId(uploadId);
+      completeRequest.SetMultipartUpload(completedUpload);
+
+      auto completeResult = client_->CompleteMultipartUpload(completeRequest);
+
+      if (completeResult.IsSuccess())
+      {
+        return;
+      }
+
+      firstExceptionMessage = std::string("error while writing file ") + path_ + ": response code = " + boost::lexical_cast<std::string>((int)completeResult.GetError().GetResponseCode()) + " " + completeResult.GetError().GetExceptionName().c_str() + " " + completeResult.GetError().GetMessage().c_str();
+    }
+
+    AbortMultipartUpload(uploadId);
+    throw StoragePluginException(firstExceptionMessage);
+  }
+
+  void WriteSinglePart(const char* data, size_t size)
   {
     Aws::S3::Model::PutObjectRequest putObjectRequest;
 
@@ -149,14 +387,18 @@ public:
       putObjectRequest.SetStorageClass(storageClass_);
     }
 
-    std::shared_ptr<Aws::StringStream> stream = Aws::MakeShared<Aws::StringStream>(ALLOCATION_TAG, std::ios_base::in | std::ios_base::binary);
+    if (!tagging_.empty())
+    {
+      putObjectRequest.SetTagging(tagging_.c_str());
+    }
 
-    stream->rdbuf()->pubsetbuf(const_cast<char*>(data), size);
-    stream->rdbuf()->pubseekpos(size);
-    stream->seekg(0);
+    // the body is read directly from the buffer provided by Orthanc
+    Aws::Utils::Stream::PreallocatedStreamBuf streamBuffer(reinterpret_cast<unsigned char*>(const_cast<char*>(data)), size);
+    std::shared_ptr<Aws::IOStream> body = Aws::MakeShared<Aws::IOStream>(ALLOCATION_TAG, &streamBuffer);
 
-    putObjectRequest.SetBody(stream);
-    putObjectRequest.SetContentMD5(Aws::Utils::HashingUtils::Base64Encode(Aws::Utils::HashingUtils::CalculateMD5(*stream)));
+    putObjectRequest.SetBody(body);
+    putObjectRequest.SetContentLength(size);
+    SetChecksum(putObjectRequest, *body, uploadConfiguration_);
 
     auto result = client_->PutObject(putObjectRequest);
 
@@ -164,8 +406,232 @@ public:
     {
       throw StoragePluginException(std::string("error while writing file ") + path_ + ": response code = " + boost::lexical_cast<std::string>((int)result.GetError().GetResponseCode()) + " " + result.GetError().GetExceptionName().c_str() + " " + result.GetError().GetMessage().c_str());
     }
+  }
+
+public:
+  DirectWriter(std::shared_ptr<Aws::S3::S3Client> client, const std::string& bucketName, const std::string& path, Aws::S3::Model::StorageClass storageClass, const std::string& tagging, const UploadConfiguration& uploadConfiguration)
+    : path_(path),
+      client_(client),
+      bucketName_(bucketName),
+      storageClass_(storageClass),
+      tagging_(tagging),
+      uploadConfiguration_(uploadConfiguration)
+  {
+  }
+
+  virtual void Write(const char* data, size_t size) ORTHANC_OVERRIDE
+  {
+    if (IsMultipart(size))
+    {
+      WriteMultipart(data, NULL, size);
+    }
+    else
+    {
+      WriteSinglePart(data, size);
+    }
+  }
+
+  virtual void WriteFromSource(IStorage::IContentSource& source, size_t size) ORTHANC_OVERRIDE
+  {
+    if (IsMultipart(size))
+    {
+      WriteMultipart(NULL, &source, size);
+    }
+    else
+    {
+      IStorage::IWriter::WriteFromSource(source, size);
+    }
+  }
+
+  virtual size_t GetBufferingSize(size_t size) const ORTHANC_OVERRIDE
+  {
+    if (IsMultipart(size))
+    {
+      // at most "MultipartUploadConcurrency" parts are in memory
+      const size_t concurrency = std::max(1u, uploadConfiguration_.multipartConcurrency_);
+      return std::min(size, GetPartSize(size) * concurrency);
+    }
+    else
+    {
+      // the objects below the multipart threshold are uploaded at once
+      return size;
+    }
+  }
+};
+
+
+// e.g. "bytes 0-16777215/134217728" -> 134217728
+static bool ParseObjectSizeFromContentRange(size_t& size, const std::string& contentRange)
+{
+  size_t slash = contentRange.find('/');
+
+  return (slash != std::string::npos &&
+          boost::conversion::try_lexical_convert(contentRange.substr(slash + 1), size));
+}
+
+
+// A stream buffer that receives the body of a GetObject response directly in a buffer that is allocated
+// as soon as the headers of the response are known (i.e. before the first byte of the body is received).
+// If the buffer has not been allocated (e.g. error responses), the body is kept in an internal buffer.
+class AllocatorStreamBuf : public std::streambuf
+{
+  IStorage::IBufferAllocator&  allocator_;
+  bool                         allocateObject_;  // allocates the whole object, or only the received range
+  bool                         allocated_;
+  bool                         reading_;
+  size_t                       objectSize_;
+  std::string                  spillover_;
+
+protected:
+  virtual int_type overflow(int_type c) ORTHANC_OVERRIDE
+  {
+    if (allocated_)
+    {
+      return traits_type::eof();  // more data than announced by the Content-Length
+    }
+
+    if (!traits_type::eq_int_type(c, traits_type::eof()))
+    {
+      spillover_.push_back(traits_type::to_char_type(c));
+    }
+
+    return traits_type::not_eof(c);
+  }
+
+  virtual std::streamsize xsputn(const char* s, std::streamsize n) ORTHANC_OVERRIDE
+  {
+    if (allocated_)
+    {
+      return std::streambuf::xsputn(s, n);
+    }
+    else
+    {
+      spillover_.append(s, static_cast<size_t>(n));
+      return n;
+    }
+  }
+
+  // the SDK reads back the body of the error responses
+  virtual int_type underflow() ORTHANC_OVERRIDE
+  {
+    if (!reading_)
+    {
+      reading_ = true;
+
+      if (allocated_)
+      {
+        setg(pbase(), pbase(), pptr());
+      }
+      else if (!spillover_.empty())
+      {
+        setg(&spillover_[0], &spillover_[0], &spillover_[0] + spillover_.size());
+      }
+    }
+
+    if (gptr() != NULL && gptr() < egptr())
+    {
+      return traits_type::to_int_type(*gptr());
+    }
+    else
+    {
+      return traits_type::eof();
+    }
+  }
+
+public:
+  AllocatorStreamBuf(IStorage::IBufferAllocator& allocator,
+                     bool allocateObject)
+    : allocator_(allocator),
+      allocateObject_(allocateObject),
+      allocated_(false),
+      reading_(false),
+      objectSize_(0)
+  {
+  }
+
+  // called before each attempt of the request
+  void Reset()
+  {
+    allocated_ = false;
+    reading_ = false;
+    objectSize_ = 0;
+    spillover_.clear();
+    setp(NULL, NULL);
+    setg(NULL, NULL, NULL);
+  }
+
+  // this is called from a callback of the HTTP client -> must not throw.  Only the successful responses
+  // allocate the buffer: the body of the other ones (e.g. 403, 404, 503) is an error document.
+  void OnHeadersReceived(const Aws::Http::HttpResponse& response)
+  {
+    size_t bodySize;
+    if (allocated_ ||
+        (response.GetResponseCode() != Aws::Http::HttpResponseCode::OK &&
+         response.GetResponseCode() != Aws::Http::HttpResponseCode::PARTIAL_CONTENT) ||
+        !response.HasHeader(Aws::Http::CONTENT_LENGTH_HEADER) ||
+        !boost::conversion::try_lexical_convert(response.GetHeader(Aws::Http::CONTENT_LENGTH_HEADER).c_str(), bodySize))
+    {
+      return;
+    }
+
+    size_t objectSize = bodySize;
+    if (response.HasHeader("content-range") &&
+        (!ParseObjectSizeFromContentRange(objectSize, response.GetHeader("content-range").c_str()) ||
+         objectSize < bodySize))
+    {
+      return;
+    }
+
+    try
+    {
+      char* data = allocator_.Allocate(allocateObject_ ? objectSize : bodySize);
+      setp(data, data + bodySize);
+      objectSize_ = objectSize;
+      allocated_ = true;
+    }
+    catch (StoragePluginException&)
+    {
+      // will be retried in GetObjectData()
+    }
+  }
+
+  // to be called once the request has succeeded.  Returns the start of the buffer and the size of the received data.
+  char* GetObjectData(size_t& receivedSize, size_t& objectSize, const std::string& contentRange)
+  {
+    if (allocated_)
+    {
+      if (pptr() != epptr())
+      {
+        throw StoragePluginException("received " + boost::lexical_cast<std::string>(pptr() - pbase()) +
+                                     " bytes instead of " + boost::lexical_cast<std::string>(epptr() - pbase()));
+      }
+
+      receivedSize = static_cast<size_t>(pptr() - pbase());
+      objectSize = objectSize_;
+      return pbase();
+    }
+    else
+    {
+      // the headers callback has not been called (e.g. empty body) -> copy the received data
+      receivedSize = spillover_.size();
+      objectSize = receivedSize;
+
+      if (!contentRange.empty() &&
+          (!ParseObjectSizeFromContentRange(objectSize, contentRange) ||
+           objectSize < receivedSize))
+      {
+        throw StoragePluginException("unexpected Content-Range: " + contentRange);
+      }
+
+      char* data = allocator_.Allocate(allocateObject_ ? objectSize : receivedSize);
+
+      if (receivedSize > 0)
+      {
+        memcpy(data, spillover_.data(), receivedSize);
+      }
 
-    SetTags(client_, bucketName_, path_, tags_);
+      return data;
+    }
   }
 };
 
@@ -177,19 +643,22 @@ protected:
   std::string                           bucketName_;
   std::list<std::string>                paths_;
   std::string                           uuid_;
+  ParallelRangeReader                   parallelReader_;
 
 public:
-  DirectReader(std::shared_ptr<Aws::S3::S3Client> client, const std::string& bucketName, const std::list<std::string>& paths, const char* uuid)
+  DirectReader(std::shared_ptr<Aws::S3::S3Client> client, const std::string& bucketName, const std::list<std::string>& paths, const char* uuid, const ParallelRangeReader& parallelReader)
     : client_(client),
       bucketName_(bucketName),
       paths_(paths),
-      uuid_(uuid)
+      uuid_(uuid),
+      parallelReader_(parallelReader)
   {
   }
 
   virtual size_t GetSize() ORTHANC_OVERRIDE
   {
     std::string firstExceptionMessage;
+    bool notFound = true;  // whether the object has been confirmed to be missing at all the paths
 
     for (const std::string& path: paths_)
     {
@@ -197,15 +666,30 @@ public:
       {
         return _GetSize(path);
       }
+      catch (StoragePluginNotFoundException& ex)
+      {
+        if (firstExceptionMessage.empty())
+        {
+          firstExceptionMessage = ex.what();
+        }
+        //ignore to retry
+      }
       catch (StoragePluginException& ex)
       {
         if (firstExceptionMessage.empty())
         {
           firstExceptionMessage = ex.what();
         }
+        notFound = false;
         //ignore to retry
       }
     }
+
+    if (notFound)
+    {
+      throw StoragePluginNotFoundException(firstExceptionMessage);
+    }
+
     throw StoragePluginException(firstExceptionMessage);
   }
 
@@ -219,6 +703,50 @@ public:
     _Read(data, size, fromOffset, true);
   }
 
+  virtual size_t ReadWholeWithAllocator(IStorage::IBufferAllocator& allocator) ORTHANC_OVERRIDE
+  {
+    std::string firstExceptionMessage;
+
+    for (const std::string& path: paths_)
+    {
+      try
+      {
+        return __ReadWhole(path, allocator);
+      }
+      catch (StoragePluginException& ex)
+      {
+        if (firstExceptionMessage.empty())
+        {
+          firstExceptionMessage = ex.what();
+        }
+        //ignore to retry
+      }
+    }
+    throw StoragePluginException(firstExceptionMessage);
+  }
+
+  virtual size_t ReadFirstBytes(std::vector<char>& data, size_t maxSize) ORTHANC_OVERRIDE
+  {
+    std::string firstExceptionMessage;
+
+    for (const std::string& path: paths_)
+    {
+      try
+      {
+        return __ReadFirstBytes(path, data, maxSize);
+      }
+      catch (StoragePluginException& ex)
+      {
+        if (firstExceptionMessage.empty())
+        {
+          firstExceptionMessage = ex.what();
+        }
+        //ignore to retry
+      }
+    }
+    throw StoragePluginException(firstExceptionMessage);
+  }
+
 private:
 
   size_t _GetSize(const std::string& path)
@@ -234,15 +762,17 @@ private:
       Aws::Vector<Aws::S3::Model::Object> objectList =
           result.GetResult().GetContents();
 
-      if (objectList.size() == 1)
-      {
-        return objectList[0].GetSize();
-      }
-      else if (objectList.size() > 1)
+      // the prefix also matches the longer keys (e.g. "compression-dictionary-1" and "compression-dictionary-12"),
+      // the key itself is listed first if it exists
+      for (size_t i = 0; i < objectList.size(); i++)
       {
-        throw StoragePluginException(std::string("error while reading file ") + path + ": multiple objet with same name !");
+        if (objectList[i].GetKey() == path.c_str())
+        {
+          return objectList[i].GetSize();
+        }
       }
-      throw StoragePluginException(std::string("error while reading file ") + path + ": object not found !");
+
+      throw StoragePluginNotFoundException(std::string("error while reading file ") + path + ": object not found !");
     }
     else
     {
@@ -259,6 +789,15 @@ private:
     {
       try
       {
+        if (parallelReader_.IsParallel(size))
+        {
+          parallelReader_.Read([this, &path](char* rangeData, size_t rangeSize, size_t rangeOffset)
+                               {
+                                 __Read(path, rangeData, rangeSize, rangeOffset, true);
+                               }, data, size, fromOffset);
+          return;
+        }
+
         return __Read(path, data, size, fromOffset, useRange);
       }
       catch (StoragePluginException& ex)
@@ -285,17 +824,127 @@ private:
       std::string range = std::string("bytes=") + boost::lexical_cast<std::string>(fromOffset) + "-" + boost::lexical_cast<std::string>(fromOffset + size -1);
       getObjectRequest.SetRange(range.c_str());
     }
+
+    // The response is received directly in the target buffer.
+    // 'streamBuffer' is captured by reference in the lambda, it must persist until the request is complete.
+    Aws::Utils::Stream::PreallocatedStreamBuf streamBuffer(reinterpret_cast<unsigned char*>(data), size);
+
+    getObjectRequest.SetResponseStreamFactory([&streamBuffer]()
+    {
+      // rewind in case the request is retried
+      streamBuffer.pubseekpos(0, std::ios_base::out);
+      streamBuffer.pubseekpos(0, std::ios_base::in);
+      return Aws::New<Aws::IOStream>(ALLOCATION_TAG, &streamBuffer);
+    });
+
     // Get the object
     auto result = client_->GetObject(getObjectRequest);
     if (!result.IsSuccess())
     {
       throw StoragePluginException(std::string("error while reading file ") + path + ": response code = " + boost::lexical_cast<std::string>((int)result.GetError().GetResponseCode()) + " " + result.GetError().GetExceptionName().c_str() + " " + result.GetError().GetMessage().c_str());
     }
-    
-    auto& body = result.GetResult().GetBody();
-    body.read(data, size);
-    // it seems important to consume the HTTP stream so the connection can go back in the pool (but, it is actually already consumed !)
-    body.ignore(std::numeric_limits<std::streamsize>::max());
+
+    if (static_cast<size_t>(result.GetResult().GetContentLength()) != size)
+    {
+      throw StoragePluginException(std::string("error while reading file ") + path + ": received " + boost::lexical_cast<std::string>(result.GetResult().GetContentLength()) + " bytes instead of " + boost::lexical_cast<std::string>(size));
+    }
+  }
+
+  // GetObject request for the first "rangeSize" bytes of the object (the whole object if "rangeSize" is 0) that is
+  // received in the buffer of "streamBuffer".  Returns false if the object is empty.
+  bool __GetFirstBytes(char*& data, size_t& receivedSize, size_t& objectSize, const std::string& path, AllocatorStreamBuf& streamBuffer, size_t rangeSize)
+  {
+    Aws::S3::Model::GetObjectRequest getObjectRequest;
+    getObjectRequest.SetBucket(bucketName_.c_str());
+    getObjectRequest.SetKey(path.c_str());
+
+    if (rangeSize > 0)
+    {
+      std::string range = std::string("bytes=0-") + boost::lexical_cast<std::string>(rangeSize - 1);
+      getObjectRequest.SetRange(range.c_str());
+    }
+
+    // The response is received directly in a buffer that is allocated once the headers are received.
+    // 'streamBuffer' is captured by reference in the lambdas, it must persist until the request is complete.
+    getObjectRequest.SetResponseStreamFactory([&streamBuffer]()
+    {
+      streamBuffer.Reset();  // in case the request is retried
+      return Aws::New<Aws::IOStream>(ALLOCATION_TAG, &streamBuffer);
+    });
+
+    getObjectRequest.SetHeadersReceivedEventHandler([&streamBuffer](const Aws::Http::HttpRequest*, Aws::Http::HttpResponse* response)
+    {
+      streamBuffer.OnHeadersReceived(*response);
+    });
+
+    auto result = client_->GetObject(getObjectRequest);
+    if (!result.IsSuccess())
+    {
+      if (rangeSize > 0 &&
+          result.GetError().GetResponseCode() == Aws::Http::HttpResponseCode::REQUESTED_RANGE_NOT_SATISFIABLE)
+      {
+        return false;  // empty object
+      }
+
+      throw StoragePluginException(std::string("error while reading file ") + path + ": response code = " + boost::lexical_cast<std::string>((int)result.GetError().GetResponseCode()) + " " + result.GetError().GetExceptionName().c_str() + " " + result.GetError().GetMessage().c_str());
+    }
+
+    // the size is taken from the Content-Length (or Content-Range) of the response -> no need for a ListObjects request
+    try
+    {
+      data = streamBuffer.GetObjectData(receivedSize, objectSize, result.GetResult().GetContentRange().c_str());
+    }
+    catch (StoragePluginException& ex)
+    {
+      throw StoragePluginException(std::string("error while reading file ") + path + ": " + ex.what());
+    }
+
+    return true;
+  }
+
+  size_t __ReadWhole(const std::string& path, IStorage::IBufferAllocator& allocator)
+  {
+    AllocatorStreamBuf streamBuffer(allocator, true);
+
+    char* data;
+    size_t receivedSize;
+    size_t size;
+
+    // if the parallel reads are enabled, only request the first chunk, the other ones are downloaded in parallel once the size of the object is known
+    if (!__GetFirstBytes(data, receivedSize, size, path, streamBuffer, parallelReader_.IsEnabled() ? parallelReader_.GetChunkSize() : 0))
+    {
+      allocator.Allocate(0);  // empty object
+      return 0;
+    }
+
+    if (size > receivedSize)
+    {
+      parallelReader_.Read([this, &path](char* rangeData, size_t rangeSize, size_t rangeOffset)
+                           {
+                             __Read(path, rangeData, rangeSize, rangeOffset, true);
+                           }, data + receivedSize, size - receivedSize, receivedSize);
+    }
+
+    return size;
+  }
+
+  size_t __ReadFirstBytes(const std::string& path, std::vector<char>& data, size_t maxSize)
+  {
+    // only the received range is allocated
+    VectorBufferAllocator allocator(data);
+    AllocatorStreamBuf streamBuffer(allocator, false);
+
+    char* received;
+    size_t receivedSize;
+    size_t size;
+
+    if (!__GetFirstBytes(received, receivedSize, size, path, streamBuffer, maxSize))
+    {
+      data.clear();  // empty object
+      return 0;
+    }
+
+    return size;
   }
 
 };
@@ -304,21 +953,16 @@ private:
 
 class TransferWriter : public IStorage::IWriter
 {
-  std::shared_ptr<Aws::S3::S3Client>                client_;
   std::string                                       path_;
   std::shared_ptr<Aws::Transfer::TransferManager>   transferManager_;
   std::string                                       bucketName_;
-  Aws::S3::Model::StorageClass                      storageClass_;
-  std::map<std::string, std::string>                tags_;
 
 public:
-  TransferWriter(std::shared_ptr<Aws::S3::S3Client> client, std::shared_ptr<Aws::Transfer::TransferManager> transferManager, const std::string& bucketName, const std::string& path, Aws::S3::Model::StorageClass storageClass, const std::map<std::string, std::string>& tags)
-    : client_(client),
-      path_(path),
+  // the storage class and the tags are set in the templates of the TransferManager
+  TransferWriter(std::shared_ptr<Aws::Transfer::TransferManager> transferManager, const std::string& bucketName, const std::string& path)
+    : path_(path),
       transferManager_(transferManager),
-      bucketName_(bucketName),
-      storageClass_(storageClass),
-      tags_(tags)
+      bucketName_(bucketName)
   {
   }
 
@@ -334,8 +978,6 @@ public:
     {
       throw StoragePluginException(std::string("error while writing file ") + path_ + ": response code = " + boost::lexical_cast<std::string>(static_cast<int>(transferHandle->GetLastError().GetResponseCode())) + " " + transferHandle->GetLastError().GetMessage());
     }
-
-    SetTags(client_, bucketName_, path_, tags_);
   }
 };
 
@@ -345,12 +987,18 @@ class TransferReader : public DirectReader
   std::shared_ptr<Aws::Transfer::TransferManager>  transferManager_;
 
 public:
-  TransferReader(std::shared_ptr<Aws::Transfer::TransferManager> transferManager, std::shared_ptr<Aws::S3::S3Client> client, const std::string& bucketName, const std::list<std::string>& paths, const char* uuid)
-    : DirectReader(client, bucketName, paths, uuid),
+  TransferReader(std::shared_ptr<Aws::Transfer::TransferManager> transferManager, std::shared_ptr<Aws::S3::S3Client> client, const std::string& bucketName, const std::list<std::string>& paths, const char* uuid, const ParallelRangeReader& parallelReader)
+    : DirectReader(client, bucketName, paths, uuid, parallelReader),
       transferManager_(transferManager)
   {
   }
 
+  virtual size_t ReadWholeWithAllocator(IStorage::IBufferAllocator& allocator) ORTHANC_OVERRIDE
+  {
+    // the TransferManager needs to know the size beforehand
+    return IStorage::IReader::ReadWholeWithAllocator(allocator);
+  }
+
   virtual void ReadWhole(char* data, size_t size) ORTHANC_OVERRIDE
   {
     std::string firstExceptionMessage;
@@ -670,9 +1318,49 @@ IStorage* AwsS3StoragePluginFactory::CreateStorage(const std::string& nameForLog
     std::map<std::string, std::string> tags;
     pluginSection.GetDictionary(tags, "Tags");
 
+    UploadConfiguration uploadConfiguration;
+    uploadConfiguration.multipartThreshold_ = static_cast<size_t>(pluginSection.GetUnsignedIntegerValue("MultipartUploadThreshold", 100)) * 1024 * 1024;  // in MB, 0 to disable
+    uploadConfiguration.multipartPartSize_ = static_cast<size_t>(pluginSection.GetUnsignedIntegerValue("MultipartUploadPartSize", 16)) * 1024 * 1024;   // in MB
+    uploadConfiguration.multipartConcurrency_ = pluginSection.GetUnsignedIntegerValue("MultipartUploadConcurrency", 8);
+
+    if (uploadConfiguration.multipartPartSize_ < MIN_MULTIPART_PART_SIZE)
+    {
+      LOG(ERROR) << "AWS S3 Storage plugin: \"MultipartUploadPartSize\" must be at least 5 MB";
+      return nullptr;
+    }
+
+    const std::string checksumAlgorithm = pluginSection.GetStringValue("ChecksumAlgorithm", "MD5");
+    uploadConfiguration.contentMD5_ = (checksumAlgorithm == "MD5");
+    uploadConfiguration.checksumAlgorithm_ = Aws::S3::Model::ChecksumAlgorithm::NOT_SET;
+
+    if (checksumAlgorithm == "CRC32")
+    {
+      uploadConfiguration.checksumAlgorithm_ = Aws::S3::Model::ChecksumAlgorithm::CRC32;
+    }
+    else if (checksumAlgorithm == "CRC32C")
+    {
+      uploadConfiguration.checksumAlgorithm_ = Aws::S3::Model::ChecksumAlgorithm::CRC32C;
+    }
+    else if (checksumAlgorithm == "SHA1")
+    {
+      uploadConfiguration.checksumAlgorithm_ = Aws::S3::Model::ChecksumAlgorithm::SHA1;
+    }
+    else if (checksumAlgorithm == "SHA256")
+    {
+      uploadConfiguration.checksumAlgorithm_ = Aws::S3::Model::ChecksumAlgorithm::SHA256;
+    }
+    else if (checksumAlgorithm != "MD5" && checksumAlgorithm != "None")
+    {
+      LOG(ERROR) << "AWS S3 Storage plugin: unrecognized value for \"ChecksumAlgorithm\": " << checksumAlgorithm;
+      return nullptr;
+    }
+
+    ParallelRangeReader parallelReader(static_cast<size_t>(pluginSection.GetUnsignedIntegerValue("ParallelDownloadChunkSize", 16)) * 1024 * 1024,  // in MB
+                                       pluginSection.GetUnsignedIntegerValue("ParallelDownloadConcurrency", 4));                                // 1 to disable
+
     LOG(INFO) << "AWS S3 storage initialized";
 
-    return new AwsS3StoragePlugin(nameForLogs, client, bucketName, enableLegacyStorageStructure, storageContainsUnknownFiles, useTransferManager, transferPoolSize, transferBufferSizeMB, storageClass, tags);
+    return new AwsS3StoragePlugin(nameForLogs, client, bucketName, enableLegacyStorageStructure, storageContainsUnknownFiles, useTransferManager, transferPoolSize, transferBufferSizeMB, storageClass, tags, uploadConfiguration, parallelReader);
   }
   catch (const std::exception& e)
   {
@@ -701,14 +1389,18 @@ AwsS3StoragePlugin::AwsS3StoragePlugin(const std::string& nameForLogs,
                                        unsigned int transferThreadPoolSize,
                                        unsigned int transferBufferSizeMB,
                                        Aws::S3::Model::StorageClass storageClass,
-                                       const std::map<std::string, std::string>& tags)
+                                       const std::map<std::string, std::string>& tags,
+                                       const UploadConfiguration& uploadConfiguration,
+                                       const ParallelRangeReader& parallelReader)
   : BaseStorage(nameForLogs, enableLegacyStorageStructure),
     bucketName_(bucketName),
     storageContainsUnknownFiles_(storageContainsUnknownFiles),
     useTransferManager_(useTransferManager),
     client_(client),
     storageClass_(storageClass),
-    tags_(tags)
+    tagging_(GetTaggingString(tags)),
+    uploadConfiguration_(uploadConfiguration),
+    parallelReader_(parallelReader)
 {
   if (useTransferManager_)
   {
@@ -722,6 +1414,12 @@ AwsS3StoragePlugin::AwsS3StoragePlugin(const std::string& nameForLogs,
       transferConfig.putObjectTemplate.SetStorageClass(storageClass_);
     }
 
+    if (!tagging_.empty())
+    {
+      transferConfig.putObjectTemplate.SetTagging(tagging_.c_str());
+      transferConfig.createMultipartUploadTemplate.SetTagging(tagging_.c_str());
+    }
+
     transferManager_ = Aws::Transfer::TransferManager::Create(transferConfig);
   }
 }
@@ -730,11 +1428,11 @@ IStorage::IWriter* AwsS3StoragePlugin::GetWriterForObject(const char* uuid, Orth
 {
   if (useTransferManager_)
   {
-    return new TransferWriter(client_, transferManager_, bucketName_, GetPath(uuid, type, encryptionEnabled), storageClass_, tags_);
+    return new TransferWriter(transferManager_, bucketName_, GetPath(uuid, type, encryptionEnabled));
   }
   else
   {
-    return new DirectWriter(client_, bucketName_, GetPath(uuid, type, encryptionEnabled), storageClass_, tags_);
+    return new DirectWriter(client_, bucketName_, GetPath(uuid, type, encryptionEnabled), storageClass_, tagging_, uploadConfiguration_);
   }
 }
 
@@ -749,11 +1447,11 @@ IStorage::IReader* AwsS3StoragePlugin::GetReaderForObject(const char* uuid, Orth
 
   if (useTransferManager_)
   {
-    return new TransferReader(transferManager_, client_, bucketName_, paths, uuid);
+    return new TransferReader(transferManager_, client_, bucketName_, paths, uuid, parallelReader_);
   }
   else
   {
-    return new DirectReader(client_, bucketName_, paths, uuid);
+    return new DirectReader(client_, bucketName_, paths, uuid, parallelReader_);
   }
 }
 
@@ -788,3 +1486,58 @@ void AwsS3StoragePlugin::DeleteObject(const char* uuid, OrthancPluginContentType
     throw StoragePluginException(firstExceptionMessage);
   }
 }
+
+void AwsS3StoragePlugin::DeleteObjects(const std::vector<ObjectIdentifier>& objects, bool encryptionEnabled)
+{
+  static const size_t MAX_KEYS_PER_REQUEST = 1000;  // S3 limit
+
+  std::vector<std::string> paths;
+  for (size_t i = 0; i < objects.size(); i++)
+  {
+    paths.push_back(GetPath(objects[i].uuid_.c_str(), objects[i].type_, encryptionEnabled, false));
+    if (storageContainsUnknownFiles_)
+    {
+      paths.push_back(GetPath(objects[i].uuid_.c_str(), objects[i].type_, encryptionEnabled, true));
+    }
+  }
+
+  std::string firstExceptionMessage;
+
+  for (size_t start = 0; start < paths.size(); start += MAX_KEYS_PER_REQUEST)
+  {
+    const size_t end = std::min(start + MAX_KEYS_PER_REQUEST, paths.size());
+
+    Aws::S3::Model::Delete deleteObjects;
+    deleteObjects.SetQuiet(true);  // only report the errors
+
+    for (size_t i = start; i < end; i++)
+    {
+      deleteObjects.AddObjects(Aws::S3::Model::ObjectIdentifier().WithKey(paths[i].c_str()));
+    }
+
+    Aws::S3::Model::DeleteObjectsRequest deleteObjectsRequest;
+    deleteObjectsRequest.SetBucket(bucketName_.c_str());
+    deleteObjectsRequest.SetDelete(deleteObjects);
+
+    auto result = client_->DeleteObjects(deleteObjectsRequest);
+
+    if (!result.IsSuccess())
+    {
+      if (firstExceptionMessage.empty())
+      {
+        firstExceptionMessage = std::string("error while deleting ") + boost::lexical_cast<std::string>(end - start) + " files: response code = " + boost::lexical_cast<std::string>((int)result.GetError().GetResponseCode()) + " " + result.GetError().GetExceptionName().c_str() + " " + result.GetError().GetMessage().c_str();
+      }
+    }
+    else if (!result.GetResult().GetErrors().empty() && firstExceptionMessage.empty())
+    {
+      const Aws::S3::Model::Error& error = result.GetResult().GetErrors().front();
+      firstExceptionMessage = std::string("error while deleting file ") + error.GetKey().c_str() + ": " + error.GetCode().c_str() + " " + error.GetMessage().c_str() +
+        " (" + boost::lexical_cast<std::string>(result.GetResult().GetErrors().size()) + " files could not be deleted)";
+    }
+  }
+
+  if (!firstExceptionMessage.empty())
+  {
+    throw StoragePluginException(firstExceptionMessage);
+  }
+}
@@ -21,9 +21,13 @@
 
 #include "AzureBlobStoragePlugin.h"
 
+#include <azure/core/base64.hpp>
+#include <azure/core/io/body_stream.hpp>
 #include <azure/storage/blobs.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string.hpp>
+#include <iomanip>
+#include <sstream>
 // #include "cpprest/rawptrstream.h"
 // #include "cpprest/details/basic_types.h"
 
@@ -32,6 +36,8 @@
 // Create aliases to make the code easier to read.
 namespace as = Azure::Storage::Blobs;
 
+static const size_t UPLOAD_BLOCK_SIZE = 8 * 1024 * 1024;   // the objects produced by a source are uploaded by blocks
+
 class AzureBlobStoragePlugin : public BaseStorage
 {
 public:
@@ -39,6 +45,8 @@ public:
   as::BlobContainerClient       blobClient_;
   bool                          storageContainsUnknownFiles_;
   as::Models::AccessTier        accessTier_;
+  int64_t                       downloadChunkSize_;
+  int32_t                       downloadConcurrency_;
 
 public:
 
@@ -46,12 +54,15 @@ public:
                          const as::BlobContainerClient& blobClient, 
                          bool enableLegacyStorageStructure,
                          bool storageContainsUnknownFiles,
-                         as::Models::AccessTier accessTier
+                         as::Models::AccessTier accessTier,
+                         int64_t downloadChunkSize,
+                         int32_t downloadConcurrency
                          );
 
   virtual IWriter* GetWriterForObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE;
   virtual IReader* GetReaderForObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE;
   virtual void DeleteObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE;
+  virtual void DeleteObjects(const std::vector<ObjectIdentifier>& objects, bool encryptionEnabled) ORTHANC_OVERRIDE;
   virtual bool HasFileExists() ORTHANC_OVERRIDE {return false;};
 };
 
@@ -90,6 +101,54 @@ public:
       throw StoragePluginException("AzureBlobStorage: error writing file " + std::string(path_) + ": " + ex.what());
     }
   }
+
+  virtual void WriteFromSource(IStorage::IContentSource& source, size_t size) ORTHANC_OVERRIDE
+  {
+    if (size <= UPLOAD_BLOCK_SIZE)
+    {
+      IStorage::IWriter::WriteFromSource(source, size);
+      return;
+    }
+
+    try
+    {
+      as::BlockBlobClient blobClient = client_.GetBlockBlobClient(path_);
+
+      std::vector<std::string> blockIds;
+      std::vector<uint8_t> block(UPLOAD_BLOCK_SIZE);
+
+      for (size_t offset = 0; offset < size; offset += UPLOAD_BLOCK_SIZE)
+      {
+        const size_t blockSize = std::min(size - offset, UPLOAD_BLOCK_SIZE);
+        source.Read(reinterpret_cast<char*>(block.data()), blockSize, offset);
+
+        // all the block ids of a blob must have the same length
+        std::ostringstream blockIndex;
+        blockIndex << std::setw(8) << std::setfill('0') << blockIds.size();
+        const std::string index = blockIndex.str();
+        const std::string blockId = Azure::Core::Convert::Base64Encode(std::vector<uint8_t>(index.begin(), index.end()));
+
+        Azure::Core::IO::MemoryBodyStream body(block.data(), blockSize);
+        blobClient.StageBlock(blockId, body);
+        blockIds.push_back(blockId);
+      }
+
+      // the staged blocks that are never committed are garbage-collected by Azure
+      as::CommitBlockListOptions commitOptions;
+      commitOptions.AccessTier = accessTier_;
+      blobClient.CommitBlockList(blockIds, commitOptions);
+    }
+    catch (std::exception& ex)
+    {
+      throw StoragePluginException("AzureBlobStorage: error writing file " + std::string(path_) + ": " + ex.what());
+    }
+  }
+
+  virtual size_t GetBufferingSize(size_t size) const ORTHANC_OVERRIDE
+  {
+    // the small objects are uploaded at once
+    return (size <= UPLOAD_BLOCK_SIZE ? size : UPLOAD_BLOCK_SIZE);
+  }
 };
 
 
@@ -98,12 +157,19 @@ class Reader : public IStorage::IReader
   std::string path_;
   as::BlobContainerClient client_;
   int64_t size_;
+  as::DownloadBlobToOptions options_;
 
 public:
-  Reader(const std::list<std::string>& paths, const as::BlobContainerClient& client)
+  Reader(const std::list<std::string>& paths, const as::BlobContainerClient& client, int64_t downloadChunkSize, int32_t downloadConcurrency)
     : client_(client)
   {
+    // large blobs are downloaded as concurrent ranges, directly into the target buffer
+    options_.TransferOptions.InitialChunkSize = downloadChunkSize;
+    options_.TransferOptions.ChunkSize = downloadChunkSize;
+    options_.TransferOptions.Concurrency = downloadConcurrency;
+
     std::string firstExceptionMessage;
+    bool notFound = true;  // whether the blob has been confirmed to be missing at all the paths
 
     for (auto& path: paths)
     {
@@ -115,15 +181,35 @@ public:
         path_ = path;
         return;
       }
+      catch (Azure::Storage::StorageException& ex)
+      {
+        if (firstExceptionMessage.empty())
+        {
+          firstExceptionMessage = "AzureBlobStorage: error opening file for reading " + std::string(path) + ": " + ex.what();
+        }
+
+        if (ex.StatusCode != Azure::Core::Http::HttpStatusCode::NotFound)
+        {
+          notFound = false;
+        }
+        //ignore to retry
+      }
       catch (std::exception& ex)
       {
         if (firstExceptionMessage.empty())
         {
           firstExceptionMessage = "AzureBlobStorage: error opening file for reading " + std::string(path) + ": " + ex.what();
         }
+        notFound = false;
         //ignore to retry
       }
     }
+
+    if (notFound)
+    {
+      throw StoragePluginNotFoundException(firstExceptionMessage);
+    }
+
     throw StoragePluginException(firstExceptionMessage);
   }
 
@@ -148,7 +234,7 @@ public:
     try
     {
       as::BlockBlobClient blobClient = client_.GetBlockBlobClient(path_);
-      blobClient.DownloadTo(reinterpret_cast<uint8_t*>(data), static_cast<int64_t>(size));
+      blobClient.DownloadTo(reinterpret_cast<uint8_t*>(data), static_cast<int64_t>(size), options_);
     }
     catch (std::exception& ex)
     {
@@ -161,7 +247,7 @@ public:
     try
     {
       as::BlockBlobClient blobClient = client_.GetBlockBlobClient(path_);
-      as::DownloadBlobToOptions options;
+      as::DownloadBlobToOptions options = options_;
       options.Range = Azure::Core::Http::HttpRange();
       options.Range.Value().Length = static_cast<int64_t>(size);
       options.Range.Value().Offset = static_cast<int64_t>(fromOffset);
@@ -222,6 +308,8 @@ IStorage* AzureBlobStoragePluginFactory::CreateStorage(const std::string& nameFo
   bool storageContainsUnknownFiles = false;
   bool createContainerIfNotExists = true;
   as::Models::AccessTier accessTier; // no need to initialize, this is a Nullable type
+  unsigned int downloadChunkSizeMB = 16;
+  unsigned int downloadConcurrency = 4;
 
   if (orthancConfig.IsSection(GetConfigurationSectionName()))
   {
@@ -249,6 +337,14 @@ IStorage* AzureBlobStoragePluginFactory::CreateStorage(const std::string& nameFo
     boost::trim(containerName);
 
     createContainerIfNotExists = pluginSection.GetBooleanValue("CreateContainerIfNotExists", true);
+    downloadChunkSizeMB = pluginSection.GetUnsignedIntegerValue("ParallelDownloadChunkSize", downloadChunkSizeMB);
+    downloadConcurrency = pluginSection.GetUnsignedIntegerValue("ParallelDownloadConcurrency", downloadConcurrency);
+
+    if (downloadChunkSizeMB == 0 || downloadConcurrency == 0)
+    {
+      LOG(ERROR) << "Azure Storage plugin: \"ParallelDownloadChunkSize\" and \"ParallelDownloadConcurrency\" must be strictly positive";
+      return nullptr;
+    }
 
     std::string strAccessTier;
     if (pluginSection.LookupStringValue(strAccessTier, "AccessTier"))
@@ -348,7 +444,8 @@ IStorage* AzureBlobStoragePluginFactory::CreateStorage(const std::string& nameFo
 
     LOG(INFO) << "Blob storage initialized";
 
-    return new AzureBlobStoragePlugin(nameForLogs, client, enableLegacyStorageStructure, storageContainsUnknownFiles, accessTier);
+    return new AzureBlobStoragePlugin(nameForLogs, client, enableLegacyStorageStructure, storageContainsUnknownFiles, accessTier,
+                                      static_cast<int64_t>(downloadChunkSizeMB) * 1024 * 1024, static_cast<int32_t>(downloadConcurrency));
   }
   catch (const std::exception& e)
   {
@@ -358,11 +455,14 @@ IStorage* AzureBlobStoragePluginFactory::CreateStorage(const std::string& nameFo
 
 }
 
-AzureBlobStoragePlugin::AzureBlobStoragePlugin(const std::string& nameForLogs, const as::BlobContainerClient& blobClient, bool enableLegacyStorageStructure, bool storageContainsUnknownFiles, as::Models::AccessTier accessTier)
+AzureBlobStoragePlugin::AzureBlobStoragePlugin(const std::string& nameForLogs, const as::BlobContainerClient& blobClient, bool enableLegacyStorageStructure, bool storageContainsUnknownFiles, as::Models::AccessTier accessTier,
+                                               int64_t downloadChunkSize, int32_t downloadConcurrency)
   : BaseStorage(nameForLogs, enableLegacyStorageStructure),
     blobClient_(blobClient),
     storageContainsUnknownFiles_(storageContainsUnknownFiles),
-    accessTier_(accessTier)
+    accessTier_(accessTier),
+    downloadChunkSize_(downloadChunkSize),
+    downloadConcurrency_(downloadConcurrency)
 {
 }
 
@@ -380,7 +480,7 @@ IStorage::IReader* AzureBlobStoragePlugin::GetReaderForObject(const char* uuid,
     paths.push_back(GetPath(uuid, type, encryptionEnabled, true));
   }
 
-  return new Reader(paths, blobClient_);
+  return new Reader(paths, blobClient_, downloadChunkSize_, downloadConcurrency_);
 }
 
 void AzureBlobStoragePlugin::DeleteObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled)
@@ -397,3 +497,66 @@ void AzureBlobStoragePlugin::DeleteObject(const char* uuid, OrthancPluginContent
     throw StoragePluginException("AzureBlobStorage: error while deleting file " + std::string(path) + ": " + ex.what());
   }
 }
+
+void AzureBlobStoragePlugin::DeleteObjects(const std::vector<ObjectIdentifier>& objects, bool encryptionEnabled)
+{
+  static const size_t MAX_SUBREQUESTS_PER_BATCH = 256;  // Blob Batch limit
+
+  std::string firstExceptionMessage;
+
+  for (size_t start = 0; start < objects.size(); start += MAX_SUBREQUESTS_PER_BATCH)
+  {
+    const size_t end = std::min(start + MAX_SUBREQUESTS_PER_BATCH, objects.size());
+
+    std::vector<std::string> paths;
+    std::vector<as::DeferredResponse<as::Models::DeleteBlobResult> > responses;
+    as::BlobContainerBatch batch = blobClient_.CreateBatch();
+
+    for (size_t i = start; i < end; i++)
+    {
+      paths.push_back(GetPath(objects[i].uuid_.c_str(), objects[i].type_, encryptionEnabled));
+      responses.push_back(batch.DeleteBlob(paths.back()));
+    }
+
+    try
+    {
+      blobClient_.SubmitBatch(batch);
+    }
+    catch (std::exception& ex)
+    {
+      if (firstExceptionMessage.empty())
+      {
+        firstExceptionMessage = "AzureBlobStorage: error while deleting " + boost::lexical_cast<std::string>(paths.size()) + " files: " + ex.what();
+      }
+
+      continue;
+    }
+
+    for (size_t i = 0; i < responses.size(); i++)
+    {
+      try
+      {
+        responses[i].GetResponse();
+      }
+      catch (Azure::Storage::StorageException& ex)
+      {
+        if (ex.ErrorCode != "BlobNotFound" && firstExceptionMessage.empty())
+        {
+          firstExceptionMessage = "AzureBlobStorage: error while deleting file " + paths[i] + ": " + ex.what();
+        }
+      }
+      catch (std::exception& ex)
+      {
+        if (firstExceptionMessage.empty())
+        {
+          firstExceptionMessage = "AzureBlobStorage: error while deleting file " + paths[i] + ": " + ex.what();
+        }
+      }
+    }
+  }
+
+  if (!firstExceptionMessage.empty())
+  {
+    throw StoragePluginException(firstExceptionMessage);
+  }
+}
@@ -0,0 +1,148 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "BackgroundThrottler.h"
+#include "Logging.h"
+
+#include <boost/thread/thread.hpp>
+
+#include <algorithm>
+
+
+// the average latency is not updated while there are no foreground reads: after this delay, the foreground is
+// considered as idle
+static const unsigned int FOREGROUND_IDLE_SECONDS = 10;
+
+static const double LATENCY_SMOOTHING = 0.2;
+
+static const unsigned int MIN_BACK_OFF_MILLISECONDS = 100;
+static const unsigned int MAX_BACK_OFF_MILLISECONDS = 5000;
+
+
+BackgroundThrottler::BackgroundThrottler(uint64_t maxBytesPerSecond,
+                                         unsigned int maxRequestsPerSecond,
+                                         unsigned int latencyThreshold) :
+  latencyThreshold_(latencyThreshold),
+  averageLatency_(0),
+  lastForegroundRead_(boost::posix_time::microsec_clock::universal_time())
+{
+  if (maxBytesPerSecond > 0)
+  {
+    bytes_.reset(new TokenBucket(maxBytesPerSecond));
+  }
+
+  if (maxRequestsPerSecond > 0)
+  {
+    requests_.reset(new TokenBucket(maxRequestsPerSecond));
+  }
+}
+
+
+bool BackgroundThrottler::IsForegroundSlow()
+{
+  if (latencyThreshold_ == 0)
+  {
+    return false;
+  }
+
+  boost::mutex::scoped_lock lock(latencyMutex_);
+
+  return (averageLatency_ > static_cast<double>(latencyThreshold_) &&
+          boost::posix_time::microsec_clock::universal_time() - lastForegroundRead_ < boost::posix_time::seconds(FOREGROUND_IDLE_SECONDS));
+}
+
+
+void BackgroundThrottler::AddForegroundRead(uint64_t latencyMicroseconds)
+{
+  if (latencyThreshold_ == 0)
+  {
+    return;
+  }
+
+  const double latency = static_cast<double>(latencyMicroseconds) / 1000.0;
+  const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+  boost::mutex::scoped_lock lock(latencyMutex_);
+
+  if (now - lastForegroundRead_ >= boost::posix_time::seconds(FOREGROUND_IDLE_SECONDS))
+  {
+    // the previous average is outdated
+    averageLatency_ = latency;
+  }
+  else
+  {
+    averageLatency_ = (1.0 - LATENCY_SMOOTHING) * averageLatency_ + LATENCY_SMOOTHING * latency;
+  }
+
+  lastForegroundRead_ = now;
+}
+
+
+bool BackgroundThrottler::WaitForForeground(const StopFlag& stop,
+                                            const boost::posix_time::ptime& deadline)
+{
+  unsigned int backOff = MIN_BACK_OFF_MILLISECONDS;
+
+  while (IsForegroundSlow())
+  {
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+    if (now >= deadline)
+    {
+      LOG(INFO) << "Background transfers: the foreground reads are still slow, but the back-off of this step has reached its limit";
+      return true;
+    }
+
+    const unsigned int delay = static_cast<unsigned int>(std::min(static_cast<int64_t>(backOff), (deadline - now).total_milliseconds() + 1));
+    LOG(INFO) << "Background transfers: the foreground reads are slow, backing off for " << delay << " ms";
+
+    // the stop requests are checked every STOP_CHECK_MILLISECONDS
+    for (unsigned int waited = 0; waited < delay; waited += TokenBucket::STOP_CHECK_MILLISECONDS)
+    {
+      if (stop.IsSet())
+      {
+        return false;
+      }
+
+      boost::this_thread::sleep(boost::posix_time::milliseconds(std::min(static_cast<unsigned int>(TokenBucket::STOP_CHECK_MILLISECONDS), delay - waited)));
+    }
+
+    backOff = std::min(2 * backOff, MAX_BACK_OFF_MILLISECONDS);
+  }
+
+  return !stop.IsSet();
+}
+
+
+bool BackgroundThrottler::ConsumeRequests(unsigned int requestsCount,
+                                          const StopFlag& stop)
+{
+  return (requests_.get() == NULL ||
+          requests_->Consume(requestsCount, stop));
+}
+
+
+bool BackgroundThrottler::ConsumeBytes(uint64_t size,
+                                       const StopFlag& stop)
+{
+  return (bytes_.get() == NULL ||
+          bytes_->Consume(size, stop));
+}
@@ -0,0 +1,72 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "TokenBucket.h"
+
+#include <memory>
+
+
+// Throttles the background transfers (the move-storage jobs) so that they only use the spare capacity of the storages:
+// their throughput and their rate of requests are limited by token buckets, and they back off while the latency of the
+// foreground reads (the reads of Orthanc) is above a threshold.
+class BackgroundThrottler : public boost::noncopyable
+{
+public:
+  // set when the job of the background transfers is stopped (paused or canceled), interrupts their back-off
+  typedef TokenBucket::StopFlag  StopFlag;
+
+private:
+  std::unique_ptr<TokenBucket>  bytes_;              // NULL if the throughput is not limited
+  std::unique_ptr<TokenBucket>  requests_;           // NULL if the rate of requests is not limited
+  unsigned int                  latencyThreshold_;   // in milliseconds, 0 to disable the back-off
+  boost::mutex                  latencyMutex_;
+  double                        averageLatency_;     // moving average of the latency of the foreground reads, in milliseconds
+  boost::posix_time::ptime      lastForegroundRead_;
+
+  bool IsForegroundSlow();
+
+public:
+  BackgroundThrottler(uint64_t maxBytesPerSecond,
+                      unsigned int maxRequestsPerSecond,
+                      unsigned int latencyThreshold);
+
+  bool HasLatencyThreshold() const
+  {
+    return latencyThreshold_ > 0;
+  }
+
+  void AddForegroundRead(uint64_t latencyMicroseconds);
+
+  // blocks while the foreground reads are slow.  The back-off is interrupted when 'stop' is set, and it does not last
+  // beyond 'deadline', so that the back-off of a job step is capped.  Returns false if it has been interrupted by 'stop'.
+  bool WaitForForeground(const StopFlag& stop,
+                         const boost::posix_time::ptime& deadline);
+
+  // block until the transfers fit within the budgets of requests and of bytes.  Return false if they have been
+  // interrupted by 'stop'.
+  bool ConsumeRequests(unsigned int requestsCount,
+                       const StopFlag& stop);
+
+  bool ConsumeBytes(uint64_t size,
+                    const StopFlag& stop);
+};
@@ -0,0 +1,950 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "CompressionHelpers.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <queue>
+#include <string.h>
+#include <unordered_map>
+#include <zlib.h>
+
+namespace fs = boost::filesystem;
+
+
+// the magic starts with a byte that can not start a JSON document nor a DICOM preamble that is left empty
+const std::string CompressionHelpers::MAGIC = std::string("\x89" "OZ1", 4);
+
+static const uint32_t STORED_FRAME = 0x80000000u;    // flag of the frames that are stored as is in the frames table
+static const size_t MAX_FRAME_SIZE = 64 * 1024 * 1024;
+static const uint64_t MAX_FRAMES_COUNT = 1u << 28;
+static const size_t WRAPPED_FRAME_SIZE = 64 * 1024;   // frame size of the objects that are wrapped without being compressed
+
+// the dictionaries are trained by selecting the segments of the samples that contain the most k-mers shared by
+// different samples (a simplified version of the COVER algorithm of zstd)
+static const size_t KMER_SIZE = 8;
+static const size_t SEGMENT_SIZE = 64;
+static const size_t SEGMENT_STEP = 8;
+
+static const char* const DICTIONARY_EXTENSION = ".zdict";
+static const unsigned int DEFAULT_VERIFICATION_DELAY_MILLISECONDS = 10000;
+static const unsigned int MAX_STORE_DICTIONARY_ATTEMPTS = 5;
+
+
+static void EncodeLittleEndian(char* output, uint64_t value, size_t size)
+{
+  for (size_t i = 0; i < size; i++)
+  {
+    output[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+  }
+}
+
+static uint64_t DecodeLittleEndian(const char* data, size_t size)
+{
+  uint64_t value = 0;
+
+  for (size_t i = 0; i < size; i++)
+  {
+    value |= static_cast<uint64_t>(static_cast<uint8_t>(data[i])) << (8 * i);
+  }
+
+  return value;
+}
+
+
+uint64_t CompressionHelpers::FramesIndex::GetFramesCount() const
+{
+  if (uncompressedSize_ == 0)
+  {
+    return 0;
+  }
+  else
+  {
+    return (uncompressedSize_ + frameSize_ - 1) / frameSize_;
+  }
+}
+
+uint64_t CompressionHelpers::FramesIndex::GetCompressedSize() const
+{
+  if (frameEntries_.size() != GetFramesCount())
+  {
+    throw StoragePluginException("The frames table of the compressed object has not been read");
+  }
+
+  if (frameEntries_.empty())
+  {
+    return GetIndexSize();
+  }
+  else
+  {
+    return frameOffsets_.back() + (frameEntries_.back() & ~STORED_FRAME);
+  }
+}
+
+void CompressionHelpers::FramesIndex::GetCompressedRange(uint64_t& compressedOffset, size_t& compressedSize, uint64_t fromOffset, size_t size) const
+{
+  if (frameEntries_.size() != GetFramesCount())
+  {
+    throw StoragePluginException("The frames table of the compressed object has not been read");
+  }
+
+  if (fromOffset + size > uncompressedSize_)
+  {
+    throw StoragePluginException("The range [" + boost::lexical_cast<std::string>(fromOffset) + ", " + boost::lexical_cast<std::string>(fromOffset + size) +
+                                 ") is out of the object of " + boost::lexical_cast<std::string>(uncompressedSize_) + " bytes");
+  }
+
+  if (size == 0)
+  {
+    compressedOffset = GetIndexSize();
+    compressedSize = 0;
+    return;
+  }
+
+  const size_t firstFrame = static_cast<size_t>(fromOffset / frameSize_);
+  const size_t lastFrame = static_cast<size_t>((fromOffset + size - 1) / frameSize_);
+
+  compressedOffset = frameOffsets_[firstFrame];
+  compressedSize = static_cast<size_t>(frameOffsets_[lastFrame] + (frameEntries_[lastFrame] & ~STORED_FRAME) - compressedOffset);
+}
+
+
+CompressionHelpers::Dictionary CompressionHelpers::LookupDictionary(uint32_t id) const
+{
+  if (id == 0)
+  {
+    return Dictionary();
+  }
+
+  for (unsigned int attempt = 0; attempt < 2; attempt++)
+  {
+    {
+      boost::mutex::scoped_lock lock(dictionariesMutex_);
+
+      std::map<uint32_t, Dictionary>::const_iterator dictionary = dictionaries_.find(id);
+
+      if (dictionary != dictionaries_.end())
+      {
+        return dictionary->second;
+      }
+    }
+
+    // the dictionary might have been trained by another instance
+    if (attempt == 0 &&
+        !FetchDictionary(id))
+    {
+      break;
+    }
+  }
+
+  throw StoragePluginException("The compression dictionary " + boost::lexical_cast<std::string>(id) + " is not available");
+}
+
+
+CompressionHelpers::CompressionHelpers()
+  : frameSize_(64 * 1024),
+    maxRatio_(90),
+    verificationDelay_(DEFAULT_VERIFICATION_DELAY_MILLISECONDS)
+{
+}
+
+void CompressionHelpers::SetLevel(OrthancPluginContentType type, int level)
+{
+  if (level < Z_BEST_SPEED || level > Z_BEST_COMPRESSION)
+  {
+    throw StoragePluginException("Invalid compression level: " + boost::lexical_cast<std::string>(level));
+  }
+
+  levels_[type] = level;
+}
+
+void CompressionHelpers::SetFrameSize(size_t frameSize)
+{
+  if (frameSize == 0 || frameSize > MAX_FRAME_SIZE)
+  {
+    throw StoragePluginException("Invalid compression frame size: " + boost::lexical_cast<std::string>(frameSize) + " bytes");
+  }
+
+  frameSize_ = frameSize;
+}
+
+void CompressionHelpers::SetMaxRatio(unsigned int maxRatio)
+{
+  maxRatio_ = maxRatio;
+}
+
+void CompressionHelpers::AddDictionary(uint32_t id, OrthancPluginContentType type, const std::string& dictionary)
+{
+  RegisterDictionary(id, type, dictionary);
+}
+
+void CompressionHelpers::RegisterDictionary(uint32_t id, OrthancPluginContentType type, const std::string& dictionary) const
+{
+  if (id == 0 ||
+      dictionary.empty() ||
+      dictionary.size() > MAX_DICTIONARY_SIZE)
+  {
+    throw StoragePluginException("Invalid compression dictionary " + boost::lexical_cast<std::string>(id));
+  }
+
+  boost::mutex::scoped_lock lock(dictionariesMutex_);
+
+  dictionaries_[id].reset(new std::string(dictionary));
+
+  std::map<OrthancPluginContentType, uint32_t>::const_iterator active = activeDictionaries_.find(type);
+  if (active == activeDictionaries_.end() ||
+      active->second < id)
+  {
+    activeDictionaries_[type] = id;
+  }
+}
+
+uint32_t CompressionHelpers::GetActiveDictionary(OrthancPluginContentType type) const
+{
+  boost::mutex::scoped_lock lock(dictionariesMutex_);
+
+  std::map<OrthancPluginContentType, uint32_t>::const_iterator active = activeDictionaries_.find(type);
+  if (active == activeDictionaries_.end())
+  {
+    return 0;
+  }
+  else
+  {
+    return active->second;
+  }
+}
+
+// the local copies of the dictionaries are stored in files named "<id>.<content type>.zdict"
+static fs::path GetDictionaryPath(const std::string& directory, uint32_t id, OrthancPluginContentType type)
+{
+  return fs::path(directory) / (boost::lexical_cast<std::string>(id) + "." + boost::lexical_cast<std::string>(static_cast<int>(type)) + DICTIONARY_EXTENSION);
+}
+
+static void WriteDictionaryFile(const fs::path& path, const std::string& dictionary)
+{
+  fs::path tmpPath = path;
+  tmpPath += ".tmp";
+
+  try
+  {
+    {
+      fs::ofstream f(tmpPath, std::ios::out | std::ios::binary | std::ios::trunc);
+      f.write(dictionary.data(), dictionary.size());
+      f.close();
+
+      if (!f.good())
+      {
+        throw StoragePluginException("Unable to write the compression dictionary " + tmpPath.string());
+      }
+    }
+
+    fs::rename(tmpPath, path);
+  }
+  catch (fs::filesystem_error& e)
+  {
+    throw StoragePluginException("Unable to write the compression dictionary " + path.string() + ": " + e.what());
+  }
+}
+
+static bool ParseDictionaryFilename(uint32_t& id, OrthancPluginContentType& type, const fs::path& path)
+{
+  if (path.extension() != DICTIONARY_EXTENSION)
+  {
+    return false;
+  }
+
+  const std::string stem = path.stem().string();
+  const size_t separator = stem.find('.');
+
+  if (separator == std::string::npos)
+  {
+    return false;
+  }
+
+  try
+  {
+    id = boost::lexical_cast<uint32_t>(stem.substr(0, separator));
+    type = static_cast<OrthancPluginContentType>(boost::lexical_cast<int>(stem.substr(separator + 1)));
+    return id != 0;
+  }
+  catch (boost::bad_lexical_cast&)
+  {
+    return false;
+  }
+}
+
+void CompressionHelpers::LoadDictionaries(const std::string& directory)
+{
+  try
+  {
+    fs::create_directories(directory);
+
+    for (fs::directory_iterator it(directory); it != fs::directory_iterator(); ++it)
+    {
+      uint32_t id;
+      OrthancPluginContentType type;
+
+      if (fs::is_regular_file(it->status()) &&
+          ParseDictionaryFilename(id, type, it->path()))
+      {
+        fs::ifstream f(it->path(), std::ios::in | std::ios::binary);
+        std::string dictionary((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+
+        if (!f.good() && !f.eof())
+        {
+          throw StoragePluginException("Unable to read the compression dictionary " + it->path().string());
+        }
+
+        AddDictionary(id, type, dictionary);
+      }
+    }
+  }
+  catch (fs::filesystem_error& e)
+  {
+    throw StoragePluginException("Unable to load the compression dictionaries from " + directory + ": " + e.what());
+  }
+
+  boost::mutex::scoped_lock lock(dictionariesMutex_);
+  dictionariesDirectory_ = directory;
+}
+
+bool CompressionHelpers::HasDictionariesDirectory() const
+{
+  boost::mutex::scoped_lock lock(dictionariesMutex_);
+  return !dictionariesDirectory_.empty();
+}
+
+void CompressionHelpers::SetDictionariesStorage(IDictionariesStorage* storage)
+{
+  dictionariesStorage_.reset(storage);
+}
+
+void CompressionHelpers::SetVerificationDelay(unsigned int milliseconds)
+{
+  verificationDelay_ = milliseconds;
+}
+
+void CompressionHelpers::KeepDictionary(uint32_t id, OrthancPluginContentType type, const std::string& dictionary) const
+{
+  RegisterDictionary(id, type, dictionary);
+
+  std::string directory;
+
+  {
+    boost::mutex::scoped_lock lock(dictionariesMutex_);
+    directory = dictionariesDirectory_;
+  }
+
+  if (!directory.empty())
+  {
+    WriteDictionaryFile(GetDictionaryPath(directory, id, type), dictionary);
+  }
+}
+
+bool CompressionHelpers::FetchDictionary(uint32_t id) const
+{
+  OrthancPluginContentType type;
+  std::string dictionary;
+
+  if (dictionariesStorage_.get() == NULL ||
+      !dictionariesStorage_->ReadDictionary(type, dictionary, id))
+  {
+    return false;
+  }
+
+  KeepDictionary(id, type, dictionary);
+  return true;
+}
+
+uint32_t CompressionHelpers::GetNextDictionaryId() const
+{
+  boost::mutex::scoped_lock lock(dictionariesMutex_);
+  return (dictionaries_.empty() ? 1 : dictionaries_.rbegin()->first + 1);
+}
+
+void CompressionHelpers::SynchronizeDictionaries()
+{
+  if (dictionariesStorage_.get() == NULL)
+  {
+    return;
+  }
+
+  std::vector<uint32_t> ids;
+
+  for (uint32_t id = GetNextDictionaryId(); ; id++)
+  {
+    OrthancPluginContentType type;
+    std::string dictionary;
+
+    if (dictionariesStorage_->ReadDictionary(type, dictionary, id))
+    {
+      ids.push_back(id);
+    }
+    else
+    {
+      break;
+    }
+  }
+
+  if (ids.empty())
+  {
+    return;
+  }
+
+  // a dictionary that has just been written might still be overwritten by another instance that has taken the same
+  // id (see StoreDictionary()): the dictionaries are only used once they are final, i.e. after the verification delay
+  boost::this_thread::sleep(boost::posix_time::milliseconds(verificationDelay_));
+
+  for (size_t i = 0; i < ids.size(); i++)
+  {
+    if (!FetchDictionary(ids[i]))
+    {
+      throw StoragePluginException("The compression dictionary " + boost::lexical_cast<std::string>(ids[i]) + " has disappeared from the storage");
+    }
+  }
+}
+
+uint32_t CompressionHelpers::StoreDictionary(OrthancPluginContentType type, const std::string& dictionary)
+{
+  if (!HasDictionariesDirectory())
+  {
+    throw StoragePluginException("No directory has been configured to store the compression dictionaries");
+  }
+
+  boost::mutex::scoped_lock storeLock(storeMutex_);
+
+  for (unsigned int attempt = 0; attempt < MAX_STORE_DICTIONARY_ATTEMPTS; attempt++)
+  {
+    // the ids that have already been used by the other instances are skipped
+    SynchronizeDictionaries();
+
+    const uint32_t id = GetNextDictionaryId();
+
+    // the dictionary must be persisted before any object is compressed with it
+    if (dictionariesStorage_.get() != NULL)
+    {
+      // The object storages have no conditional writes: another instance might write the same id at the same
+      // time.  The id is only kept if the dictionary is still there once the other instances that have seen this
+      // id as free have had the time to write it.  The last writer wins, the other ones take the next id.
+      const boost::posix_time::ptime probe = boost::posix_time::microsec_clock::universal_time();
+
+      OrthancPluginContentType storedType;
+      std::string storedDictionary;
+
+      if (dictionariesStorage_->ReadDictionary(storedType, storedDictionary, id))
+      {
+        continue;  // just taken by another instance
+      }
+
+      dictionariesStorage_->WriteDictionary(id, type, dictionary);
+
+      if (boost::posix_time::microsec_clock::universal_time() - probe >= boost::posix_time::milliseconds(verificationDelay_))
+      {
+        // this write might have overwritten a dictionary that another instance has already verified
+        throw StoragePluginException("The compression dictionary " + boost::lexical_cast<std::string>(id) +
+                                     " has not been written within the verification delay");
+      }
+
+      boost::this_thread::sleep(boost::posix_time::milliseconds(verificationDelay_));
+
+      if (!dictionariesStorage_->ReadDictionary(storedType, storedDictionary, id))
+      {
+        throw StoragePluginException("The compression dictionary " + boost::lexical_cast<std::string>(id) + " has disappeared from the storage");
+      }
+
+      if (storedType != type ||
+          storedDictionary != dictionary)
+      {
+        continue;  // taken by another instance, whose dictionary is read at the next attempt
+      }
+    }
+
+    KeepDictionary(id, type, dictionary);
+    return id;
+  }
+
+  throw StoragePluginException("Unable to find a free id for the compression dictionary after " +
+                               boost::lexical_cast<std::string>(MAX_STORE_DICTIONARY_ATTEMPTS) + " attempts");
+}
+
+
+namespace
+{
+  struct KmerFrequency
+  {
+    uint32_t samplesCount_;   // number of samples that contain the k-mer
+    uint32_t lastSample_;
+  };
+
+  struct Segment
+  {
+    uint64_t score_;
+    uint32_t sample_;
+    uint32_t position_;
+
+    bool operator< (const Segment& other) const
+    {
+      return score_ < other.score_;
+    }
+  };
+}
+
+static uint64_t GetKmer(const std::string& sample, size_t position)
+{
+  uint64_t kmer;
+  memcpy(&kmer, sample.data() + position, KMER_SIZE);
+  return kmer;
+}
+
+// the k-mers that are contained by a single sample are not worth being in the dictionary
+static uint64_t GetSegmentScore(const std::unordered_map<uint64_t, KmerFrequency>& frequencies, const std::string& sample, size_t position)
+{
+  uint64_t score = 0;
+
+  for (size_t i = position; i + KMER_SIZE <= position + SEGMENT_SIZE; i++)
+  {
+    const uint32_t samplesCount = frequencies.find(GetKmer(sample, i))->second.samplesCount_;
+
+    if (samplesCount >= 2)
+    {
+      score += samplesCount;
+    }
+  }
+
+  return score;
+}
+
+void CompressionHelpers::TrainDictionary(std::string& dictionary, const std::vector<std::string>& samples, size_t maxSize)
+{
+  maxSize = std::min(maxSize, static_cast<size_t>(MAX_DICTIONARY_SIZE));
+
+  std::unordered_map<uint64_t, KmerFrequency> frequencies;
+
+  for (size_t s = 0; s < samples.size(); s++)
+  {
+    for (size_t i = 0; i + KMER_SIZE <= samples[s].size(); i++)
+    {
+      KmerFrequency& frequency = frequencies[GetKmer(samples[s], i)];   // value-initialized if new
+
+      if (frequency.samplesCount_ == 0 ||
+          frequency.lastSample_ != s)
+      {
+        frequency.samplesCount_++;
+        frequency.lastSample_ = static_cast<uint32_t>(s);
+      }
+    }
+  }
+
+  std::priority_queue<Segment> candidates;
+
+  for (size_t s = 0; s < samples.size(); s++)
+  {
+    for (size_t i = 0; i + SEGMENT_SIZE <= samples[s].size(); i += SEGMENT_STEP)
+    {
+      Segment segment;
+      segment.score_ = GetSegmentScore(frequencies, samples[s], i);
+      segment.sample_ = static_cast<uint32_t>(s);
+      segment.position_ = static_cast<uint32_t>(i);
+
+      if (segment.score_ > 0)
+      {
+        candidates.push(segment);
+      }
+    }
+  }
+
+  // greedy selection of the best segments.  The k-mers of the selected segments do not count anymore, so the scores
+  // of the candidates can only decrease: they are updated lazily, when they reach the top of the queue.
+  std::vector<Segment> selected;
+  size_t selectedSize = 0;
+
+  while (!candidates.empty() &&
+         selectedSize + SEGMENT_SIZE <= maxSize)
+  {
+    Segment segment = candidates.top();
+    candidates.pop();
+
+    segment.score_ = GetSegmentScore(frequencies, samples[segment.sample_], segment.position_);
+
+    if (segment.score_ == 0)
+    {
+      continue;
+    }
+
+    if (!candidates.empty() &&
+        segment.score_ < candidates.top().score_)
+    {
+      candidates.push(segment);
+      continue;
+    }
+
+    selected.push_back(segment);
+    selectedSize += SEGMENT_SIZE;
+
+    for (size_t i = segment.position_; i + KMER_SIZE <= segment.position_ + SEGMENT_SIZE; i++)
+    {
+      frequencies[GetKmer(samples[segment.sample_], i)].samplesCount_ = 0;
+    }
+  }
+
+  if (selected.empty())
+  {
+    throw StoragePluginException("The samples do not share enough content to train a compression dictionary");
+  }
+
+  // zlib encodes the closest matches with fewer bits: the best segments are at the end of the dictionary
+  dictionary.clear();
+  dictionary.reserve(selectedSize);
+
+  for (std::vector<Segment>::const_reverse_iterator it = selected.rbegin(); it != selected.rend(); ++it)
+  {
+    dictionary.append(samples[it->sample_], it->position_, SEGMENT_SIZE);
+  }
+}
+
+
+void CompressionHelpers::CompressFrame(std::string& target, const char* data, size_t size, int level, const std::string* dictionary)
+{
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+
+  if (deflateInit(&stream, level) != Z_OK)
+  {
+    throw StoragePluginException("Unable to initialize zlib");
+  }
+
+  if (dictionary != NULL &&
+      deflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(dictionary->data()), static_cast<uInt>(dictionary->size())) != Z_OK)
+  {
+    deflateEnd(&stream);
+    throw StoragePluginException("Unable to set the compression dictionary");
+  }
+
+  target.resize(deflateBound(&stream, static_cast<uLong>(size)));
+
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  stream.avail_in = static_cast<uInt>(size);
+  stream.next_out = reinterpret_cast<Bytef*>(&target[0]);
+  stream.avail_out = static_cast<uInt>(target.size());
+
+  const int result = deflate(&stream, Z_FINISH);
+  const size_t compressedSize = stream.total_out;
+  deflateEnd(&stream);
+
+  if (result != Z_STREAM_END)
+  {
+    throw StoragePluginException("Error while compressing a frame of " + boost::lexical_cast<std::string>(size) + " bytes");
+  }
+
+  target.resize(compressedSize);
+}
+
+void CompressionHelpers::DecompressFrame(char* target, size_t targetSize, const char* data, uint32_t frameEntry, const std::string* dictionary)
+{
+  const size_t size = frameEntry & ~STORED_FRAME;
+
+  if (frameEntry & STORED_FRAME)
+  {
+    if (size != targetSize)
+    {
+      throw StoragePluginException("Corrupted compressed object: unexpected size of a stored frame");
+    }
+
+    memcpy(target, data, size);
+  }
+  else
+  {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    if (inflateInit(&stream) != Z_OK)
+    {
+      throw StoragePluginException("Unable to initialize zlib");
+    }
+
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    stream.avail_in = static_cast<uInt>(size);
+    stream.next_out = reinterpret_cast<Bytef*>(target);
+    stream.avail_out = static_cast<uInt>(targetSize);
+
+    int result = inflate(&stream, Z_FINISH);
+
+    if (result == Z_NEED_DICT &&
+        dictionary != NULL &&
+        inflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(dictionary->data()), static_cast<uInt>(dictionary->size())) == Z_OK)
+    {
+      result = inflate(&stream, Z_FINISH);
+    }
+
+    const size_t uncompressedSize = stream.total_out;
+    inflateEnd(&stream);
+
+    if (result != Z_STREAM_END ||
+        uncompressedSize != targetSize)
+    {
+      throw StoragePluginException("Corrupted compressed object: unable to decompress a frame");
+    }
+  }
+}
+
+bool CompressionHelpers::Compress(std::string& compressed, const char* data, size_t size, OrthancPluginContentType type) const
+{
+  std::map<OrthancPluginContentType, int>::const_iterator level = levels_.find(type);
+
+  if (level == levels_.end() ||
+      size == 0)
+  {
+    return false;
+  }
+
+  const uint32_t dictionaryId = GetActiveDictionary(type);
+  const Dictionary dictionary = LookupDictionary(dictionaryId);
+
+  const size_t framesCount = (size + frameSize_ - 1) / frameSize_;
+  const size_t indexSize = HEADER_SIZE + framesCount * FRAME_ENTRY_SIZE;
+
+  compressed.clear();
+  compressed.reserve(indexSize + size / 2);
+  compressed.resize(indexSize);
+
+  memcpy(&compressed[0], MAGIC.data(), MAGIC_SIZE);
+  EncodeLittleEndian(&compressed[MAGIC_SIZE], size, UNCOMPRESSED_SIZE_SIZE);
+  EncodeLittleEndian(&compressed[MAGIC_SIZE + UNCOMPRESSED_SIZE_SIZE], frameSize_, FRAME_SIZE_SIZE);
+  EncodeLittleEndian(&compressed[MAGIC_SIZE + UNCOMPRESSED_SIZE_SIZE + FRAME_SIZE_SIZE], dictionaryId, DICTIONARY_ID_SIZE);
+
+  std::string frame;
+
+  for (size_t i = 0; i < framesCount; i++)
+  {
+    const size_t frameStart = i * frameSize_;
+    const size_t frameSize = std::min(frameSize_, size - frameStart);
+
+    CompressFrame(frame, data + frameStart, frameSize, level->second, dictionary.get());
+
+    // the content is assumed to be incompressible (e.g. DICOM with a compressed transfer syntax) if its first frame is
+    if (i == 0 &&
+        static_cast<uint64_t>(frame.size()) * 100 > static_cast<uint64_t>(frameSize) * maxRatio_)
+    {
+      return false;
+    }
+
+    uint32_t entry;
+
+    if (frame.size() < frameSize)
+    {
+      compressed.append(frame);
+      entry = static_cast<uint32_t>(frame.size());
+    }
+    else
+    {
+      compressed.append(data + frameStart, frameSize);
+      entry = static_cast<uint32_t>(frameSize) | STORED_FRAME;
+    }
+
+    EncodeLittleEndian(&compressed[HEADER_SIZE + i * FRAME_ENTRY_SIZE], entry, FRAME_ENTRY_SIZE);
+  }
+
+  return (static_cast<uint64_t>(compressed.size()) * 100 <= static_cast<uint64_t>(size) * maxRatio_);
+}
+
+bool CompressionHelpers::ParseHeader(FramesIndex& index, const char* data, size_t size)
+{
+  if (size < HEADER_SIZE ||
+      memcmp(data, MAGIC.data(), MAGIC_SIZE) != 0)
+  {
+    return false;
+  }
+
+  index.uncompressedSize_ = DecodeLittleEndian(data + MAGIC_SIZE, UNCOMPRESSED_SIZE_SIZE);
+  index.frameSize_ = static_cast<uint32_t>(DecodeLittleEndian(data + MAGIC_SIZE + UNCOMPRESSED_SIZE_SIZE, FRAME_SIZE_SIZE));
+  index.dictionaryId_ = static_cast<uint32_t>(DecodeLittleEndian(data + MAGIC_SIZE + UNCOMPRESSED_SIZE_SIZE + FRAME_SIZE_SIZE, DICTIONARY_ID_SIZE));
+  index.frameEntries_.clear();
+  index.frameOffsets_.clear();
+
+  // an object that starts with the magic but whose header is not valid is an object that is stored as is
+  return (index.frameSize_ != 0 &&
+          index.frameSize_ <= MAX_FRAME_SIZE &&
+          index.uncompressedSize_ <= MAX_FRAMES_COUNT * MAX_FRAME_SIZE &&
+          index.GetFramesCount() <= MAX_FRAMES_COUNT);
+}
+
+bool CompressionHelpers::ParseFramesTable(FramesIndex& index, const char* table, size_t size)
+{
+  const size_t framesCount = static_cast<size_t>(index.GetFramesCount());
+
+  if (size < framesCount * FRAME_ENTRY_SIZE)
+  {
+    return false;
+  }
+
+  std::vector<uint32_t> entries(framesCount);
+  std::vector<uint64_t> offsets(framesCount);
+
+  uint64_t offset = index.GetIndexSize();
+
+  for (size_t i = 0; i < framesCount; i++)
+  {
+    const uint32_t entry = static_cast<uint32_t>(DecodeLittleEndian(table + i * FRAME_ENTRY_SIZE, FRAME_ENTRY_SIZE));
+    const uint64_t frameStart = static_cast<uint64_t>(i) * index.frameSize_;
+    const uint64_t frameSize = std::min(static_cast<uint64_t>(index.frameSize_), index.uncompressedSize_ - frameStart);
+
+    // the frames are only compressed if they get smaller (see Compress())
+    if ((entry & STORED_FRAME) ?
+        (entry & ~STORED_FRAME) != frameSize :
+        (entry == 0 || entry >= frameSize))
+    {
+      return false;
+    }
+
+    entries[i] = entry;
+    offsets[i] = offset;
+    offset += (entry & ~STORED_FRAME);
+  }
+
+  index.frameEntries_.swap(entries);
+  index.frameOffsets_.swap(offsets);
+  return true;
+}
+
+bool CompressionHelpers::IsCompressed(const char* data, size_t size)
+{
+  FramesIndex index;
+  return (ParseHeader(index, data, size) &&
+          size >= index.GetIndexSize() &&
+          ParseFramesTable(index, data + HEADER_SIZE, size - HEADER_SIZE) &&
+          index.GetCompressedSize() == size);
+}
+
+bool CompressionHelpers::NeedsWrapping(const char* data, size_t size)
+{
+  return (size >= MAGIC_SIZE &&
+          memcmp(data, MAGIC.data(), MAGIC_SIZE) == 0);
+}
+
+void CompressionHelpers::Wrap(std::string& wrapped, const char* data, size_t size)
+{
+  const size_t framesCount = (size + WRAPPED_FRAME_SIZE - 1) / WRAPPED_FRAME_SIZE;
+  const size_t indexSize = HEADER_SIZE + framesCount * FRAME_ENTRY_SIZE;
+
+  wrapped.resize(indexSize);
+
+  memcpy(&wrapped[0], MAGIC.data(), MAGIC_SIZE);
+  EncodeLittleEndian(&wrapped[MAGIC_SIZE], size, UNCOMPRESSED_SIZE_SIZE);
+  EncodeLittleEndian(&wrapped[MAGIC_SIZE + UNCOMPRESSED_SIZE_SIZE], WRAPPED_FRAME_SIZE, FRAME_SIZE_SIZE);
+  EncodeLittleEndian(&wrapped[MAGIC_SIZE + UNCOMPRESSED_SIZE_SIZE + FRAME_SIZE_SIZE], 0, DICTIONARY_ID_SIZE);
+
+  for (size_t i = 0; i < framesCount; i++)
+  {
+    const size_t frameSize = std::min(WRAPPED_FRAME_SIZE, size - i * WRAPPED_FRAME_SIZE);
+    EncodeLittleEndian(&wrapped[HEADER_SIZE + i * FRAME_ENTRY_SIZE], static_cast<uint32_t>(frameSize) | STORED_FRAME, FRAME_ENTRY_SIZE);
+  }
+
+  wrapped.append(data, size);
+}
+
+uint64_t CompressionHelpers::GetUncompressedSize(const char* data, size_t size)
+{
+  FramesIndex index;
+
+  if (!ParseHeader(index, data, size))
+  {
+    throw StoragePluginException("The object is not compressed");
+  }
+
+  return index.GetUncompressedSize();
+}
+
+void CompressionHelpers::Decompress(char* target, size_t targetSize, const char* data, size_t size) const
+{
+  FramesIndex index;
+
+  if (!ParseHeader(index, data, size))
+  {
+    throw StoragePluginException("The object is not compressed");
+  }
+
+  if (size < index.GetIndexSize() ||
+      !ParseFramesTable(index, data + HEADER_SIZE, size - HEADER_SIZE))
+  {
+    throw StoragePluginException("Corrupted compressed object: invalid frames table");
+  }
+
+  if (index.GetUncompressedSize() != targetSize ||
+      index.GetCompressedSize() != size)
+  {
+    throw StoragePluginException("Corrupted compressed object: the size of the object does not match its header");
+  }
+
+  DecompressRange(target, targetSize, 0, index, data + index.GetIndexSize(), size - index.GetIndexSize());
+}
+
+void CompressionHelpers::DecompressRange(char* target, size_t size, uint64_t fromOffset, const FramesIndex& index, const char* compressed, size_t compressedSize) const
+{
+  uint64_t expectedOffset;
+  size_t expectedSize;
+  index.GetCompressedRange(expectedOffset, expectedSize, fromOffset, size);
+
+  if (compressedSize != expectedSize)
+  {
+    throw StoragePluginException("The compressed range has an unexpected size: " + boost::lexical_cast<std::string>(compressedSize) + " bytes");
+  }
+
+  if (size == 0)
+  {
+    return;
+  }
+
+  const uint64_t toOffset = fromOffset + size;
+  const size_t firstFrame = static_cast<size_t>(fromOffset / index.frameSize_);
+  const size_t lastFrame = static_cast<size_t>((toOffset - 1) / index.frameSize_);
+
+  const Dictionary dictionary = LookupDictionary(index.dictionaryId_);
+
+  std::vector<char> partialFrame;
+
+  for (size_t i = firstFrame; i <= lastFrame; i++)
+  {
+    const uint64_t frameStart = static_cast<uint64_t>(i) * index.frameSize_;
+    const size_t frameSize = static_cast<size_t>(std::min(static_cast<uint64_t>(index.frameSize_), index.uncompressedSize_ - frameStart));
+    const char* source = compressed + (index.frameOffsets_[i] - expectedOffset);
+
+    if (frameStart >= fromOffset &&
+        frameStart + frameSize <= toOffset)
+    {
+      DecompressFrame(target + (frameStart - fromOffset), frameSize, source, index.frameEntries_[i], dictionary.get());
+    }
+    else
+    {
+      // the frames at the boundaries of the range are decompressed in a temporary buffer
+      partialFrame.resize(frameSize);
+      DecompressFrame(partialFrame.data(), frameSize, source, index.frameEntries_[i], dictionary.get());
+
+      const uint64_t copyStart = std::max(frameStart, fromOffset);
+      const uint64_t copyEnd = std::min(frameStart + frameSize, toOffset);
+      memcpy(target + (copyStart - fromOffset), partialFrame.data() + (copyStart - frameStart), static_cast<size_t>(copyEnd - copyStart));
+    }
+  }
+}
@@ -0,0 +1,223 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "IStorage.h"
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+// Compression of the objects before they are encrypted and written.  The objects are compressed in
+// independent frames so that a range of the uncompressed object can be read without reading the whole object:
+// magic/uncompressed size/frame size/dictionary id, followed by the size of each compressed frame and by the frames.
+// The objects that are not compressed (incompressible content, or written before the compression was
+// enabled) are stored as is, except the ones that start with the magic: they are wrapped in frames that are
+// all stored as is, so that they can not be mistaken for compressed objects.  An object is only considered
+// as compressed if its header and its frames table are valid and match its size.
+// The small objects compress much better with a preset dictionary that is trained on a sample of similar objects.
+// The dictionaries are versioned by their id, that is stored in the header of the objects (0 = no dictionary).
+// They are stored next to the objects, so that all the Orthanc instances that share the storage can read them.
+class CompressionHelpers : public boost::noncopyable
+{
+public:
+  // the storage that is shared by all the Orthanc instances, where the dictionaries are persisted
+  class IDictionariesStorage : public boost::noncopyable
+  {
+  public:
+    virtual ~IDictionariesStorage()
+    {
+    }
+
+    // returns false if the storage has confirmed that there is no dictionary with this id, throws on the other errors
+    virtual bool ReadDictionary(OrthancPluginContentType& type, std::string& dictionary, uint32_t id) = 0;
+
+    virtual void WriteDictionary(uint32_t id, OrthancPluginContentType type, const std::string& dictionary) = 0;
+  };
+
+  static const size_t MAGIC_SIZE = 4;
+  static const size_t UNCOMPRESSED_SIZE_SIZE = 8;
+  static const size_t FRAME_SIZE_SIZE = 4;
+  static const size_t DICTIONARY_ID_SIZE = 4;
+  static const size_t FRAME_ENTRY_SIZE = 4;    // compressed size of a frame in the frames table
+  static const size_t HEADER_SIZE = MAGIC_SIZE + UNCOMPRESSED_SIZE_SIZE + FRAME_SIZE_SIZE + DICTIONARY_ID_SIZE;
+  static const size_t MAX_DICTIONARY_SIZE = 32 * 1024;   // size of the zlib window
+
+  static const std::string MAGIC;
+
+  // header and frames table of a compressed object
+  class FramesIndex
+  {
+    friend class CompressionHelpers;
+
+    uint64_t               uncompressedSize_;
+    uint32_t               frameSize_;
+    uint32_t               dictionaryId_;
+    std::vector<uint32_t>  frameEntries_;       // compressed size of each frame | STORED_FRAME flag
+    std::vector<uint64_t>  frameOffsets_;       // offset of each frame in the compressed object
+
+  public:
+    FramesIndex()
+      : uncompressedSize_(0),
+        frameSize_(0),
+        dictionaryId_(0)
+    {
+    }
+
+    uint64_t GetUncompressedSize() const
+    {
+      return uncompressedSize_;
+    }
+
+    uint32_t GetDictionaryId() const
+    {
+      return dictionaryId_;
+    }
+
+    uint64_t GetFramesCount() const;
+
+    // size of the header and of the frames table
+    size_t GetIndexSize() const
+    {
+      return HEADER_SIZE + static_cast<size_t>(GetFramesCount()) * FRAME_ENTRY_SIZE;
+    }
+
+    uint64_t GetCompressedSize() const;
+
+    // range of the compressed object that must be read to decompress the range [fromOffset, fromOffset + size)
+    void GetCompressedRange(uint64_t& compressedOffset, size_t& compressedSize, uint64_t fromOffset, size_t size) const;
+  };
+
+private:
+  typedef boost::shared_ptr<const std::string>  Dictionary;
+
+  std::map<OrthancPluginContentType, int>  levels_;      // only the content types in this map are compressed
+  size_t                                   frameSize_;
+  unsigned int                             maxRatio_;    // in percent
+
+  // the dictionaries can be trained while the plugin is running, by this instance or by another one: the
+  // dictionaries that are not known yet are read from the shared storage when an object needs them
+  mutable boost::mutex                                  dictionariesMutex_;
+  mutable std::map<uint32_t, Dictionary>                dictionaries_;
+  mutable std::map<OrthancPluginContentType, uint32_t>  activeDictionaries_;   // dictionary used to compress each content type
+  std::string                                           dictionariesDirectory_;  // local copy of the dictionaries
+  std::unique_ptr<IDictionariesStorage>                 dictionariesStorage_;
+  boost::mutex                                          storeMutex_;           // the new dictionaries are stored one by one
+  unsigned int                                          verificationDelay_;    // in milliseconds, see StoreDictionary()
+
+  void RegisterDictionary(uint32_t id, OrthancPluginContentType type, const std::string& dictionary) const;
+
+  // registers a dictionary, and keeps a local copy of it
+  void KeepDictionary(uint32_t id, OrthancPluginContentType type, const std::string& dictionary) const;
+
+  // reads a dictionary from the shared storage, and keeps it
+  bool FetchDictionary(uint32_t id) const;
+
+  uint32_t GetNextDictionaryId() const;
+
+  Dictionary LookupDictionary(uint32_t id) const;
+
+  static void CompressFrame(std::string& target, const char* data, size_t size, int level, const std::string* dictionary);
+
+  static void DecompressFrame(char* target, size_t targetSize, const char* data, uint32_t frameEntry, const std::string* dictionary);
+
+public:
+  CompressionHelpers();
+
+  // zlib level, from 1 (fastest) to 9 (smallest)
+  void SetLevel(OrthancPluginContentType type, int level);
+
+  bool IsCompressionEnabled(OrthancPluginContentType type) const
+  {
+    return levels_.find(type) != levels_.end();
+  }
+
+  void SetFrameSize(size_t frameSize);
+
+  size_t GetFrameSize() const
+  {
+    return frameSize_;
+  }
+
+  // the objects whose compressed size is larger than "maxRatio" percent of their size are not compressed
+  void SetMaxRatio(unsigned int maxRatio);
+
+  // registers a dictionary.  It is used to compress the objects of its content type if it is the most recent one.
+  void AddDictionary(uint32_t id, OrthancPluginContentType type, const std::string& dictionary);
+
+  // returns 0 if the objects of this content type are compressed without dictionary
+  uint32_t GetActiveDictionary(OrthancPluginContentType type) const;
+
+  // loads the dictionaries that have been copied in this directory, the new dictionaries are copied in the same directory
+  void LoadDictionaries(const std::string& directory);
+
+  bool HasDictionariesDirectory() const;
+
+  void SetDictionariesStorage(IDictionariesStorage* storage);  // takes ownership
+
+  // reads the dictionaries that have been stored by the other instances since the last one that is known.  Waits for
+  // the verification delay if there are new ones, as they might still be overwritten.
+  void SynchronizeDictionaries();
+
+  // time after which a dictionary that has been written to the shared storage is read back, to check that no other
+  // instance has taken the same id.  Each write of a dictionary must complete within this delay.
+  void SetVerificationDelay(unsigned int milliseconds);
+
+  // stores a new version of the dictionary of a content type in the shared storage and in the local directory, and
+  // activates it.  Returns the id of the new dictionary.
+  uint32_t StoreDictionary(OrthancPluginContentType type, const std::string& dictionary);
+
+  // builds a dictionary from the substrings that are the most frequently shared by the samples
+  static void TrainDictionary(std::string& dictionary, const std::vector<std::string>& samples, size_t maxSize);
+
+  // returns false if the object must be stored as is (content type that is not compressed, or incompressible content)
+  bool Compress(std::string& compressed, const char* data, size_t size, OrthancPluginContentType type) const;
+
+  // returns false if "data" (that contains at least the beginning of an object) does not start with a valid header.
+  // "size" must be at least HEADER_SIZE to detect a compressed object.
+  static bool ParseHeader(FramesIndex& index, const char* data, size_t size);
+
+  // completes the index with the frames table, that starts right after the header (see FramesIndex::GetIndexSize()).
+  // Returns false if the frames table is not valid.  The object is only compressed if the size of the stored object
+  // is FramesIndex::GetCompressedSize().
+  static bool ParseFramesTable(FramesIndex& index, const char* table, size_t size);
+
+  // "data" must contain the whole stored object
+  static bool IsCompressed(const char* data, size_t size);
+
+  // the objects that are stored as is must be wrapped if they start with the magic
+  static bool NeedsWrapping(const char* data, size_t size);
+
+  static void Wrap(std::string& wrapped, const char* data, size_t size);
+
+  static uint64_t GetUncompressedSize(const char* data, size_t size);
+
+  void Decompress(char* target, size_t targetSize, const char* data, size_t size) const;
+
+  // decompresses the range [fromOffset, fromOffset + size).  "compressed" must contain the range of the compressed
+  // object that is given by FramesIndex::GetCompressedRange()
+  void DecompressRange(char* target, size_t size, uint64_t fromOffset, const FramesIndex& index, const char* compressed, size_t compressedSize) const;
+};
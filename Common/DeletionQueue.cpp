@@ -0,0 +1,527 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "DeletionQueue.h"
+#include "FileSystemStorage.h"
+
+#include <Logging.h>
+#include <SystemToolbox.h>
+#include <Toolbox.h>
+
+#include <boost/filesystem/fstream.hpp>
+#include <boost/lexical_cast.hpp>
+
+#if defined(_WIN32)
+#  include <io.h>
+#else
+#  include <unistd.h>
+#endif
+
+
+
+static const char* const JOURNAL_FILENAME = "deletions.journal";
+static const char* const JOURNAL_TMP_FILENAME = "deletions.journal.tmp";
+static const unsigned int MAX_ATTEMPTS = 3;
+static const unsigned int RETRY_DELAY_SECONDS = 5;
+static const unsigned int FAILED_BATCH_RETRY_DELAY_SECONDS = 60;   // the batches that still fail after MAX_ATTEMPTS are requeued after this delay
+static const size_t MIN_JOURNAL_ENTRIES_TO_COMPACT = 10000;
+
+
+static bool WriteJournalEntry(FILE* journal, const std::string& uuid, OrthancPluginContentType type, bool encryptionEnabled)
+{
+  const std::string line = uuid + " " + boost::lexical_cast<std::string>(static_cast<int>(type)) + " " +
+    (encryptionEnabled ? "1" : "0") + "\n";
+
+  return (fwrite(line.c_str(), 1, line.size(), journal) == line.size());
+}
+
+
+// fsync of a file whose buffers have been flushed; "fd" can be a duplicate of the descriptor used for the writes
+static bool SyncFileDescriptor(int fd)
+{
+#if defined(_WIN32)
+  return (_commit(fd) == 0);
+#else
+  return (::fsync(fd) == 0);
+#endif
+}
+
+
+DeletionQueue::DeletionQueue(IStorage& primaryStorage,
+                             IStorage* secondaryStorage,
+                             const std::string& journalDirectory,
+                             unsigned int threadsCount,
+                             size_t batchSize)
+  : primaryStorage_(primaryStorage),
+    secondaryStorage_(secondaryStorage),
+    batchSize_(batchSize == 0 ? 1 : batchSize),
+    retryDelay_(boost::posix_time::seconds(RETRY_DELAY_SECONDS)),
+    failedBatchRetryDelay_(boost::posix_time::seconds(FAILED_BATCH_RETRY_DELAY_SECONDS)),
+    minJournalEntriesToCompact_(MIN_JOURNAL_ENTRIES_TO_COMPACT),
+    journal_(NULL),
+    journalEntries_(0),
+    journalSequence_(0),
+    syncedSequence_(0),
+    continue_(true)
+{
+  Orthanc::SystemToolbox::MakeDirectory(journalDirectory);
+  journalPath_ = fs::path(journalDirectory) / JOURNAL_FILENAME;
+
+  Replay();
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    RewriteJournal();
+  }
+
+  if (threadsCount == 0)
+  {
+    threadsCount = 1;
+  }
+
+  for (unsigned int i = 0; i < threadsCount; i++)
+  {
+    workers_.push_back(new boost::thread(WorkerThread, this));
+  }
+
+  LOG(WARNING) << primaryStorage_.GetNameForLogs() << ": deletion queue enabled, journal in " << journalPath_.string()
+               << " (" << queue_.size() << " pending deletions)";
+}
+
+
+DeletionQueue::~DeletionQueue()
+{
+  // the deletions that are not complete yet stay in the journal and will be resumed at the next startup
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    continue_ = false;
+  }
+
+  queueNotEmpty_.notify_all();
+
+  for (size_t i = 0; i < workers_.size(); i++)
+  {
+    if (workers_[i]->joinable())
+    {
+      workers_[i]->join();
+    }
+
+    delete workers_[i];
+  }
+
+  if (journal_ != NULL)
+  {
+    fclose(journal_);
+  }
+}
+
+
+void DeletionQueue::SetRetryDelays(unsigned int retryMilliseconds,
+                                   unsigned int failedBatchRetryMilliseconds)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  retryDelay_ = boost::posix_time::milliseconds(retryMilliseconds);
+  failedBatchRetryDelay_ = boost::posix_time::milliseconds(failedBatchRetryMilliseconds);
+}
+
+
+void DeletionQueue::SetCompactionThreshold(size_t minJournalEntries)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  minJournalEntriesToCompact_ = minJournalEntries;
+}
+
+
+void DeletionQueue::AppendToJournal(const PendingDeletion& deletion)
+{
+  // the entry is flushed to the OS right away, SyncJournal() makes it durable
+  if (journal_ == NULL ||
+      !WriteJournalEntry(journal_, deletion.object_.uuid_, deletion.object_.type_, deletion.encryptionEnabled_) ||
+      fflush(journal_) != 0)
+  {
+    throw StoragePluginException("error while writing in the deletion journal " + journalPath_.string());
+  }
+
+  journalEntries_++;
+  journalSequence_++;
+}
+
+
+void DeletionQueue::SyncJournal(uint64_t sequence)
+{
+  boost::mutex::scoped_lock syncLock(syncMutex_);
+
+  if (syncedSequence_ >= sequence)
+  {
+    return;  // already made durable by the fsync of another thread
+  }
+
+  uint64_t target;
+  int fd;
+
+  {
+    // the journal might be replaced by RewriteJournal() during the fsync -> sync a duplicate of its descriptor,
+    // the compacted journal is durable as soon as it replaces the current one
+    boost::mutex::scoped_lock lock(mutex_);
+    target = journalSequence_;
+
+#if defined(_WIN32)
+    fd = (journal_ == NULL ? -1 : _dup(_fileno(journal_)));
+#else
+    fd = (journal_ == NULL ? -1 : ::dup(fileno(journal_)));
+#endif
+  }
+
+  if (fd < 0)
+  {
+    throw StoragePluginException("unable to sync the deletion journal " + journalPath_.string());
+  }
+
+  const bool success = SyncFileDescriptor(fd);
+
+#if defined(_WIN32)
+  _close(fd);
+#else
+  ::close(fd);
+#endif
+
+  if (!success)
+  {
+    throw StoragePluginException("unable to sync the deletion journal " + journalPath_.string());
+  }
+
+  syncedSequence_ = target;
+}
+
+
+void DeletionQueue::RewriteJournal()
+{
+  const fs::path tmpPath = journalPath_.parent_path() / JOURNAL_TMP_FILENAME;
+
+  FILE* f = fopen(tmpPath.string().c_str(), "wb");
+  if (f == NULL)
+  {
+    throw StoragePluginException("unable to create the deletion journal " + tmpPath.string());
+  }
+
+  size_t entries = 0;
+  bool success = true;
+
+  for (std::deque<PendingDeletion>::const_iterator it = queue_.begin(); success && it != queue_.end(); ++it, entries++)
+  {
+    success = WriteJournalEntry(f, it->object_.uuid_, it->object_.type_, it->encryptionEnabled_);
+  }
+
+  for (std::set<const Batch*>::const_iterator batch = inProgress_.begin(); success && batch != inProgress_.end(); ++batch)
+  {
+    for (Batch::const_iterator it = (*batch)->begin(); success && it != (*batch)->end(); ++it, entries++)
+    {
+      success = WriteJournalEntry(f, it->object_.uuid_, it->object_.type_, it->encryptionEnabled_);
+    }
+  }
+
+  for (std::multimap<boost::posix_time::ptime, PendingDeletion>::const_iterator it = retries_.begin(); success && it != retries_.end(); ++it, entries++)
+  {
+    success = WriteJournalEntry(f, it->second.object_.uuid_, it->second.object_.type_, it->second.encryptionEnabled_);
+  }
+
+  success = (success &&
+             fflush(f) == 0 &&
+             SyncFileDescriptor(fileno(f)));
+
+  if (fclose(f) != 0 || !success)
+  {
+    boost::system::error_code err;
+    fs::remove(tmpPath, err);
+    throw StoragePluginException("error while writing in the deletion journal " + tmpPath.string());
+  }
+
+  // the files must be closed before they are renamed on Windows
+  if (journal_ != NULL)
+  {
+    fclose(journal_);
+    journal_ = NULL;
+  }
+
+  // if the renaming fails, the appends go on in the current journal
+  boost::system::error_code err;
+  fs::rename(tmpPath, journalPath_, err);
+
+  journal_ = fopen(journalPath_.string().c_str(), "ab");
+
+  if (journal_ == NULL)
+  {
+    throw StoragePluginException("unable to open the deletion journal " + journalPath_.string());
+  }
+  else if (err)
+  {
+    throw StoragePluginException("unable to replace the deletion journal " + journalPath_.string() + ": " + err.message());
+  }
+
+  journalEntries_ = entries;
+  FileSystemStoragePlugin::SyncDirectory(journalPath_.parent_path());
+}
+
+
+void DeletionQueue::Replay()
+{
+  if (!fs::exists(journalPath_))
+  {
+    return;
+  }
+
+  fs::ifstream journal(journalPath_);
+  std::string line;
+
+  while (std::getline(journal, line))
+  {
+    std::vector<std::string> tokens;
+    Orthanc::Toolbox::TokenizeString(tokens, line, ' ');
+
+    // the last line might be truncated if Orthanc has been stopped while it was written
+    if (tokens.size() != 3 ||
+        tokens[0].empty() ||
+        (tokens[2] != "0" && tokens[2] != "1"))
+    {
+      if (!line.empty())
+      {
+        LOG(WARNING) << primaryStorage_.GetNameForLogs() << ": ignoring invalid line in the deletion journal: " << line;
+      }
+
+      continue;
+    }
+
+    try
+    {
+      queue_.push_back(PendingDeletion(tokens[0],
+                                       static_cast<OrthancPluginContentType>(boost::lexical_cast<int>(tokens[1])),
+                                       tokens[2] == "1"));
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+      LOG(WARNING) << primaryStorage_.GetNameForLogs() << ": ignoring invalid line in the deletion journal: " << line;
+    }
+  }
+}
+
+
+bool DeletionQueue::IsRunning()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return continue_;
+}
+
+
+bool DeletionQueue::DeleteBatch(const std::vector<IStorage::ObjectIdentifier>& objects, bool encryptionEnabled)
+{
+  bool success = true;
+
+  // in hybrid mode, we do not know which storage contains the objects -> delete them from both
+  std::vector<IStorage*> storages;
+  storages.push_back(&primaryStorage_);
+
+  if (secondaryStorage_ != NULL)
+  {
+    storages.push_back(secondaryStorage_);
+  }
+
+  for (size_t i = 0; i < storages.size(); i++)
+  {
+    for (unsigned int attempt = 1; ; attempt++)
+    {
+      try
+      {
+        storages[i]->DeleteObjects(objects, encryptionEnabled);
+        LOG(INFO) << storages[i]->GetNameForLogs() << ": deletion queue: deleted " << objects.size() << " objects";
+        break;
+      }
+      catch (StoragePluginException& ex)
+      {
+        if (attempt == MAX_ATTEMPTS || !IsRunning())
+        {
+          LOG(ERROR) << storages[i]->GetNameForLogs() << ": deletion queue: failed to delete a batch of "
+                     << objects.size() << " objects, the batch is kept in the journal and will be retried: " << ex.what();
+          success = false;
+          break;
+        }
+
+        LOG(WARNING) << storages[i]->GetNameForLogs() << ": deletion queue: error while deleting a batch of "
+                     << objects.size() << " objects, will retry: " << ex.what();
+
+        boost::posix_time::time_duration retryDelay;
+
+        {
+          boost::mutex::scoped_lock lock(mutex_);
+          retryDelay = retryDelay_;
+        }
+
+        // sleep by slices of 100ms to stop quickly when Orthanc stops
+        const boost::posix_time::ptime retryTime = boost::posix_time::microsec_clock::universal_time() + retryDelay;
+
+        for (;;)
+        {
+          const boost::posix_time::time_duration remaining = retryTime - boost::posix_time::microsec_clock::universal_time();
+
+          if (!IsRunning() ||
+              remaining <= boost::posix_time::time_duration())
+          {
+            break;
+          }
+
+          boost::this_thread::sleep(std::min(remaining, boost::posix_time::time_duration(boost::posix_time::milliseconds(100))));
+        }
+      }
+    }
+  }
+
+  return success;
+}
+
+
+void DeletionQueue::WorkerThread(DeletionQueue* that)
+{
+  for (;;)
+  {
+    Batch batch;
+
+    {
+      boost::mutex::scoped_lock lock(that->mutex_);
+
+      while (that->continue_ && that->queue_.empty())
+      {
+        const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+        while (!that->retries_.empty() &&
+               that->retries_.begin()->first <= now)
+        {
+          that->queue_.push_back(that->retries_.begin()->second);
+          that->retries_.erase(that->retries_.begin());
+        }
+
+        if (!that->queue_.empty())
+        {
+          break;
+        }
+        else if (that->retries_.empty())
+        {
+          that->queueNotEmpty_.wait(lock);
+        }
+        else
+        {
+          that->queueNotEmpty_.timed_wait(lock, that->retries_.begin()->first);
+        }
+      }
+
+      if (!that->continue_)
+      {
+        return;
+      }
+
+      while (!that->queue_.empty() && batch.size() < that->batchSize_)
+      {
+        batch.push_back(that->queue_.front());
+        that->queue_.pop_front();
+      }
+
+      that->inProgress_.insert(&batch);
+    }
+
+    std::map<bool, std::vector<IStorage::ObjectIdentifier> > objects;  // grouped by encryption flag
+
+    for (size_t i = 0; i < batch.size(); i++)
+    {
+      objects[batch[i].encryptionEnabled_].push_back(batch[i].object_);
+    }
+
+    std::set<bool> failures;
+
+    for (std::map<bool, std::vector<IStorage::ObjectIdentifier> >::const_iterator it = objects.begin(); it != objects.end(); ++it)
+    {
+      if (!that->DeleteBatch(it->second, it->first))
+      {
+        failures.insert(it->first);
+      }
+    }
+
+    {
+      boost::mutex::scoped_lock lock(that->mutex_);
+      that->inProgress_.erase(&batch);
+
+      if (!failures.empty())
+      {
+        const boost::posix_time::ptime retryTime = (boost::posix_time::microsec_clock::universal_time() +
+                                                    that->failedBatchRetryDelay_);
+
+        for (size_t i = 0; i < batch.size(); i++)
+        {
+          if (failures.find(batch[i].encryptionEnabled_) != failures.end())
+          {
+            that->retries_.insert(std::make_pair(retryTime, batch[i]));
+          }
+        }
+      }
+
+      // the journal only needs to contain the deletions that are still pending: it is truncated as soon as the queue
+      // has been drained, and compacted once most of its entries correspond to deletions that are complete
+      size_t pendingCount = that->queue_.size() + that->retries_.size();
+
+      for (std::set<const Batch*>::const_iterator it = that->inProgress_.begin(); it != that->inProgress_.end(); ++it)
+      {
+        pendingCount += (*it)->size();
+      }
+
+      if (pendingCount == 0 ||
+          (that->journalEntries_ >= that->minJournalEntriesToCompact_ &&
+           that->journalEntries_ > 2 * pendingCount))
+      {
+        try
+        {
+          that->RewriteJournal();
+        }
+        catch (StoragePluginException& ex)
+        {
+          LOG(ERROR) << that->primaryStorage_.GetNameForLogs() << ": deletion queue: " << ex.what();
+        }
+      }
+    }
+  }
+}
+
+
+void DeletionQueue::Enqueue(const std::string& uuid, OrthancPluginContentType type, bool encryptionEnabled)
+{
+  PendingDeletion deletion(uuid, type, encryptionEnabled);
+  uint64_t sequence;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    AppendToJournal(deletion);
+    queue_.push_back(deletion);
+    sequence = journalSequence_;
+  }
+
+  queueNotEmpty_.notify_one();
+
+  // the deletion is only acknowledged once it is durable in the journal (if the worker deletes the object
+  // before, the deletion is simply performed again at the next startup)
+  SyncJournal(sequence);
+}
+
@@ -0,0 +1,117 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "IStorage.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+#include <deque>
+#include <map>
+#include <set>
+#include <stdio.h>
+
+namespace fs = boost::filesystem;
+
+
+// The deletions are acknowledged immediately to Orthanc and performed by a pool of background threads,
+// by batches, using the bulk-delete API of the storage.  The pending deletions are appended to a journal
+// file that is replayed at startup, so that no deletion is lost if Orthanc stops before the queue is drained.
+// The appends to the journal are fsynced before the deletions are acknowledged; the concurrent deletions
+// share a single fsync (group commit).
+class DeletionQueue : public boost::noncopyable
+{
+private:
+  struct PendingDeletion
+  {
+    IStorage::ObjectIdentifier  object_;
+    bool                        encryptionEnabled_;
+
+    PendingDeletion(const std::string& uuid, OrthancPluginContentType type, bool encryptionEnabled)
+      : object_(uuid, type),
+        encryptionEnabled_(encryptionEnabled)
+    {
+    }
+  };
+
+  IStorage&                     primaryStorage_;
+  IStorage*                     secondaryStorage_;  // can be NULL
+  fs::path                      journalPath_;
+  size_t                        batchSize_;
+  boost::posix_time::time_duration  retryDelay_;             // between the attempts to delete a batch
+  boost::posix_time::time_duration  failedBatchRetryDelay_;  // before requeuing a batch that still fails after all the attempts
+  size_t                        minJournalEntriesToCompact_;
+
+  typedef std::vector<PendingDeletion>  Batch;
+
+  boost::mutex                  mutex_;
+  boost::condition_variable     queueNotEmpty_;
+  std::deque<PendingDeletion>   queue_;
+  std::set<const Batch*>        inProgress_;       // batches that are being deleted by the workers
+  std::multimap<boost::posix_time::ptime, PendingDeletion>  retries_;   // failed deletions, requeued after a delay
+  FILE*                         journal_;
+  size_t                        journalEntries_;   // including the deletions that are complete
+  uint64_t                      journalSequence_;  // number of appends to the journal since the startup
+
+  boost::mutex                  syncMutex_;        // taken before "mutex_"
+  uint64_t                      syncedSequence_;   // the appends up to this one are durable
+  bool                          continue_;
+  std::vector<boost::thread*>   workers_;
+
+  void AppendToJournal(const PendingDeletion& deletion);  // the mutex must be locked
+
+  // makes the appends up to "sequence" durable, the mutex must not be locked
+  void SyncJournal(uint64_t sequence);
+
+  // the journal is compacted to the deletions that are still pending (queued, in progress or to be retried),
+  // the compacted journal is written in a temporary file that atomically replaces the current one
+  void RewriteJournal();  // the mutex must be locked
+
+  void Replay();
+
+  bool IsRunning();
+
+  // returns false if the objects might remain in one of the storages
+  bool DeleteBatch(const std::vector<IStorage::ObjectIdentifier>& objects, bool encryptionEnabled);
+
+  static void WorkerThread(DeletionQueue* that);
+
+public:
+  DeletionQueue(IStorage& primaryStorage,
+                IStorage* secondaryStorage,
+                const std::string& journalDirectory,
+                unsigned int threadsCount,
+                size_t batchSize);
+
+  ~DeletionQueue();
+
+  // the default delays are 5 seconds between the attempts and 60 seconds before retrying a failed batch
+  void SetRetryDelays(unsigned int retryMilliseconds,
+                      unsigned int failedBatchRetryMilliseconds);
+
+  // the journal is compacted once it contains at least this number of entries and most of them correspond
+  // to deletions that are complete (10000 by default)
+  void SetCompactionThreshold(size_t minJournalEntries);
+
+  void Enqueue(const std::string& uuid, OrthancPluginContentType type, bool encryptionEnabled);
+};
@@ -0,0 +1,116 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "DictionaryTrainingJob.h"
+#include "StoragePlugin.h"
+
+#include <Logging.h>
+
+#include <boost/lexical_cast.hpp>
+
+
+static const size_t MAX_SAMPLE_SIZE = 128 * 1024;   // only the beginning of the large objects is representative
+
+
+DictionaryTrainingJob::DictionaryTrainingJob(CompressionHelpers& compression,
+                                             OrthancPluginContentType contentType,
+                                             const std::vector<std::string>& instances,
+                                             size_t dictionarySize)
+  : OrthancPlugins::OrthancJob(JOB_TYPE_TRAIN_DICTIONARY),
+    compression_(compression),
+    contentType_(contentType),
+    instances_(instances),
+    dictionarySize_(dictionarySize),
+    processedInstancesCount_(0)
+{
+  UpdateJobContent(0);
+}
+
+void DictionaryTrainingJob::UpdateJobContent(uint32_t dictionaryId)
+{
+  Json::Value content;
+  content[KEY_CONTENT_TYPE] = static_cast<int>(contentType_);
+  content[KEY_INSTANCES_COUNT] = static_cast<Json::UInt64>(instances_.size());
+  content[KEY_SAMPLES_COUNT] = static_cast<Json::UInt64>(samples_.size());
+
+  if (dictionaryId != 0)
+  {
+    content[KEY_DICTIONARY_ID] = dictionaryId;
+  }
+
+  UpdateContent(content);
+}
+
+OrthancPluginJobStepStatus DictionaryTrainingJob::Step()
+{
+  if (processedInstancesCount_ < instances_.size())
+  {
+    // the instances that do not have an attachment of this content type are skipped
+    std::string sample;
+    if (OrthancPlugins::RestApiGetString(sample, "/instances/" + instances_[processedInstancesCount_] + "/attachments/" +
+                                         boost::lexical_cast<std::string>(static_cast<int>(contentType_)) + "/data", false) &&
+        !sample.empty())
+    {
+      if (sample.size() > MAX_SAMPLE_SIZE)
+      {
+        sample.resize(MAX_SAMPLE_SIZE);
+      }
+
+      samples_.push_back(sample);
+    }
+
+    processedInstancesCount_++;
+    UpdateProgress(static_cast<float>(processedInstancesCount_) / static_cast<float>(instances_.size() + 1));
+
+    return OrthancPluginJobStepStatus_Continue;
+  }
+
+  try
+  {
+    std::string dictionary;
+    CompressionHelpers::TrainDictionary(dictionary, samples_, dictionarySize_);
+
+    const uint32_t dictionaryId = compression_.StoreDictionary(contentType_, dictionary);
+
+    LOG(WARNING) << "Compression dictionary " << dictionaryId << " of " << dictionary.size() << " bytes trained on "
+                 << samples_.size() << " objects of type " << static_cast<int>(contentType_);
+
+    UpdateJobContent(dictionaryId);
+    UpdateProgress(1);
+
+    return OrthancPluginJobStepStatus_Success;
+  }
+  catch (StoragePluginException& e)
+  {
+    LOG(ERROR) << "Unable to train a compression dictionary: " << e.what();
+    return OrthancPluginJobStepStatus_Failure;
+  }
+}
+
+void DictionaryTrainingJob::Stop(OrthancPluginJobStopReason reason)
+{
+}
+
+void DictionaryTrainingJob::Reset()
+{
+  processedInstancesCount_ = 0;
+  samples_.clear();
+}
@@ -0,0 +1,55 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "CompressionHelpers.h"
+
+#include <OrthancPluginCppWrapper.h>
+
+#include <vector>
+
+
+// reads the objects of a content type from a sample of instances and trains a new version of the compression
+// dictionary of this content type.  The samples are kept in memory: the job restarts from scratch if it is resubmitted.
+class DictionaryTrainingJob : public OrthancPlugins::OrthancJob
+{
+  CompressionHelpers&       compression_;
+  OrthancPluginContentType  contentType_;
+  std::vector<std::string>  instances_;
+  size_t                    dictionarySize_;
+  size_t                    processedInstancesCount_;
+  std::vector<std::string>  samples_;
+
+  void UpdateJobContent(uint32_t dictionaryId);
+
+public:
+  DictionaryTrainingJob(CompressionHelpers& compression,
+                        OrthancPluginContentType contentType,
+                        const std::vector<std::string>& instances,
+                        size_t dictionarySize);
+
+  virtual OrthancPluginJobStepStatus Step() ORTHANC_OVERRIDE;
+
+  virtual void Stop(OrthancPluginJobStopReason reason) ORTHANC_OVERRIDE;
+
+  virtual void Reset() ORTHANC_OVERRIDE;
+};
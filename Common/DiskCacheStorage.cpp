@@ -0,0 +1,616 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "DiskCacheStorage.h"
+#include "FileSystemStorage.h"
+
+#include <Logging.h>
+#include <SystemToolbox.h>
+
+#include <boost/filesystem/fstream.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <algorithm>
+#include <ctime>
+#include <vector>
+
+static const size_t MAX_GHOSTS_COUNT = 100000;
+
+
+class DiskCacheStorage::CachedReader : public IStorage::IReader
+{
+  DiskCacheStorage&                         that_;
+  std::string                               key_;
+  FileSystemStoragePlugin::FileSystemReader cacheReader_;
+  std::unique_ptr<IStorage::IReader>        fallbackReader_;
+  uint64_t                                  cachedSize_;  // the size of the object in the index
+  const std::string                         uuid_;
+  OrthancPluginContentType                  type_;
+  bool                                      encryptionEnabled_;
+
+  // the cached file might have been evicted by another thread in the meantime, or be truncated -> read from the storage
+  IStorage::IReader& GetFallbackReader()
+  {
+    if (fallbackReader_.get() == NULL)
+    {
+      LOG(INFO) << that_.GetNameForLogs() << ": local cache: " << key_ << " has been evicted or is invalid, reading from the storage";
+      that_.Invalidate(key_);
+      fallbackReader_.reset(that_.storage_->GetReaderForObject(uuid_.c_str(), type_, encryptionEnabled_));
+    }
+
+    return *fallbackReader_;
+  }
+
+public:
+  CachedReader(DiskCacheStorage& that, const std::string& key, uint64_t cachedSize, const char* uuid, OrthancPluginContentType type, bool encryptionEnabled)
+    : that_(that),
+      key_(key),
+      cacheReader_(that.GetCachePath(key)),
+      cachedSize_(cachedSize),
+      uuid_(uuid),
+      type_(type),
+      encryptionEnabled_(encryptionEnabled)
+  {
+  }
+
+  virtual size_t GetSize() ORTHANC_OVERRIDE
+  {
+    if (fallbackReader_.get() == NULL)
+    {
+      try
+      {
+        const size_t size = cacheReader_.GetSize();
+        if (size == cachedSize_)
+        {
+          return size;
+        }
+      }
+      catch (StoragePluginException&)
+      {
+      }
+    }
+
+    return GetFallbackReader().GetSize();
+  }
+
+  virtual void ReadWhole(char* data, size_t size) ORTHANC_OVERRIDE
+  {
+    ReadRange(data, size, 0);
+  }
+
+  virtual void ReadRange(char* data, size_t size, size_t fromOffset) ORTHANC_OVERRIDE
+  {
+    if (fallbackReader_.get() == NULL)
+    {
+      // the cache reader throws if the file is shorter than expected
+      if (fromOffset + size <= cachedSize_)
+      {
+        try
+        {
+          cacheReader_.ReadRange(data, size, fromOffset);
+          return;
+        }
+        catch (StoragePluginException&)
+        {
+        }
+      }
+    }
+
+    GetFallbackReader().ReadRange(data, size, fromOffset);
+  }
+};
+
+
+class DiskCacheStorage::ReadThroughReader : public IStorage::IReader
+{
+  DiskCacheStorage&                   that_;
+  std::string                         key_;
+  std::unique_ptr<IStorage::IReader>  reader_;
+  bool                                admitted_;
+
+  // an object that is read in successive ranges from its beginning (e.g. the large encrypted objects, that are
+  // read in segments) is written to a temporary file, that is moved into the cache once the object is complete.
+  // The first bytes are only written once the next range is read, as most of the partial reads stop there.
+  std::vector<char>                   firstBytes_;
+  fs::path                            fillPath_;
+  fs::ofstream                        fillFile_;
+  uint64_t                            filledSize_;
+  uint64_t                            fillTotalSize_;
+
+  void AbandonFill()
+  {
+    firstBytes_.clear();
+
+    if (fillFile_.is_open())
+    {
+      fillFile_.close();
+
+      boost::system::error_code err;
+      fs::remove(fillPath_, err);
+    }
+  }
+
+  void StartFill(const std::vector<char>& firstBytes, uint64_t totalSize)
+  {
+    AbandonFill();
+
+    if (totalSize <= that_.maxSize_)
+    {
+      firstBytes_ = firstBytes;
+      fillTotalSize_ = totalSize;
+    }
+  }
+
+  void ContinueFill(const char* data, size_t size, uint64_t fromOffset)
+  {
+    if (!firstBytes_.empty())
+    {
+      if (fromOffset > firstBytes_.size())
+      {
+        AbandonFill();  // not the continuation of the first bytes
+        return;
+      }
+
+      fillPath_ = that_.GetTemporaryPath();
+      fillFile_.open(fillPath_, std::ios::out | std::ios::binary | std::ios::trunc);
+      fillFile_.write(firstBytes_.data(), firstBytes_.size());
+      filledSize_ = firstBytes_.size();
+      firstBytes_.clear();
+    }
+
+    if (!fillFile_.is_open())
+    {
+      return;
+    }
+
+    if (fromOffset > filledSize_ ||
+        fromOffset + size > fillTotalSize_)
+    {
+      AbandonFill();  // the object is not read in order
+      return;
+    }
+
+    if (fromOffset + size > filledSize_)
+    {
+      // the range might overlap the content that has already been written
+      const size_t skipped = static_cast<size_t>(filledSize_ - fromOffset);
+      fillFile_.write(data + skipped, size - skipped);
+      filledSize_ = fromOffset + size;
+    }
+
+    if (!fillFile_.good())
+    {
+      LOG(WARNING) << that_.GetNameForLogs() << ": local cache: unable to store " << key_;
+      AbandonFill();
+    }
+    else if (filledSize_ == fillTotalSize_)
+    {
+      fillFile_.close();
+      that_.Commit(key_, fillPath_, fillTotalSize_);
+    }
+  }
+
+public:
+  ReadThroughReader(DiskCacheStorage& that, const std::string& key, IStorage::IReader* reader, bool admitted)
+    : that_(that),
+      key_(key),
+      reader_(reader),
+      admitted_(admitted),
+      filledSize_(0),
+      fillTotalSize_(0)
+  {
+  }
+
+  virtual ~ReadThroughReader()
+  {
+    AbandonFill();
+  }
+
+  virtual size_t GetSize() ORTHANC_OVERRIDE
+  {
+    return reader_->GetSize();
+  }
+
+  virtual void ReadWhole(char* data, size_t size) ORTHANC_OVERRIDE
+  {
+    reader_->ReadWhole(data, size);
+
+    if (admitted_)
+    {
+      that_.Store(key_, data, size);
+    }
+  }
+
+  virtual void ReadRange(char* data, size_t size, size_t fromOffset) ORTHANC_OVERRIDE
+  {
+    reader_->ReadRange(data, size, fromOffset);
+
+    // the other partial reads are never stored in the cache
+    ContinueFill(data, size, fromOffset);
+  }
+
+  virtual size_t ReadFirstBytes(std::vector<char>& data, size_t maxSize) ORTHANC_OVERRIDE
+  {
+    // the underlying reader might need a single request
+    const size_t size = reader_->ReadFirstBytes(data, maxSize);
+
+    if (admitted_)
+    {
+      if (data.size() >= size)
+      {
+        that_.Store(key_, data.data(), size);
+      }
+      else
+      {
+        // the rest of the object might be read by the next ranges
+        StartFill(data, size);
+      }
+    }
+
+    return size;
+  }
+
+  virtual size_t ReadWholeWithAllocator(IStorage::IBufferAllocator& allocator) ORTHANC_OVERRIDE
+  {
+    // keep track of the buffer that has been allocated by the underlying reader
+    class RecordingAllocator : public IStorage::IBufferAllocator
+    {
+      IStorage::IBufferAllocator& allocator_;
+      char*                       data_;
+
+    public:
+      explicit RecordingAllocator(IStorage::IBufferAllocator& allocator)
+        : allocator_(allocator),
+          data_(NULL)
+      {
+      }
+
+      virtual char* Allocate(size_t size) ORTHANC_OVERRIDE
+      {
+        data_ = allocator_.Allocate(size);
+        return data_;
+      }
+
+      const char* GetData() const
+      {
+        return data_;
+      }
+    };
+
+    RecordingAllocator recordingAllocator(allocator);
+    size_t size = reader_->ReadWholeWithAllocator(recordingAllocator);
+
+    if (admitted_)
+    {
+      that_.Store(key_, recordingAllocator.GetData(), size);
+    }
+
+    return size;
+  }
+};
+
+
+DiskCacheStorage::DiskCacheStorage(IStorage* storage,
+                                   const std::string& cacheDirectory,
+                                   uint64_t maxSize,
+                                   bool admitOnFirstAccess)
+  : IStorage(storage->GetNameForLogs()),
+    storage_(storage),
+    cacheDirectory_(cacheDirectory),
+    maxSize_(maxSize),
+    admitOnFirstAccess_(admitOnFirstAccess),
+    currentSize_(0)
+{
+  Orthanc::SystemToolbox::MakeDirectory(cacheDirectory_.string());
+  Reindex();
+
+  LOG(WARNING) << GetNameForLogs() << ": local cache enabled in " << cacheDirectory_.string() << ": " << index_.size()
+               << " objects, " << (currentSize_ / (1024 * 1024)) << "/" << (maxSize_ / (1024 * 1024)) << " MB";
+}
+
+
+std::string DiskCacheStorage::GetKey(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled)
+{
+  std::string key = std::string(uuid) + "." + boost::lexical_cast<std::string>(static_cast<int>(type));
+
+  if (encryptionEnabled)
+  {
+    key += ".enc";
+  }
+
+  return key;
+}
+
+
+fs::path DiskCacheStorage::GetCachePath(const std::string& key) const
+{
+  fs::path path = cacheDirectory_;
+
+  path /= key.substr(0, 2);
+  path /= key;
+
+  return path;
+}
+
+
+void DiskCacheStorage::Reindex()
+{
+  // rebuild the index from the files that are already in the cache (e.g. after a restart).
+  // Since we do not keep track of the accesses on disk, the most recently written files are considered as the most recently used.
+  std::vector<std::pair<std::time_t, std::string> > files;
+  std::vector<fs::path> leftovers;
+
+  for (fs::recursive_directory_iterator it(cacheDirectory_); it != fs::recursive_directory_iterator(); ++it)
+  {
+    if (!fs::is_regular_file(it->status()))
+    {
+      continue;
+    }
+
+    if (it->path().extension() == ".tmp")
+    {
+      // leftover from an interrupted write, removed once the iteration is over
+      leftovers.push_back(it->path());
+      continue;
+    }
+
+    boost::system::error_code err;
+    std::time_t lastWriteTime = fs::last_write_time(it->path(), err);
+    if (!err)
+    {
+      files.push_back(std::make_pair(lastWriteTime, it->path().filename().string()));
+    }
+  }
+
+  for (size_t i = 0; i < leftovers.size(); ++i)
+  {
+    boost::system::error_code err;
+    fs::remove(leftovers[i], err);
+  }
+
+  std::sort(files.begin(), files.end());
+
+  for (size_t i = 0; i < files.size(); ++i)
+  {
+    const std::string& key = files[i].second;
+
+    lru_.push_front(key);
+
+    Entry entry;
+    entry.size_ = fs::file_size(GetCachePath(key));
+    entry.lruPosition_ = lru_.begin();
+    index_[key] = entry;
+
+    currentSize_ += entry.size_;
+  }
+
+  boost::mutex::scoped_lock lock(mutex_);
+  EvictUntilFits(0);
+}
+
+
+void DiskCacheStorage::EvictUntilFits(uint64_t size)
+{
+  while (!lru_.empty() && currentSize_ + size > maxSize_)
+  {
+    const std::string key = lru_.back();
+    lru_.pop_back();
+
+    std::map<std::string, Entry>::iterator it = index_.find(key);
+    assert(it != index_.end());
+
+    currentSize_ -= it->second.size_;
+    index_.erase(it);
+
+    boost::system::error_code err;
+    fs::remove(GetCachePath(key), err);
+  }
+}
+
+
+bool DiskCacheStorage::LookupAndTouch(uint64_t& size, const std::string& key)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  std::map<std::string, Entry>::iterator it = index_.find(key);
+  if (it == index_.end())
+  {
+    return false;
+  }
+
+  lru_.splice(lru_.begin(), lru_, it->second.lruPosition_);
+  size = it->second.size_;
+  return true;
+}
+
+
+bool DiskCacheStorage::IsAdmitted(const std::string& key)
+{
+  if (admitOnFirstAccess_)
+  {
+    return true;
+  }
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  std::map<std::string, std::list<std::string>::iterator>::iterator it = ghostsIndex_.find(key);
+  if (it != ghostsIndex_.end())
+  {
+    ghosts_.erase(it->second);
+    ghostsIndex_.erase(it);
+    return true;
+  }
+
+  ghosts_.push_front(key);
+  ghostsIndex_[key] = ghosts_.begin();
+
+  if (ghosts_.size() > MAX_GHOSTS_COUNT)
+  {
+    ghostsIndex_.erase(ghosts_.back());
+    ghosts_.pop_back();
+  }
+
+  return false;
+}
+
+
+fs::path DiskCacheStorage::GetTemporaryPath() const
+{
+  return cacheDirectory_ / fs::unique_path("%%%%-%%%%-%%%%-%%%%.tmp");
+}
+
+
+void DiskCacheStorage::Store(const std::string& key, const char* data, size_t size)
+{
+  if (size > maxSize_)
+  {
+    return;
+  }
+
+  fs::path tmpPath = GetTemporaryPath();
+
+  try
+  {
+    // write to a temporary file first so that a partial file is never considered as a valid cached object
+    Orthanc::SystemToolbox::WriteFile(data, size, tmpPath.string(), false);
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    LOG(WARNING) << GetNameForLogs() << ": local cache: unable to store " << key << ": " << e.What();
+
+    boost::system::error_code err;
+    fs::remove(tmpPath, err);
+    return;
+  }
+
+  Commit(key, tmpPath, size);
+}
+
+
+void DiskCacheStorage::Commit(const std::string& key, const fs::path& tmpPath, uint64_t size)
+{
+  fs::path path = GetCachePath(key);
+
+  try
+  {
+    Orthanc::SystemToolbox::MakeDirectory(path.parent_path().string());
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    LOG(WARNING) << GetNameForLogs() << ": local cache: unable to store " << key << ": " << e.What();
+
+    boost::system::error_code err;
+    fs::remove(tmpPath, err);
+    return;
+  }
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (index_.find(key) != index_.end())
+  {
+    // another thread has already stored this object
+    boost::system::error_code err;
+    fs::remove(tmpPath, err);
+    return;
+  }
+
+  EvictUntilFits(size);
+
+  boost::system::error_code err;
+  fs::rename(tmpPath, path, err);
+
+  if (err)
+  {
+    LOG(WARNING) << GetNameForLogs() << ": local cache: unable to store " << key << ": " << err.message();
+    fs::remove(tmpPath, err);
+    return;
+  }
+
+  lru_.push_front(key);
+
+  Entry entry;
+  entry.size_ = size;
+  entry.lruPosition_ = lru_.begin();
+  index_[key] = entry;
+
+  currentSize_ += size;
+}
+
+
+void DiskCacheStorage::Invalidate(const std::string& key)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  std::map<std::string, Entry>::iterator it = index_.find(key);
+  if (it != index_.end())
+  {
+    currentSize_ -= it->second.size_;
+    lru_.erase(it->second.lruPosition_);
+    index_.erase(it);
+
+    boost::system::error_code err;
+    fs::remove(GetCachePath(key), err);
+  }
+}
+
+
+IStorage::IWriter* DiskCacheStorage::GetWriterForObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled)
+{
+  Invalidate(GetKey(uuid, type, encryptionEnabled));
+
+  return storage_->GetWriterForObject(uuid, type, encryptionEnabled);
+}
+
+
+IStorage::IReader* DiskCacheStorage::GetReaderForObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled)
+{
+  const std::string key = GetKey(uuid, type, encryptionEnabled);
+
+  uint64_t cachedSize;
+  if (LookupAndTouch(cachedSize, key))
+  {
+    LOG(INFO) << GetNameForLogs() << ": local cache hit for " << key;
+    return new CachedReader(*this, key, cachedSize, uuid, type, encryptionEnabled);
+  }
+  else
+  {
+    bool admitted = IsAdmitted(key);
+    return new ReadThroughReader(*this, key, storage_->GetReaderForObject(uuid, type, encryptionEnabled), admitted);
+  }
+}
+
+
+void DiskCacheStorage::DeleteObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled)
+{
+  Invalidate(GetKey(uuid, type, encryptionEnabled));
+
+  storage_->DeleteObject(uuid, type, encryptionEnabled);
+}
+
+
+void DiskCacheStorage::DeleteObjects(const std::vector<ObjectIdentifier>& objects, bool encryptionEnabled)
+{
+  for (size_t i = 0; i < objects.size(); i++)
+  {
+    Invalidate(GetKey(objects[i].uuid_.c_str(), objects[i].type_, encryptionEnabled));
+  }
+
+  storage_->DeleteObjects(objects, encryptionEnabled);
+}
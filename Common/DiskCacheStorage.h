@@ -0,0 +1,111 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "IStorage.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <list>
+#include <map>
+
+namespace fs = boost::filesystem;
+
+
+// A read-through cache that keeps a copy of the objects of another storage on a local disk.
+// The content is stored "as is" (i.e., encrypted if encryption is enabled).
+class DiskCacheStorage : public IStorage
+{
+public:
+  class CachedReader;
+  class ReadThroughReader;
+
+private:
+  struct Entry
+  {
+    uint64_t                          size_;
+    std::list<std::string>::iterator  lruPosition_;
+  };
+
+  std::unique_ptr<IStorage>       storage_;
+  fs::path                        cacheDirectory_;
+  uint64_t                        maxSize_;
+  bool                            admitOnFirstAccess_;
+
+  boost::mutex                    mutex_;
+  uint64_t                        currentSize_;
+  std::map<std::string, Entry>    index_;
+  std::list<std::string>          lru_;           // most recently used first
+
+  // to resist "scans" (e.g. a full backup), an object is only admitted in the cache the second time it is missed.
+  // This keeps track of the keys that have been missed once.
+  std::list<std::string>          ghosts_;       // oldest last
+  std::map<std::string, std::list<std::string>::iterator>  ghostsIndex_;
+
+  static std::string GetKey(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled);
+
+  fs::path GetCachePath(const std::string& key) const;
+
+  void Reindex();
+
+  void EvictUntilFits(uint64_t size);  // the mutex must be locked
+
+  bool LookupAndTouch(uint64_t& size, const std::string& key);
+
+  bool IsAdmitted(const std::string& key);
+
+  fs::path GetTemporaryPath() const;
+
+  // moves a temporary file that contains the whole object into the cache.  The temporary file is removed on failure.
+  void Commit(const std::string& key, const fs::path& tmpPath, uint64_t size);
+
+  void Store(const std::string& key, const char* data, size_t size);
+
+  void Invalidate(const std::string& key);
+
+public:
+  DiskCacheStorage(IStorage* storage /* takes ownership */,
+                   const std::string& cacheDirectory,
+                   uint64_t maxSize,
+                   bool admitOnFirstAccess);
+
+  virtual void SetRootPath(const std::string& rootPath) ORTHANC_OVERRIDE
+  {
+    storage_->SetRootPath(rootPath);
+  }
+
+  virtual IWriter* GetWriterForObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE;
+  virtual IReader* GetReaderForObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE;
+  virtual void DeleteObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE;
+  virtual void DeleteObjects(const std::vector<ObjectIdentifier>& objects, bool encryptionEnabled) ORTHANC_OVERRIDE;
+
+  virtual bool HasFileExists() ORTHANC_OVERRIDE
+  {
+    return storage_->HasFileExists();
+  }
+
+  virtual bool FileExists(const std::string& uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE
+  {
+    return storage_->FileExists(uuid, type, encryptionEnabled);
+  }
+};
@@ -26,6 +26,8 @@
 
 #include <Logging.h>
 
+#include <boost/thread.hpp>
+
 bool ReadMasterKey(uint32_t& id, std::string& keyPath, const Json::Value& node)
 {
   if (!node.isArray() || node.size() != 2 || !node[0].isUInt() || !node[1].isString())
@@ -62,6 +64,35 @@ EncryptionHelpers* EncryptionConfigurator::CreateEncryptionHelpers(const Orthanc
 
   std::unique_ptr<EncryptionHelpers> crypto(new EncryptionHelpers(maxConcurrentInputSizeInMb * 1024*1024));
 
+  // new objects are encrypted in chunks that can be decrypted independently (0 = legacy format, the object is encrypted at once)
+  unsigned int chunkSizeInKb = cryptoSection.GetUnsignedIntegerValue("ChunkSize", 64);
+  crypto->SetChunkSize(static_cast<size_t>(chunkSizeInKb) * 1024);
+
+  // the chunks of the large objects are encrypted/decrypted concurrently
+  unsigned int threadsCount = cryptoSection.GetUnsignedIntegerValue("Threads", std::max(1u, boost::thread::hardware_concurrency()));
+  unsigned int parallelThresholdInMb = cryptoSection.GetUnsignedIntegerValue("ParallelThreshold", 4);
+  crypto->SetParallelism(threadsCount, static_cast<size_t>(parallelThresholdInMb) * 1024 * 1024);
+
+  // implementation of the AES primitives, the encrypted objects are the same whatever the engine
+  std::string engine = cryptoSection.GetStringValue("Engine", "Crypto++");
+
+  if (engine == "OpenSSL")
+  {
+#if defined(ORTHANC_ENABLE_SSL) && ORTHANC_ENABLE_SSL == 1
+    crypto->SetEngine(new OpenSslEncryptionEngine);
+#else
+    LOG(ERROR) << "Encryption: the OpenSSL engine is not available, this plugin has been built without OpenSSL";
+    return nullptr;
+#endif
+  }
+  else if (engine != "Crypto++")
+  {
+    LOG(ERROR) << "Encryption: unknown Engine '" << engine << "', allowed values are 'Crypto++' and 'OpenSSL'";
+    return nullptr;
+  }
+
+  LOG(WARNING) << "Encryption: using the " << crypto->GetEngineName() << " engine";
+
   uint32_t masterKeyId;
   std::string masterKeyPath;
 
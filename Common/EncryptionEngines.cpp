@@ -0,0 +1,320 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "EncryptionEngines.h"
+#include "EncryptionHelpers.h"
+
+#include <cryptopp/aes.h>
+#include <cryptopp/gcm.h>
+#include <cryptopp/modes.h>
+
+#if defined(ORTHANC_ENABLE_SSL) && ORTHANC_ENABLE_SSL == 1
+#  include <openssl/evp.h>
+#endif
+
+#include <string.h>
+
+
+namespace
+{
+  class CryptoppGcmCipher : public IEncryptionEngine::IGcmCipher
+  {
+  private:
+    CryptoPP::SecByteBlock                 key_;
+    bool                                   keySet_;
+    CryptoPP::GCM<CryptoPP::AES>::Encryption  encryption_;
+    CryptoPP::GCM<CryptoPP::AES>::Decryption  decryption_;
+    bool                                   encrypt_;
+
+    CryptoPP::AuthenticatedSymmetricCipher& GetCipher()
+    {
+      if (encrypt_)
+      {
+        return encryption_;
+      }
+      else
+      {
+        return decryption_;
+      }
+    }
+
+  public:
+    CryptoppGcmCipher(const CryptoPP::SecByteBlock& key, bool encrypt)
+      : key_(key),
+        keySet_(false),
+        encrypt_(encrypt)
+    {
+    }
+
+    virtual void SetIv(const uint8_t* iv, size_t ivSize) ORTHANC_OVERRIDE
+    {
+      try
+      {
+        // Crypto++ requires the iv to set the key: the key schedule is only computed once
+        if (keySet_)
+        {
+          GetCipher().Resynchronize(iv, static_cast<int>(ivSize));
+        }
+        else
+        {
+          GetCipher().SetKeyWithIV(key_, key_.size(), iv, ivSize);
+          keySet_ = true;
+        }
+      }
+      catch (CryptoPP::Exception& e)
+      {
+        throw EncryptionException(e.what());
+      }
+    }
+
+    virtual void AddAuthenticatedData(const uint8_t* data, size_t size) ORTHANC_OVERRIDE
+    {
+      try
+      {
+        GetCipher().Update(data, size);
+      }
+      catch (CryptoPP::Exception& e)
+      {
+        throw EncryptionException(e.what());
+      }
+    }
+
+    virtual void ProcessData(uint8_t* output, const uint8_t* input, size_t size) ORTHANC_OVERRIDE
+    {
+      try
+      {
+        GetCipher().ProcessData(output, input, size);
+      }
+      catch (CryptoPP::Exception& e)
+      {
+        throw EncryptionException(e.what());
+      }
+    }
+
+    virtual void GetTag(uint8_t* tag, size_t tagSize) ORTHANC_OVERRIDE
+    {
+      try
+      {
+        encryption_.TruncatedFinal(tag, tagSize);
+      }
+      catch (CryptoPP::Exception& e)
+      {
+        throw EncryptionException(e.what());
+      }
+    }
+
+    virtual bool VerifyTag(const uint8_t* tag, size_t tagSize) ORTHANC_OVERRIDE
+    {
+      try
+      {
+        return decryption_.TruncatedVerify(tag, tagSize);
+      }
+      catch (CryptoPP::Exception& e)
+      {
+        throw EncryptionException(e.what());
+      }
+    }
+  };
+}
+
+
+IEncryptionEngine::IGcmCipher* CryptoppEncryptionEngine::CreateGcmEncryption(const CryptoPP::SecByteBlock& key)
+{
+  return new CryptoppGcmCipher(key, true);
+}
+
+
+IEncryptionEngine::IGcmCipher* CryptoppEncryptionEngine::CreateGcmDecryption(const CryptoPP::SecByteBlock& key)
+{
+  return new CryptoppGcmCipher(key, false);
+}
+
+
+void CryptoppEncryptionEngine::ProcessCtr(uint8_t* output, const uint8_t* input, size_t size, const CryptoPP::SecByteBlock& key)
+{
+  try
+  {
+    CryptoPP::SecByteBlock iv(16);
+    memset(iv.data(), 0, iv.size());
+
+    // CTR is a stream mode: the encryption and the decryption are the same operation, no padding is required
+    CryptoPP::CTR_Mode<CryptoPP::AES>::Encryption e;
+    e.SetKeyWithIV(key, key.size(), iv.data(), iv.size());
+    e.ProcessData(output, input, size);
+  }
+  catch (CryptoPP::Exception& e)
+  {
+    throw EncryptionException(e.what());
+  }
+}
+
+
+#if defined(ORTHANC_ENABLE_SSL) && ORTHANC_ENABLE_SSL == 1
+
+namespace
+{
+  class OpenSslCipherContext : public boost::noncopyable
+  {
+  private:
+    EVP_CIPHER_CTX*  context_;
+
+  public:
+    OpenSslCipherContext()
+      : context_(EVP_CIPHER_CTX_new())
+    {
+      if (context_ == NULL)
+      {
+        throw EncryptionException("OpenSSL: unable to create a cipher context");
+      }
+    }
+
+    ~OpenSslCipherContext()
+    {
+      EVP_CIPHER_CTX_free(context_);
+    }
+
+    EVP_CIPHER_CTX* GetContext()
+    {
+      return context_;
+    }
+  };
+
+
+  class OpenSslGcmCipher : public IEncryptionEngine::IGcmCipher
+  {
+  private:
+    OpenSslCipherContext    context_;
+    CryptoPP::SecByteBlock  key_;
+    bool                    encrypt_;
+    size_t                  ivSize_;
+
+    void Check(int result, const char* operation)
+    {
+      if (result != 1)
+      {
+        throw EncryptionException(std::string("OpenSSL: ") + operation + " failed");
+      }
+    }
+
+  public:
+    OpenSslGcmCipher(const CryptoPP::SecByteBlock& key, bool encrypt)
+      : key_(key),
+        encrypt_(encrypt),
+        ivSize_(0)
+    {
+      Check(EVP_CipherInit_ex(context_.GetContext(), EVP_aes_256_gcm(), NULL, NULL, NULL, encrypt_ ? 1 : 0), "GCM initialization");
+    }
+
+    virtual void SetIv(const uint8_t* iv, size_t ivSize) ORTHANC_OVERRIDE
+    {
+      if (ivSize != ivSize_)
+      {
+        // the default iv size of OpenSSL is 12 bytes, our formats use 32 bytes.  The key is set once the iv size is known.
+        Check(EVP_CIPHER_CTX_ctrl(context_.GetContext(), EVP_CTRL_GCM_SET_IVLEN, static_cast<int>(ivSize), NULL), "GCM iv length");
+        Check(EVP_CipherInit_ex(context_.GetContext(), NULL, NULL, key_.data(), iv, encrypt_ ? 1 : 0), "GCM key");
+        ivSize_ = ivSize;
+      }
+      else
+      {
+        // only resets the iv, the key schedule is kept
+        Check(EVP_CipherInit_ex(context_.GetContext(), NULL, NULL, NULL, iv, encrypt_ ? 1 : 0), "GCM iv");
+      }
+    }
+
+    virtual void AddAuthenticatedData(const uint8_t* data, size_t size) ORTHANC_OVERRIDE
+    {
+      int length = 0;
+      Check(EVP_CipherUpdate(context_.GetContext(), NULL, &length, data, static_cast<int>(size)), "GCM authenticated data");
+    }
+
+    virtual void ProcessData(uint8_t* output, const uint8_t* input, size_t size) ORTHANC_OVERRIDE
+    {
+      // EVP_CipherUpdate() takes an int length
+      static const size_t MAX_BLOCK_SIZE = 1024 * 1024 * 1024;
+
+      while (size > 0)
+      {
+        const size_t blockSize = std::min(size, MAX_BLOCK_SIZE);
+        int length = 0;
+
+        Check(EVP_CipherUpdate(context_.GetContext(), output, &length, input, static_cast<int>(blockSize)), "GCM update");
+
+        if (static_cast<size_t>(length) != blockSize)
+        {
+          throw EncryptionException("OpenSSL: unexpected GCM output size");
+        }
+
+        output += blockSize;
+        input += blockSize;
+        size -= blockSize;
+      }
+    }
+
+    virtual void GetTag(uint8_t* tag, size_t tagSize) ORTHANC_OVERRIDE
+    {
+      uint8_t unused[16];
+      int length = 0;
+      Check(EVP_CipherFinal_ex(context_.GetContext(), unused, &length), "GCM finalization");
+      Check(EVP_CIPHER_CTX_ctrl(context_.GetContext(), EVP_CTRL_GCM_GET_TAG, static_cast<int>(tagSize), tag), "GCM tag");
+    }
+
+    virtual bool VerifyTag(const uint8_t* tag, size_t tagSize) ORTHANC_OVERRIDE
+    {
+      Check(EVP_CIPHER_CTX_ctrl(context_.GetContext(), EVP_CTRL_GCM_SET_TAG, static_cast<int>(tagSize), const_cast<uint8_t*>(tag)), "GCM tag");
+
+      uint8_t unused[16];
+      int length = 0;
+      return EVP_CipherFinal_ex(context_.GetContext(), unused, &length) == 1;
+    }
+  };
+}
+
+
+IEncryptionEngine::IGcmCipher* OpenSslEncryptionEngine::CreateGcmEncryption(const CryptoPP::SecByteBlock& key)
+{
+  return new OpenSslGcmCipher(key, true);
+}
+
+
+IEncryptionEngine::IGcmCipher* OpenSslEncryptionEngine::CreateGcmDecryption(const CryptoPP::SecByteBlock& key)
+{
+  return new OpenSslGcmCipher(key, false);
+}
+
+
+void OpenSslEncryptionEngine::ProcessCtr(uint8_t* output, const uint8_t* input, size_t size, const CryptoPP::SecByteBlock& key)
+{
+  // only used for the small prefix blocks (keys and ivs)
+  uint8_t iv[16];
+  memset(iv, 0, sizeof(iv));
+
+  OpenSslCipherContext context;
+  int length = 0;
+
+  if (EVP_EncryptInit_ex(context.GetContext(), EVP_aes_256_ctr(), NULL, key.data(), iv) != 1 ||
+      EVP_EncryptUpdate(context.GetContext(), output, &length, input, static_cast<int>(size)) != 1 ||
+      static_cast<size_t>(length) != size)
+  {
+    throw EncryptionException("OpenSSL: CTR encryption failed");
+  }
+}
+
+#endif
@@ -0,0 +1,111 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <Compatibility.h>
+
+#include <cryptopp/secblock.h>
+
+#include <boost/noncopyable.hpp>
+
+#include <stdint.h>
+
+
+// The AES-256 primitives on which the encryption formats are built.  An engine can be shared
+// between threads but the ciphers it creates can not: each thread must create its own cipher.
+class IEncryptionEngine : public boost::noncopyable
+{
+public:
+  // AES-256-GCM cipher bound to a key, that can process successive messages (one per iv)
+  class IGcmCipher : public boost::noncopyable
+  {
+  public:
+    virtual ~IGcmCipher()
+    {
+    }
+
+    // starts a new message
+    virtual void SetIv(const uint8_t* iv, size_t ivSize) = 0;
+
+    // must be called before ProcessData()
+    virtual void AddAuthenticatedData(const uint8_t* data, size_t size) = 0;
+
+    virtual void ProcessData(uint8_t* output, const uint8_t* input, size_t size) = 0;
+
+    // encryption only: ends the message
+    virtual void GetTag(uint8_t* tag, size_t tagSize) = 0;
+
+    // decryption only: ends the message, returns false if the integrity check fails
+    virtual bool VerifyTag(const uint8_t* tag, size_t tagSize) = 0;
+  };
+
+  virtual ~IEncryptionEngine()
+  {
+  }
+
+  virtual const char* GetName() const = 0;
+
+  virtual IGcmCipher* CreateGcmEncryption(const CryptoPP::SecByteBlock& key) = 0;
+
+  virtual IGcmCipher* CreateGcmDecryption(const CryptoPP::SecByteBlock& key) = 0;
+
+  // AES-256-CTR with a zero iv (used to protect the data keys and ivs of the legacy "A1" objects with the master key)
+  virtual void ProcessCtr(uint8_t* output, const uint8_t* input, size_t size, const CryptoPP::SecByteBlock& key) = 0;
+};
+
+
+class CryptoppEncryptionEngine : public IEncryptionEngine
+{
+public:
+  virtual const char* GetName() const ORTHANC_OVERRIDE
+  {
+    return "Crypto++";
+  }
+
+  virtual IGcmCipher* CreateGcmEncryption(const CryptoPP::SecByteBlock& key) ORTHANC_OVERRIDE;
+
+  virtual IGcmCipher* CreateGcmDecryption(const CryptoPP::SecByteBlock& key) ORTHANC_OVERRIDE;
+
+  virtual void ProcessCtr(uint8_t* output, const uint8_t* input, size_t size, const CryptoPP::SecByteBlock& key) ORTHANC_OVERRIDE;
+};
+
+
+#if defined(ORTHANC_ENABLE_SSL) && ORTHANC_ENABLE_SSL == 1
+
+// relies on OpenSSL EVP, that uses the AES-NI/VAES instructions when they are available.
+// OpenSSL is initialized by the Orthanc framework.
+class OpenSslEncryptionEngine : public IEncryptionEngine
+{
+public:
+  virtual const char* GetName() const ORTHANC_OVERRIDE
+  {
+    return "OpenSSL";
+  }
+
+  virtual IGcmCipher* CreateGcmEncryption(const CryptoPP::SecByteBlock& key) ORTHANC_OVERRIDE;
+
+  virtual IGcmCipher* CreateGcmDecryption(const CryptoPP::SecByteBlock& key) ORTHANC_OVERRIDE;
+
+  virtual void ProcessCtr(uint8_t* output, const uint8_t* input, size_t size, const CryptoPP::SecByteBlock& key) ORTHANC_OVERRIDE;
+};
+
+#endif
@@ -21,22 +21,342 @@
 
 #include "EncryptionHelpers.h"
 
+#include <algorithm>
 #include <cassert>
+#include <deque>
+#include <boost/function.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
 #include <iostream>
+#include <vector>
 
 #include <cryptopp/cryptlib.h>
-#include <cryptopp/modes.h>
 #include <cryptopp/hex.h>
 #include <cryptopp/base64.h>
-#include <cryptopp/gcm.h>
 #include <cryptopp/files.h>
 #include <cryptopp/filters.h>
+#include <cryptopp/osrng.h>
 
 const std::string EncryptionHelpers::HEADER_VERSION = "A1";
+const std::string EncryptionHelpers::CHUNKED_HEADER_VERSION = "A2";
 
 using namespace  CryptoPP;
 
+
+static void EncodeLittleEndian(char* output, uint64_t value, size_t size)
+{
+  for (size_t i = 0; i < size; i++)
+  {
+    output[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+  }
+}
+
+static uint64_t DecodeLittleEndian(const char* data, size_t size)
+{
+  uint64_t value = 0;
+
+  for (size_t i = 0; i < size; i++)
+  {
+    value |= static_cast<uint64_t>(static_cast<uint8_t>(data[i])) << (8 * i);
+  }
+
+  return value;
+}
+
+
+namespace
+{
+  // hands out the chunks of an object to the threads that encrypt/decrypt them
+  class ChunksQueue : public boost::noncopyable
+  {
+  private:
+    boost::mutex  mutex_;
+    uint64_t      nextChunk_;
+    uint64_t      endChunk_;
+    std::string   firstErrorMessage_;
+
+  public:
+    ChunksQueue(uint64_t firstChunk, uint64_t endChunk)
+      : nextChunk_(firstChunk),
+        endChunk_(endChunk)
+    {
+    }
+
+    // returns false if there is nothing left to process or if a chunk has failed
+    bool GetNextChunk(uint64_t& chunk)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (!firstErrorMessage_.empty() ||
+          nextChunk_ >= endChunk_)
+      {
+        return false;
+      }
+
+      chunk = nextChunk_++;
+      return true;
+    }
+
+    void SetError(const std::string& message)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (firstErrorMessage_.empty())
+      {
+        firstErrorMessage_ = message;
+      }
+    }
+
+    void CheckError() const
+    {
+      if (!firstErrorMessage_.empty())
+      {
+        throw EncryptionException(firstErrorMessage_);
+      }
+    }
+  };
+}
+
+
+namespace
+{
+  // AutoSeededRandomPool is not thread-safe and seeding it from the OS is expensive: each thread has its
+  // own generator that is seeded once and then reseeded after a given amount of random data.
+  class ThreadRandomGenerator : public boost::noncopyable
+  {
+  private:
+    static const size_t RESEED_INTERVAL = 1024 * 1024;  // in bytes
+
+    CryptoPP::AutoSeededRandomPool  pool_;
+    size_t                          generatedSinceReseed_;
+
+  public:
+    ThreadRandomGenerator()
+      : generatedSinceReseed_(0)
+    {
+    }
+
+    void GenerateBlock(byte* output, size_t size)
+    {
+      if (generatedSinceReseed_ >= RESEED_INTERVAL)
+      {
+        pool_.Reseed();
+        generatedSinceReseed_ = 0;
+      }
+
+      pool_.GenerateBlock(output, size);
+      generatedSinceReseed_ += size;
+    }
+  };
+
+  boost::thread_specific_ptr<ThreadRandomGenerator>  threadRandomGenerator_;
+}
+
+
+// fixed-size pool of threads that run the workers of the objects that are encrypted/decrypted concurrently
+class EncryptionHelpers::WorkersPool : public boost::noncopyable
+{
+private:
+  // one call to RunWorkers(): "queued_" copies of the worker are still waiting for a thread
+  struct Batch
+  {
+    const boost::function<void ()>*  worker_;
+    unsigned int                     queued_;
+    unsigned int                     running_;
+  };
+
+  boost::mutex                 mutex_;
+  boost::condition_variable    queueNotEmpty_;
+  boost::condition_variable    batchDone_;
+  std::deque<Batch*>           queue_;
+  bool                         stop_;
+  std::vector<boost::thread*>  threads_;
+
+  void Stop()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stop_ = true;
+    }
+
+    queueNotEmpty_.notify_all();
+
+    for (size_t i = 0; i < threads_.size(); i++)
+    {
+      threads_[i]->join();
+      delete threads_[i];
+    }
+
+    threads_.clear();
+  }
+
+  void WorkerThread()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    for (;;)
+    {
+      while (!stop_ && queue_.empty())
+      {
+        queueNotEmpty_.wait(lock);
+      }
+
+      if (stop_)
+      {
+        return;
+      }
+
+      Batch* batch = queue_.front();
+      batch->queued_--;
+      batch->running_++;
+
+      if (batch->queued_ == 0)
+      {
+        queue_.pop_front();
+      }
+
+      lock.unlock();
+
+      try
+      {
+        (*batch->worker_) ();
+      }
+      catch (...)
+      {
+        // the workers report their errors through their ChunksQueue
+      }
+
+      lock.lock();
+      batch->running_--;
+      batchDone_.notify_all();
+    }
+  }
+
+public:
+  explicit WorkersPool(unsigned int threadsCount)
+    : stop_(false)
+  {
+    try
+    {
+      for (unsigned int i = 0; i < threadsCount; i++)
+      {
+        threads_.push_back(new boost::thread(&WorkersPool::WorkerThread, this));
+      }
+    }
+    catch (...)
+    {
+      Stop();
+      throw;
+    }
+  }
+
+  ~WorkersPool()
+  {
+    Stop();
+  }
+
+  // the calling thread is also running the worker.  Once it returns, there is nothing left to process
+  // and the copies that have not been picked by a thread yet are cancelled.
+  void Run(const boost::function<void ()>& worker, unsigned int threadsCount)
+  {
+    Batch batch;
+    batch.worker_ = &worker;
+    batch.queued_ = std::min(threadsCount - 1, static_cast<unsigned int>(threads_.size()));
+    batch.running_ = 0;
+
+    if (batch.queued_ > 0)
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        queue_.push_back(&batch);
+      }
+
+      queueNotEmpty_.notify_all();
+    }
+
+    try
+    {
+      worker();
+    }
+    catch (...)
+    {
+      // the workers report their errors through their ChunksQueue
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (batch.queued_ > 0)
+    {
+      queue_.erase(std::find(queue_.begin(), queue_.end(), &batch));
+      batch.queued_ = 0;
+    }
+
+    while (batch.running_ > 0)
+    {
+      batchDone_.wait(lock);
+    }
+  }
+};
+
+
+void EncryptionHelpers::RunWorkers(const boost::function<void ()>& worker, unsigned int threadsCount) const
+{
+  if (threadsCount > 1 &&
+      workersPool_.get() != NULL)
+  {
+    workersPool_->Run(worker, threadsCount);
+  }
+  else
+  {
+    worker();
+  }
+}
+
+
+uint64_t EncryptionHelpers::ChunkedHeader::GetChunksCount() const
+{
+  if (plainTextSize_ == 0)
+  {
+    return 1;
+  }
+  else
+  {
+    return (plainTextSize_ + chunkSize_ - 1) / chunkSize_;
+  }
+}
+
+size_t EncryptionHelpers::ChunkedHeader::GetPlainTextChunkSize(uint64_t chunkIndex) const
+{
+  assert(chunkIndex < GetChunksCount());
+
+  const uint64_t chunkStart = chunkIndex * chunkSize_;
+  return static_cast<size_t>(std::min(static_cast<uint64_t>(chunkSize_), plainTextSize_ - chunkStart));
+}
+
+uint64_t EncryptionHelpers::ChunkedHeader::GetEncryptedSize() const
+{
+  return CHUNKED_HEADER_SIZE + plainTextSize_ + GetChunksCount() * INTEGRITY_CHECK_TAG_SIZE;
+}
+
+void EncryptionHelpers::ChunkedHeader::GetEncryptedRange(uint64_t& encryptedOffset, size_t& encryptedSize, uint64_t fromOffset, size_t size) const
+{
+  if (fromOffset + size > plainTextSize_)
+  {
+    throw EncryptionException("The range [" + boost::lexical_cast<std::string>(fromOffset) + ", " + boost::lexical_cast<std::string>(fromOffset + size) +
+                              ") is out of the object of " + boost::lexical_cast<std::string>(plainTextSize_) + " bytes");
+  }
+
+  const uint64_t firstChunk = (plainTextSize_ == 0 ? 0 : std::min(fromOffset / chunkSize_, GetChunksCount() - 1));
+  const uint64_t lastChunk = (size == 0 ? firstChunk : (fromOffset + size - 1) / chunkSize_);
+
+  encryptedOffset = CHUNKED_HEADER_SIZE + firstChunk * (chunkSize_ + INTEGRITY_CHECK_TAG_SIZE);
+
+  const uint64_t encryptedEnd = (CHUNKED_HEADER_SIZE + lastChunk * (chunkSize_ + INTEGRITY_CHECK_TAG_SIZE) +
+                                 GetPlainTextChunkSize(lastChunk) + INTEGRITY_CHECK_TAG_SIZE);
+  encryptedSize = static_cast<size_t>(encryptedEnd - encryptedOffset);
+}
+
 std::string EncryptionHelpers::ToHexString(const void* block, size_t size)
 {
   std::string blockAsString = std::string(reinterpret_cast<const char*>(block), size);
@@ -107,10 +427,51 @@ void EncryptionHelpers::AddPreviousMasterKey(uint32_t id, const std::string& pat
 
 EncryptionHelpers::EncryptionHelpers(size_t maxConcurrentInputSize)
   : concurrentInputSizeSemaphore_(maxConcurrentInputSize),
-    maxConcurrentInputSize_(maxConcurrentInputSize)
+    maxConcurrentInputSize_(maxConcurrentInputSize),
+    engine_(new CryptoppEncryptionEngine),
+    chunkSize_(0),
+    threadsCount_(1),
+    parallelThreshold_(0)
+{
+}
+
+EncryptionHelpers::~EncryptionHelpers()
 {
 }
 
+void EncryptionHelpers::SetEngine(IEncryptionEngine* engine)
+{
+  if (engine == NULL)
+  {
+    throw EncryptionException("No encryption engine");
+  }
+
+  engine_.reset(engine);
+}
+
+void EncryptionHelpers::SetParallelism(unsigned int threadsCount, size_t threshold)
+{
+  threadsCount_ = (threadsCount == 0 ? 1 : threadsCount);
+  parallelThreshold_ = threshold;
+
+  workersPool_.reset();  // joins the threads of the previous pool
+
+  if (threadsCount_ > 1)
+  {
+    workersPool_.reset(new WorkersPool(threadsCount_ - 1));
+  }
+}
+
+void EncryptionHelpers::SetChunkSize(size_t chunkSize)
+{
+  if (chunkSize > 0xffffffffu)
+  {
+    throw EncryptionException("The encryption chunk size is too large: " + boost::lexical_cast<std::string>(chunkSize) + " bytes");
+  }
+
+  chunkSize_ = chunkSize;
+}
+
 void EncryptionHelpers::SetCurrentMasterKey(uint32_t id, const CryptoPP::SecByteBlock& key)
 {
   encryptionMasterKey_ = key;
@@ -139,11 +500,25 @@ const CryptoPP::SecByteBlock& EncryptionHelpers::GetMasterKey(const std::string&
 
 void EncryptionHelpers::GenerateKey(CryptoPP::SecByteBlock& key)
 {
-  AutoSeededRandomPool prng;
+  GenerateRandomBlock(key, AES_KEY_SIZE);
+}
 
-  SecByteBlock tempKey(AES_KEY_SIZE);
-  prng.GenerateBlock( tempKey, tempKey.size() );
-  key = tempKey;
+void EncryptionHelpers::GenerateRandomBlock(CryptoPP::SecByteBlock& block, size_t size)
+{
+  try
+  {
+    if (threadRandomGenerator_.get() == NULL)
+    {
+      threadRandomGenerator_.reset(new ThreadRandomGenerator);
+    }
+
+    block.resize(size);
+    threadRandomGenerator_->GenerateBlock(block.data(), size);
+  }
+  catch (CryptoPP::Exception& e)
+  {
+    throw EncryptionException(e.what());
+  }
 }
 
 void EncryptionHelpers::Encrypt(std::string &output, const std::string &input)
@@ -152,6 +527,12 @@ void EncryptionHelpers::Encrypt(std::string &output, const std::string &input)
 }
 
 void EncryptionHelpers::Encrypt(std::string &output, const char* data, size_t size)
+{
+  output.resize(GetEncryptedSize(size));
+  Encrypt(&output[0], data, size);
+}
+
+void EncryptionHelpers::Encrypt(char* output, const char* data, size_t size)
 {
   if (size > maxConcurrentInputSize_)
   {
@@ -160,24 +541,58 @@ void EncryptionHelpers::Encrypt(std::string &output, const char* data, size_t si
 
   Orthanc::Semaphore::Locker lock(concurrentInputSizeSemaphore_, size);
 
-  EncryptInternal(output, data, size, encryptionMasterKey_);
+  if (chunkSize_ > 0)
+  {
+    std::unique_ptr<ChunkedEncryptor> encryptor(CreateChunkedEncryptor(data, size));
+    EncryptChunks(output, static_cast<size_t>(encryptor->GetHeader().GetEncryptedSize()), 0, *encryptor);
+  }
+  else
+  {
+    EncryptInternal(output, data, size, encryptionMasterKey_);
+  }
+}
+
+size_t EncryptionHelpers::GetEncryptedSize(size_t plainTextSize) const
+{
+  if (chunkSize_ > 0)
+  {
+    ChunkedHeader header;
+    header.chunkSize_ = static_cast<uint32_t>(chunkSize_);
+    header.plainTextSize_ = plainTextSize;
+    return static_cast<size_t>(header.GetEncryptedSize());
+  }
+  else
+  {
+    return plainTextSize + OVERHEAD_SIZE;
+  }
 }
 
 void EncryptionHelpers::Decrypt(std::string &output, const std::string &input)
 {
-  output.resize(input.size() - OVERHEAD_SIZE);
+  output.resize(GetPlainTextSize(input.data(), input.size()));
   Decrypt(const_cast<char*>(output.data()), input.data(), input.size());
 }
 
-void EncryptionHelpers::Decrypt(char* output, const char* data, size_t size)
+size_t EncryptionHelpers::GetPlainTextSize(const char* data, size_t size)
 {
-  if (size > maxConcurrentInputSize_)
+  ChunkedHeader header;
+
+  if (ParseChunkedHeader(header, data, size))
   {
-    throw EncryptionException("The file is too large to decrypt: " + boost::lexical_cast<std::string>(size) + " bytes.  Try increasing the MaxConcurrentInputSize");
+    return static_cast<size_t>(header.GetPlainTextSize());
   }
+  else if (size < OVERHEAD_SIZE)
+  {
+    throw EncryptionException("Unable to decrypt data, size of file is too small: " + boost::lexical_cast<std::string>(size) + " bytes");
+  }
+  else
+  {
+    return size - OVERHEAD_SIZE;
+  }
+}
 
-  Orthanc::Semaphore::Locker lock(concurrentInputSizeSemaphore_, size);
-
+bool EncryptionHelpers::ParseChunkedHeader(ChunkedHeader& header, const char* data, size_t size)
+{
   if (size < HEADER_VERSION_SIZE)
   {
     throw EncryptionException("Unable to decrypt data, no header found");
@@ -185,207 +600,446 @@ void EncryptionHelpers::Decrypt(char* output, const char* data, size_t size)
 
   std::string version = std::string(data, HEADER_VERSION_SIZE);
 
-  if (version != "A1")
+  if (version == HEADER_VERSION)
+  {
+    return false;
+  }
+  else if (version != CHUNKED_HEADER_VERSION)
   {
     throw EncryptionException("Unable to decrypt data, version '" + version + "' is not supported");
   }
 
-  if (size < (HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE))
+  if (size < CHUNKED_HEADER_SIZE)
   {
-    throw EncryptionException("Unable to decrypt data, no master key id found");
+    throw EncryptionException("Unable to decrypt data, header is truncated");
   }
 
-  std::string decryptionMasterKeyId = std::string(data + HEADER_VERSION_SIZE, MASTER_KEY_ID_SIZE);
+  const size_t chunkSizeOffset = HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE + WRAPPED_KEYS_SIZE;
+
+  header.header_.assign(data, CHUNKED_HEADER_SIZE);
+  header.chunkSize_ = static_cast<uint32_t>(DecodeLittleEndian(data + chunkSizeOffset, CHUNK_SIZE_SIZE));
+  header.plainTextSize_ = DecodeLittleEndian(data + chunkSizeOffset + CHUNK_SIZE_SIZE, PLAIN_TEXT_SIZE_SIZE);
+
+  if (header.chunkSize_ == 0)
+  {
+    throw EncryptionException("Unable to decrypt data, invalid chunk size");
+  }
+
+  return true;
+}
+
+void EncryptionHelpers::DecryptRange(char* output, size_t size, uint64_t fromOffset, const ChunkedHeader& header, const char* encrypted, size_t encryptedSize)
+{
+  if (encryptedSize > maxConcurrentInputSize_)
+  {
+    throw EncryptionException("The range is too large to decrypt: " + boost::lexical_cast<std::string>(encryptedSize) + " bytes.  Try increasing the MaxConcurrentInputSize");
+  }
+
+  Orthanc::Semaphore::Locker lock(concurrentInputSizeSemaphore_, encryptedSize);
+
+  std::string decryptionMasterKeyId = header.header_.substr(HEADER_VERSION_SIZE, MASTER_KEY_ID_SIZE);
 
   const SecByteBlock& decryptionMasterKey = GetMasterKey(decryptionMasterKeyId);
-  DecryptInternal(output, data, size, decryptionMasterKey);
+  DecryptChunks(output, size, fromOffset, header, encrypted, encryptedSize, decryptionMasterKey);
 }
 
-void EncryptionHelpers::EncryptPrefixSecBlock(std::string& output, const CryptoPP::SecByteBlock& input, const CryptoPP::SecByteBlock& masterKey)
+void EncryptionHelpers::Decrypt(char* output, const char* data, size_t size)
 {
-  try
+  if (size > maxConcurrentInputSize_)
   {
-    SecByteBlock iv(16);
-    memset(iv.data(), 0, iv.size());
+    throw EncryptionException("The file is too large to decrypt: " + boost::lexical_cast<std::string>(size) + " bytes.  Try increasing the MaxConcurrentInputSize");
+  }
+
+  Orthanc::Semaphore::Locker lock(concurrentInputSizeSemaphore_, size);
+
+  if (size < HEADER_VERSION_SIZE)
+  {
+    throw EncryptionException("Unable to decrypt data, no header found");
+  }
 
-    CTR_Mode<AES>::Encryption e;
-    e.SetKeyWithIV(masterKey, masterKey.size(), iv.data(), iv.size());
+  ChunkedHeader header;
 
-    std::string inputString = ToString(input);
+  if (ParseChunkedHeader(header, data, size))
+  {
+    if (size != header.GetEncryptedSize())
+    {
+      throw EncryptionException("Unable to decrypt data, the size of the file (" + boost::lexical_cast<std::string>(size) +
+                                " bytes) does not match its header (" + boost::lexical_cast<std::string>(header.GetEncryptedSize()) + " bytes)");
+    }
 
-    // The StreamTransformationFilter adds padding
-    //  as required. ECB and CBC Mode must be padded
-    //  to the block size of the cipher.
-    StringSource ss(inputString, true,
-        new StreamTransformationFilter(e,
-            new StringSink(output)
-        ) // StreamTransformationFilter
-    ); // StringSource
+    std::string decryptionMasterKeyId = std::string(data + HEADER_VERSION_SIZE, MASTER_KEY_ID_SIZE);
+
+    const SecByteBlock& decryptionMasterKey = GetMasterKey(decryptionMasterKeyId);
+    DecryptChunks(output, static_cast<size_t>(header.GetPlainTextSize()), 0, header, data + CHUNKED_HEADER_SIZE, size - CHUNKED_HEADER_SIZE, decryptionMasterKey);
+    return;
   }
-  catch (CryptoPP::Exception& e)
+
+  if (size < (HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE))
   {
-    throw EncryptionException(e.what());
+    throw EncryptionException("Unable to decrypt data, no master key id found");
   }
 
-  assert(output.size() == input.size());
+  std::string decryptionMasterKeyId = std::string(data + HEADER_VERSION_SIZE, MASTER_KEY_ID_SIZE);
+
+  const SecByteBlock& decryptionMasterKey = GetMasterKey(decryptionMasterKeyId);
+  DecryptInternal(output, data, size, decryptionMasterKey);
 }
 
-void EncryptionHelpers::DecryptPrefixSecBlock(CryptoPP::SecByteBlock& output, const std::string& input, const CryptoPP::SecByteBlock& masterKey)
+void EncryptionHelpers::EncryptPrefixSecBlock(char* output, const CryptoPP::SecByteBlock& input, const CryptoPP::SecByteBlock& masterKey) const
 {
-  try
-  {
-    SecByteBlock iv(16);
-    memset(iv.data(), 0, iv.size());
+  // CTR is a stream mode: the output has the size of the input, no padding is required
+  engine_->ProcessCtr(reinterpret_cast<byte*>(output), input.data(), input.size(), masterKey);
+}
 
-    CTR_Mode<AES>::Decryption  d;
-    d.SetKeyWithIV(masterKey, masterKey.size(), iv.data(), iv.size());
+void EncryptionHelpers::DecryptPrefixSecBlock(CryptoPP::SecByteBlock& output, const char* input, size_t size, const CryptoPP::SecByteBlock& masterKey) const
+{
+  output.resize(size);
+  engine_->ProcessCtr(output.data(), reinterpret_cast<const byte*>(input), size, masterKey);
+}
 
-    std::string outputString;
+void EncryptionHelpers::WrapChunkedKeys(char* header, const CryptoPP::SecByteBlock& iv, const CryptoPP::SecByteBlock& dataKey, const CryptoPP::SecByteBlock& masterKey) const
+{
+  // the master key encrypts many data keys: each wrapping uses its own random nonce
+  SecByteBlock nonce;
+  GenerateRandomBlock(nonce, KEYS_WRAPPING_NONCE_SIZE);
+
+  SecByteBlock keys(IV_SIZE + AES_KEY_SIZE);
+  memcpy(keys.data(), iv.data(), IV_SIZE);
+  memcpy(keys.data() + IV_SIZE, dataKey.data(), AES_KEY_SIZE);
+
+  byte* target = reinterpret_cast<byte*>(header) + HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE;
+  memcpy(target, nonce.data(), KEYS_WRAPPING_NONCE_SIZE);
+
+  std::unique_ptr<IEncryptionEngine::IGcmCipher> e(engine_->CreateGcmEncryption(masterKey));
+  e->SetIv(nonce, nonce.size());
+  e->AddAuthenticatedData(reinterpret_cast<const byte*>(header), HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE);
+  e->ProcessData(target + KEYS_WRAPPING_NONCE_SIZE, keys.data(), keys.size());
+  e->GetTag(target + KEYS_WRAPPING_NONCE_SIZE + keys.size(), INTEGRITY_CHECK_TAG_SIZE);
+}
 
-    // The StreamTransformationFilter adds padding
-    //  as required. ECB and CBC Mode must be padded
-    //  to the block size of the cipher.
-    StringSource ss(input, true,
-        new StreamTransformationFilter(d,
-            new StringSink(outputString)
-        ) // StreamTransformationFilter
-    ); // StringSource
+void EncryptionHelpers::UnwrapChunkedKeys(CryptoPP::SecByteBlock& iv, CryptoPP::SecByteBlock& dataKey, const char* header, const CryptoPP::SecByteBlock& masterKey) const
+{
+  const byte* source = reinterpret_cast<const byte*>(header) + HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE;
 
-    output.Assign(reinterpret_cast<const byte*>(outputString.data()), outputString.size());
-  }
-  catch (CryptoPP::Exception& e)
+  SecByteBlock keys(IV_SIZE + AES_KEY_SIZE);
+
+  std::unique_ptr<IEncryptionEngine::IGcmCipher> d(engine_->CreateGcmDecryption(masterKey));
+  d->SetIv(source, KEYS_WRAPPING_NONCE_SIZE);
+  d->AddAuthenticatedData(reinterpret_cast<const byte*>(header), HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE);
+  d->ProcessData(keys.data(), source + KEYS_WRAPPING_NONCE_SIZE, keys.size());
+
+  if (!d->VerifyTag(source + KEYS_WRAPPING_NONCE_SIZE + keys.size(), INTEGRITY_CHECK_TAG_SIZE))
   {
-    throw EncryptionException(e.what());
+    throw EncryptionException("Integrity check failed for the keys of the object");
   }
 
-  assert(output.size() == input.size());
+  iv.Assign(keys.data(), IV_SIZE);
+  dataKey.Assign(keys.data() + IV_SIZE, AES_KEY_SIZE);
 }
 
 
-void EncryptionHelpers::EncryptInternal(std::string& output, const char* data, size_t size, const CryptoPP::SecByteBlock& masterKey)
+void EncryptionHelpers::EncryptInternal(char* output, const char* data, size_t size, const CryptoPP::SecByteBlock& masterKey)
 {
-  // std::cout << "EncryptInternal" << std::endl;
-  // std::cout << "masterKey " << ToHexString(masterKey) << std::endl;
-
-  SecByteBlock iv(IV_SIZE);
-  randomGenerator_.GenerateBlock(iv, iv.size());  // with GCM, the iv is supposed to be a nonce (not a random number).  However, since each dataKey is used only once, we consider a random number is fine.
+  SecByteBlock iv;
+  GenerateRandomBlock(iv, IV_SIZE);  // with GCM, the iv is supposed to be a nonce (not a random number).  However, since each dataKey is used only once, we consider a random number is fine.
 
   SecByteBlock dataKey;
   GenerateKey(dataKey);
 
-  // std::cout << "dataKey " << ToHexString(dataKey) << std::endl;
-  // std::cout << "iv " << ToHexString(iv) << std::endl;
-  std::string encryptedDataKey;
-  std::string encryptedIv;
+  // the output starts with the unencrypted prefix: header version/master key id/encrypted iv/encrypted data key
+  const size_t prefixSize = HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE + IV_SIZE + AES_KEY_SIZE;
+  byte* target = reinterpret_cast<byte*>(output);
 
-  EncryptPrefixSecBlock(encryptedIv, iv, masterKey);
-  EncryptPrefixSecBlock(encryptedDataKey, dataKey, masterKey);
+  memcpy(target, HEADER_VERSION.data(), HEADER_VERSION_SIZE);
+  memcpy(target + HEADER_VERSION_SIZE, encryptionMasterKeyId_.data(), MASTER_KEY_ID_SIZE);
+  EncryptPrefixSecBlock(output + HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE, iv, masterKey);
+  EncryptPrefixSecBlock(output + HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE + IV_SIZE, dataKey, masterKey);
 
-  // std::cout << "encryptedIv " << ToHexString(encryptedIv) << std::endl;
-  // std::cout << "encryptedDataKey " << ToHexString(encryptedDataKey) << std::endl;
+  std::unique_ptr<IEncryptionEngine::IGcmCipher> e(engine_->CreateGcmEncryption(dataKey));
+  e->SetIv(iv, iv.size());
 
-  std::string prefix = HEADER_VERSION + encryptionMasterKeyId_ + encryptedIv + encryptedDataKey;
+  // the prefix is authenticated, the data is encrypted and authenticated.
+  // Authenticated data *must* be pushed before Confidential/Authenticated data.
+  e->AddAuthenticatedData(target, prefixSize);
 
-  try
+  if (size > 0)
   {
-    GCM<AES>::Encryption e;
-    e.SetKeyWithIV(dataKey, dataKey.size(), iv, iv.size());
+    e->ProcessData(target + prefixSize, reinterpret_cast<const byte*>(data), size);
+  }
+
+  e->GetTag(target + prefixSize + size, INTEGRITY_CHECK_TAG_SIZE);
+}
+
+void EncryptionHelpers::DecryptInternal(char* output, const char* data, size_t size, const CryptoPP::SecByteBlock& masterKey) const
+{
+  if (size < OVERHEAD_SIZE)
+  {
+    throw EncryptionException("Unable to decrypt data, size of file is too small: " + boost::lexical_cast<std::string>(size) + " bytes");
+  }
+
+  const size_t prefixSize = HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE + IV_SIZE + AES_KEY_SIZE;
+  const size_t plainTextSize = size - OVERHEAD_SIZE;
 
-    // the output text starts with the unencrypted prefix
-    output = prefix;
+  SecByteBlock dataKey;
+  SecByteBlock iv;
 
-    AuthenticatedEncryptionFilter ef(e,
-                                      new StringSink(output), false, INTEGRITY_CHECK_TAG_SIZE
-                                      );
+  DecryptPrefixSecBlock(iv, data + HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE, IV_SIZE, masterKey);
+  DecryptPrefixSecBlock(dataKey, data + HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE + IV_SIZE, AES_KEY_SIZE, masterKey);
 
+  std::unique_ptr<IEncryptionEngine::IGcmCipher> d(engine_->CreateGcmDecryption(dataKey));
+  d->SetIv(iv, iv.size());
 
-    // AuthenticatedEncryptionFilter::ChannelPut
-    //  defines two channels: "" (empty) and "AAD"
-    //   channel "" is encrypted and authenticated
-    //   channel "AAD" is authenticated
-    ef.ChannelPut("AAD", reinterpret_cast<const byte*>(prefix.data()), prefix.size());
-    ef.ChannelMessageEnd("AAD");
+  // the data is decrypted directly in the output buffer, that is discarded by the caller if the integrity check fails
+  d->AddAuthenticatedData(reinterpret_cast<const byte*>(data), prefixSize);
 
-    // Authenticated data *must* be pushed before
-    //  Confidential/Authenticated data. Otherwise
-    //  we must catch the BadState exception
-    ef.ChannelPut("", reinterpret_cast<const byte*>(data), size);
-    ef.ChannelMessageEnd("");
+  if (plainTextSize > 0)
+  {
+    d->ProcessData(reinterpret_cast<byte*>(output), reinterpret_cast<const byte*>(data) + prefixSize, plainTextSize);
   }
-  catch(CryptoPP::Exception& e)
+
+  if (!d->VerifyTag(reinterpret_cast<const byte*>(data) + size - INTEGRITY_CHECK_TAG_SIZE, INTEGRITY_CHECK_TAG_SIZE))
   {
-    throw EncryptionException(e.what());
+    throw EncryptionException("Integrity check failed");
+  }
+}
+
+void EncryptionHelpers::GetChunkIv(CryptoPP::SecByteBlock& chunkIv, const CryptoPP::SecByteBlock& iv, uint64_t chunkIndex)
+{
+  // each chunk uses a distinct nonce: the index of the chunk is xored in the last 8 bytes of the iv of the object
+  chunkIv.Assign(iv.data(), iv.size());
+
+  for (size_t i = 0; i < 8; i++)
+  {
+    chunkIv[iv.size() - 1 - i] ^= static_cast<byte>((chunkIndex >> (8 * i)) & 0xff);
   }
 }
 
-void EncryptionHelpers::DecryptInternal(char* output, const char* data, size_t size, const CryptoPP::SecByteBlock& masterKey)
+EncryptionHelpers::ChunkedEncryptor* EncryptionHelpers::CreateChunkedEncryptor(const char* data, size_t size)
 {
-  // std::cout << "DecryptInternal" << std::endl;
-  // std::cout << "masterKey " << ToHexString(masterKey) << std::endl;
+  if (chunkSize_ == 0)
+  {
+    throw EncryptionException("The chunk size must be defined to encrypt an object in chunks");
+  }
 
-  size_t prefixSize = HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE + IV_SIZE + AES_KEY_SIZE;
+  std::unique_ptr<ChunkedEncryptor> encryptor(new ChunkedEncryptor);
+  encryptor->plainText_ = data;
 
-  std::string prefix = std::string(data, prefixSize);
-  std::string mac = std::string(data + size - INTEGRITY_CHECK_TAG_SIZE, INTEGRITY_CHECK_TAG_SIZE);
+  GenerateRandomBlock(encryptor->iv_, IV_SIZE);
+  GenerateKey(encryptor->dataKey_);
 
-  // std::cout << "prefix " << ToHexString(prefix) << std::endl;
-  // std::cout << "mac " << ToHexString(mac) << std::endl;
+  // the header is authenticated together with each chunk
+  const size_t chunkSizeOffset = HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE + WRAPPED_KEYS_SIZE;
+  char header[CHUNKED_HEADER_SIZE];
 
-  std::string encryptedIv = prefix.substr(HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE, IV_SIZE);
-  std::string encryptedDataKey = prefix.substr(HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE + IV_SIZE, AES_KEY_SIZE);
+  memcpy(header, CHUNKED_HEADER_VERSION.data(), HEADER_VERSION_SIZE);
+  memcpy(header + HEADER_VERSION_SIZE, encryptionMasterKeyId_.data(), MASTER_KEY_ID_SIZE);
+  WrapChunkedKeys(header, encryptor->iv_, encryptor->dataKey_, encryptionMasterKey_);
+  EncodeLittleEndian(header + chunkSizeOffset, chunkSize_, CHUNK_SIZE_SIZE);
+  EncodeLittleEndian(header + chunkSizeOffset + CHUNK_SIZE_SIZE, size, PLAIN_TEXT_SIZE_SIZE);
 
-  // std::cout << "encryptedIv " << ToHexString(encryptedIv) << std::endl;
-  // std::cout << "encryptedDataKey " << ToHexString(encryptedDataKey) << std::endl;
+  ParseChunkedHeader(encryptor->header_, header, CHUNKED_HEADER_SIZE);
 
-  SecByteBlock dataKey;
-  SecByteBlock iv;
+  return encryptor.release();
+}
 
-  DecryptPrefixSecBlock(iv, encryptedIv, masterKey);
-  DecryptPrefixSecBlock(dataKey, encryptedDataKey, masterKey);
-  // std::cout << "dataKey " << ToHexString(dataKey) << std::endl;
-  // std::cout << "iv " << ToHexString(iv) << std::endl;
+void EncryptionHelpers::EncryptRange(char* output, size_t size, uint64_t fromOffset, const ChunkedEncryptor& encryptor)
+{
+  if (size > maxConcurrentInputSize_)
+  {
+    throw EncryptionException("The range is too large to encrypt: " + boost::lexical_cast<std::string>(size) + " bytes.  Try increasing the MaxConcurrentInputSize");
+  }
 
-  GCM<AES>::Decryption d;
-  d.SetKeyWithIV(dataKey, dataKey.size(), iv, iv.size());
+  Orthanc::Semaphore::Locker lock(concurrentInputSizeSemaphore_, size);
 
-  try {
-    AuthenticatedDecryptionFilter df(d, NULL,
-                                      AuthenticatedDecryptionFilter::MAC_AT_BEGIN |
-                                      AuthenticatedDecryptionFilter::THROW_EXCEPTION, INTEGRITY_CHECK_TAG_SIZE);
+  EncryptChunks(output, size, fromOffset, encryptor);
+}
 
-    // The order of the following calls are important
-    df.ChannelPut("", reinterpret_cast<const byte*>(mac.data()), mac.size());
-    df.ChannelPut("AAD", reinterpret_cast<const byte*>(prefix.data()), prefix.size());
-    df.ChannelPut("", reinterpret_cast<const byte*>(data) + prefixSize, size - INTEGRITY_CHECK_TAG_SIZE - prefixSize);
+void EncryptionHelpers::EncryptChunks(char* output, size_t size, uint64_t fromOffset, const ChunkedEncryptor& encryptor) const
+{
+  const ChunkedHeader& header = encryptor.header_;
+  const uint64_t toOffset = fromOffset + size;
 
-    // If the object throws, it will most likely occur
-    //  during ChannelMessageEnd()
-    df.ChannelMessageEnd("AAD");
-    df.ChannelMessageEnd("");
+  if (toOffset > header.GetEncryptedSize())
+  {
+    throw EncryptionException("The range [" + boost::lexical_cast<std::string>(fromOffset) + ", " + boost::lexical_cast<std::string>(toOffset) +
+                              ") is out of the encrypted object of " + boost::lexical_cast<std::string>(header.GetEncryptedSize()) + " bytes");
+  }
 
-    // If the object does not throw, here's the only
-    // opportunity to check the data's integrity
-    if (!df.GetLastResult())
-    {
-      throw EncryptionException("The decryption filter failed for some unknown reason.  Integrity check failed ?");
-    }
+  if (fromOffset < CHUNKED_HEADER_SIZE)
+  {
+    memcpy(output, header.header_.data() + fromOffset, static_cast<size_t>(std::min(toOffset, static_cast<uint64_t>(CHUNKED_HEADER_SIZE)) - fromOffset));
+  }
 
-    // Remove data from channel
-    size_t n = (size_t)-1;
+  if (toOffset <= CHUNKED_HEADER_SIZE)
+  {
+    return;
+  }
 
-    // Recover plain text
-    df.SetRetrievalChannel("");
-    n = (size_t)df.MaxRetrievable();
+  const uint64_t chunkSize = header.GetChunkSize();
+  const uint64_t encryptedChunkSize = chunkSize + INTEGRITY_CHECK_TAG_SIZE;
+  const uint64_t firstChunk = (std::max(fromOffset, static_cast<uint64_t>(CHUNKED_HEADER_SIZE)) - CHUNKED_HEADER_SIZE) / encryptedChunkSize;
+  const uint64_t endChunk = (toOffset - CHUNKED_HEADER_SIZE + encryptedChunkSize - 1) / encryptedChunkSize;
+
+  ChunksQueue queue(firstChunk, endChunk);
+
+  // each thread has its own cipher
+  RunWorkers([&]()
+             {
+               try
+               {
+                 std::unique_ptr<IEncryptionEngine::IGcmCipher> e(engine_->CreateGcmEncryption(encryptor.dataKey_));
+
+                 SecByteBlock chunkIv;
+                 std::vector<byte> partialChunk;
+                 uint64_t chunk;
+
+                 while (queue.GetNextChunk(chunk))
+                 {
+                   const size_t plainTextChunkSize = header.GetPlainTextChunkSize(chunk);
+                   const uint64_t chunkStart = CHUNKED_HEADER_SIZE + chunk * encryptedChunkSize;
+                   const uint64_t chunkEnd = chunkStart + plainTextChunkSize + INTEGRITY_CHECK_TAG_SIZE;
+
+                   // the chunks that are entirely part of the range are encrypted in place, the others in a temporary buffer
+                   const bool partial = (chunkStart < fromOffset || chunkEnd > toOffset);
+
+                   byte* target;
+                   if (partial)
+                   {
+                     partialChunk.resize(plainTextChunkSize + INTEGRITY_CHECK_TAG_SIZE);
+                     target = partialChunk.data();
+                   }
+                   else
+                   {
+                     target = reinterpret_cast<byte*>(output) + (chunkStart - fromOffset);
+                   }
+
+                   GetChunkIv(chunkIv, encryptor.iv_, chunk);
+                   e->SetIv(chunkIv, chunkIv.size());
+                   e->AddAuthenticatedData(reinterpret_cast<const byte*>(header.header_.data()), header.header_.size());
+
+                   if (plainTextChunkSize > 0)
+                   {
+                     e->ProcessData(target, reinterpret_cast<const byte*>(encryptor.plainText_) + chunk * chunkSize, plainTextChunkSize);
+                   }
+
+                   e->GetTag(target + plainTextChunkSize, INTEGRITY_CHECK_TAG_SIZE);
+
+                   if (partial)
+                   {
+                     const uint64_t copyStart = std::max(chunkStart, fromOffset);
+                     const uint64_t copyEnd = std::min(chunkEnd, toOffset);
+                     memcpy(output + (copyStart - fromOffset), partialChunk.data() + (copyStart - chunkStart), static_cast<size_t>(copyEnd - copyStart));
+                   }
+                 }
+               }
+               catch (std::exception& e)
+               {
+                 queue.SetError(e.what());
+               }
+             }, GetThreadsCount(size, endChunk - firstChunk));
+
+  queue.CheckError();
+}
 
-    if(n > 0)
-    {
-      assert(n == size - OVERHEAD_SIZE);
+void EncryptionHelpers::DecryptChunks(char* output, size_t size, uint64_t fromOffset, const ChunkedHeader& header, const char* encrypted, size_t encryptedSize, const CryptoPP::SecByteBlock& masterKey) const
+{
+  uint64_t expectedOffset;
+  size_t expectedSize;
+  header.GetEncryptedRange(expectedOffset, expectedSize, fromOffset, size);
 
-      df.Get(reinterpret_cast<byte*>(output), n);
-    }
+  if (encryptedSize != expectedSize)
+  {
+    throw EncryptionException("Unable to decrypt data, the encrypted range has an unexpected size: " + boost::lexical_cast<std::string>(encryptedSize) + " bytes");
   }
-  catch (CryptoPP::Exception& ex)
+
+  SecByteBlock dataKey;
+  SecByteBlock iv;
+
+  UnwrapChunkedKeys(iv, dataKey, header.header_.data(), masterKey);
+
+  const uint64_t chunkSize = header.GetChunkSize();
+  const uint64_t firstChunk = (expectedOffset - CHUNKED_HEADER_SIZE) / (chunkSize + INTEGRITY_CHECK_TAG_SIZE);
+  const uint64_t chunksCount = (encryptedSize + chunkSize + INTEGRITY_CHECK_TAG_SIZE - 1) / (chunkSize + INTEGRITY_CHECK_TAG_SIZE);
+  const uint64_t toOffset = fromOffset + size;
+
+  ChunksQueue queue(firstChunk, firstChunk + chunksCount);
+
+  // each thread has its own cipher
+  RunWorkers([&]()
+             {
+               try
+               {
+                 std::unique_ptr<IEncryptionEngine::IGcmCipher> d(engine_->CreateGcmDecryption(dataKey));
+
+                 SecByteBlock chunkIv;
+                 std::vector<byte> partialChunk;
+                 uint64_t chunk;
+
+                 while (queue.GetNextChunk(chunk))
+                 {
+                   const uint64_t chunkStart = chunk * chunkSize;
+                   const size_t plainTextChunkSize = header.GetPlainTextChunkSize(chunk);
+                   const byte* source = reinterpret_cast<const byte*>(encrypted) + (chunk - firstChunk) * (chunkSize + INTEGRITY_CHECK_TAG_SIZE);
+
+                   // the chunks that are entirely part of the range are decrypted in place, the others in a temporary buffer
+                   const bool partial = (chunkStart < fromOffset || chunkStart + plainTextChunkSize > toOffset);
+
+                   byte* target;
+                   if (partial)
+                   {
+                     partialChunk.resize(plainTextChunkSize);
+                     target = partialChunk.data();
+                   }
+                   else
+                   {
+                     target = reinterpret_cast<byte*>(output) + (chunkStart - fromOffset);
+                   }
+
+                   GetChunkIv(chunkIv, iv, chunk);
+                   d->SetIv(chunkIv, chunkIv.size());
+                   d->AddAuthenticatedData(reinterpret_cast<const byte*>(header.header_.data()), header.header_.size());
+
+                   if (plainTextChunkSize > 0)
+                   {
+                     d->ProcessData(target, source, plainTextChunkSize);
+                   }
+
+                   if (!d->VerifyTag(source + plainTextChunkSize, INTEGRITY_CHECK_TAG_SIZE))
+                   {
+                     queue.SetError("Integrity check failed for chunk " + boost::lexical_cast<std::string>(chunk));
+                     return;
+                   }
+
+                   if (partial)
+                   {
+                     const uint64_t copyStart = std::max(chunkStart, fromOffset);
+                     const uint64_t copyEnd = std::min(chunkStart + plainTextChunkSize, toOffset);
+
+                     if (copyEnd > copyStart)
+                     {
+                       memcpy(output + (copyStart - fromOffset), partialChunk.data() + (copyStart - chunkStart), static_cast<size_t>(copyEnd - copyStart));
+                     }
+                   }
+                 }
+               }
+               catch (std::exception& ex)
+               {
+                 queue.SetError(ex.what());
+               }
+             }, GetThreadsCount(encryptedSize, chunksCount));
+
+  queue.CheckError();
+}
+
+unsigned int EncryptionHelpers::GetThreadsCount(size_t size, uint64_t chunksCount) const
+{
+  if (threadsCount_ > 1 &&
+      size >= parallelThreshold_)
+  {
+    return static_cast<unsigned int>(std::min(static_cast<uint64_t>(threadsCount_), chunksCount));
+  }
+  else
   {
-    throw EncryptionException(ex.what());
+    return 1;  // small objects are processed by the calling thread only
   }
 }
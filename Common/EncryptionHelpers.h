@@ -21,9 +21,12 @@
 
 #pragma once
 
+#include "EncryptionEngines.h"
+
 #include <memory.h>
+#include <memory>
 #include <cryptopp/secblock.h>
-#include <cryptopp/osrng.h>
+#include <boost/function.hpp>
 #include <boost/thread/mutex.hpp>
 #include <MultiThreading/Semaphore.h>
 
@@ -47,14 +50,83 @@ public:
 
   static const size_t OVERHEAD_SIZE = HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE + AES_KEY_SIZE + IV_SIZE + INTEGRITY_CHECK_TAG_SIZE;
 
+  static const size_t CHUNK_SIZE_SIZE = 4;
+  static const size_t PLAIN_TEXT_SIZE_SIZE = 8;
+  static const size_t KEYS_WRAPPING_NONCE_SIZE = 12;      // random nonce of the AES-GCM encryption of the iv and data key of the "A2" objects
+  static const size_t WRAPPED_KEYS_SIZE = KEYS_WRAPPING_NONCE_SIZE + IV_SIZE + AES_KEY_SIZE + INTEGRITY_CHECK_TAG_SIZE;
+  static const size_t CHUNKED_HEADER_SIZE = HEADER_VERSION_SIZE + MASTER_KEY_ID_SIZE + WRAPPED_KEYS_SIZE + CHUNK_SIZE_SIZE + PLAIN_TEXT_SIZE_SIZE;
+
+
+  static const std::string HEADER_VERSION;          // the whole object is encrypted and authenticated at once
+  static const std::string CHUNKED_HEADER_VERSION;  // the object is made of independently authenticated chunks that can be decrypted separately
+
+  // header of the objects that are encrypted in chunks:
+  // header version/master key id/wrapped keys/chunk size/plain text size, followed by the chunks (encrypted data/integrity check tag).
+  // The wrapped keys are the nonce/iv and data key encrypted with AES-GCM under the master key/integrity check tag.
+  class ChunkedHeader
+  {
+    friend class EncryptionHelpers;
+
+    std::string   header_;
+    uint32_t      chunkSize_;
+    uint64_t      plainTextSize_;
+
+  public:
+    ChunkedHeader()
+      : chunkSize_(0),
+        plainTextSize_(0)
+    {
+    }
+
+    uint32_t GetChunkSize() const
+    {
+      return chunkSize_;
+    }
+
+    uint64_t GetPlainTextSize() const
+    {
+      return plainTextSize_;
+    }
+
+    uint64_t GetChunksCount() const;  // there is always at least one chunk, even for empty objects
+
+    size_t GetPlainTextChunkSize(uint64_t chunkIndex) const;
 
-  static const std::string HEADER_VERSION;
+    uint64_t GetEncryptedSize() const;
+
+    // range of the encrypted object that must be read to decrypt the plain text range [fromOffset, fromOffset + size)
+    void GetEncryptedRange(uint64_t& encryptedOffset, size_t& encryptedSize, uint64_t fromOffset, size_t size) const;
+  };
+
+  // state of an object in the "A2" format whose encrypted bytes are produced range by range, e.g. while
+  // the previous ranges are being uploaded.  The plain text must remain available until the last range is encrypted.
+  class ChunkedEncryptor : public boost::noncopyable
+  {
+    friend class EncryptionHelpers;
+
+    ChunkedHeader           header_;
+    CryptoPP::SecByteBlock  dataKey_;
+    CryptoPP::SecByteBlock  iv_;
+    const char*             plainText_;
+
+  public:
+    const ChunkedHeader& GetHeader() const
+    {
+      return header_;
+    }
+  };
 
 private:
+  class WorkersPool;
+
   Orthanc::Semaphore                concurrentInputSizeSemaphore_;
   size_t                            maxConcurrentInputSize_;
 
-  CryptoPP::AutoSeededRandomPool    randomGenerator_;
+  std::unique_ptr<IEncryptionEngine>  engine_;
+  size_t                            chunkSize_;
+  unsigned int                      threadsCount_;
+  size_t                            parallelThreshold_;
+  std::unique_ptr<WorkersPool>      workersPool_;  // shared by all the objects that are processed concurrently
 
   CryptoPP::SecByteBlock            encryptionMasterKey_;  // at a given time, there's only one master key that is used for encryption
   std::string                       encryptionMasterKeyId_;
@@ -63,11 +135,13 @@ private:
 
 public:
 
-  // since the memory used during encryption/decryption can grow up to a bit more than 2 times the input,
+  // since the encryption/decryption needs an output buffer of the size of the input,
   // we want to limit the number of threads doing concurrent processing according to the available memory
   // instead of the number of concurrent threads
   explicit EncryptionHelpers(size_t maxConcurrentInputSize = 1024*1024*1024);
 
+  ~EncryptionHelpers();
+
   void SetCurrentMasterKey(uint32_t id, const std::string& path);
 
   void SetCurrentMasterKey(uint32_t id, const CryptoPP::SecByteBlock& key);
@@ -76,27 +150,90 @@ public:
 
   void AddPreviousMasterKey(uint32_t id, const CryptoPP::SecByteBlock& key);
 
+  // new objects are encrypted in chunks of this size.  0 means that they are encrypted at once (legacy "A1" format)
+  void SetChunkSize(size_t chunkSize);
+
+  size_t GetChunkSize() const
+  {
+    return chunkSize_;
+  }
+
+  // selects the implementation of the AES primitives.  All the engines produce the same encrypted objects.
+  void SetEngine(IEncryptionEngine* engine);  // takes ownership
+
+  const char* GetEngineName() const
+  {
+    return engine_->GetName();
+  }
+
+  // the chunks of the objects of at least "threshold" bytes are encrypted/decrypted concurrently by up to "threadsCount" threads:
+  // the calling thread and the "threadsCount - 1" threads of a pool that is created here and shared by all the objects.
+  // The objects in the legacy "A1" format are always processed by a single thread.  Not thread-safe: call it at startup.
+  void SetParallelism(unsigned int threadsCount, size_t threshold);
+
   // input: plain text data
   // output: prefix/encrypted data/integrity check tag
   void Encrypt(std::string& output, const std::string& input);
   void Encrypt(std::string& output, const char* data, size_t size);
 
+  // encrypts in a buffer provided by the caller, whose size must be GetEncryptedSize(size)
+  void Encrypt(char* output, const char* data, size_t size);
+
+  size_t GetEncryptedSize(size_t plainTextSize) const;
+
+  // starts the encryption of "data" in the "A2" format (the chunk size must not be 0)
+  ChunkedEncryptor* CreateChunkedEncryptor(const char* data, size_t size);
+
+  // produces the range [fromOffset, fromOffset + size) of the encrypted object.  The ranges can be encrypted in
+  // any order, only the memory of the range is locked against "MaxConcurrentInputSize".
+  void EncryptRange(char* output, size_t size, uint64_t fromOffset, const ChunkedEncryptor& encryptor);
+
   // input: prefix/encrypted data/integrity check tag
   // output: plain text data
   void Decrypt(std::string& output, const std::string& input);
   void Decrypt(char* output, const char* data, size_t size);
 
+  // size of the plain text data, computed from the prefix of the encrypted data
+  static size_t GetPlainTextSize(const char* data, size_t size);
+
+  // returns false if the object has not been encrypted in chunks and can only be decrypted as a whole ("A1" objects)
+  static bool ParseChunkedHeader(ChunkedHeader& header, const char* data, size_t size);
+
+  // decrypts the plain text range [fromOffset, fromOffset + size).  "encrypted" must contain the range
+  // of the encrypted object that is given by ChunkedHeader::GetEncryptedRange()
+  void DecryptRange(char* output, size_t size, uint64_t fromOffset, const ChunkedHeader& header, const char* encrypted, size_t encryptedSize);
+
   static void GenerateKey(CryptoPP::SecByteBlock& key);
 
+  // the random numbers (data keys and ivs) come from a generator that is specific to the calling thread
+  static void GenerateRandomBlock(CryptoPP::SecByteBlock& block, size_t size);
+
 private:
 
-  void EncryptInternal(std::string& output, const char* data, size_t size, const CryptoPP::SecByteBlock& masterKey);
+  void EncryptInternal(char* output, const char* data, size_t size, const CryptoPP::SecByteBlock& masterKey);
+
+  void DecryptInternal(char* output, const char* data, size_t size, const CryptoPP::SecByteBlock& masterKey) const;
+
+  void EncryptChunks(char* output, size_t size, uint64_t fromOffset, const ChunkedEncryptor& encryptor) const;
+
+  void DecryptChunks(char* output, size_t size, uint64_t fromOffset, const ChunkedHeader& header, const char* encrypted, size_t encryptedSize, const CryptoPP::SecByteBlock& masterKey) const;
+
+  unsigned int GetThreadsCount(size_t size, uint64_t chunksCount) const;
+
+  void RunWorkers(const boost::function<void ()>& worker, unsigned int threadsCount) const;
+
+  static void GetChunkIv(CryptoPP::SecByteBlock& chunkIv, const CryptoPP::SecByteBlock& iv, uint64_t chunkIndex);
+
+  // the iv and data key of the legacy "A1" objects are encrypted with AES-CTR and a zero iv
+  void EncryptPrefixSecBlock(char* output, const CryptoPP::SecByteBlock& input, const CryptoPP::SecByteBlock& masterKey) const;
 
-  static void DecryptInternal(char* output, const char* data, size_t size, const CryptoPP::SecByteBlock& masterKey);
+  void DecryptPrefixSecBlock(CryptoPP::SecByteBlock& output, const char* input, size_t size, const CryptoPP::SecByteBlock& masterKey) const;
 
-  static void EncryptPrefixSecBlock(std::string& output, const CryptoPP::SecByteBlock& input, const CryptoPP::SecByteBlock& masterKey);
+  // the iv and data key of the "A2" objects are encrypted with AES-GCM and a random nonce, the header version and
+  // master key id are authenticated.  "header" points to the start of the chunked header.
+  void WrapChunkedKeys(char* header, const CryptoPP::SecByteBlock& iv, const CryptoPP::SecByteBlock& dataKey, const CryptoPP::SecByteBlock& masterKey) const;
 
-  static void DecryptPrefixSecBlock(CryptoPP::SecByteBlock& output, const std::string& input, const CryptoPP::SecByteBlock& masterKey);
+  void UnwrapChunkedKeys(CryptoPP::SecByteBlock& iv, CryptoPP::SecByteBlock& dataKey, const char* header, const CryptoPP::SecByteBlock& masterKey) const;
 
   std::string GetMasterKeyIdentifier(const CryptoPP::SecByteBlock& masterKey);
 
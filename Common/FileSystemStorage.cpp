@@ -26,9 +26,21 @@
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <stdio.h>
+
+#if defined(_WIN32)
+#  include <io.h>
+#else
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
 
 namespace fs = boost::filesystem;
 
+static const size_t WRITE_CHUNK_SIZE = 8 * 1024 * 1024;
+
 void FileSystemStoragePlugin::FileSystemWriter::Write(const char* data, size_t size)
 {
   Orthanc::SystemToolbox::MakeDirectory(path_.parent_path().string());
@@ -36,8 +48,97 @@ void FileSystemStoragePlugin::FileSystemWriter::Write(const char* data, size_t s
   Orthanc::SystemToolbox::WriteFile(reinterpret_cast<const void*>(data), size, path_.string(), fsync_);
 }
 
+void FileSystemStoragePlugin::FileSystemWriter::WriteFromSource(IContentSource& source, size_t size)
+{
+  Orthanc::SystemToolbox::MakeDirectory(path_.parent_path().string());
+
+  WriteFileFromSource(path_, source, size, fsync_);
+}
+
+void FileSystemStoragePlugin::WriteFileFromSource(const fs::path& path, IContentSource& source, size_t size, bool fsync)
+{
+  FILE* f = fopen(path.string().c_str(), "wb");
+  if (f == NULL)
+  {
+    throw StoragePluginException(std::string("Unable to open the file for writing: ") + path.string());
+  }
+
+  bool success = true;
+
+  try
+  {
+    std::unique_ptr<char[]> chunk(new char[std::min(size, WRITE_CHUNK_SIZE)]);
+
+    for (size_t offset = 0; offset < size && success; offset += WRITE_CHUNK_SIZE)
+    {
+      const size_t chunkSize = std::min(size - offset, WRITE_CHUNK_SIZE);
+      source.Read(chunk.get(), chunkSize, offset);
+      success = (fwrite(chunk.get(), 1, chunkSize, f) == chunkSize);
+    }
+
+    success = success && (fflush(f) == 0);
+
+    if (success && fsync)
+    {
+#if defined(_WIN32)
+      success = (_commit(_fileno(f)) == 0);
+#else
+      success = (::fsync(fileno(f)) == 0);
+#endif
+    }
+  }
+  catch (...)
+  {
+    fclose(f);
+
+    boost::system::error_code err;
+    fs::remove(path, err);
+    throw;
+  }
+
+  success = (fclose(f) == 0) && success;
+
+  if (!success)
+  {
+    boost::system::error_code err;
+    fs::remove(path, err);
+    throw StoragePluginException(std::string("Error while writing the file: ") + path.string());
+  }
+}
+
+size_t FileSystemStoragePlugin::GetWriteFromSourceBufferingSize(size_t size)
+{
+  return std::min(size, WRITE_CHUNK_SIZE);
+}
+
+void FileSystemStoragePlugin::SyncDirectory(const fs::path& directory)
+{
+#if !defined(_WIN32)
+  // on Windows, the directories can not be opened as files and their entries are made durable by the file system
+  int fd = ::open(directory.string().c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    throw StoragePluginException(std::string("Unable to open the directory: ") + directory.string());
+  }
+
+  const bool success = (::fsync(fd) == 0);
+  ::close(fd);
+
+  if (!success)
+  {
+    throw StoragePluginException(std::string("Error while syncing the directory: ") + directory.string());
+  }
+#endif
+}
+
 size_t FileSystemStoragePlugin::FileSystemReader::GetSize()
 {
+  boost::system::error_code err;
+  if (!fs::exists(path_, err) && !err)
+  {
+    throw StoragePluginNotFoundException(std::string("The file does not exist: ") + path_.string());
+  }
+
   if (!Orthanc::SystemToolbox::IsRegularFile(path_.string()))
   {
     throw StoragePluginException(std::string("The path does not point to a regular file: ") + path_.string());
@@ -79,6 +180,8 @@ void FileSystemStoragePlugin::FileSystemReader::ReadRange(char* data, size_t siz
     throw StoragePluginException(std::string("The path does not point to a regular file: ") + path_.string());
   }
 
+  std::streamsize readSize;
+
   try
   {
     fs::ifstream f;
@@ -91,6 +194,7 @@ void FileSystemStoragePlugin::FileSystemReader::ReadRange(char* data, size_t siz
     f.seekg(fromOffset, std::ios::beg);
 
     f.read(reinterpret_cast<char*>(data), size);
+    readSize = f.gcount();
 
     f.close();
   }
@@ -98,6 +202,14 @@ void FileSystemStoragePlugin::FileSystemReader::ReadRange(char* data, size_t siz
   {
     throw StoragePluginException(std::string("Unexpected error while reading: ") + path_.string());
   }
+
+  // the file might have been truncated (e.g. by a crash while it was being written)
+  if (readSize < 0 ||
+      static_cast<size_t>(readSize) != size)
+  {
+    throw StoragePluginException("Unable to read " + boost::lexical_cast<std::string>(size) + " bytes at offset " +
+                                 boost::lexical_cast<std::string>(fromOffset) + " in: " + path_.string());
+  }
 }
 
 
@@ -41,6 +41,13 @@ public:
     {}
 
     virtual void Write(const char* data, size_t size) ORTHANC_OVERRIDE;
+
+    virtual void WriteFromSource(IContentSource& source, size_t size) ORTHANC_OVERRIDE;
+
+    virtual size_t GetBufferingSize(size_t size) const ORTHANC_OVERRIDE
+    {
+      return GetWriteFromSourceBufferingSize(size);
+    }
   };
 
   class FileSystemReader: public IStorage::IReader
@@ -59,6 +66,15 @@ public:
   std::string fileSystemRootPath_;
   bool fsync_;
 public:
+  // writes the content produced by "source" chunk by chunk, the file is removed if the write fails
+  static void WriteFileFromSource(const fs::path& path, IContentSource& source, size_t size, bool fsync);
+
+  // memory used by WriteFileFromSource() to write a file of "size" bytes
+  static size_t GetWriteFromSourceBufferingSize(size_t size);
+
+  // makes the creation, the renaming or the removal of the files of a directory durable
+  static void SyncDirectory(const fs::path& directory);
+
   FileSystemStoragePlugin(const std::string& nameForLogs, const std::string& fileSystemRootPath, bool fsync)
   : IStorage(nameForLogs),
     fileSystemRootPath_(fileSystemRootPath),
@@ -24,6 +24,10 @@
 #include <orthanc/OrthancCPlugin.h>
 #include <OrthancPluginCppWrapper.h>
 
+#include <algorithm>
+#include <memory>
+#include <vector>
+
 class StoragePluginException : public std::runtime_error
 {
 public:
@@ -33,6 +37,17 @@ public:
   }
 };
 
+// thrown by the readers when the storage has confirmed that the object does not exist, as opposed to the
+// other errors (network, permissions...) after which nothing is known about the object
+class StoragePluginNotFoundException : public StoragePluginException
+{
+public:
+  explicit StoragePluginNotFoundException(const std::string& what)
+    : StoragePluginException(what)
+  {
+  }
+};
+
 
 
 
@@ -47,6 +62,26 @@ public:
 class IStorage : public boost::noncopyable
 {
 public:
+  struct ObjectIdentifier
+  {
+    std::string               uuid_;
+    OrthancPluginContentType  type_;
+
+    ObjectIdentifier(const std::string& uuid, OrthancPluginContentType type)
+      : uuid_(uuid),
+        type_(type)
+    {
+    }
+  };
+
+  // content of an object that is produced on demand, range by range (e.g. encrypted while it is uploaded)
+  class IContentSource
+  {
+  public:
+    virtual ~IContentSource() {}
+    virtual void Read(char* data, size_t size, uint64_t fromOffset) = 0;
+  };
+
   class IWriter
   {
   public:
@@ -55,6 +90,31 @@ public:
 
     virtual ~IWriter() {}
     virtual void Write(const char* data, size_t size) = 0;
+
+    // writes an object of "size" bytes whose content is produced by "source".  The default implementation produces
+    // the whole content at once; writers that upload in parts should override it to only produce the parts being uploaded.
+    virtual void WriteFromSource(IContentSource& source, size_t size)
+    {
+      std::unique_ptr<char[]> buffer(new char[size]);
+      source.Read(buffer.get(), size, 0);
+      Write(buffer.get(), size);
+    }
+
+    // memory that WriteFromSource() keeps while writing an object of "size" bytes, to bound the memory of the
+    // concurrent writes.  Writers that override WriteFromSource() must override it as well.
+    virtual size_t GetBufferingSize(size_t size) const
+    {
+      return size;
+    }
+  };
+
+  class IBufferAllocator
+  {
+  public:
+    virtual ~IBufferAllocator() {}
+
+    // might be called multiple times (e.g. when retrying on another path), only the last buffer is used
+    virtual char* Allocate(size_t size) = 0;
   };
 
   class IReader
@@ -67,6 +127,20 @@ public:
     virtual size_t GetSize() = 0;
     virtual void ReadWhole(char* data, size_t size) = 0;
     virtual void ReadRange(char* data, size_t size, size_t fromOffset) = 0;
+
+    // reads the whole object in a buffer that is allocated once its size is known and returns its size.
+    // The default implementation needs 2 requests; readers that learn the size from the response itself should override it.
+    virtual size_t ReadWholeWithAllocator(IBufferAllocator& allocator)
+    {
+      size_t size = GetSize();
+      ReadWhole(allocator.Allocate(size), size);
+      return size;
+    }
+
+    // reads the beginning of the object (at least its first "maxSize" bytes, or the whole object if it is smaller) and
+    // returns the size of the whole object.  The default implementation needs 2 requests; readers that learn the size
+    // from the response to a range request should override it to use a single request.
+    virtual size_t ReadFirstBytes(std::vector<char>& data, size_t maxSize);
   };
 
   std::string nameForLogs_;
@@ -85,8 +159,85 @@ public:
   virtual IReader* GetReaderForObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) = 0;
   virtual void DeleteObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) = 0;  // returns true only if 100% sure that the file has been deleted, false otherwise
 
+  // deletes multiple objects, with as few requests as possible.  Objects that do not exist are not considered as errors.
+  // The default implementation deletes the objects one by one and throws the first error once all the objects have been processed.
+  virtual void DeleteObjects(const std::vector<ObjectIdentifier>& objects, bool encryptionEnabled)
+  {
+    std::string firstExceptionMessage;
+
+    for (size_t i = 0; i < objects.size(); i++)
+    {
+      try
+      {
+        DeleteObject(objects[i].uuid_.c_str(), objects[i].type_, encryptionEnabled);
+      }
+      catch (StoragePluginException& ex)
+      {
+        if (firstExceptionMessage.empty())
+        {
+          firstExceptionMessage = ex.what();
+        }
+      }
+    }
+
+    if (!firstExceptionMessage.empty())
+    {
+      throw StoragePluginException(firstExceptionMessage);
+    }
+  }
+
   const std::string& GetNameForLogs() {return nameForLogs_;}
 
   virtual bool HasFileExists() = 0;
   virtual bool FileExists(const std::string& uuid, OrthancPluginContentType type, bool encryptionEnabled) {return false;}
 };
+
+
+class VectorBufferAllocator : public IStorage::IBufferAllocator
+{
+  std::vector<char>& buffer_;
+
+public:
+  explicit VectorBufferAllocator(std::vector<char>& buffer)
+    : buffer_(buffer)
+  {
+  }
+
+  virtual char* Allocate(size_t size) ORTHANC_OVERRIDE
+  {
+    buffer_.resize(size);
+    return buffer_.data();
+  }
+};
+
+
+// content of an object that is read range by range, to copy it to another storage without loading it in memory
+class ReaderContentSource : public IStorage::IContentSource
+{
+  IStorage::IReader& reader_;
+
+public:
+  explicit ReaderContentSource(IStorage::IReader& reader)
+    : reader_(reader)
+  {
+  }
+
+  virtual void Read(char* data, size_t size, uint64_t fromOffset) ORTHANC_OVERRIDE
+  {
+    reader_.ReadRange(data, size, static_cast<size_t>(fromOffset));
+  }
+};
+
+
+inline size_t IStorage::IReader::ReadFirstBytes(std::vector<char>& data, size_t maxSize)
+{
+  const size_t size = GetSize();
+  data.resize(std::min(size, maxSize));
+
+  if (!data.empty())
+  {
+    ReadRange(data.data(), data.size(), 0);
+  }
+
+  return size;
+}
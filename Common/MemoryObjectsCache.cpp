@@ -0,0 +1,188 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "MemoryObjectsCache.h"
+
+#include <OrthancPluginCppWrapper.h>
+
+#include <boost/functional/hash.hpp>
+#include <string.h>
+
+
+void MemoryObjectsCache::Shard::Remove(std::map<Key, Entry>::iterator it)
+{
+  currentSize_ -= it->second.content_->size();
+  lru_.erase(it->second.lruPosition_);
+  content_.erase(it);
+}
+
+
+void MemoryObjectsCache::Shard::Add(const Key& key, const void* data, size_t size)
+{
+  if (size > maxSize_)
+  {
+    return;
+  }
+
+  // copy the content before locking the mutex
+  boost::shared_ptr<std::string> content(new std::string(reinterpret_cast<const char*>(data), size));
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  std::map<Key, Entry>::iterator found = content_.find(key);
+  if (found != content_.end())
+  {
+    Remove(found);
+  }
+
+  while (!lru_.empty() && currentSize_ + size > maxSize_)
+  {
+    Remove(content_.find(lru_.back()));
+  }
+
+  lru_.push_front(key);
+
+  Entry entry;
+  entry.content_ = content;
+  entry.lruPosition_ = lru_.begin();
+  content_[key] = entry;
+
+  currentSize_ += size;
+}
+
+
+boost::shared_ptr<std::string> MemoryObjectsCache::Shard::Lookup(const Key& key)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  std::map<Key, Entry>::iterator found = content_.find(key);
+  if (found == content_.end())
+  {
+    return boost::shared_ptr<std::string>();
+  }
+
+  lru_.splice(lru_.begin(), lru_, found->second.lruPosition_);
+  return found->second.content_;
+}
+
+
+void MemoryObjectsCache::Shard::Invalidate(const Key& key)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  std::map<Key, Entry>::iterator found = content_.find(key);
+  if (found != content_.end())
+  {
+    Remove(found);
+  }
+}
+
+
+MemoryObjectsCache::MemoryObjectsCache(size_t maxSize, unsigned int shardsCount)
+{
+  if (shardsCount == 0)
+  {
+    shardsCount = 1;
+  }
+
+  for (unsigned int i = 0; i < shardsCount; i++)
+  {
+    shards_.push_back(new Shard(maxSize / shardsCount));
+  }
+}
+
+
+MemoryObjectsCache::~MemoryObjectsCache()
+{
+  for (size_t i = 0; i < shards_.size(); i++)
+  {
+    delete shards_[i];
+  }
+}
+
+
+MemoryObjectsCache::Shard& MemoryObjectsCache::GetShard(const std::string& uuid)
+{
+  return *shards_[boost::hash<std::string>()(uuid) % shards_.size()];
+}
+
+
+void MemoryObjectsCache::SetMaxObjectSize(OrthancPluginContentType type, size_t maxObjectSize)
+{
+  maxObjectSizes_[type] = maxObjectSize;
+}
+
+
+bool MemoryObjectsCache::IsCacheable(OrthancPluginContentType type, size_t size) const
+{
+  std::map<OrthancPluginContentType, size_t>::const_iterator found = maxObjectSizes_.find(type);
+
+  return (found != maxObjectSizes_.end() &&
+          size <= found->second);
+}
+
+
+void MemoryObjectsCache::Add(const std::string& uuid, OrthancPluginContentType type, const void* data, size_t size)
+{
+  if (IsCacheable(type, size))
+  {
+    GetShard(uuid).Add(std::make_pair(uuid, type), data, size);
+  }
+}
+
+
+boost::shared_ptr<std::string> MemoryObjectsCache::Lookup(const std::string& uuid, OrthancPluginContentType type)
+{
+  if (maxObjectSizes_.find(type) == maxObjectSizes_.end())
+  {
+    return boost::shared_ptr<std::string>();
+  }
+
+  return GetShard(uuid).Lookup(std::make_pair(uuid, type));
+}
+
+
+bool MemoryObjectsCache::Read(OrthancPluginMemoryBuffer64* target, const std::string& uuid, OrthancPluginContentType type)
+{
+  boost::shared_ptr<std::string> content = Lookup(uuid, type);
+
+  if (content.get() == NULL ||
+      OrthancPluginCreateMemoryBuffer64(OrthancPlugins::GetGlobalContext(), target, content->size()) != OrthancPluginErrorCode_Success)
+  {
+    return false;
+  }
+
+  if (!content->empty())
+  {
+    memcpy(target->data, content->data(), content->size());
+  }
+
+  return true;
+}
+
+
+void MemoryObjectsCache::Invalidate(const std::string& uuid, OrthancPluginContentType type)
+{
+  if (maxObjectSizes_.find(type) != maxObjectSizes_.end())
+  {
+    GetShard(uuid).Invalidate(std::make_pair(uuid, type));
+  }
+}
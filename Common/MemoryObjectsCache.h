@@ -0,0 +1,98 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <orthanc/OrthancCPlugin.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+
+// An in-memory LRU cache for the small objects that are read very often (e.g. DICOM headers, DicomAsJson).
+// The cache is split into shards that are protected by their own mutex to limit the contention between threads.
+// It contains the plain text content of the objects (i.e., after decryption).
+class MemoryObjectsCache : public boost::noncopyable
+{
+private:
+  typedef std::pair<std::string, OrthancPluginContentType>  Key;
+
+  class Shard : public boost::noncopyable
+  {
+    struct Entry
+    {
+      boost::shared_ptr<std::string>  content_;
+      std::list<Key>::iterator        lruPosition_;
+    };
+
+    boost::mutex          mutex_;
+    size_t                maxSize_;
+    size_t                currentSize_;
+    std::map<Key, Entry>  content_;
+    std::list<Key>        lru_;  // most recently used first
+
+    void Remove(std::map<Key, Entry>::iterator it);  // the mutex must be locked
+
+  public:
+    explicit Shard(size_t maxSize) :
+      maxSize_(maxSize),
+      currentSize_(0)
+    {
+    }
+
+    void Add(const Key& key, const void* data, size_t size);
+
+    boost::shared_ptr<std::string> Lookup(const Key& key);
+
+    void Invalidate(const Key& key);
+  };
+
+  std::vector<Shard*>                           shards_;
+  std::map<OrthancPluginContentType, size_t>    maxObjectSizes_;
+
+  Shard& GetShard(const std::string& uuid);
+
+public:
+  MemoryObjectsCache(size_t maxSize, unsigned int shardsCount);
+
+  ~MemoryObjectsCache();
+
+  // objects of a content type without a maximum size are never cached
+  void SetMaxObjectSize(OrthancPluginContentType type, size_t maxObjectSize);
+
+  bool IsCacheable(OrthancPluginContentType type, size_t size) const;
+
+  void Add(const std::string& uuid, OrthancPluginContentType type, const void* data, size_t size);
+
+  // returns NULL if the object is not in the cache
+  boost::shared_ptr<std::string> Lookup(const std::string& uuid, OrthancPluginContentType type);
+
+  // allocates the target buffer if the object is in the cache
+  bool Read(OrthancPluginMemoryBuffer64* target, const std::string& uuid, OrthancPluginContentType type);
+
+  void Invalidate(const std::string& uuid, OrthancPluginContentType type);
+};
@@ -22,38 +22,658 @@
 #include "Logging.h"
 #include "StoragePlugin.h"
 
+#include <Enumerations.h>
+#include <MultiThreading/Semaphore.h>
+#include <Toolbox.h>
 
-MoveStorageJob::MoveStorageJob(const std::string& targetStorage,
-                               const std::vector<std::string>& instances,
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+
+
+static const size_t INSTANCES_PER_THREAD_AND_STEP = 16;
+
+// the requests to move an attachment are estimated for the background throttling: the existence checks, the read
+// and the deletion, plus one request per part of the write (that is charged with the part)
+static const unsigned int REQUESTS_PER_ATTACHMENT = 4;
+static const uint64_t WRITE_PART_SIZE = 8 * 1024 * 1024;
+
+// while the foreground reads are slow, the moves of a step back off for at most this duration, so that the steps end
+static const unsigned int MAX_BACK_OFF_PER_STEP_SECONDS = 60;
+
+// the state of the job is serialized at most every 10 seconds, since the list of instances might be large
+static const unsigned int CHECKPOINT_INTERVAL_SECONDS = 10;
+
+// the Orthanc identifiers are SHA-1 hashes, e.g. "e98b1ce2-0a2a3bc4-5ac84dd5-2b2d8efe-7d02e5c2"
+static const size_t ORTHANC_ID_LENGTH = 44;
+static const size_t PACKED_ORTHANC_ID_SIZE = 20;
+
+
+namespace
+{
+  struct Attachment
+  {
+    std::string  uuid_;
+    int          type_;
+  };
+
+  struct ResolvedInstance
+  {
+    std::string              instanceId_;
+    std::vector<Attachment>  attachments_;
+  };
+
+  // limits of the concurrent moves of a job step
+  struct TransferLimits
+  {
+    Orthanc::Semaphore*                   inFlightSize_;
+    size_t                                maxInFlightSize_;
+    TokenBucket*                          bandwidth_;          // NULL if the throughput of the job is not limited
+    BackgroundThrottler*                  throttler_;          // NULL if the background transfers are not throttled
+    const BackgroundThrottler::StopFlag*  stop_;
+    boost::posix_time::ptime              backOffDeadline_;    // the moves of the step do not back off beyond this time
+  };
+
+  // thrown by the content source when the job is stopped while the transfer is throttled
+  class StoppedException : public StoragePluginException
+  {
+  public:
+    StoppedException()
+      : StoragePluginException("the job has been stopped")
+    {
+    }
+  };
+
+  // the budgets of bytes and of requests are charged as the attachment is read, part by part, so that the moves are
+  // spread over time instead of waiting for the budget of the whole attachment and then transferring it at full rate
+  class ThrottledContentSource : public IStorage::IContentSource
+  {
+    ReaderContentSource    source_;
+    const TransferLimits&  limits_;
+
+  public:
+    ThrottledContentSource(IStorage::IReader& reader,
+                           const TransferLimits& limits)
+      : source_(reader),
+        limits_(limits)
+    {
+    }
+
+    virtual void Read(char* data, size_t size, uint64_t fromOffset) ORTHANC_OVERRIDE
+    {
+      // the writers that do not upload in parts read the whole attachment at once
+      for (size_t offset = 0; offset < size; offset += static_cast<size_t>(WRITE_PART_SIZE))
+      {
+        const size_t partSize = std::min(size - offset, static_cast<size_t>(WRITE_PART_SIZE));
+
+        if ((limits_.throttler_ != NULL &&
+             (!limits_.throttler_->ConsumeRequests(1, *limits_.stop_) ||
+              !limits_.throttler_->ConsumeBytes(partSize, *limits_.stop_))) ||
+            (limits_.bandwidth_ != NULL &&
+             !limits_.bandwidth_->Consume(partSize, *limits_.stop_)))
+        {
+          throw StoppedException();
+        }
+
+        source_.Read(data + offset, partSize, fromOffset + offset);
+      }
+    }
+  };
+}
+
+
+// resolves the uuids of the attachments of the instances.  The attachments of all the instances of a series are
+// retrieved at once by /tools/find, that is why the instances are expected to be grouped by series (which is the
+// case when they are listed from studies or series).  The resolver falls back to the per-instance routes on the
+// versions of Orthanc whose /tools/find does not return the attachments.
+class MoveStorageJob::AttachmentsResolver : public boost::noncopyable
+{
+  bool                                                     bulkSupported_;
+  std::map<std::string, std::vector<Attachment> >          seriesAttachments_;   // attachments of the instances of the last series
+
+  static bool ParseAttachments(std::vector<Attachment>& attachments, const Json::Value& source)
+  {
+    if (source.type() != Json::arrayValue)
+    {
+      return false;
+    }
+
+    for (Json::Value::ArrayIndex i = 0; i < source.size(); i++)
+    {
+      if (source[i].type() != Json::objectValue ||
+          !source[i].isMember("Uuid") ||
+          !source[i].isMember("ContentType") ||
+          source[i]["Uuid"].type() != Json::stringValue ||
+          !source[i]["ContentType"].isInt())
+      {
+        return false;
+      }
+
+      Attachment attachment;
+      attachment.uuid_ = source[i]["Uuid"].asString();
+      attachment.type_ = source[i]["ContentType"].asInt();
+      attachments.push_back(attachment);
+    }
+
+    return true;
+  }
+
+  bool LoadSeriesAttachments(const std::string& instanceId)
+  {
+    Json::Value series;
+    if (!OrthancPlugins::RestApiGet(series, "/instances/" + instanceId + "/series", false) ||
+        series.type() != Json::objectValue ||
+        !series.isMember("ID"))
+    {
+      return false;
+    }
+
+    Json::Value query;
+    query["Level"] = "Instance";
+    query["Query"] = Json::objectValue;
+    query["ParentSeries"] = series["ID"].asString();
+    query["ResponseContent"] = Json::arrayValue;
+    query["ResponseContent"].append("Attachments");
+
+    Json::Value instances;
+    if (!OrthancPlugins::RestApiPost(instances, "/tools/find", query, false) ||
+        instances.type() != Json::arrayValue)
+    {
+      bulkSupported_ = false;
+      return false;
+    }
+
+    seriesAttachments_.clear();
+
+    for (Json::Value::ArrayIndex i = 0; i < instances.size(); i++)
+    {
+      std::vector<Attachment> attachments;
+
+      if (instances[i].type() != Json::objectValue ||
+          !instances[i].isMember("ID") ||
+          !instances[i].isMember("Attachments") ||
+          !ParseAttachments(attachments, instances[i]["Attachments"]))
+      {
+        LOG(INFO) << "Move storage: /tools/find does not return the attachments, resolving them instance by instance";
+        seriesAttachments_.clear();
+        bulkSupported_ = false;
+        return false;
+      }
+
+      seriesAttachments_[instances[i]["ID"].asString()].swap(attachments);
+    }
+
+    return true;
+  }
+
+  static void ResolveInstance(std::vector<Attachment>& attachments, const std::string& instanceId)
+  {
+    Json::Value attachmentsList;
+    OrthancPlugins::RestApiGet(attachmentsList, std::string("/instances/") + instanceId + "/attachments?full", false);
+
+    Json::Value::Members attachmentsMembers = attachmentsList.getMemberNames();
+
+    for (size_t i = 0; i < attachmentsMembers.size(); i++)
+    {
+      int attachmentId = attachmentsList[attachmentsMembers[i]].asInt();
+
+      Json::Value attachmentInfo;
+      OrthancPlugins::RestApiGet(attachmentInfo, std::string("/instances/") + instanceId + "/attachments/" + boost::lexical_cast<std::string>(attachmentId) + "/info", false);
+
+      Attachment attachment;
+      attachment.uuid_ = attachmentInfo["Uuid"].asString();
+      attachment.type_ = attachmentId;
+      attachments.push_back(attachment);
+    }
+  }
+
+public:
+  AttachmentsResolver()
+    : bulkSupported_(true)
+  {
+  }
+
+  void Resolve(std::vector<Attachment>& attachments, const std::string& instanceId)
+  {
+    attachments.clear();
+
+    std::map<std::string, std::vector<Attachment> >::iterator found = seriesAttachments_.find(instanceId);
+
+    if (found == seriesAttachments_.end() &&
+        bulkSupported_ &&
+        LoadSeriesAttachments(instanceId))
+    {
+      found = seriesAttachments_.find(instanceId);
+    }
+
+    if (found != seriesAttachments_.end())
+    {
+      attachments.swap(found->second);
+      seriesAttachments_.erase(found);
+    }
+    else
+    {
+      ResolveInstance(attachments, instanceId);
+    }
+  }
+};
+
+
+MoveStorageJob::MoveStorageJob(const std::string& jobType,
+                               const std::string& targetStorage,
+                               const std::vector<std::string>& resources,
+                               const std::string& resourcesLevel,
                                const Json::Value& resourceForJobContent,
-                               bool cryptoEnabled)
-  : OrthancPlugins::OrthancJob(JOB_TYPE_MOVE_STORAGE),
+                               bool cryptoEnabled,
+                               unsigned int threadsCount,
+                               size_t maxInFlightSize)
+  : OrthancPlugins::OrthancJob(jobType),
     targetStorage_(targetStorage),
-    instances_(instances),
+    resources_(resources),
+    resourcesLevel_(resourcesLevel),
+    expandedResourcesCount_(0),
+    chunkResourcesCount_(0),
     processedInstancesCount_(0),
     resourceForJobContent_(resourceForJobContent),
     fileSystemStorage_(NULL),
     objectStorage_(NULL),
-    cryptoEnabled_(cryptoEnabled)
+    cryptoEnabled_(cryptoEnabled),
+    threadsCount_(std::max(1u, threadsCount)),
+    maxInFlightSize_(std::max(static_cast<size_t>(1), maxInFlightSize)),
+    resolver_(new AttachmentsResolver),
+    lastCheckpoint_(boost::posix_time::microsec_clock::universal_time()),
+    throttler_(NULL)
 {
   UpdateContent(resourceForJobContent);
-  
-  Json::Value serialized;
-  Serialize(serialized);
-  UpdateSerialized(serialized);
+
+  SerializeResources();
+  SerializeInstances();
+  Checkpoint(true);
+}
+
+MoveStorageJob::MoveStorageJob(const std::string& targetStorage,
+                               const std::vector<std::string>& resources,
+                               const std::string& resourcesLevel,
+                               const Json::Value& resourceForJobContent,
+                               bool cryptoEnabled,
+                               unsigned int threadsCount,
+                               size_t maxInFlightSize)
+  : MoveStorageJob(JOB_TYPE_MOVE_STORAGE, targetStorage, resources, resourcesLevel, resourceForJobContent,
+                   cryptoEnabled, threadsCount, maxInFlightSize)
+{
+}
+
+MoveStorageJob::~MoveStorageJob()
+{
+}
+
+static int DecodeHexDigit(char c)
+{
+  if (c >= '0' && c <= '9')
+  {
+    return c - '0';
+  }
+  else if (c >= 'a' && c <= 'f')
+  {
+    return c - 'a' + 10;
+  }
+  else
+  {
+    return -1;
+  }
+}
+
+// returns false if one of the identifiers does not have the format of the Orthanc identifiers
+static bool PackIdentifiers(std::string& packed, const std::vector<std::string>& identifiers)
+{
+  packed.clear();
+  packed.reserve(identifiers.size() * PACKED_ORTHANC_ID_SIZE);
+
+  for (size_t i = 0; i < identifiers.size(); i++)
+  {
+    const std::string& id = identifiers[i];
+
+    if (id.size() != ORTHANC_ID_LENGTH)
+    {
+      return false;
+    }
+
+    // 5 groups of 8 hexadecimal digits separated by dashes
+    for (size_t group = 0; group < 5; group++)
+    {
+      const size_t offset = group * 9;
+
+      if (group > 0 && id[offset - 1] != '-')
+      {
+        return false;
+      }
+
+      for (size_t j = offset; j < offset + 8; j += 2)
+      {
+        const int high = DecodeHexDigit(id[j]);
+        const int low = DecodeHexDigit(id[j + 1]);
+
+        if (high < 0 || low < 0)
+        {
+          return false;
+        }
+
+        packed.push_back(static_cast<char>(high * 16 + low));
+      }
+    }
+  }
+
+  return true;
+}
+
+static void UnpackIdentifiers(std::vector<std::string>& identifiers, const std::string& packed)
+{
+  static const char* const HEX_DIGITS = "0123456789abcdef";
+
+  if (packed.size() % PACKED_ORTHANC_ID_SIZE != 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "Invalid list of identifiers in a serialized move-storage job");
+  }
+
+  identifiers.resize(packed.size() / PACKED_ORTHANC_ID_SIZE);
+
+  for (size_t i = 0; i < identifiers.size(); i++)
+  {
+    std::string& id = identifiers[i];
+    id.clear();
+    id.reserve(ORTHANC_ID_LENGTH);
+
+    for (size_t j = 0; j < PACKED_ORTHANC_ID_SIZE; j++)
+    {
+      if (j > 0 && j % 4 == 0)
+      {
+        id.push_back('-');
+      }
+
+      const uint8_t value = static_cast<uint8_t>(packed[i * PACKED_ORTHANC_ID_SIZE + j]);
+      id.push_back(HEX_DIGITS[value >> 4]);
+      id.push_back(HEX_DIGITS[value & 0x0f]);
+    }
+  }
+}
+
+static void SerializeList(Json::Value& target, const std::vector<std::string>& identifiers)
+{
+  target = Json::arrayValue;
+
+  for (size_t i = 0; i < identifiers.size(); ++i)
+  {
+    target.append(identifiers[i]);
+  }
+}
+
+static void UnserializeList(std::vector<std::string>& identifiers, const Json::Value& source)
+{
+  identifiers.clear();
+
+  if (source.type() != Json::arrayValue)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "Invalid list of identifiers in a serialized move-storage job");
+  }
+
+  identifiers.reserve(source.size());
+
+  for (Json::Value::ArrayIndex i = 0; i < source.size(); ++i)
+  {
+    identifiers.push_back(source[i].asString());
+  }
+}
+
+// the identifiers are stored as 20 bytes instead of 44 characters, unless one of them is not an Orthanc identifier
+static void SerializeIdentifiers(Json::Value& target,
+                                 const std::vector<std::string>& identifiers,
+                                 const char* packedKey,
+                                 const char* key)
+{
+  target = Json::objectValue;
+
+  std::string packed;
+  if (PackIdentifiers(packed, identifiers))
+  {
+    std::string encoded;
+    Orthanc::Toolbox::EncodeBase64(encoded, packed);
+    target[packedKey] = encoded;
+  }
+  else
+  {
+    SerializeList(target[key], identifiers);
+  }
+}
+
+// returns false if the list is not present
+static bool UnserializeIdentifiers(std::vector<std::string>& identifiers,
+                                   const Json::Value& source,
+                                   const char* packedKey,
+                                   const char* key)
+{
+  if (source.isMember(packedKey))
+  {
+    std::string packed;
+    Orthanc::Toolbox::DecodeBase64(packed, source[packedKey].asString());
+    UnpackIdentifiers(identifiers, packed);
+    return true;
+  }
+  else if (source.isMember(key))
+  {
+    UnserializeList(identifiers, source[key]);
+    return true;
+  }
+  else
+  {
+    identifiers.clear();
+    return false;
+  }
+}
+
+static void MergeMembers(Json::Value& target, const Json::Value& source)
+{
+  const Json::Value::Members members = source.getMemberNames();
+
+  for (size_t i = 0; i < members.size(); i++)
+  {
+    target[members[i]] = source[members[i]];
+  }
+}
+
+// the lists are only encoded when they change, not at each checkpoint
+void MoveStorageJob::SerializeResources()
+{
+  SerializeIdentifiers(serializedResources_, resources_, KEY_PACKED_RESOURCES, KEY_RESOURCES);
+}
+
+void MoveStorageJob::SerializeInstances()
+{
+  SerializeIdentifiers(serializedInstances_, instances_, KEY_PACKED_INSTANCES, KEY_INSTANCES);
 }
 
 void MoveStorageJob::Serialize(Json::Value& target) const
 {
+  target = Json::objectValue;
+  MergeMembers(target, serializedResources_);
+  MergeMembers(target, serializedInstances_);
+
   target[KEY_CONTENT] = resourceForJobContent_;
   target[KEY_TARGET_STORAGE] = targetStorage_;
-  target[KEY_INSTANCES] = Json::arrayValue;
+  target[KEY_EXPANDED_RESOURCES_COUNT] = static_cast<Json::UInt64>(expandedResourcesCount_);
+  target[KEY_PROCESSED_INSTANCES_COUNT] = static_cast<Json::UInt64>(processedInstancesCount_);
+  SerializeList(target[KEY_FAILED_INSTANCES], failedInstances_);
+
+  if (!resourcesLevel_.empty())
+  {
+    target[KEY_LEVEL] = resourcesLevel_;
+  }
+}
 
-  for (size_t i = 0; i < instances_.size(); ++i)
+void MoveStorageJob::Checkpoint(bool force)
+{
+  const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+  if (force ||
+      now - lastCheckpoint_ >= boost::posix_time::seconds(CHECKPOINT_INTERVAL_SECONDS))
   {
-    target[KEY_INSTANCES].append(instances_[i]);
+    Json::Value serialized;
+    Serialize(serialized);
+    UpdateSerialized(serialized);
+
+    lastCheckpoint_ = now;
   }
+}
 
+float MoveStorageJob::ComputeProgress() const
+{
+  const float chunkProgress = (instances_.empty() ? 1.0f : (float)processedInstancesCount_/(float)instances_.size());
+
+  if (resources_.empty())
+  {
+    return chunkProgress;
+  }
+  else
+  {
+    return ((float)(expandedResourcesCount_ - chunkResourcesCount_) + chunkProgress * (float)chunkResourcesCount_) /
+      (float)resources_.size();
+  }
+}
+
+void MoveStorageJob::ReportProgress()
+{
+  UpdateProgress(ComputeProgress());
+}
+
+void MoveStorageJob::RestoreCheckpoint(const Json::Value& serialized)
+{
+  if (serialized.isMember(KEY_CONTENT))
+  {
+    resourceForJobContent_ = serialized[KEY_CONTENT];
+    UpdateContent(resourceForJobContent_);
+  }
+
+  // the jobs serialized by the previous versions of the plugin only contain the list of instances
+  UnserializeIdentifiers(resources_, serialized, KEY_PACKED_RESOURCES, KEY_RESOURCES);
+  UnserializeIdentifiers(instances_, serialized, KEY_PACKED_INSTANCES, KEY_INSTANCES);
+
+  // the jobs serialized by the previous versions of the plugin have no checkpoint and restart from the beginning
+  if (serialized.isMember(KEY_EXPANDED_RESOURCES_COUNT))
+  {
+    expandedResourcesCount_ = std::min(static_cast<size_t>(serialized[KEY_EXPANDED_RESOURCES_COUNT].asUInt64()), resources_.size());
+  }
+
+  if (serialized.isMember(KEY_PROCESSED_INSTANCES_COUNT))
+  {
+    processedInstancesCount_ = std::min(static_cast<size_t>(serialized[KEY_PROCESSED_INSTANCES_COUNT].asUInt64()), instances_.size());
+  }
+
+  if (serialized.isMember(KEY_FAILED_INSTANCES))
+  {
+    UnserializeList(failedInstances_, serialized[KEY_FAILED_INSTANCES]);
+  }
+
+  SerializeResources();
+  SerializeInstances();
+  ReportProgress();
+  Checkpoint(true);
+}
+
+void MoveStorageJob::AddResourceForJobContent(Json::Value& content, Orthanc::ResourceType resourceType, const std::string& resourceId)
+{
+  const char* resourceGroup = Orthanc::GetResourceTypeText(resourceType, true, true);
+
+  if (!content.isMember(resourceGroup))
+  {
+    content[resourceGroup] = Json::arrayValue;
+  }
+  
+  content[resourceGroup].append(resourceId);
+}
+
+static bool GetChildInstances(Json::Value& instances, Orthanc::ResourceType resourceType, const std::string& resourceId)
+{
+  return (OrthancPlugins::RestApiGet(instances, std::string("/") + Orthanc::GetResourceTypeText(resourceType, true, false) + "/" + resourceId + "/instances", false) &&
+          instances.type() == Json::arrayValue);
+}
+
+void MoveStorageJob::ExpandResource(const std::string& resourceId)
+{
+  Orthanc::ResourceType resourceType = Orthanc::ResourceType_Instance;
+  Json::Value tmpResource;
+  Json::Value tmpInstances;
+  bool found = false;
+
+  if (!resourcesLevel_.empty())
+  {
+    resourceType = Orthanc::StringToResourceType(resourcesLevel_.c_str());
+
+    // the instances are not probed: a missing instance simply has no attachments to move
+    found = (resourceType == Orthanc::ResourceType_Instance ||
+             GetChildInstances(tmpInstances, resourceType, resourceId));
+  }
+  else if (OrthancPlugins::RestApiGet(tmpResource, "/instances/" + resourceId, false))
+  {
+    // Test whether this resource is an instance
+    found = true;
+  }
+  else
+  {
+    // This was not an instance, successively try with series/studies/patients
+    static const Orthanc::ResourceType PROBED_TYPES[] = { Orthanc::ResourceType_Series, Orthanc::ResourceType_Study, Orthanc::ResourceType_Patient };
+
+    for (size_t i = 0; i < sizeof(PROBED_TYPES) / sizeof(PROBED_TYPES[0]) && !found; i++)
+    {
+      resourceType = PROBED_TYPES[i];
+      found = (OrthancPlugins::RestApiGet(tmpResource, std::string("/") + Orthanc::GetResourceTypeText(resourceType, true, false) + "/" + resourceId, false) &&
+               GetChildInstances(tmpInstances, resourceType, resourceId));
+    }
+  }
+
+  if (!found)
+  {
+    LOG(WARNING) << "Move storage: unknown resource " << resourceId << ", it might have been deleted since the job was submitted";
+    return;
+  }
+
+  AddResourceForJobContent(resourceForJobContent_, resourceType, resourceId);
+
+  if (resourceType == Orthanc::ResourceType_Instance)
+  {
+    instances_.push_back(resourceId);
+  }
+  else
+  {
+    for (Json::Value::ArrayIndex j = 0; j < tmpInstances.size(); j++)
+    {
+      instances_.push_back(tmpInstances[j]["ID"].asString());
+    }
+  }
+}
+
+void MoveStorageJob::ExpandResources()
+{
+  // the instances that have been moved are not kept, the failed ones are in failedInstances_
+  instances_.clear();
+  processedInstancesCount_ = 0;
+  chunkResourcesCount_ = 0;
+
+  const size_t batchSize = threadsCount_ * INSTANCES_PER_THREAD_AND_STEP;
+
+  while (expandedResourcesCount_ < resources_.size() &&
+         instances_.size() < batchSize)
+  {
+    ExpandResource(resources_[expandedResourcesCount_]);
+    expandedResourcesCount_++;
+    chunkResourcesCount_++;
+  }
+
+  LOG(INFO) << "Move storage: " << expandedResourcesCount_ << "/" << resources_.size() << " resources expanded, "
+            << instances_.size() << " instances to move to " << targetStorage_;
+
+  UpdateContent(resourceForJobContent_);
+  SerializeInstances();
 }
 
 void MoveStorageJob::SetStorages(IStorage* fileSystemStorage, IStorage* objectStorage)
@@ -62,9 +682,44 @@ void MoveStorageJob::SetStorages(IStorage* fileSystemStorage, IStorage* objectSt
   objectStorage_ = objectStorage;
 }
 
-static bool MoveAttachment(const std::string& uuid, int type, IStorage* sourceStorage, IStorage* targetStorage, bool cryptoEnabled)
+void MoveStorageJob::SetThrottler(BackgroundThrottler* throttler)
+{
+  throttler_ = throttler;
+}
+
+void MoveStorageJob::SetMaxBandwidth(uint64_t bytesPerSecond)
+{
+  if (bytesPerSecond == 0)
+  {
+    bandwidth_.reset();
+  }
+  else
+  {
+    bandwidth_.reset(new TokenBucket(bytesPerSecond));
+  }
+}
+
+static bool MoveAttachment(const std::string& uuid, int type, IStorage* sourceStorage, IStorage* targetStorage, bool cryptoEnabled,
+                           const TransferLimits& limits)
 {
-  std::vector<char> buffer;
+  // the moves back off before reserving their memory, so that the other moves are not blocked in the meantime
+  if (limits.throttler_ != NULL)
+  {
+    if (!limits.throttler_->WaitForForeground(*limits.stop_, limits.backOffDeadline_))
+    {
+      LOG(INFO) << "Move attachment: " << uuid << " of type " << boost::lexical_cast<std::string>(type) << ", the job has been stopped";
+      return false;
+    }
+
+    if (!limits.throttler_->ConsumeRequests(REQUESTS_PER_ATTACHMENT, *limits.stop_))
+    {
+      LOG(INFO) << "Move attachment: " << uuid << " of type " << boost::lexical_cast<std::string>(type) << ", the job has been stopped";
+      return false;
+    }
+  }
+
+  std::unique_ptr<IStorage::IReader> reader;
+  size_t size = 0;
   
   // read from source storage
   try
@@ -87,12 +742,8 @@ static bool MoveAttachment(const std::string& uuid, int type, IStorage* sourceSt
                 << uuid << " of type " << boost::lexical_cast<std::string>(type);
     }
 
-    std::unique_ptr<IStorage::IReader> reader(sourceStorage->GetReaderForObject(uuid.c_str(), static_cast<OrthancPluginContentType>(type), cryptoEnabled));
-
-    size_t fileSize = reader->GetSize();
-    buffer.resize(fileSize);
-
-    reader->ReadWhole(buffer.data(), fileSize);
+    reader.reset(sourceStorage->GetReaderForObject(uuid.c_str(), static_cast<OrthancPluginContentType>(type), cryptoEnabled));
+    size = reader->GetSize();
   }
   catch (StoragePluginException& ex)
   {
@@ -101,14 +752,24 @@ static bool MoveAttachment(const std::string& uuid, int type, IStorage* sourceSt
     return true;
   }
 
-  // write to target storage
-  if (buffer.size() > 0)
+  // write to target storage, while reading the source chunk by chunk
+  if (size > 0)
   {
     try
     {
       std::unique_ptr<IStorage::IWriter> writer(targetStorage->GetWriterForObject(uuid.c_str(), static_cast<OrthancPluginContentType>(type), cryptoEnabled));
 
-      writer->Write(buffer.data(), buffer.size());
+      // the memory that is reserved is the one that the writer keeps while writing the attachment (the whole attachment
+      // for the writers that do not upload in parts)
+      Orthanc::Semaphore::Locker lock(*limits.inFlightSize_, static_cast<unsigned int>(std::min(writer->GetBufferingSize(size), limits.maxInFlightSize_)));
+
+      ThrottledContentSource content(*reader, limits);
+      writer->WriteFromSource(content, size);
+    }
+    catch (StoppedException&)
+    {
+      LOG(INFO) << "Move attachment: " << uuid << " of type " << boost::lexical_cast<std::string>(type) << ", the job has been stopped";
+      return false;
     }
     catch (StoragePluginException& ex)
     {
@@ -119,7 +780,7 @@ static bool MoveAttachment(const std::string& uuid, int type, IStorage* sourceSt
   }
 
   // everything went well so far, we can delete from source storage
-  if (buffer.size() > 0)
+  if (size > 0)
   {
     try
     {
@@ -135,60 +796,272 @@ static bool MoveAttachment(const std::string& uuid, int type, IStorage* sourceSt
   return true;
 }
 
-static bool MoveInstance(const std::string& instanceId, IStorage* sourceStorage, IStorage* targetStorage, bool cryptoEnabled)
+static bool MoveInstance(const ResolvedInstance& instance, IStorage* sourceStorage, IStorage* targetStorage, bool cryptoEnabled,
+                         const TransferLimits& limits)
 {
   LOG(INFO) << "Moving instance from " << sourceStorage->GetNameForLogs() << " to " << targetStorage->GetNameForLogs();
 
-  Json::Value attachmentsList;
-  OrthancPlugins::RestApiGet(attachmentsList, std::string("/instances/") + instanceId + "/attachments?full", false);
-
-  Json::Value::Members attachmentsMembers = attachmentsList.getMemberNames();
   bool success = true;
 
-  for (size_t i = 0; i < attachmentsMembers.size(); i++)
+  for (size_t i = 0; i < instance.attachments_.size(); i++)
   {
-    int attachmentId = attachmentsList[attachmentsMembers[i]].asInt();
-
-    Json::Value attachmentInfo;
-    OrthancPlugins::RestApiGet(attachmentInfo, std::string("/instances/") + instanceId + "/attachments/" + boost::lexical_cast<std::string>(attachmentId) + "/info", false);
-
-    std::string attachmentUuid = attachmentInfo["Uuid"].asString();
+    const Attachment& attachment = instance.attachments_[i];
 
     // now we have the uuid and type.  We actually don't know where the file is but we'll try to move it anyway to the requested target
-    success &= MoveAttachment(attachmentUuid, attachmentId, sourceStorage, targetStorage, cryptoEnabled);
+    success &= MoveAttachment(attachment.uuid_, attachment.type_, sourceStorage, targetStorage, cryptoEnabled, limits);
   }
 
   return success;
 }
 
-OrthancPluginJobStepStatus MoveStorageJob::Step()
+namespace
 {
-  if (processedInstancesCount_ < instances_.size())
+  // the instances of a step are resolved by a thread that runs ahead of the threads that move them
+  class InstancesQueue : public boost::noncopyable
   {
-    IStorage* sourceStorage = (targetStorage_ == STORAGE_TYPE_FILE_SYSTEM ? objectStorage_ : fileSystemStorage_);
-    IStorage* targetStorage = (targetStorage_ == STORAGE_TYPE_FILE_SYSTEM ? fileSystemStorage_ : objectStorage_);
+    boost::mutex                  mutex_;
+    boost::condition_variable     resolved_;
+    std::deque<ResolvedInstance>  queue_;
+    size_t                        remaining_;   // number of instances that have been neither dequeued nor skipped yet
+    std::vector<std::string>      failures_;
 
-    if (MoveInstance(instances_[processedInstancesCount_], sourceStorage, targetStorage, cryptoEnabled_))
+  public:
+    explicit InstancesQueue(size_t count)
+      : remaining_(count)
     {
-      processedInstancesCount_++;
-      UpdateProgress((float)processedInstancesCount_/(float)instances_.size());
-      
-      return OrthancPluginJobStepStatus_Continue;
     }
-    else
+
+    void Enqueue(const ResolvedInstance& instance)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      queue_.push_back(instance);
+      resolved_.notify_one();
+    }
+
+    // the instance could not be resolved and will not be enqueued
+    void SkipFailure(const std::string& instanceId)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      failures_.push_back(instanceId);
+      remaining_--;
+      resolved_.notify_all();
+    }
+
+    // returns false when all the instances have been dequeued or skipped
+    bool Dequeue(ResolvedInstance& instance)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      while (remaining_ > 0 && queue_.empty())
+      {
+        resolved_.wait(lock);
+      }
+
+      if (queue_.empty())
+      {
+        return false;
+      }
+
+      instance = queue_.front();
+      queue_.pop_front();
+      remaining_--;
+
+      if (remaining_ == 0)
+      {
+        resolved_.notify_all();
+      }
+
+      return true;
+    }
+
+    void AddFailure(const std::string& instanceId)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      failures_.push_back(instanceId);
+    }
+
+    void GetFailures(std::vector<std::string>& failures)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      failures = failures_;
+    }
+  };
+}
+
+static void ResolveInstancesWorker(InstancesQueue* queue, MoveStorageJob::AttachmentsResolver* resolver,
+                                   const std::vector<std::string>* instances, size_t start, size_t end)
+{
+  for (size_t i = start; i < end; i++)
+  {
+    try
+    {
+      ResolvedInstance instance;
+      instance.instanceId_ = (*instances)[i];
+      resolver->Resolve(instance.attachments_, instance.instanceId_);
+      queue->Enqueue(instance);
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(ERROR) << "Move instance " << (*instances)[i] << ": unable to list its attachments: " << e.What();
+      queue->SkipFailure((*instances)[i]);
+    }
+    catch (std::exception& e)
+    {
+      LOG(ERROR) << "Move instance " << (*instances)[i] << ": unable to list its attachments: " << e.what();
+      queue->SkipFailure((*instances)[i]);
+    }
+  }
+}
+
+static void MoveInstancesWorker(InstancesQueue* queue, IStorage* sourceStorage, IStorage* targetStorage, bool cryptoEnabled,
+                                const TransferLimits* limits)
+{
+  ResolvedInstance instance;
+
+  while (queue->Dequeue(instance))
+  {
+    try
+    {
+      if (!MoveInstance(instance, sourceStorage, targetStorage, cryptoEnabled, *limits))
+      {
+        queue->AddFailure(instance.instanceId_);
+      }
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(ERROR) << "Move instance " << instance.instanceId_ << ": " << e.What();
+      queue->AddFailure(instance.instanceId_);
+    }
+    catch (std::exception& e)
+    {
+      LOG(ERROR) << "Move instance " << instance.instanceId_ << ": " << e.what();
+      queue->AddFailure(instance.instanceId_);
+    }
+  }
+}
+
+void MoveStorageJob::MoveInstances(std::vector<std::string>& failures,
+                                   size_t end)
+{
+  IStorage* sourceStorage = (targetStorage_ == STORAGE_TYPE_FILE_SYSTEM ? objectStorage_ : fileSystemStorage_);
+  IStorage* targetStorage = (targetStorage_ == STORAGE_TYPE_FILE_SYSTEM ? fileSystemStorage_ : objectStorage_);
+
+  InstancesQueue queue(end - processedInstancesCount_);
+  Orthanc::Semaphore inFlightSize(static_cast<unsigned int>(maxInFlightSize_));
+
+  TransferLimits limits;
+  limits.inFlightSize_ = &inFlightSize;
+  limits.maxInFlightSize_ = maxInFlightSize_;
+  limits.bandwidth_ = bandwidth_.get();
+  limits.throttler_ = throttler_;
+  limits.stop_ = &stop_;
+  limits.backOffDeadline_ = boost::posix_time::microsec_clock::universal_time() + boost::posix_time::seconds(MAX_BACK_OFF_PER_STEP_SECONDS);
+
+  const size_t threadsCount = std::min(static_cast<size_t>(threadsCount_), end - processedInstancesCount_);
+
+  boost::thread_group threads;
+
+  threads.create_thread(boost::bind(ResolveInstancesWorker, &queue, resolver_.get(), &instances_, processedInstancesCount_, end));
+
+  for (size_t i = 0; i < threadsCount; i++)
+  {
+    threads.create_thread(boost::bind(MoveInstancesWorker, &queue, sourceStorage, targetStorage, cryptoEnabled_, &limits));
+  }
+
+  threads.join_all();
+
+  queue.GetFailures(failures);
+}
+
+OrthancPluginJobStepStatus MoveStorageJob::Step()
+{
+  // the job has been resumed if it had been stopped
+  stop_.Set(false);
+
+  if (processedInstancesCount_ < instances_.size())
+  {
+    // each step moves a batch of instances, so that the job can still be paused or canceled between the steps
+    const size_t end = std::min(instances_.size(), processedInstancesCount_ + threadsCount_ * INSTANCES_PER_THREAD_AND_STEP);
+
+    std::vector<std::string> failures;
+    MoveInstances(failures, end);
+
+    const size_t batchSize = end - processedInstancesCount_;
+
+    // the failed instances are recorded and the job goes on, the next run of the job only retries them
+    failedInstances_.insert(failedInstances_.end(), failures.begin(), failures.end());
+    processedInstancesCount_ = end;
+    ReportProgress();
+
+    if (failures.size() == batchSize)
     {
+      // none of the instances of the batch could be moved, the storage is most likely unavailable
+      LOG(ERROR) << "Move storage: no instance of the last batch could be moved, stopping the job";
+      Checkpoint(true);
       return OrthancPluginJobStepStatus_Failure;
     }
+
+    Checkpoint(false);
+    return OrthancPluginJobStepStatus_Continue;
+  }
+
+  if (expandedResourcesCount_ < resources_.size())
+  {
+    // the resources are expanded into their instances progressively, a few of them at each step
+    ExpandResources();
+    ReportProgress();
+    Checkpoint(false);
+    return OrthancPluginJobStepStatus_Continue;
+  }
+
+  std::vector<std::string> resources;
+  if (FetchResources(resources))
+  {
+    // all the previous resources have been expanded, they are not kept
+    resources_.swap(resources);
+    expandedResourcesCount_ = 0;
+    chunkResourcesCount_ = 0;
+
+    SerializeResources();
+    ReportProgress();
+    Checkpoint(false);
+    return OrthancPluginJobStepStatus_Continue;
   }
 
+  if (!failedInstances_.empty())
+  {
+    LOG(ERROR) << "Move storage: " << failedInstances_.size() << " instance(s) could not be moved, resubmit the job to retry them";
+    Checkpoint(true);
+    return OrthancPluginJobStepStatus_Failure;
+  }
+
+  Checkpoint(true);
   return OrthancPluginJobStepStatus_Success;
 }
 
 void MoveStorageJob::Stop(OrthancPluginJobStopReason reason)
 {
+  // interrupts the back-off of the moves of the current step
+  stop_.Set(true);
 }
     
 void MoveStorageJob::Reset()
 {
+  // a resubmitted job only retries the instances that have failed or that have not been processed yet, and the
+  // resources that have not been expanded yet
+  std::vector<std::string> instances(failedInstances_);
+  instances.insert(instances.end(), instances_.begin() + processedInstancesCount_, instances_.end());
+
+  instances_.swap(instances);
   processedInstancesCount_ = 0;
+  failedInstances_.clear();
+
+  resources_.erase(resources_.begin(), resources_.begin() + expandedResourcesCount_);
+  expandedResourcesCount_ = 0;
+  chunkResourcesCount_ = 0;
+
+  SerializeResources();
+  SerializeInstances();
+  ReportProgress();
+  Checkpoint(true);
 }
@@ -25,26 +25,95 @@
 #include <orthanc/OrthancCPlugin.h>
 #include <OrthancPluginCppWrapper.h>
 #include <json/json.h>
+#include <Enumerations.h>
+#include "BackgroundThrottler.h"
 #include "IStorage.h"
 
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <memory>
 #include <vector>
 
 class MoveStorageJob : public OrthancPlugins::OrthancJob
 {
+public:
+  class AttachmentsResolver;
+
+private:
   std::string targetStorage_;
-  std::vector<std::string> instances_;
+  std::vector<std::string> resources_;              // resources to move, expanded into their instances by the steps
+  std::string resourcesLevel_;                      // level of all the resources, empty if it must be probed
+  size_t expandedResourcesCount_;
+  size_t chunkResourcesCount_;                      // number of resources whose instances are in instances_
+  std::vector<std::string> instances_;              // instances of the last expanded resources
   size_t processedInstancesCount_;
   Json::Value resourceForJobContent_;
   IStorage* fileSystemStorage_;
   IStorage* objectStorage_;
   bool cryptoEnabled_;
+  unsigned int threadsCount_;
+  size_t maxInFlightSize_;    // maximum memory buffered by the writers of the attachments that are being moved concurrently
+  std::unique_ptr<AttachmentsResolver> resolver_;   // keeps the attachments of the current series between the steps
+  std::vector<std::string> failedInstances_;        // processed instances that could not be moved
+  Json::Value serializedResources_;                 // the serialized resources_, only updated when resources_ changes
+  Json::Value serializedInstances_;                 // the serialized instances_, only updated when instances_ changes
+  boost::posix_time::ptime lastCheckpoint_;
+  std::unique_ptr<TokenBucket> bandwidth_;          // NULL if the throughput of the moves is not limited
+  BackgroundThrottler* throttler_;                  // shared by all the background transfers, NULL if disabled
+  BackgroundThrottler::StopFlag stop_;
+
+  void SerializeResources();
+
+  void SerializeInstances();
+
+  void ExpandResource(const std::string& resourceId);
+
+  // replaces instances_ by the instances of the next resources
+  void ExpandResources();
+
+  // moves the instances [processedInstancesCount_, end) concurrently and lists the ones that have failed
+  void MoveInstances(std::vector<std::string>& failures,
+                     size_t end);
+
+protected:
+  MoveStorageJob(const std::string& jobType,
+                 const std::string& targetStorage,
+                 const std::vector<std::string>& resources,
+                 const std::string& resourcesLevel,
+                 const Json::Value& resourceForJobContent,
+                 bool cryptoEnabled,
+                 unsigned int threadsCount,
+                 size_t maxInFlightSize);
+
+  virtual void Serialize(Json::Value& target) const;
+
+  // persists the progress of the job, at most every few seconds unless forced
+  void Checkpoint(bool force);
+
+  // progress of the resources that have been provided so far
+  virtual float ComputeProgress() const;
+
+  void ReportProgress();
+
+  // called when a resource is expanded, to describe it in the content of the job
+  virtual void AddResourceForJobContent(Json::Value& content, Orthanc::ResourceType resourceType, const std::string& resourceId);
+
+  // called once all the resources have been moved, to provide the next ones.  Returns false if there are no more
+  // resources to move.
+  virtual bool FetchResources(std::vector<std::string>& resources)
+  {
+    return false;
+  }
 
-  void Serialize(Json::Value& target) const;
 public:
   MoveStorageJob(const std::string& targetStorage,
-                  const std::vector<std::string>& instances,
-                  const Json::Value& resourceForJobContent,
-                  bool cryptoEnabled);
+                 const std::vector<std::string>& resources,
+                 const std::string& resourcesLevel,
+                 const Json::Value& resourceForJobContent,
+                 bool cryptoEnabled,
+                 unsigned int threadsCount,
+                 size_t maxInFlightSize);
+
+  virtual ~MoveStorageJob();
 
   virtual OrthancPluginJobStepStatus Step();
 
@@ -54,4 +123,12 @@ public:
 
   void SetStorages(IStorage* fileSystemStorage, IStorage* objectStorage);
 
+  void SetThrottler(BackgroundThrottler* throttler);
+
+  // limits the throughput of the moves of this job, 0 for no limit
+  void SetMaxBandwidth(uint64_t bytesPerSecond);
+
+  // restores the progress of a job that has been serialized by Checkpoint()
+  virtual void RestoreCheckpoint(const Json::Value& serialized);
+
 };
\ No newline at end of file
@@ -0,0 +1,251 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "MoveStorageQueryJob.h"
+#include "Logging.h"
+#include "StoragePlugin.h"
+
+#include <algorithm>
+#include <set>
+
+
+static const size_t STUDIES_PER_PAGE = 100;
+
+
+static Json::Value CreateJobContent(const std::string& targetStorage,
+                                    const Json::Value& query,
+                                    const std::string& lastUpdateBefore)
+{
+  Json::Value content;
+  content[KEY_TARGET_STORAGE] = targetStorage;
+  content[KEY_QUERY] = query;
+
+  if (!lastUpdateBefore.empty())
+  {
+    content[KEY_LAST_UPDATE_BEFORE] = lastUpdateBefore;
+  }
+
+  content[KEY_STUDIES_COUNT] = 0;
+  return content;
+}
+
+
+MoveStorageQueryJob::MoveStorageQueryJob(const std::string& targetStorage,
+                                         const Json::Value& query,
+                                         const std::string& lastUpdateBefore,
+                                         bool cryptoEnabled,
+                                         unsigned int threadsCount,
+                                         size_t maxInFlightSize,
+                                         uint64_t maxBandwidth)
+  : MoveStorageJob(JOB_TYPE_MOVE_STORAGE_QUERY, targetStorage, std::vector<std::string>(), "Study",
+                   CreateJobContent(targetStorage, query, lastUpdateBefore), cryptoEnabled, threadsCount, maxInFlightSize),
+    query_(query),
+    lastUpdateBefore_(lastUpdateBefore),
+    threadsCount_(threadsCount),
+    maxBandwidth_(maxBandwidth),
+    offset_(0),
+    pageSize_(0),
+    candidatesCount_(0),
+    done_(false)
+{
+  SetMaxBandwidth(maxBandwidth);
+  Checkpoint(true);
+}
+
+
+void MoveStorageQueryJob::Serialize(Json::Value& target) const
+{
+  MoveStorageJob::Serialize(target);
+
+  target[KEY_QUERY] = query_;
+  target[KEY_LAST_UPDATE_BEFORE] = lastUpdateBefore_;
+  target[KEY_THREADS] = threadsCount_;
+  target[KEY_MAX_BANDWIDTH] = static_cast<Json::UInt64>(maxBandwidth_);
+  target[KEY_OFFSET] = static_cast<Json::UInt64>(offset_);
+  target[KEY_PAGE_SIZE] = static_cast<Json::UInt64>(pageSize_);
+
+  Json::Value lastPage = Json::arrayValue;
+  for (size_t i = 0; i < lastPage_.size(); i++)
+  {
+    lastPage.append(lastPage_[i]);
+  }
+
+  target[KEY_LAST_PAGE] = lastPage;
+  target[KEY_CANDIDATES_COUNT] = static_cast<Json::UInt64>(candidatesCount_);
+  target[KEY_DONE] = done_;
+}
+
+
+void MoveStorageQueryJob::RestoreCheckpoint(const Json::Value& serialized)
+{
+  offset_ = static_cast<size_t>(serialized[KEY_OFFSET].asUInt64());
+  pageSize_ = static_cast<size_t>(serialized[KEY_PAGE_SIZE].asUInt64());
+
+  lastPage_.clear();
+  if (serialized.isMember(KEY_LAST_PAGE))  // not present in the jobs that have been serialized by older versions
+  {
+    for (Json::Value::ArrayIndex i = 0; i < serialized[KEY_LAST_PAGE].size(); i++)
+    {
+      lastPage_.push_back(serialized[KEY_LAST_PAGE][i].asString());
+    }
+  }
+  candidatesCount_ = static_cast<size_t>(serialized[KEY_CANDIDATES_COUNT].asUInt64());
+  done_ = serialized[KEY_DONE].asBool();
+
+  MoveStorageJob::RestoreCheckpoint(serialized);
+}
+
+
+float MoveStorageQueryJob::ComputeProgress() const
+{
+  if (candidatesCount_ == 0)
+  {
+    return 0;
+  }
+  else
+  {
+    // the progress within the last page is approximated by the progress of its matching studies
+    const float pageStart = static_cast<float>(offset_ - pageSize_);
+    const float progress = (pageStart + MoveStorageJob::ComputeProgress() * static_cast<float>(pageSize_)) / static_cast<float>(candidatesCount_);
+    return std::min(1.0f, progress);
+  }
+}
+
+
+void MoveStorageQueryJob::AddResourceForJobContent(Json::Value& content, Orthanc::ResourceType /*resourceType*/, const std::string& /*resourceId*/)
+{
+  // the moved studies are only counted, there might be a lot of them
+  content[KEY_STUDIES_COUNT] = content[KEY_STUDIES_COUNT].asUInt64() + 1;
+}
+
+
+void MoveStorageQueryJob::CountCandidates()
+{
+  Json::Value request;
+  request["Level"] = "Study";
+  request["Query"] = query_;
+
+  // this route is only available in Orthanc >= 1.12.5, the progress is not reported with the older versions
+  Json::Value response;
+  if (OrthancPlugins::RestApiPost(response, "/tools/count-resources", request, false) &&
+      response.type() == Json::objectValue &&
+      response.isMember("Count") &&
+      response["Count"].isUInt64())
+  {
+    candidatesCount_ = static_cast<size_t>(response["Count"].asUInt64());
+    LOG(INFO) << "Move storage: " << candidatesCount_ << " studies match the query";
+  }
+}
+
+
+void MoveStorageQueryJob::FindStudies(Json::Value& studies, size_t since, size_t limit) const
+{
+  Json::Value request;
+  request["Level"] = "Study";
+  request["Query"] = query_;
+  request["Expand"] = true;
+  request["Since"] = static_cast<Json::UInt64>(since);
+  request["Limit"] = static_cast<Json::UInt64>(limit);
+
+  if (!OrthancPlugins::RestApiPost(studies, "/tools/find", request, false) ||
+      studies.type() != Json::arrayValue)
+  {
+    LOG(ERROR) << "Move storage: unable to list the studies that match the query, the job can be resubmitted to resume it";
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol);
+  }
+}
+
+
+bool MoveStorageQueryJob::FetchResources(std::vector<std::string>& resources)
+{
+  if (done_)
+  {
+    return false;
+  }
+
+  if (offset_ == 0)
+  {
+    CountCandidates();
+  }
+
+  // The studies are listed in the order of their creation: moving their attachments does not change their
+  // position, the new studies are added at the end of the list, but the deleted studies shift the next ones
+  // towards the beginning of the list.  The last page is listed again with the next one: the new studies
+  // start after the last study of the last page that still exists.  If all of them have been deleted, the
+  // window is moved backwards until one of them is found (at worst, some studies are moved again, which is
+  // a no-op for the attachments that are already in the target storage).
+  const std::set<std::string> lastPage(lastPage_.begin(), lastPage_.end());
+
+  size_t since = (offset_ >= lastPage_.size() ? offset_ - lastPage_.size() : 0);
+  const size_t limit = lastPage_.size() + STUDIES_PER_PAGE;
+
+  Json::Value studies;
+  Json::ArrayIndex first = 0;  // index of the first study that has not been listed yet
+
+  for (;;)
+  {
+    FindStudies(studies, since, limit);
+
+    bool found = false;
+    for (Json::ArrayIndex i = studies.size(); i > 0 && !found; i--)
+    {
+      if (lastPage.find(studies[i - 1]["ID"].asString()) != lastPage.end())
+      {
+        first = i;
+        found = true;
+      }
+    }
+
+    if (found || lastPage.empty() || since == 0)
+    {
+      break;
+    }
+
+    since = (since > STUDIES_PER_PAGE ? since - STUDIES_PER_PAGE : 0);
+  }
+
+  const Json::ArrayIndex end = std::min(studies.size(), static_cast<Json::ArrayIndex>(first + STUDIES_PER_PAGE));
+
+  pageSize_ = end - first;
+  offset_ = since + end;
+  done_ = (studies.size() < limit && end == studies.size());
+
+  if (end > first)
+  {
+    lastPage_.clear();  // otherwise, the same studies are used to find the next page
+  }
+
+  for (Json::ArrayIndex i = first; i < end; i++)
+  {
+    lastPage_.push_back(studies[i]["ID"].asString());
+
+    // the "LastUpdate" timestamps are ISO strings that can be compared as strings
+    if (lastUpdateBefore_.empty() ||
+        (studies[i].isMember("LastUpdate") &&
+         studies[i]["LastUpdate"].asString() < lastUpdateBefore_))
+    {
+      resources.push_back(studies[i]["ID"].asString());
+    }
+  }
+
+  LOG(INFO) << "Move storage: " << resources.size() << " of the " << pageSize_ << " listed studies will be moved";
+  return true;
+}
@@ -0,0 +1,67 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "MoveStorageJob.h"
+
+
+// moves the studies that match a selector (the "Query" of /tools/find and an optional threshold on their
+// "LastUpdate").  The studies are listed page by page while the job runs, and are moved by the same pipeline
+// as the ones of MoveStorageJob.  Since studies can be deleted while the job runs, the position of the next
+// page is found from the studies of the last page instead of relying on an offset only.
+class MoveStorageQueryJob : public MoveStorageJob
+{
+private:
+  Json::Value   query_;
+  std::string   lastUpdateBefore_;   // ISO timestamp, empty to move the studies regardless of their last update
+  unsigned int  threadsCount_;
+  uint64_t      maxBandwidth_;       // in bytes per second, 0 for no limit
+  size_t        offset_;             // position of the next study in the list, if no study has been deleted
+  size_t        pageSize_;           // number of studies in the last page
+  std::vector<std::string>  lastPage_;  // all the studies of the last page (including the ones that are not moved)
+  size_t        candidatesCount_;    // number of studies that match the query, 0 if unknown
+  bool          done_;
+
+  void CountCandidates();
+
+  void FindStudies(Json::Value& studies, size_t since, size_t limit) const;
+
+protected:
+  virtual void Serialize(Json::Value& target) const ORTHANC_OVERRIDE;
+
+  virtual float ComputeProgress() const ORTHANC_OVERRIDE;
+
+  virtual void AddResourceForJobContent(Json::Value& content, Orthanc::ResourceType resourceType, const std::string& resourceId) ORTHANC_OVERRIDE;
+
+  virtual bool FetchResources(std::vector<std::string>& resources) ORTHANC_OVERRIDE;
+
+public:
+  MoveStorageQueryJob(const std::string& targetStorage,
+                      const Json::Value& query,
+                      const std::string& lastUpdateBefore,
+                      bool cryptoEnabled,
+                      unsigned int threadsCount,
+                      size_t maxInFlightSize,
+                      uint64_t maxBandwidth);
+
+  virtual void RestoreCheckpoint(const Json::Value& serialized) ORTHANC_OVERRIDE;
+};
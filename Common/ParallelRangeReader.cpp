@@ -0,0 +1,147 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "ParallelRangeReader.h"
+#include "IStorage.h"
+
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <vector>
+
+
+namespace
+{
+  class SharedState : public boost::noncopyable
+  {
+  private:
+    const ParallelRangeReader::ReadRangeFunction& readRange_;
+    char*                                         data_;
+    size_t                                        size_;
+    size_t                                        fromOffset_;
+    size_t                                        chunkSize_;
+
+    boost::mutex                                  mutex_;
+    size_t                                        nextChunk_;
+    std::string                                   firstErrorMessage_;
+
+    // returns false if there is nothing left to read or if a range has failed
+    bool GetNextChunk(size_t& chunk)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (!firstErrorMessage_.empty() ||
+          nextChunk_ * chunkSize_ >= size_)
+      {
+        return false;
+      }
+
+      chunk = nextChunk_++;
+      return true;
+    }
+
+    void SetError(const std::string& message)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (firstErrorMessage_.empty())
+      {
+        firstErrorMessage_ = message;
+      }
+    }
+
+  public:
+    SharedState(const ParallelRangeReader::ReadRangeFunction& readRange, char* data, size_t size, size_t fromOffset, size_t chunkSize) :
+      readRange_(readRange),
+      data_(data),
+      size_(size),
+      fromOffset_(fromOffset),
+      chunkSize_(chunkSize),
+      nextChunk_(0)
+    {
+    }
+
+    const std::string& GetFirstErrorMessage() const
+    {
+      return firstErrorMessage_;
+    }
+
+    static void Worker(SharedState* that)
+    {
+      size_t chunk;
+
+      while (that->GetNextChunk(chunk))
+      {
+        const size_t offset = chunk * that->chunkSize_;
+        const size_t size = std::min(that->chunkSize_, that->size_ - offset);
+
+        try
+        {
+          that->readRange_(that->data_ + offset, size, that->fromOffset_ + offset);
+        }
+        catch (StoragePluginException& ex)
+        {
+          that->SetError(ex.what());
+        }
+        catch (std::exception& ex)
+        {
+          that->SetError(ex.what());
+        }
+      }
+    }
+  };
+}
+
+
+void ParallelRangeReader::Read(const ReadRangeFunction& readRange, char* data, size_t size, size_t fromOffset) const
+{
+  if (!IsParallel(size))
+  {
+    readRange(data, size, fromOffset);
+    return;
+  }
+
+  const size_t chunksCount = (size + chunkSize_ - 1) / chunkSize_;
+  const size_t threadsCount = std::min(static_cast<size_t>(concurrency_), chunksCount);
+
+  SharedState state(readRange, data, size, fromOffset, chunkSize_);
+
+  std::vector<boost::thread*> threads;
+
+  // the current thread is also downloading ranges
+  for (size_t i = 1; i < threadsCount; i++)
+  {
+    threads.push_back(new boost::thread(SharedState::Worker, &state));
+  }
+
+  SharedState::Worker(&state);
+
+  for (size_t i = 0; i < threads.size(); i++)
+  {
+    threads[i]->join();
+    delete threads[i];
+  }
+
+  if (!state.GetFirstErrorMessage().empty())
+  {
+    throw StoragePluginException(state.GetFirstErrorMessage());
+  }
+}
@@ -0,0 +1,65 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/function.hpp>
+
+#include <stddef.h>
+
+
+// Splits a large read into byte ranges that are downloaded concurrently, each range being
+// written directly into its own slice of the target buffer.
+class ParallelRangeReader
+{
+public:
+  typedef boost::function<void (char* data, size_t size, size_t fromOffset)>  ReadRangeFunction;
+
+private:
+  size_t        chunkSize_;
+  unsigned int  concurrency_;
+
+public:
+  ParallelRangeReader(size_t chunkSize,
+                      unsigned int concurrency) :
+    chunkSize_(chunkSize),
+    concurrency_(concurrency)
+  {
+  }
+
+  size_t GetChunkSize() const
+  {
+    return chunkSize_;
+  }
+
+  bool IsEnabled() const
+  {
+    return concurrency_ > 1 && chunkSize_ > 0;
+  }
+
+  bool IsParallel(size_t size) const
+  {
+    return IsEnabled() && size > chunkSize_;
+  }
+
+  // readRange is called from multiple threads and must be thread-safe
+  void Read(const ReadRangeFunction& readRange, char* data, size_t size, size_t fromOffset) const;
+};
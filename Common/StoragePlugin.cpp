@@ -34,17 +34,29 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <deque>
 #include <string>
 
 #include <iostream>
+#include <boost/date_time/gregorian/gregorian.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/thread.hpp>
 
+#include "BackgroundThrottler.h"
+#include "CompressionHelpers.h"
+#include "DeletionQueue.h"
+#include "DictionaryTrainingJob.h"
+#include "DiskCacheStorage.h"
 #include "EncryptionConfigurator.h"
 #include "EncryptionHelpers.h"
 #include "FileSystemStorage.h"
+#include "MemoryObjectsCache.h"
 #include "MoveStorageJob.h"
+#include "MoveStorageQueryJob.h"
 #include "StoragePlugin.h"
+#include "WriteBehindStorage.h"
 
 #include <Logging.h>
 #include <SystemToolbox.h>
@@ -63,6 +75,14 @@
 
 static std::unique_ptr<IStorage> primaryStorage;
 static std::unique_ptr<IStorage> secondaryStorage;
+static IStorage* objectStorage = NULL;  // the object storage itself, without the write-behind journal and the local cache
+
+static std::unique_ptr<MemoryObjectsCache> memoryCache;
+
+static std::unique_ptr<DeletionQueue> deletionQueue;
+
+static std::unique_ptr<CompressionHelpers> compression;
+static bool compressionConfigured = false;  // whether the storage might contain compressed objects
 
 static std::unique_ptr<EncryptionHelpers> crypto;
 static bool cryptoEnabled = false;
@@ -78,6 +98,12 @@ typedef enum
 } HybridMode;  
 
 static HybridMode hybridMode = HybridMode_Disabled;
+static unsigned int moveStorageThreadsCount = 4;
+static size_t moveStorageMaxInFlightSize = 256 * 1024 * 1024;
+static std::unique_ptr<BackgroundThrottler> backgroundThrottler;
+
+// the duration of the reads of larger objects depends on their size more than on the load of the storage
+static const uint64_t FOREGROUND_LATENCY_MAX_SIZE = 1024 * 1024;
 
 static bool IsReadFromDisk()
 {
@@ -101,6 +127,58 @@ static void LogErrorAsError(const std::string& message)
   LOG(ERROR) << message;
 }
 
+static bool LookupContentType(OrthancPluginContentType& type, const std::string& name)
+{
+  if (name == "Dicom")
+  {
+    type = OrthancPluginContentType_Dicom;
+  }
+  else if (name == "DicomAsJson")
+  {
+    type = OrthancPluginContentType_DicomAsJson;
+  }
+  else if (name == "DicomUntilPixelData")
+  {
+    type = OrthancPluginContentType_DicomUntilPixelData;
+  }
+  else
+  {
+    return false;
+  }
+
+  return true;
+}
+
+
+
+// the large encrypted objects are downloaded and decrypted by segments of this size.  At most
+// STREAMING_PENDING_SEGMENTS segments are downloaded in advance while the current one is being decrypted.
+static const size_t STREAMING_SEGMENT_SIZE = 8 * 1024 * 1024;
+static const size_t STREAMING_PENDING_SEGMENTS = 2;
+
+// first bytes of the objects that are read to detect the compressed objects and to read their frames table
+static const size_t INDEX_PROBE_SIZE = 4096;
+
+
+// produces the ranges of an object that is encrypted in chunks, e.g. while the previous parts are being uploaded
+class EncryptedContentSource : public IStorage::IContentSource
+{
+  EncryptionHelpers&                           crypto_;
+  const EncryptionHelpers::ChunkedEncryptor&   encryptor_;
+
+public:
+  EncryptedContentSource(EncryptionHelpers& crypto,
+                         const EncryptionHelpers::ChunkedEncryptor& encryptor)
+    : crypto_(crypto),
+      encryptor_(encryptor)
+  {
+  }
+
+  virtual void Read(char* data, size_t size, uint64_t fromOffset) ORTHANC_OVERRIDE
+  {
+    crypto_.EncryptRange(data, size, fromOffset, encryptor_);
+  }
+};
 
 
 static OrthancPluginErrorCode StorageCreate(const char* uuid,
@@ -120,25 +198,64 @@ static OrthancPluginErrorCode StorageCreate(const char* uuid,
               << " of type " << boost::lexical_cast<std::string>(type);
     std::unique_ptr<IStorage::IWriter> writer(primaryStorage->GetWriterForObject(uuid, type, cryptoEnabled));
 
-    if (cryptoEnabled)
+    // the objects are compressed before being encrypted
+    const char* data = reinterpret_cast<const char*>(content);
+    size_t dataSize = static_cast<size_t>(size);
+
+    std::string compressed;
+    if (compression.get() != NULL &&
+        compression->Compress(compressed, data, dataSize, type))
     {
-      std::string encryptedFile;
+      LOG(INFO) << primaryStorage->GetNameForLogs() << ": attachment " << uuid << " compressed from " << dataSize << " to " << compressed.size() << " bytes";
+      data = compressed.data();
+      dataSize = compressed.size();
+    }
+    else if (CompressionHelpers::NeedsWrapping(data, dataSize))
+    {
+      // the objects that are stored as is must not be mistaken for compressed objects when they are read
+      CompressionHelpers::Wrap(compressed, data, dataSize);
+      data = compressed.data();
+      dataSize = compressed.size();
+    }
 
+    if (cryptoEnabled && crypto->GetChunkSize() > 0)
+    {
+      // the object is encrypted range by range, as it is being written: writers that upload in parts only
+      // keep the parts being uploaded in memory and the encryption overlaps the upload of the previous parts
       try
       {
-        crypto->Encrypt(encryptedFile, reinterpret_cast<const char*>(content), size);
+        std::unique_ptr<EncryptionHelpers::ChunkedEncryptor> encryptor(crypto->CreateChunkedEncryptor(data, dataSize));
+        EncryptedContentSource source(*crypto, *encryptor);
+
+        writer->WriteFromSource(source, static_cast<size_t>(encryptor->GetHeader().GetEncryptedSize()));
       }
       catch (EncryptionException& ex)
       {
         LOG(ERROR) << primaryStorage->GetNameForLogs() << ": error while encrypting object " << uuid << ": " << ex.what();
         return OrthancPluginErrorCode_StorageAreaPlugin;
       }
+    }
+    else if (cryptoEnabled)
+    {
+      // the legacy "A1" format can only be encrypted at once: the object is encrypted in a single buffer that is directly uploaded (no zero-initialization, no copy)
+      const size_t encryptedSize = crypto->GetEncryptedSize(dataSize);
+      std::unique_ptr<char[]> encryptedFile(new char[encryptedSize]);
 
-      writer->Write(encryptedFile.data(), encryptedFile.size());
+      try
+      {
+        crypto->Encrypt(encryptedFile.get(), data, dataSize);
+      }
+      catch (EncryptionException& ex)
+      {
+        LOG(ERROR) << primaryStorage->GetNameForLogs() << ": error while encrypting object " << uuid << ": " << ex.what();
+        return OrthancPluginErrorCode_StorageAreaPlugin;
+      }
+
+      writer->Write(encryptedFile.get(), encryptedSize);
     }
     else
     {
-      writer->Write(reinterpret_cast<const char*>(content), size);
+      writer->Write(data, dataSize);
     }
     LOG(INFO) << primaryStorage->GetNameForLogs() << ": created attachment " << uuid
               << " (" << timer.GetHumanTransferSpeed(true, size) << ")";
@@ -153,6 +270,300 @@ static OrthancPluginErrorCode StorageCreate(const char* uuid,
 }
 
 
+// reads the object as it is stored, before its decompression.  The beginning of the object is read with a bounded
+// request that also gives its size, and the ranges that it covers are not read again.  Only the chunks that cover a
+// range are read and decrypted.  The objects that are not encrypted in chunks (legacy "A1" format) can only be
+// decrypted as a whole: they are read and decrypted once, then the ranges are copied from the plain text.
+class StoredObjectReader : public boost::noncopyable
+{
+private:
+  IStorage::IReader&                reader_;
+  EncryptionHelpers::ChunkedHeader  header_;
+  bool                              isChunked_;
+  std::vector<char>                 firstBytes_;   // beginning of the stored object, or whole plain text of the "A1" objects
+  uint64_t                          size_;
+
+public:
+  StoredObjectReader(IStorage::IReader& reader,
+                     size_t probeSize) :
+    reader_(reader),
+    isChunked_(false),
+    size_(0)
+  {
+    if (!cryptoEnabled)
+    {
+      size_ = reader_.ReadFirstBytes(firstBytes_, probeSize);
+      return;
+    }
+
+    std::vector<char> encrypted;
+    const size_t fileSize = reader_.ReadFirstBytes(encrypted, EncryptionHelpers::CHUNKED_HEADER_SIZE);
+
+    if (EncryptionHelpers::ParseChunkedHeader(header_, encrypted.data(), encrypted.size()))
+    {
+      isChunked_ = true;
+      size_ = header_.GetPlainTextSize();
+
+      firstBytes_.resize(static_cast<size_t>(std::min(size_, static_cast<uint64_t>(probeSize))));
+
+      if (!firstBytes_.empty())
+      {
+        ReadChunks(firstBytes_.data(), firstBytes_.size(), 0);
+      }
+    }
+    else
+    {
+      const size_t receivedSize = encrypted.size();
+      encrypted.resize(fileSize);
+
+      if (receivedSize < fileSize)
+      {
+        reader_.ReadRange(encrypted.data() + receivedSize, fileSize - receivedSize, receivedSize);
+      }
+
+      firstBytes_.resize(EncryptionHelpers::GetPlainTextSize(encrypted.data(), fileSize));
+      crypto->Decrypt(firstBytes_.data(), encrypted.data(), fileSize);
+      size_ = firstBytes_.size();
+    }
+  }
+
+  uint64_t GetSize() const
+  {
+    return size_;
+  }
+
+  void ReadRange(char* target,
+                 size_t size,
+                 uint64_t rangeStart)
+  {
+    if (rangeStart + size > size_)
+    {
+      throw StoragePluginException("The range [" + boost::lexical_cast<std::string>(rangeStart) + ", " + boost::lexical_cast<std::string>(rangeStart + size) +
+                                   ") is out of the object of " + boost::lexical_cast<std::string>(size_) + " bytes");
+    }
+
+    if (size == 0)
+    {
+      return;
+    }
+
+    if (rangeStart + size <= firstBytes_.size())
+    {
+      memcpy(target, firstBytes_.data() + rangeStart, size);
+    }
+    else if (isChunked_)
+    {
+      ReadChunks(target, size, rangeStart);
+    }
+    else
+    {
+      reader_.ReadRange(target, size, static_cast<size_t>(rangeStart));
+    }
+  }
+
+private:
+  void ReadChunks(char* target,
+                  size_t size,
+                  uint64_t rangeStart)
+  {
+    uint64_t encryptedOffset;
+    size_t encryptedSize;
+    header_.GetEncryptedRange(encryptedOffset, encryptedSize, rangeStart, size);
+
+    std::vector<char> encrypted(encryptedSize);
+    reader_.ReadRange(encrypted.data(), encryptedSize, static_cast<size_t>(encryptedOffset));
+
+    crypto->DecryptRange(target, size, rangeStart, header_, encrypted.data(), encryptedSize);
+  }
+};
+
+
+// the objects are decompressed whatever the current compression configuration, so that they remain
+// readable if it is disabled.  The objects that have been compressed without dictionary can be
+// decompressed even if the compression is not configured.
+static const CompressionHelpers& GetDecompressor()
+{
+  static const CompressionHelpers withoutDictionaries;
+  return (compression.get() != NULL ? *compression : withoutDictionaries);
+}
+
+
+// the compression dictionaries are stored in the object storage, next to the objects, so that all the Orthanc
+// instances that share the storage can read them: "<content type (4 bytes, little endian)><dictionary>",
+// encrypted as the objects.  They are not referenced by the Orthanc database.
+class SharedDictionariesStorage : public CompressionHelpers::IDictionariesStorage
+{
+private:
+  static const size_t CONTENT_TYPE_SIZE = 4;
+
+  static std::string GetUuid(uint32_t id)
+  {
+    return "compression-dictionary-" + boost::lexical_cast<std::string>(id);
+  }
+
+  // in the hybrid mode, the file system might be local to each instance.  The dictionaries must be in the object
+  // storage as soon as they are written, not in the local write-behind journal.
+  static IStorage& GetObjectStorage()
+  {
+    return *objectStorage;
+  }
+
+public:
+  virtual bool ReadDictionary(OrthancPluginContentType& type, std::string& dictionary, uint32_t id) ORTHANC_OVERRIDE
+  {
+    IStorage& storage = GetObjectStorage();
+    const std::string uuid = GetUuid(id);
+
+    std::string stored;
+
+    try
+    {
+      std::unique_ptr<IStorage::IReader> reader(storage.GetReaderForObject(uuid.c_str(), OrthancPluginContentType_Unknown, cryptoEnabled));
+      stored.resize(reader->GetSize());
+
+      if (!stored.empty())
+      {
+        reader->ReadWhole(&stored[0], stored.size());
+      }
+    }
+    catch (StoragePluginNotFoundException& ex)
+    {
+      LOG(INFO) << storage.GetNameForLogs() << ": no compression dictionary " << id << " in the storage: " << ex.what();
+      return false;
+    }
+    catch (StoragePluginException& ex)
+    {
+      throw StoragePluginException("Unable to read the compression dictionary " + boost::lexical_cast<std::string>(id) + ": " + ex.what());
+    }
+
+    std::string content;
+
+    if (cryptoEnabled)
+    {
+      try
+      {
+        crypto->Decrypt(content, stored);
+      }
+      catch (EncryptionException& ex)
+      {
+        throw StoragePluginException("Unable to decrypt the compression dictionary " + boost::lexical_cast<std::string>(id) + ": " + ex.what());
+      }
+    }
+    else
+    {
+      content.swap(stored);
+    }
+
+    if (content.size() <= CONTENT_TYPE_SIZE)
+    {
+      throw StoragePluginException("Invalid compression dictionary " + boost::lexical_cast<std::string>(id) + " in the storage");
+    }
+
+    uint32_t contentType = 0;
+    for (size_t i = 0; i < CONTENT_TYPE_SIZE; i++)
+    {
+      contentType |= static_cast<uint32_t>(static_cast<uint8_t>(content[i])) << (8 * i);
+    }
+
+    type = static_cast<OrthancPluginContentType>(contentType);
+    dictionary.assign(content, CONTENT_TYPE_SIZE, std::string::npos);
+    return true;
+  }
+
+  virtual void WriteDictionary(uint32_t id, OrthancPluginContentType type, const std::string& dictionary) ORTHANC_OVERRIDE
+  {
+    std::string content(CONTENT_TYPE_SIZE, '\0');
+    for (size_t i = 0; i < CONTENT_TYPE_SIZE; i++)
+    {
+      content[i] = static_cast<char>((static_cast<uint32_t>(type) >> (8 * i)) & 0xff);
+    }
+
+    content += dictionary;
+
+    if (cryptoEnabled)
+    {
+      try
+      {
+        std::string encrypted;
+        crypto->Encrypt(encrypted, content);
+        content.swap(encrypted);
+      }
+      catch (EncryptionException& ex)
+      {
+        throw StoragePluginException("Unable to encrypt the compression dictionary " + boost::lexical_cast<std::string>(id) + ": " + ex.what());
+      }
+    }
+
+    const std::string uuid = GetUuid(id);
+    std::unique_ptr<IStorage::IWriter> writer(GetObjectStorage().GetWriterForObject(uuid.c_str(), OrthancPluginContentType_Unknown, cryptoEnabled));
+    writer->Write(content.data(), content.size());
+  }
+};
+
+
+// reads a range of an object that might be compressed: the header and the frames table of the compressed
+// objects are read first, then only the frames that cover the range.  The detection rule is the one of
+// CompressionHelpers::IsCompressed(): valid header and frames table that match the size of the stored object.
+static void ReadPossiblyCompressedRange(IStorage::IReader& reader,
+                                        char* target,
+                                        size_t size,
+                                        uint64_t rangeStart)
+{
+  if (!compressionConfigured)
+  {
+    // no object has been compressed -> no need to read the index first
+    if (cryptoEnabled)
+    {
+      StoredObjectReader stored(reader, 0);
+      stored.ReadRange(target, size, rangeStart);
+    }
+    else if (size > 0)
+    {
+      reader.ReadRange(target, size, static_cast<size_t>(rangeStart));
+    }
+
+    return;
+  }
+
+  // the first request covers the header and the frames table of the small objects, and the range if it starts
+  // within them -> no additional request for the uncompressed objects
+  StoredObjectReader stored(reader, (rangeStart < INDEX_PROBE_SIZE ?
+                                     std::max(INDEX_PROBE_SIZE, static_cast<size_t>(rangeStart) + size) :
+                                     INDEX_PROBE_SIZE));
+
+  CompressionHelpers::FramesIndex index;
+  std::vector<char> indexData(static_cast<size_t>(std::min(stored.GetSize(), static_cast<uint64_t>(CompressionHelpers::HEADER_SIZE))));
+  stored.ReadRange(indexData.data(), indexData.size(), 0);
+
+  bool isCompressed = (CompressionHelpers::ParseHeader(index, indexData.data(), indexData.size()) &&
+                       index.GetIndexSize() <= stored.GetSize());
+
+  if (isCompressed)
+  {
+    indexData.resize(index.GetIndexSize());
+    stored.ReadRange(indexData.data() + CompressionHelpers::HEADER_SIZE, indexData.size() - CompressionHelpers::HEADER_SIZE, CompressionHelpers::HEADER_SIZE);
+
+    isCompressed = (CompressionHelpers::ParseFramesTable(index, indexData.data() + CompressionHelpers::HEADER_SIZE, indexData.size() - CompressionHelpers::HEADER_SIZE) &&
+                    index.GetCompressedSize() == stored.GetSize());
+  }
+
+  if (!isCompressed)
+  {
+    stored.ReadRange(target, size, rangeStart);
+    return;
+  }
+
+  uint64_t compressedOffset;
+  size_t compressedSize;
+  index.GetCompressedRange(compressedOffset, compressedSize, rangeStart, size);
+
+  std::vector<char> compressed(compressedSize);
+  stored.ReadRange(compressed.data(), compressedSize, compressedOffset);
+
+  GetDecompressor().DecompressRange(target, size, rangeStart, index, compressed.data(), compressedSize);
+}
+
+
 static OrthancPluginErrorCode StorageReadRange(IStorage* storage,
                                                LogErrorFunction logErrorFunction,
                                                OrthancPluginMemoryBuffer64* target, // Memory buffer where to store the content of the range.  The memory buffer is allocated and freed by Orthanc. The length of the range of interest corresponds to the size of this buffer.
@@ -160,8 +571,6 @@ static OrthancPluginErrorCode StorageReadRange(IStorage* storage,
                                                OrthancPluginContentType type,
                                                uint64_t rangeStart)
 {
-  assert(!cryptoEnabled);
-
   try
   {
 #if ORTHANC_FRAMEWORK_VERSION_IS_ABOVE(1, 12, 11)
@@ -174,8 +583,17 @@ static OrthancPluginErrorCode StorageReadRange(IStorage* storage,
               << " of type " << boost::lexical_cast<std::string>(type);
     
     std::unique_ptr<IStorage::IReader> reader(storage->GetReaderForObject(uuid, type, cryptoEnabled));
-    reader->ReadRange(reinterpret_cast<char*>(target->data), target->size, rangeStart);
-    
+
+    try
+    {
+      ReadPossiblyCompressedRange(*reader, reinterpret_cast<char*>(target->data), target->size, rangeStart);
+    }
+    catch (EncryptionException& ex)
+    {
+      logErrorFunction(storage->GetNameForLogs() + ": error while decrypting range of object " + std::string(uuid) + ": " + ex.what());
+      return OrthancPluginErrorCode_StorageAreaPlugin;
+    }
+
     LOG(INFO) << storage->GetNameForLogs() << ": read range of attachment " << uuid
               << " (" << timer.GetHumanTransferSpeed(true, target->size) << ")";
     return OrthancPluginErrorCode_Success;
@@ -187,11 +605,23 @@ static OrthancPluginErrorCode StorageReadRange(IStorage* storage,
   }
 }
 
+static void AddForegroundRead(const boost::posix_time::ptime& start, uint64_t size)
+{
+  if (backgroundThrottler.get() != NULL &&
+      backgroundThrottler->HasLatencyThreshold() &&
+      size <= FOREGROUND_LATENCY_MAX_SIZE)
+  {
+    backgroundThrottler->AddForegroundRead((boost::posix_time::microsec_clock::universal_time() - start).total_microseconds());
+  }
+}
+
 static OrthancPluginErrorCode StorageReadRange(OrthancPluginMemoryBuffer64* target, // Memory buffer where to store the content of the range.  The memory buffer is allocated and freed by Orthanc. The length of the range of interest corresponds to the size of this buffer.
                                                const char* uuid,
                                                OrthancPluginContentType type,
                                                uint64_t rangeStart)
 {
+  const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
   OrthancPluginErrorCode res = StorageReadRange(primaryStorage.get(),
                                                 (IsHybridModeEnabled() ? LogErrorAsWarning : LogErrorAsError), // log errors as warning on first try
                                                 target,
@@ -208,11 +638,262 @@ static OrthancPluginErrorCode StorageReadRange(OrthancPluginMemoryBuffer64* targ
                            type,
                            rangeStart);
   }
+
+  if (res == OrthancPluginErrorCode_Success)
+  {
+    AddForegroundRead(start, target->size);
+  }
+
   return res;
 }
 
 
 
+// allocates the Orthanc memory buffer that is returned to the core.  The buffer is freed
+// if it has not been released, e.g. if the read fails after the allocation.
+class OrthancBufferAllocator : public IStorage::IBufferAllocator
+{
+  OrthancPluginMemoryBuffer64* target_;
+  bool                         allocated_;
+
+  void Free()
+  {
+    if (allocated_)
+    {
+      OrthancPluginFreeMemoryBuffer64(OrthancPlugins::GetGlobalContext(), target_);
+      allocated_ = false;
+    }
+  }
+
+public:
+  explicit OrthancBufferAllocator(OrthancPluginMemoryBuffer64* target)
+    : target_(target),
+      allocated_(false)
+  {
+  }
+
+  virtual ~OrthancBufferAllocator()
+  {
+    Free();
+  }
+
+  virtual char* Allocate(size_t size) ORTHANC_OVERRIDE
+  {
+    Free();
+
+    if (OrthancPluginCreateMemoryBuffer64(OrthancPlugins::GetGlobalContext(), target_, size) != OrthancPluginErrorCode_Success)
+    {
+      throw StoragePluginException("cannot allocate memory of size " + boost::lexical_cast<std::string>(size) + " bytes");
+    }
+
+    allocated_ = true;
+    return reinterpret_cast<char*>(target_->data);
+  }
+
+  // the core of Orthanc now owns the buffer
+  void Release()
+  {
+    allocated_ = false;
+  }
+};
+
+
+// downloads the segments of an object in a background thread, in order, while the previous segments
+// are being processed by the calling thread.  At most "maxPendingSegments" segments are kept in advance.
+class SegmentsDownloader : public boost::noncopyable
+{
+public:
+  typedef std::pair<uint64_t, size_t>  Segment;  // offset, size
+
+private:
+  IStorage::IReader&                               reader_;
+  std::vector<Segment>                             segments_;
+  size_t                                           maxPendingSegments_;
+
+  boost::mutex                                     mutex_;
+  boost::condition_variable                        condition_;
+  std::deque<boost::shared_ptr<std::vector<char> > > downloaded_;
+  std::string                                      errorMessage_;
+  bool                                             stop_;
+  boost::thread                                    thread_;
+
+  void Worker()
+  {
+    for (size_t i = 0; i < segments_.size(); i++)
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        while (!stop_ && downloaded_.size() >= maxPendingSegments_)
+        {
+          condition_.wait(lock);
+        }
+
+        if (stop_)
+        {
+          return;
+        }
+      }
+
+      try
+      {
+        boost::shared_ptr<std::vector<char> > segment(new std::vector<char>(segments_[i].second));
+        reader_.ReadRange(segment->data(), segment->size(), static_cast<size_t>(segments_[i].first));
+
+        boost::mutex::scoped_lock lock(mutex_);
+        downloaded_.push_back(segment);
+        condition_.notify_all();
+      }
+      catch (std::exception& ex)
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        errorMessage_ = ex.what();
+        condition_.notify_all();
+        return;
+      }
+    }
+  }
+
+public:
+  SegmentsDownloader(IStorage::IReader& reader,
+                     const std::vector<Segment>& segments,
+                     size_t maxPendingSegments)
+    : reader_(reader),
+      segments_(segments),
+      maxPendingSegments_(std::max(static_cast<size_t>(1), maxPendingSegments)),
+      stop_(false)
+  {
+    thread_ = boost::thread(&SegmentsDownloader::Worker, this);
+  }
+
+  ~SegmentsDownloader()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stop_ = true;
+      condition_.notify_all();
+    }
+
+    thread_.join();
+  }
+
+  boost::shared_ptr<std::vector<char> > WaitNextSegment()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    while (downloaded_.empty() && errorMessage_.empty())
+    {
+      condition_.wait(lock);
+    }
+
+    if (downloaded_.empty())
+    {
+      throw StoragePluginException(errorMessage_);
+    }
+
+    boost::shared_ptr<std::vector<char> > segment = downloaded_.front();
+    downloaded_.pop_front();
+    condition_.notify_all();
+
+    return segment;
+  }
+};
+
+
+// decrypts the chunks [firstChunk, endChunk) of "header" that are all contained in "encrypted"
+static void DecryptChunks(char* plainText, const EncryptionHelpers::ChunkedHeader& header, uint64_t firstChunk, uint64_t endChunk, const char* encrypted, size_t encryptedSize)
+{
+  const uint64_t fromOffset = firstChunk * header.GetChunkSize();
+  const uint64_t toOffset = std::min(endChunk * header.GetChunkSize(), header.GetPlainTextSize());
+
+  crypto->DecryptRange(plainText + fromOffset, static_cast<size_t>(toOffset - fromOffset), fromOffset, header, encrypted, encryptedSize);
+}
+
+
+// reads and decrypts an encrypted object whose first bytes have already been received.  The objects that are encrypted
+// in chunks are decrypted segment by segment while the next segments are being downloaded, with a bounded memory usage.
+static void ReadEncryptedWholeInSegments(IStorage::IReader& reader,
+                                         IStorage::IBufferAllocator& allocator,
+                                         std::vector<char>& firstBytes,
+                                         size_t fileSize)
+{
+  EncryptionHelpers::ChunkedHeader header;
+
+  if (!EncryptionHelpers::ParseChunkedHeader(header, firstBytes.data(), firstBytes.size()))
+  {
+    // legacy "A1" format: the object can only be decrypted as a whole
+    const size_t receivedSize = firstBytes.size();
+    firstBytes.resize(fileSize);
+    reader.ReadRange(firstBytes.data() + receivedSize, fileSize - receivedSize, receivedSize);
+
+    crypto->Decrypt(allocator.Allocate(EncryptionHelpers::GetPlainTextSize(firstBytes.data(), fileSize)), firstBytes.data(), fileSize);
+    return;
+  }
+
+  if (header.GetEncryptedSize() != fileSize)
+  {
+    throw EncryptionException("Unable to decrypt data, the size of the file (" + boost::lexical_cast<std::string>(fileSize) +
+                              " bytes) does not match its header (" + boost::lexical_cast<std::string>(header.GetEncryptedSize()) + " bytes)");
+  }
+
+  char* plainText = allocator.Allocate(static_cast<size_t>(header.GetPlainTextSize()));
+
+  const uint64_t encryptedChunkSize = header.GetChunkSize() + EncryptionHelpers::INTEGRITY_CHECK_TAG_SIZE;
+  const uint64_t chunksCount = header.GetChunksCount();
+
+  // the chunks that have been entirely received with the first bytes
+  const uint64_t receivedChunks = std::min(chunksCount, (firstBytes.size() - EncryptionHelpers::CHUNKED_HEADER_SIZE) / encryptedChunkSize);
+
+  std::vector<SegmentsDownloader::Segment> segments;
+  std::vector<uint64_t> segmentsFirstChunk;
+
+  const uint64_t chunksPerSegment = std::max(static_cast<uint64_t>(1), STREAMING_SEGMENT_SIZE / encryptedChunkSize);
+
+  for (uint64_t chunk = receivedChunks; chunk < chunksCount; chunk += chunksPerSegment)
+  {
+    const uint64_t endChunk = std::min(chunk + chunksPerSegment, chunksCount);
+    const uint64_t segmentStart = EncryptionHelpers::CHUNKED_HEADER_SIZE + chunk * encryptedChunkSize;
+    const uint64_t segmentEnd = std::min(EncryptionHelpers::CHUNKED_HEADER_SIZE + endChunk * encryptedChunkSize, static_cast<uint64_t>(fileSize));
+
+    segments.push_back(std::make_pair(segmentStart, static_cast<size_t>(segmentEnd - segmentStart)));
+    segmentsFirstChunk.push_back(chunk);
+  }
+
+  SegmentsDownloader downloader(reader, segments, STREAMING_PENDING_SEGMENTS);
+
+  if (receivedChunks > 0)
+  {
+    DecryptChunks(plainText, header, 0, receivedChunks, firstBytes.data() + EncryptionHelpers::CHUNKED_HEADER_SIZE,
+                  static_cast<size_t>(receivedChunks * encryptedChunkSize));
+  }
+
+  for (size_t i = 0; i < segments.size(); i++)
+  {
+    boost::shared_ptr<std::vector<char> > segment = downloader.WaitNextSegment();
+    DecryptChunks(plainText, header, segmentsFirstChunk[i], std::min(segmentsFirstChunk[i] + chunksPerSegment, chunksCount),
+                  segment->data(), segment->size());
+  }
+}
+
+
+// replaces the content of the target buffer by its decompressed content if the object is compressed
+static void DecompressIfNeeded(OrthancBufferAllocator& targetAllocator,
+                               OrthancPluginMemoryBuffer64* target)
+{
+  const char* content = reinterpret_cast<const char*>(target->data);
+
+  if (CompressionHelpers::IsCompressed(content, target->size))
+  {
+    // the compressed content must be copied since allocating the new target buffer frees the current one
+    std::vector<char> compressed(content, content + target->size);
+
+    const size_t uncompressedSize = static_cast<size_t>(CompressionHelpers::GetUncompressedSize(compressed.data(), compressed.size()));
+    char* uncompressed = targetAllocator.Allocate(uncompressedSize);
+    GetDecompressor().Decompress(uncompressed, uncompressedSize, compressed.data(), compressed.size());
+  }
+}
+
+
 static OrthancPluginErrorCode StorageReadWhole(IStorage* storage,
                                                LogErrorFunction logErrorFunction,
                                                OrthancPluginMemoryBuffer64* target, // Memory buffer where to store the content of the file. It must be allocated by the plugin using OrthancPluginCreateMemoryBuffer64(). The core of Orthanc will free it.
@@ -231,48 +912,53 @@ static OrthancPluginErrorCode StorageReadWhole(IStorage* storage,
               << " of type " << boost::lexical_cast<std::string>(type);
     std::unique_ptr<IStorage::IReader> reader(storage->GetReaderForObject(uuid, type, cryptoEnabled));
 
-    size_t fileSize = reader->GetSize();
-    size_t size;
+    size_t fileSize;
 
     if (cryptoEnabled)
     {
-      size = fileSize - crypto->OVERHEAD_SIZE;
-    }
-    else
-    {
-      size = fileSize;
-    }
-
-    if (size <= 0)
-    {
-      logErrorFunction(storage->GetNameForLogs() + ": error while reading object " + std::string(uuid) + ", size of file is too small: " + boost::lexical_cast<std::string>(fileSize) + " bytes");
-      return OrthancPluginErrorCode_StorageAreaPlugin;
-    }
-
-    if (OrthancPluginCreateMemoryBuffer64(OrthancPlugins::GetGlobalContext(), target, size) != OrthancPluginErrorCode_Success)
-    {
-      logErrorFunction(storage->GetNameForLogs() + ": error while reading object " + std::string(uuid) + ", cannot allocate memory of size " + boost::lexical_cast<std::string>(size) + " bytes");
-      return OrthancPluginErrorCode_StorageAreaPlugin;
-    }
+      // the small objects are read at once, the first segment of the large ones gives their size
+      std::vector<char> encrypted;
+      fileSize = reader->ReadFirstBytes(encrypted, STREAMING_SEGMENT_SIZE);
 
-    if (cryptoEnabled)
-    {
-      std::vector<char> encrypted(fileSize);
-      reader->ReadWhole(encrypted.data(), fileSize);
+      OrthancBufferAllocator targetAllocator(target);
 
       try
       {
-        crypto->Decrypt(reinterpret_cast<char*>(target->data), encrypted.data(), fileSize);
+        if (encrypted.size() < fileSize)
+        {
+          ReadEncryptedWholeInSegments(*reader, targetAllocator, encrypted, fileSize);
+        }
+        else
+        {
+          char* plainText = targetAllocator.Allocate(EncryptionHelpers::GetPlainTextSize(encrypted.data(), fileSize));
+          crypto->Decrypt(plainText, encrypted.data(), fileSize);
+        }
+
+        DecompressIfNeeded(targetAllocator, target);
       }
       catch (EncryptionException& ex)
       {
         logErrorFunction(storage->GetNameForLogs() + ": error while decrypting object " + std::string(uuid) + ": " + ex.what());
         return OrthancPluginErrorCode_StorageAreaPlugin;
       }
+
+      targetAllocator.Release();
     }
     else
     {
-      reader->ReadWhole(reinterpret_cast<char*>(target->data), fileSize);
+      // the target buffer is allocated as soon as the size of the object is known
+      OrthancBufferAllocator targetAllocator(target);
+      fileSize = reader->ReadWholeWithAllocator(targetAllocator);
+
+      if (fileSize == 0)
+      {
+        logErrorFunction(storage->GetNameForLogs() + ": error while reading object " + std::string(uuid) + ", size of file is too small: " + boost::lexical_cast<std::string>(fileSize) + " bytes");
+        return OrthancPluginErrorCode_StorageAreaPlugin;
+      }
+
+      DecompressIfNeeded(targetAllocator, target);
+
+      targetAllocator.Release();
     }
 
     LOG(INFO) << storage->GetNameForLogs() << ": read whole attachment " << uuid
@@ -291,6 +977,15 @@ static OrthancPluginErrorCode StorageReadWhole(OrthancPluginMemoryBuffer64* targ
                                                const char* uuid,
                                                OrthancPluginContentType type)
 {
+  if (memoryCache.get() != NULL &&
+      memoryCache->Read(target, uuid, type))
+  {
+    LOG(INFO) << "read whole attachment " << uuid << " from the memory cache";
+    return OrthancPluginErrorCode_Success;
+  }
+
+  const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
   OrthancPluginErrorCode res = StorageReadWhole(primaryStorage.get(),
                                                 (IsHybridModeEnabled() ? LogErrorAsWarning : LogErrorAsError), // log errors as warning on first try
                                                 target,
@@ -305,27 +1000,21 @@ static OrthancPluginErrorCode StorageReadWhole(OrthancPluginMemoryBuffer64* targ
                            uuid,
                            type);
   }
-  return res;
-}
 
-static OrthancPluginErrorCode StorageReadWholeLegacy(void** content,
-                                                     int64_t* size,
-                                                     const char* uuid,
-                                                     OrthancPluginContentType type)
-{
-  OrthancPluginMemoryBuffer64 buffer;
-  OrthancPluginErrorCode result = StorageReadWhole(&buffer, uuid, type); // will allocate OrthancPluginMemoryBuffer64
+  if (res == OrthancPluginErrorCode_Success)
+  {
+    AddForegroundRead(start, target->size);
+  }
 
-  if (result == OrthancPluginErrorCode_Success)
+  if (res == OrthancPluginErrorCode_Success &&
+      memoryCache.get() != NULL)
   {
-    *size = buffer.size;
-    *content = buffer.data; // orthanc will free the buffer (we don't have to delete it ourselves)
+    memoryCache->Add(uuid, type, target->data, target->size);
   }
 
-  return result;
+  return res;
 }
 
-
 static OrthancPluginErrorCode StorageRemove(IStorage* storage,
                                             LogErrorFunction logErrorFunction,
                                             const char* uuid,
@@ -354,6 +1043,24 @@ static OrthancPluginErrorCode StorageRemove(IStorage* storage,
 static OrthancPluginErrorCode StorageRemove(const char* uuid,
                                             OrthancPluginContentType type)
 {
+  if (memoryCache.get() != NULL)
+  {
+    memoryCache->Invalidate(uuid, type);
+  }
+
+  if (deletionQueue.get() != NULL)
+  {
+    try
+    {
+      deletionQueue->Enqueue(uuid, type, cryptoEnabled);
+      return OrthancPluginErrorCode_Success;
+    }
+    catch (StoragePluginException& ex)
+    {
+      LOG(WARNING) << StoragePluginFactory::GetStoragePluginName() << ": unable to queue the deletion of " << uuid << ", deleting it synchronously: " << ex.what();
+    }
+  }
+
   OrthancPluginErrorCode res = StorageRemove(primaryStorage.get(),
                                              (IsHybridModeEnabled() ? LogErrorAsWarning : LogErrorAsError), // log errors as warning on first try
                                              uuid,
@@ -370,9 +1077,11 @@ static OrthancPluginErrorCode StorageRemove(const char* uuid,
 }
 
 
-static MoveStorageJob* CreateMoveStorageJob(const std::string& targetStorage, const std::vector<std::string>& instances, const Json::Value& resourcesForJobContent)
+static MoveStorageJob* CreateMoveStorageJob(const std::string& targetStorage, const std::vector<std::string>& resources, const std::string& resourcesLevel,
+                                            const Json::Value& resourcesForJobContent)
 {
-  std::unique_ptr<MoveStorageJob> job(new MoveStorageJob(targetStorage, instances, resourcesForJobContent, cryptoEnabled));
+  std::unique_ptr<MoveStorageJob> job(new MoveStorageJob(targetStorage, resources, resourcesLevel, resourcesForJobContent, cryptoEnabled,
+                                                         moveStorageThreadsCount, moveStorageMaxInFlightSize));
 
   if (hybridMode == HybridMode_WriteToFileSystem)
   {
@@ -383,22 +1092,33 @@ static MoveStorageJob* CreateMoveStorageJob(const std::string& targetStorage, co
     job->SetStorages(secondaryStorage.get(), primaryStorage.get());
   }
 
+  job->SetThrottler(backgroundThrottler.get());
+
   return job.release();
 }
 
 
-static void AddResourceForJobContent(Json::Value& resourcesForJobContent /* out */, Orthanc::ResourceType resourceType, const std::string& resourceId)
+static MoveStorageQueryJob* CreateMoveStorageQueryJob(const std::string& targetStorage, const Json::Value& query, const std::string& lastUpdateBefore,
+                                                      unsigned int threadsCount, uint64_t maxBandwidth)
 {
-  const char* resourceGroup = Orthanc::GetResourceTypeText(resourceType, true, true);
+  std::unique_ptr<MoveStorageQueryJob> job(new MoveStorageQueryJob(targetStorage, query, lastUpdateBefore, cryptoEnabled,
+                                                                   threadsCount, moveStorageMaxInFlightSize, maxBandwidth));
 
-  if (!resourcesForJobContent.isMember(resourceGroup))
+  if (hybridMode == HybridMode_WriteToFileSystem)
+  {
+    job->SetStorages(primaryStorage.get(), secondaryStorage.get());
+  }
+  else
   {
-    resourcesForJobContent[resourceGroup] = Json::arrayValue;
+    job->SetStorages(secondaryStorage.get(), primaryStorage.get());
   }
-  
-  resourcesForJobContent[resourceGroup].append(resourceId);
+
+  job->SetThrottler(backgroundThrottler.get());
+
+  return job.release();
 }
 
+
 void MoveStorage(OrthancPluginRestOutput* output,
                  const char* /*url*/,
                  const OrthancPluginHttpRequest* request)
@@ -418,8 +1138,8 @@ void MoveStorage(OrthancPluginRestOutput* output,
     throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "A JSON payload was expected");
   }
 
-  std::vector<std::string> instances;
-  Json::Value resourcesForJobContent;
+  std::vector<std::string> resources;
+  std::string resourcesLevel;
 
   if (requestPayload.type() != Json::objectValue ||
       !requestPayload.isMember(KEY_RESOURCES) ||
@@ -443,60 +1163,225 @@ void MoveStorage(OrthancPluginRestOutput* output,
       "\" set to \"" + std::string(STORAGE_TYPE_FILE_SYSTEM) + "\" or \"" + std::string(STORAGE_TYPE_OBJECT_STORAGE) +  "\"");
   }
 
+  if (requestPayload.isMember(KEY_LEVEL))
+  {
+    // optional hint to avoid probing the level of each resource
+    if (requestPayload[KEY_LEVEL].type() != Json::stringValue)
+    {
+      throw Orthanc::OrthancException(
+        Orthanc::ErrorCode_BadFileFormat,
+        "The field \"" + std::string(KEY_LEVEL) + "\" of a request to the move-storage endpoint must be "
+        "\"Patient\", \"Study\", \"Series\" or \"Instance\"");
+    }
+
+    resourcesLevel = Orthanc::GetResourceTypeText(Orthanc::StringToResourceType(requestPayload[KEY_LEVEL].asCString()), false, true);
+  }
+
   const std::string& targetStorage = requestPayload[KEY_TARGET_STORAGE].asString();
-  const Json::Value& resources = requestPayload[KEY_RESOURCES];
+  const Json::Value& resourcesList = requestPayload[KEY_RESOURCES];
 
-  // Extract information about all the child instances
-  for (Json::Value::ArrayIndex i = 0; i < resources.size(); i++)
+  // The resources are only expanded into their child instances by the steps of the job
+  for (Json::Value::ArrayIndex i = 0; i < resourcesList.size(); i++)
   {
-    if (resources[i].type() != Json::stringValue)
+    if (resourcesList[i].type() != Json::stringValue)
     {
       throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
     }
 
-    std::string resource = resources[i].asString();
+    std::string resource = resourcesList[i].asString();
     if (resource.empty())
     {
       throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
     }
 
-    // Test whether this resource is an instance
-    Json::Value tmpResource;
-    Json::Value tmpInstances;
-    if (OrthancPlugins::RestApiGet(tmpResource, "/instances/" + resource, false))
+    resources.push_back(resource);
+  }
+
+  LOG(INFO) << "Moving " << resources.size() << " resources to " << targetStorage;
+
+  std::unique_ptr<MoveStorageJob> job(CreateMoveStorageJob(targetStorage, resources, resourcesLevel, Json::objectValue));
+
+  OrthancPlugins::OrthancJob::SubmitFromRestApiPost(output, requestPayload, job.release());
+}
+
+static unsigned int GetOptionalUnsignedInteger(const Json::Value& payload, const char* key, unsigned int defaultValue)
+{
+  if (!payload.isMember(key))
+  {
+    return defaultValue;
+  }
+  else if (payload[key].isUInt())
+  {
+    return payload[key].asUInt();
+  }
+  else
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "The field \"" + std::string(key) + "\" must be a positive integer");
+  }
+}
+
+void MoveStorageQuery(OrthancPluginRestOutput* output,
+                      const char* /*url*/,
+                      const OrthancPluginHttpRequest* request)
+{
+  OrthancPluginContext* context = OrthancPlugins::GetGlobalContext();
+
+  if (request->method != OrthancPluginHttpMethod_Post)
+  {
+    OrthancPluginSendMethodNotAllowed(context, output, "POST");
+    return;
+  }
+
+  Json::Value requestPayload;
+
+  if (!OrthancPlugins::ReadJson(requestPayload, request->body, request->bodySize) ||
+      requestPayload.type() != Json::objectValue)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "A JSON object was expected");
+  }
+
+  if (!requestPayload.isMember(KEY_TARGET_STORAGE)
+      || requestPayload[KEY_TARGET_STORAGE].type() != Json::stringValue
+      || (requestPayload[KEY_TARGET_STORAGE].asString() != STORAGE_TYPE_FILE_SYSTEM && requestPayload[KEY_TARGET_STORAGE].asString() != STORAGE_TYPE_OBJECT_STORAGE))
+  {
+    throw Orthanc::OrthancException(
+      Orthanc::ErrorCode_BadFileFormat,
+      "A request to the move-storage/query endpoint must provide a JSON object "
+      "with the field \"" + std::string(KEY_TARGET_STORAGE) + 
+      "\" set to \"" + std::string(STORAGE_TYPE_FILE_SYSTEM) + "\" or \"" + std::string(STORAGE_TYPE_OBJECT_STORAGE) +  "\"");
+  }
+
+  // the thresholds are converted to absolute dates, so that the selection does not drift if the job is resumed later
+  Json::Value query = Json::objectValue;
+  std::string lastUpdateBefore;
+
+  if (requestPayload.isMember(KEY_STUDY_DATE_OLDER_THAN))
+  {
+    const unsigned int days = GetOptionalUnsignedInteger(requestPayload, KEY_STUDY_DATE_OLDER_THAN, 0);
+    query["StudyDate"] = "-" + boost::gregorian::to_iso_string(boost::gregorian::day_clock::universal_day() - boost::gregorian::days(days + 1));
+  }
+
+  if (requestPayload.isMember(KEY_MODALITIES))
+  {
+    const Json::Value& modalities = requestPayload[KEY_MODALITIES];
+
+    if (modalities.type() != Json::arrayValue ||
+        modalities.size() == 0)
     {
-      instances.push_back(resource);
-      AddResourceForJobContent(resourcesForJobContent, Orthanc::ResourceType_Instance, resource);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "The field \"" + std::string(KEY_MODALITIES) + "\" must be a non-empty list of modalities");
     }
-    // This was not an instance, successively try with series/studies/patients
-    else if ((OrthancPlugins::RestApiGet(tmpResource, "/series/" + resource, false) &&
-              OrthancPlugins::RestApiGet(tmpInstances, "/series/" + resource + "/instances", false)) ||
-             (OrthancPlugins::RestApiGet(tmpResource, "/studies/" + resource, false) &&
-              OrthancPlugins::RestApiGet(tmpInstances, "/studies/" + resource + "/instances", false)) ||
-             (OrthancPlugins::RestApiGet(tmpResource, "/patients/" + resource, false) &&
-              OrthancPlugins::RestApiGet(tmpInstances, "/patients/" + resource + "/instances", false)))
+
+    std::string modalitiesInStudy;
+    for (Json::Value::ArrayIndex i = 0; i < modalities.size(); i++)
     {
-      if (tmpInstances.type() != Json::arrayValue)
+      if (modalities[i].type() != Json::stringValue ||
+          modalities[i].asString().empty())
       {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "The field \"" + std::string(KEY_MODALITIES) + "\" must be a non-empty list of modalities");
       }
 
-      AddResourceForJobContent(resourcesForJobContent, Orthanc::StringToResourceType(tmpResource["Type"].asString().c_str()), resource);
-
-      for (Json::Value::ArrayIndex j = 0; j < tmpInstances.size(); j++)
-      {
-        instances.push_back(tmpInstances[j]["ID"].asString());
-      }
+      modalitiesInStudy += (i == 0 ? "" : "\\") + modalities[i].asString();
     }
-    else
-    {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
-    }   
+
+    query["ModalitiesInStudy"] = modalitiesInStudy;
+  }
+
+  if (requestPayload.isMember(KEY_LAST_UPDATE_OLDER_THAN))
+  {
+    // Orthanc does not record the last access to the studies, only their last update
+    const unsigned int days = GetOptionalUnsignedInteger(requestPayload, KEY_LAST_UPDATE_OLDER_THAN, 0);
+    lastUpdateBefore = boost::posix_time::to_iso_string(boost::posix_time::second_clock::universal_time() - boost::gregorian::days(days));
+  }
+
+  if (query.empty() && lastUpdateBefore.empty())
+  {
+    throw Orthanc::OrthancException(
+      Orthanc::ErrorCode_BadFileFormat,
+      "A request to the move-storage/query endpoint must provide at least one of the fields \"" + std::string(KEY_STUDY_DATE_OLDER_THAN) +
+      "\", \"" + std::string(KEY_MODALITIES) + "\" or \"" + std::string(KEY_LAST_UPDATE_OLDER_THAN) + "\"");
+  }
+
+  const unsigned int threadsCount = std::max(1u, GetOptionalUnsignedInteger(requestPayload, KEY_THREADS, moveStorageThreadsCount));
+  const uint64_t maxBandwidth = static_cast<uint64_t>(GetOptionalUnsignedInteger(requestPayload, KEY_MAX_BANDWIDTH, 0)) * 1024 * 1024;  // in MB/s
+
+  LOG(INFO) << "Moving the studies that match " << query.toStyledString() << " to " << requestPayload[KEY_TARGET_STORAGE].asString();
+
+  std::unique_ptr<MoveStorageQueryJob> job(CreateMoveStorageQueryJob(requestPayload[KEY_TARGET_STORAGE].asString(), query, lastUpdateBefore,
+                                                                     threadsCount, maxBandwidth));
+
+  OrthancPlugins::OrthancJob::SubmitFromRestApiPost(output, requestPayload, job.release());
+}
+
+void TrainCompressionDictionary(OrthancPluginRestOutput* output,
+                                const char* /*url*/,
+                                const OrthancPluginHttpRequest* request)
+{
+  OrthancPluginContext* context = OrthancPlugins::GetGlobalContext();
+
+  if (request->method != OrthancPluginHttpMethod_Post)
+  {
+    OrthancPluginSendMethodNotAllowed(context, output, "POST");
+    return;
+  }
+
+  Json::Value requestPayload;
+
+  if (!OrthancPlugins::ReadJson(requestPayload, request->body, request->bodySize))
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "A JSON payload was expected");
   }
 
-  LOG(INFO) << "Moving " << instances.size() << " instances to " << targetStorage;
+  OrthancPluginContentType contentType;
 
-  std::unique_ptr<MoveStorageJob> job(CreateMoveStorageJob(targetStorage, instances, resourcesForJobContent));
+  if (requestPayload.type() != Json::objectValue ||
+      !requestPayload.isMember(KEY_CONTENT_TYPE) ||
+      requestPayload[KEY_CONTENT_TYPE].type() != Json::stringValue ||
+      !LookupContentType(contentType, requestPayload[KEY_CONTENT_TYPE].asString()))
+  {
+    throw Orthanc::OrthancException(
+      Orthanc::ErrorCode_BadFileFormat,
+      "A request to the train-dictionary endpoint must provide a JSON object "
+      "with the field \"" + std::string(KEY_CONTENT_TYPE) + "\" set to \"DicomAsJson\", \"DicomUntilPixelData\" or \"Dicom\"");
+  }
+
+  unsigned int samplesCount = 1000;
+  unsigned int dictionarySize = 32;  // in KB
+
+  if ((requestPayload.isMember(KEY_SAMPLES_COUNT) && !requestPayload[KEY_SAMPLES_COUNT].isUInt()) ||
+      (requestPayload.isMember(KEY_DICTIONARY_SIZE) && !requestPayload[KEY_DICTIONARY_SIZE].isUInt()))
+  {
+    throw Orthanc::OrthancException(
+      Orthanc::ErrorCode_BadFileFormat,
+      "The fields \"" + std::string(KEY_SAMPLES_COUNT) + "\" and \"" + std::string(KEY_DICTIONARY_SIZE) + "\" must be positive integers");
+  }
+
+  if (requestPayload.isMember(KEY_SAMPLES_COUNT))
+  {
+    samplesCount = requestPayload[KEY_SAMPLES_COUNT].asUInt();
+  }
+
+  if (requestPayload.isMember(KEY_DICTIONARY_SIZE))
+  {
+    dictionarySize = requestPayload[KEY_DICTIONARY_SIZE].asUInt();
+  }
+
+  // the samples are taken from the oldest instances
+  Json::Value tmpInstances;
+  if (!OrthancPlugins::RestApiGet(tmpInstances, "/instances?since=0&limit=" + boost::lexical_cast<std::string>(samplesCount), false) ||
+      tmpInstances.type() != Json::arrayValue)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+  }
+
+  std::vector<std::string> instances;
+  for (Json::Value::ArrayIndex i = 0; i < tmpInstances.size(); i++)
+  {
+    instances.push_back(tmpInstances[i].asString());
+  }
+
+  LOG(INFO) << "Training a compression dictionary on " << instances.size() << " instances";
+
+  std::unique_ptr<DictionaryTrainingJob> job(new DictionaryTrainingJob(*compression, contentType, instances, static_cast<size_t>(dictionarySize) * 1024));
 
   OrthancPlugins::OrthancJob::SubmitFromRestApiPost(output, requestPayload, job.release());
 }
@@ -512,7 +1397,8 @@ OrthancPluginJob* JobUnserializer(const char* jobType,
 
   std::string type(jobType);
 
-  if (type != JOB_TYPE_MOVE_STORAGE)
+  if (type != JOB_TYPE_MOVE_STORAGE &&
+      type != JOB_TYPE_MOVE_STORAGE_QUERY)
   {
     return NULL;
   }
@@ -528,14 +1414,20 @@ OrthancPluginJob* JobUnserializer(const char* jobType,
 
       if (type == JOB_TYPE_MOVE_STORAGE)
       {
-        std::vector<std::string> instances;
-
-        for (size_t i = 0; i < source[KEY_INSTANCES].size(); ++i)
-        {
-          instances.push_back(source[KEY_INSTANCES][static_cast<int>(i)].asString());
-        }
+        const std::string resourcesLevel = (source.isMember(KEY_LEVEL) ? source[KEY_LEVEL].asString() : "");
 
-        job.reset(CreateMoveStorageJob(source[KEY_TARGET_STORAGE].asString(), instances, source[KEY_CONTENT]));
+        // the resources, the instances and the content are restored with the checkpoint
+        std::unique_ptr<MoveStorageJob> moveJob(CreateMoveStorageJob(source[KEY_TARGET_STORAGE].asString(), std::vector<std::string>(), resourcesLevel, Json::objectValue));
+        moveJob->RestoreCheckpoint(source);
+        job.reset(moveJob.release());
+      }
+      else if (type == JOB_TYPE_MOVE_STORAGE_QUERY)
+      {
+        std::unique_ptr<MoveStorageQueryJob> queryJob(CreateMoveStorageQueryJob(source[KEY_TARGET_STORAGE].asString(), source[KEY_QUERY],
+                                                                                source[KEY_LAST_UPDATE_BEFORE].asString(),
+                                                                                source[KEY_THREADS].asUInt(), source[KEY_MAX_BANDWIDTH].asUInt64()));
+        queryJob->RestoreCheckpoint(source);
+        job.reset(queryJob.release());
       }
 
       if (job.get() == NULL)
@@ -604,6 +1496,12 @@ extern "C"
     {
       const char* pluginSectionName = StoragePluginFactory::GetConfigurationSectionName();
       static const char* const ENCRYPTION_SECTION = "StorageEncryption";
+      static const char* const LOCAL_CACHE_SECTION = "LocalCache";
+      static const char* const MEMORY_CACHE_SECTION = "MemoryCache";
+      static const char* const WRITE_BEHIND_SECTION = "WriteBehind";
+      static const char* const DELETION_QUEUE_SECTION = "DeletionQueue";
+      static const char* const COMPRESSION_SECTION = "StorageCompression";
+      static const char* const MOVE_STORAGE_SECTION = "MoveStorage";
 
       if (!orthancConfig.IsSection(pluginSectionName))
       {
@@ -670,6 +1568,65 @@ extern "C"
       }
 
       objectStoragePlugin->SetRootPath(objectsRootPath);
+      objectStorage = objectStoragePlugin.get();  // owned by the decorators or by the primary/secondary storage
+
+      if (pluginSection.IsSection(WRITE_BEHIND_SECTION))
+      {
+        OrthancPlugins::OrthancConfiguration writeBehindSection;
+        pluginSection.GetSection(writeBehindSection, WRITE_BEHIND_SECTION);
+
+        if (writeBehindSection.GetBooleanValue("Enable", true))
+        {
+          std::string journalDirectory;
+          if (!writeBehindSection.LookupStringValue(journalDirectory, "JournalDirectory"))
+          {
+            LOG(ERROR) << StoragePluginFactory::GetStoragePluginName() << ": WriteBehind/JournalDirectory configuration missing.  Unable to initialize plugin";
+            return -1;
+          }
+
+          const unsigned int threadsCount = writeBehindSection.GetUnsignedIntegerValue("Threads", 4);
+          const bool fsync = writeBehindSection.GetBooleanValue("Fsync", true);
+
+          try
+          {
+            objectStoragePlugin.reset(new WriteBehindStorage(objectStoragePlugin.release(), journalDirectory, threadsCount, fsync));
+          }
+          catch (fs::filesystem_error& e)
+          {
+            LOG(ERROR) << StoragePluginFactory::GetStoragePluginName() << ": unable to initialize the write-behind journal in " << journalDirectory << ": " << e.what();
+            return -1;
+          }
+        }
+      }
+
+      if (pluginSection.IsSection(LOCAL_CACHE_SECTION))
+      {
+        OrthancPlugins::OrthancConfiguration cacheSection;
+        pluginSection.GetSection(cacheSection, LOCAL_CACHE_SECTION);
+
+        if (cacheSection.GetBooleanValue("Enable", true))
+        {
+          std::string cacheDirectory;
+          if (!cacheSection.LookupStringValue(cacheDirectory, "Directory"))
+          {
+            LOG(ERROR) << StoragePluginFactory::GetStoragePluginName() << ": LocalCache/Directory configuration missing.  Unable to initialize plugin";
+            return -1;
+          }
+
+          const uint64_t maxCacheSize = static_cast<uint64_t>(cacheSection.GetUnsignedIntegerValue("MaxSize", 1024)) * 1024 * 1024;  // in MB
+          const bool admitOnFirstAccess = cacheSection.GetBooleanValue("AdmitOnFirstAccess", false);
+
+          try
+          {
+            objectStoragePlugin.reset(new DiskCacheStorage(objectStoragePlugin.release(), cacheDirectory, maxCacheSize, admitOnFirstAccess));
+          }
+          catch (fs::filesystem_error& e)
+          {
+            LOG(ERROR) << StoragePluginFactory::GetStoragePluginName() << ": unable to initialize the local cache in " << cacheDirectory << ": " << e.what();
+            return -1;
+          }
+        }
+      }
 
       std::unique_ptr<IStorage> fileSystemStoragePlugin;
       if (IsHybridModeEnabled())
@@ -704,6 +1661,153 @@ extern "C"
         secondaryStorage.reset(objectStoragePlugin.release());
       }
 
+      if (pluginSection.IsSection(DELETION_QUEUE_SECTION))
+      {
+        OrthancPlugins::OrthancConfiguration deletionQueueSection;
+        pluginSection.GetSection(deletionQueueSection, DELETION_QUEUE_SECTION);
+
+        if (deletionQueueSection.GetBooleanValue("Enable", true))
+        {
+          std::string journalDirectory;
+          if (!deletionQueueSection.LookupStringValue(journalDirectory, "JournalDirectory"))
+          {
+            LOG(ERROR) << StoragePluginFactory::GetStoragePluginName() << ": DeletionQueue/JournalDirectory configuration missing.  Unable to initialize plugin";
+            return -1;
+          }
+
+          const unsigned int threadsCount = deletionQueueSection.GetUnsignedIntegerValue("Threads", 2);
+          const size_t batchSize = deletionQueueSection.GetUnsignedIntegerValue("BatchSize", 1000);
+
+          try
+          {
+            deletionQueue.reset(new DeletionQueue(*primaryStorage, secondaryStorage.get(), journalDirectory, threadsCount, batchSize));
+          }
+          catch (fs::filesystem_error& e)
+          {
+            LOG(ERROR) << StoragePluginFactory::GetStoragePluginName() << ": unable to initialize the deletion journal in " << journalDirectory << ": " << e.what();
+            return -1;
+          }
+          catch (StoragePluginException& e)
+          {
+            LOG(ERROR) << StoragePluginFactory::GetStoragePluginName() << ": " << e.what();
+            return -1;
+          }
+        }
+      }
+
+      if (pluginSection.IsSection(MEMORY_CACHE_SECTION))
+      {
+        OrthancPlugins::OrthancConfiguration cacheSection;
+        pluginSection.GetSection(cacheSection, MEMORY_CACHE_SECTION);
+
+        if (cacheSection.GetBooleanValue("Enable", true))
+        {
+          const size_t maxCacheSize = static_cast<size_t>(cacheSection.GetUnsignedIntegerValue("MaxSize", 64)) * 1024 * 1024;  // in MB
+          const unsigned int shardsCount = cacheSection.GetUnsignedIntegerValue("Shards", 16);
+
+          memoryCache.reset(new MemoryObjectsCache(maxCacheSize, shardsCount));
+
+          Json::Value maxObjectSizes = cacheSection.GetJson()["MaxObjectSize"];  // in KB, per content type
+          if (maxObjectSizes.isNull())
+          {
+            maxObjectSizes["DicomUntilPixelData"] = 256;
+            maxObjectSizes["DicomAsJson"] = 256;
+          }
+
+          if (!maxObjectSizes.isObject())
+          {
+            LOG(ERROR) << StoragePluginFactory::GetStoragePluginName() << ": MemoryCache/MaxObjectSize must be a dictionary";
+            return -1;
+          }
+
+          Json::Value::Members members = maxObjectSizes.getMemberNames();
+          for (size_t i = 0; i < members.size(); i++)
+          {
+            OrthancPluginContentType contentType;
+            if (!LookupContentType(contentType, members[i]) || !maxObjectSizes[members[i]].isUInt())
+            {
+              LOG(ERROR) << StoragePluginFactory::GetStoragePluginName() << ": MemoryCache/MaxObjectSize: invalid entry for \"" << members[i] << "\"";
+              return -1;
+            }
+
+            memoryCache->SetMaxObjectSize(contentType, static_cast<size_t>(maxObjectSizes[members[i]].asUInt()) * 1024);
+          }
+
+          LOG(WARNING) << StoragePluginFactory::GetStoragePluginName() << ": memory cache enabled (" << (maxCacheSize / (1024 * 1024)) << " MB)";
+        }
+      }
+
+      if (pluginSection.IsSection(COMPRESSION_SECTION))
+      {
+        compressionConfigured = true;
+
+        OrthancPlugins::OrthancConfiguration compressionSection;
+        pluginSection.GetSection(compressionSection, COMPRESSION_SECTION);
+
+        const bool compressionEnabled = compressionSection.GetBooleanValue("Enable", true);
+
+        // the dictionaries are still loaded when the compression is disabled, to read the objects that have been compressed with them
+        std::string dictionariesDirectory;
+        const bool hasDictionaries = compressionSection.LookupStringValue(dictionariesDirectory, "DictionariesDirectory");
+
+        Json::Value levels = compressionSection.GetJson()["ContentTypes"];  // zlib level, per content type
+        if (levels.isNull())
+        {
+          levels["DicomUntilPixelData"] = 6;
+          levels["DicomAsJson"] = 6;
+        }
+
+        if (!levels.isObject())
+        {
+          LOG(ERROR) << StoragePluginFactory::GetStoragePluginName() << ": StorageCompression/ContentTypes must be a dictionary";
+          return -1;
+        }
+
+        if (compressionEnabled || hasDictionaries)
+        {
+          try
+          {
+            compression.reset(new CompressionHelpers());
+            compression->SetDictionariesStorage(new SharedDictionariesStorage);
+            compression->SetFrameSize(static_cast<size_t>(compressionSection.GetUnsignedIntegerValue("FrameSize", 64)) * 1024);  // in KB
+            compression->SetMaxRatio(compressionSection.GetUnsignedIntegerValue("MaxRatio", 90));  // in percent
+
+            if (hasDictionaries)
+            {
+              compression->LoadDictionaries(dictionariesDirectory);
+            }
+
+            Json::Value::Members members = levels.getMemberNames();
+            for (size_t i = 0; compressionEnabled && i < members.size(); i++)
+            {
+              OrthancPluginContentType contentType;
+              if (!LookupContentType(contentType, members[i]) || !levels[members[i]].isInt())
+              {
+                LOG(ERROR) << StoragePluginFactory::GetStoragePluginName() << ": StorageCompression/ContentTypes: invalid entry for \"" << members[i] << "\"";
+                return -1;
+              }
+
+              compression->SetLevel(contentType, levels[members[i]].asInt());
+            }
+          }
+          catch (StoragePluginException& e)
+          {
+            LOG(ERROR) << StoragePluginFactory::GetStoragePluginName() << ": " << e.what();
+            return -1;
+          }
+        }
+
+        if (compressionEnabled)
+        {
+          LOG(WARNING) << StoragePluginFactory::GetStoragePluginName() << ": storage compression enabled (frames of " << (compression->GetFrameSize() / 1024) << " KB)";
+
+          if (hasDictionaries)
+          {
+            OrthancPlugins::RegisterRestCallback<TrainCompressionDictionary>("/compression/train-dictionary", true);
+          }
+        }
+      }
+
       if (pluginSection.IsSection(ENCRYPTION_SECTION))
       {
         OrthancPlugins::OrthancConfiguration cryptoSection;
@@ -722,22 +1826,60 @@ extern "C"
         LOG(WARNING) << StoragePluginFactory::GetStoragePluginName() << ": client-side encryption is disabled";
       }
 
+      if (compression.get() != NULL)
+      {
+        // the dictionaries can only be decrypted once the encryption is configured
+        try
+        {
+          compression->SynchronizeDictionaries();
+        }
+        catch (StoragePluginException& e)
+        {
+          LOG(WARNING) << StoragePluginFactory::GetStoragePluginName() << ": unable to read the compression dictionaries from the storage, "
+                       << "they will be read when they are needed: " << e.what();
+        }
+      }
+
 
       if (IsHybridModeEnabled())
       {
+        if (pluginSection.IsSection(MOVE_STORAGE_SECTION))
+        {
+          OrthancPlugins::OrthancConfiguration moveStorageSection;
+          pluginSection.GetSection(moveStorageSection, MOVE_STORAGE_SECTION);
+
+          moveStorageThreadsCount = std::max(1u, moveStorageSection.GetUnsignedIntegerValue("Threads", moveStorageThreadsCount));
+
+          // in MB, the limit is the maximum value of a semaphore
+          const unsigned int maxInFlightSize = std::min(4095u, std::max(1u, moveStorageSection.GetUnsignedIntegerValue("MaxInFlightSize", 256)));
+          moveStorageMaxInFlightSize = static_cast<size_t>(maxInFlightSize) * 1024 * 1024;
+
+          // the background moves only use the spare capacity of the storages
+          const unsigned int maxBandwidth = moveStorageSection.GetUnsignedIntegerValue("MaxBandwidth", 0);  // in MB/s
+          const unsigned int maxRequestsPerSecond = moveStorageSection.GetUnsignedIntegerValue("MaxRequestsPerSecond", 0);
+          const unsigned int latencyThreshold = moveStorageSection.GetUnsignedIntegerValue("ForegroundLatencyThreshold", 0);  // in ms
+
+          if (maxBandwidth > 0 || maxRequestsPerSecond > 0 || latencyThreshold > 0)
+          {
+            backgroundThrottler.reset(new BackgroundThrottler(static_cast<uint64_t>(maxBandwidth) * 1024 * 1024, maxRequestsPerSecond, latencyThreshold));
+
+            LOG(WARNING) << StoragePluginFactory::GetStoragePluginName() << ": the move-storage jobs are throttled: "
+                         << (maxBandwidth > 0 ? boost::lexical_cast<std::string>(maxBandwidth) + " MB/s" : "unlimited throughput") << ", "
+                         << (maxRequestsPerSecond > 0 ? boost::lexical_cast<std::string>(maxRequestsPerSecond) + " requests/s" : "unlimited requests")
+                         << (latencyThreshold > 0 ? ", back-off above " + boost::lexical_cast<std::string>(latencyThreshold) + " ms of foreground latency" : "");
+          }
+        }
+
+        LOG(WARNING) << StoragePluginFactory::GetStoragePluginName() << ": the move-storage jobs use " << moveStorageThreadsCount
+                     << " threads and up to " << (moveStorageMaxInFlightSize / (1024 * 1024)) << " MB of attachments in flight";
+
         OrthancPlugins::RegisterRestCallback<MoveStorage>("/move-storage", true);
+        OrthancPlugins::RegisterRestCallback<MoveStorageQuery>("/move-storage/query", true);
         OrthancPluginRegisterJobsUnserializer(context, JobUnserializer);
       }
 
-      if (cryptoEnabled)
-      {
-        // with encrypted file, we can not support ReadRange.  Therefore, we register the old interface
-        OrthancPluginRegisterStorageArea(context, StorageCreate, StorageReadWholeLegacy, StorageRemove);
-      }
-      else
-      {
-        OrthancPluginRegisterStorageArea2(context, StorageCreate, StorageReadWhole, StorageReadRange, StorageRemove);
-      }
+      // with encrypted files, ReadRange only decrypts the chunks that cover the range
+      OrthancPluginRegisterStorageArea2(context, StorageCreate, StorageReadWhole, StorageReadRange, StorageRemove);
     }
     catch (Orthanc::OrthancException& e)
     {
@@ -752,8 +1894,13 @@ extern "C"
   ORTHANC_PLUGINS_API void OrthancPluginFinalize()
   {
     LOG(WARNING) << StoragePluginFactory::GetStoragePluginName() << " plugin is finalizing";
+    deletionQueue.reset();  // must be stopped before the storages it uses
     primaryStorage.reset();
     secondaryStorage.reset();
+    objectStorage = NULL;
+    memoryCache.reset();
+    backgroundThrottler.reset();
+    compression.reset();
     Orthanc::FinalizeFramework();
   }
 
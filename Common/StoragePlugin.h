@@ -23,11 +23,37 @@
 
 
 static const char* const JOB_TYPE_MOVE_STORAGE = "MoveStorage";
+static const char* const JOB_TYPE_MOVE_STORAGE_QUERY = "MoveStorageQuery";
+static const char* const JOB_TYPE_TRAIN_DICTIONARY = "TrainCompressionDictionary";
 
 static const char* const KEY_RESOURCES = "Resources";
+static const char* const KEY_PACKED_RESOURCES = "PackedResources";
+static const char* const KEY_EXPANDED_RESOURCES_COUNT = "ExpandedResourcesCount";
+static const char* const KEY_LEVEL = "Level";
 static const char* const KEY_TARGET_STORAGE = "TargetStorage";
 static const char* const KEY_INSTANCES = "Instances";
+static const char* const KEY_PACKED_INSTANCES = "PackedInstances";
+static const char* const KEY_PROCESSED_INSTANCES_COUNT = "ProcessedInstancesCount";
+static const char* const KEY_FAILED_INSTANCES = "FailedInstances";
 static const char* const KEY_CONTENT = "Content";
+static const char* const KEY_CONTENT_TYPE = "ContentType";
+static const char* const KEY_INSTANCES_COUNT = "InstancesCount";
+static const char* const KEY_SAMPLES_COUNT = "SamplesCount";
+static const char* const KEY_DICTIONARY_ID = "DictionaryId";
+static const char* const KEY_DICTIONARY_SIZE = "DictionarySize";
+static const char* const KEY_QUERY = "Query";
+static const char* const KEY_STUDY_DATE_OLDER_THAN = "StudyDateOlderThan";
+static const char* const KEY_MODALITIES = "Modalities";
+static const char* const KEY_LAST_UPDATE_OLDER_THAN = "LastUpdateOlderThan";
+static const char* const KEY_LAST_UPDATE_BEFORE = "LastUpdateBefore";
+static const char* const KEY_STUDIES_COUNT = "StudiesCount";
+static const char* const KEY_THREADS = "Threads";
+static const char* const KEY_MAX_BANDWIDTH = "MaxBandwidth";
+static const char* const KEY_OFFSET = "Offset";
+static const char* const KEY_PAGE_SIZE = "PageSize";
+static const char* const KEY_LAST_PAGE = "LastPage";
+static const char* const KEY_CANDIDATES_COUNT = "CandidatesCount";
+static const char* const KEY_DONE = "Done";
 
 static const char* const STORAGE_TYPE_FILE_SYSTEM = "file-system";
 static const char* const STORAGE_TYPE_OBJECT_STORAGE = "object-storage";
@@ -0,0 +1,78 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "TokenBucket.h"
+
+#include <boost/thread/thread.hpp>
+
+#include <algorithm>
+
+
+TokenBucket::TokenBucket(uint64_t ratePerSecond) :
+  ratePerSecond_(static_cast<double>(std::max(static_cast<uint64_t>(1), ratePerSecond))),
+  tokens_(ratePerSecond_),
+  lastRefill_(boost::posix_time::microsec_clock::universal_time())
+{
+}
+
+
+bool TokenBucket::Consume(uint64_t cost,
+                          const StopFlag& stop)
+{
+  double wait;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    const double elapsed = static_cast<double>((now - lastRefill_).total_microseconds()) / 1000000.0;
+
+    tokens_ = std::min(ratePerSecond_, tokens_ + elapsed * ratePerSecond_);
+    lastRefill_ = now;
+
+    // the budget is reserved immediately, so that the concurrent transfers wait in turn
+    tokens_ -= static_cast<double>(cost);
+    wait = (tokens_ < 0 ? -tokens_ / ratePerSecond_ : 0);
+  }
+
+  const boost::posix_time::ptime deadline = (boost::posix_time::microsec_clock::universal_time() +
+                                             boost::posix_time::microseconds(static_cast<int64_t>(wait * 1000000.0)));
+
+  for (;;)
+  {
+    if (stop.IsSet())
+    {
+      // the transfer will not happen
+      boost::mutex::scoped_lock lock(mutex_);
+      tokens_ = std::min(ratePerSecond_, tokens_ + static_cast<double>(cost));
+      return false;
+    }
+
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+    if (now >= deadline)
+    {
+      return true;
+    }
+
+    boost::this_thread::sleep(std::min(deadline - now, boost::posix_time::time_duration(boost::posix_time::milliseconds(static_cast<int64_t>(STOP_CHECK_MILLISECONDS)))));
+  }
+}
@@ -0,0 +1,79 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <stdint.h>
+
+
+// A token bucket that limits the rate of the background transfers (e.g. the move-storage jobs), in bytes or in requests
+// per second.  The bucket holds up to one second of budget.  Each transfer reserves its cost in the bucket before
+// starting, and waits until the bucket is no longer in debt, which keeps the average rate below the limit.
+class TokenBucket : public boost::noncopyable
+{
+public:
+  // set when the job of the transfers is stopped (paused or canceled), interrupts their waits
+  class StopFlag : public boost::noncopyable
+  {
+  private:
+    mutable boost::mutex  mutex_;
+    bool                  stopped_;
+
+  public:
+    StopFlag() :
+      stopped_(false)
+    {
+    }
+
+    void Set(bool stopped)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      stopped_ = stopped;
+    }
+
+    bool IsSet() const
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return stopped_;
+    }
+  };
+
+  // the waits check the stop flag at this interval
+  static const unsigned int STOP_CHECK_MILLISECONDS = 100;
+
+private:
+  boost::mutex              mutex_;
+  double                    ratePerSecond_;
+  double                    tokens_;   // negative when the last transfers have exceeded the budget
+  boost::posix_time::ptime  lastRefill_;
+
+public:
+  explicit TokenBucket(uint64_t ratePerSecond);
+
+  // blocks until a transfer that costs 'cost' tokens fits within the budget.  Returns false if the wait has been
+  // interrupted by 'stop', in which case the tokens are given back.
+  bool Consume(uint64_t cost,
+               const StopFlag& stop);
+};
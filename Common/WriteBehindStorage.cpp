@@ -0,0 +1,733 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+#include "WriteBehindStorage.h"
+#include "FileSystemStorage.h"
+
+#include <Logging.h>
+#include <SystemToolbox.h>
+#include <Toolbox.h>
+
+#include <boost/lexical_cast.hpp>
+
+#include <algorithm>
+
+
+static const unsigned int MAX_RETRY_DELAY_SECONDS = 60;
+
+
+class PendingUpload : public Orthanc::IDynamicObject
+{
+  std::string key_;
+
+public:
+  explicit PendingUpload(const std::string& key)
+    : key_(key)
+  {
+  }
+
+  const std::string& GetKey() const
+  {
+    return key_;
+  }
+};
+
+
+class WriteBehindStorage::JournalWriter : public IStorage::IWriter
+{
+  WriteBehindStorage& that_;
+  std::string         key_;
+
+  // the content is either given by "data" or produced by "source"
+  void WriteJournal(const char* data, IStorage::IContentSource* source, size_t size)
+  {
+    fs::path path = that_.GetJournalPath(key_);
+    fs::path tmpPath = GetTemporaryPath(path, size);
+
+    try
+    {
+      const bool isNewDirectory = !fs::is_directory(path.parent_path());
+      Orthanc::SystemToolbox::MakeDirectory(path.parent_path().string());
+
+      if (source != NULL)
+      {
+        FileSystemStoragePlugin::WriteFileFromSource(tmpPath, *source, size, that_.fsync_);
+      }
+      else
+      {
+        Orthanc::SystemToolbox::WriteFile(data, size, tmpPath.string(), that_.fsync_);
+      }
+
+      fs::rename(tmpPath, path);
+
+      // the write is only acknowledged once the renaming is durable
+      if (that_.fsync_)
+      {
+        FileSystemStoragePlugin::SyncDirectory(path.parent_path());
+
+        if (isNewDirectory)
+        {
+          FileSystemStoragePlugin::SyncDirectory(that_.journalDirectory_);
+        }
+      }
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      throw StoragePluginException("error while writing " + key_ + " in the write-behind journal: " + e.What());
+    }
+    catch (fs::filesystem_error& e)
+    {
+      throw StoragePluginException("error while writing " + key_ + " in the write-behind journal: " + e.what());
+    }
+
+    {
+      boost::mutex::scoped_lock lock(that_.mutex_);
+      that_.pending_.insert(key_);
+    }
+
+    that_.Enqueue(key_);
+  }
+
+public:
+  // the size of the content is part of the name of the temporary files, so that the complete ones can be recovered
+  static fs::path GetTemporaryPath(const fs::path& path, size_t size)
+  {
+    fs::path tmpPath = path;
+    tmpPath += "." + boost::lexical_cast<std::string>(size) + ".tmp";
+    return tmpPath;
+  }
+
+  JournalWriter(WriteBehindStorage& that, const std::string& key)
+    : that_(that),
+      key_(key)
+  {
+  }
+
+  virtual void Write(const char* data, size_t size) ORTHANC_OVERRIDE
+  {
+    WriteJournal(data, NULL, size);
+  }
+
+  virtual void WriteFromSource(IStorage::IContentSource& source, size_t size) ORTHANC_OVERRIDE
+  {
+    WriteJournal(NULL, &source, size);
+  }
+
+  virtual size_t GetBufferingSize(size_t size) const ORTHANC_OVERRIDE
+  {
+    return FileSystemStoragePlugin::GetWriteFromSourceBufferingSize(size);
+  }
+};
+
+
+class WriteBehindStorage::JournalReader : public IStorage::IReader
+{
+  WriteBehindStorage&                       that_;
+  FileSystemStoragePlugin::FileSystemReader journalReader_;
+  std::unique_ptr<IStorage::IReader>        fallbackReader_;
+  const std::string                         uuid_;
+  OrthancPluginContentType                  type_;
+  bool                                      encryptionEnabled_;
+
+  // the object might have been uploaded (and removed from the journal) in the meantime
+  IStorage::IReader& GetFallbackReader()
+  {
+    if (fallbackReader_.get() == NULL)
+    {
+      fallbackReader_.reset(that_.storage_->GetReaderForObject(uuid_.c_str(), type_, encryptionEnabled_));
+    }
+
+    return *fallbackReader_;
+  }
+
+public:
+  JournalReader(WriteBehindStorage& that, const std::string& key, const char* uuid, OrthancPluginContentType type, bool encryptionEnabled)
+    : that_(that),
+      journalReader_(that.GetJournalPath(key)),
+      uuid_(uuid),
+      type_(type),
+      encryptionEnabled_(encryptionEnabled)
+  {
+  }
+
+  virtual size_t GetSize() ORTHANC_OVERRIDE
+  {
+    if (fallbackReader_.get() == NULL)
+    {
+      try
+      {
+        return journalReader_.GetSize();
+      }
+      catch (StoragePluginException&)
+      {
+      }
+    }
+
+    return GetFallbackReader().GetSize();
+  }
+
+  virtual void ReadWhole(char* data, size_t size) ORTHANC_OVERRIDE
+  {
+    ReadRange(data, size, 0);
+  }
+
+  virtual void ReadRange(char* data, size_t size, size_t fromOffset) ORTHANC_OVERRIDE
+  {
+    if (fallbackReader_.get() == NULL)
+    {
+      try
+      {
+        journalReader_.ReadRange(data, size, fromOffset);
+        return;
+      }
+      catch (StoragePluginException&)
+      {
+      }
+    }
+
+    GetFallbackReader().ReadRange(data, size, fromOffset);
+  }
+};
+
+
+WriteBehindStorage::WriteBehindStorage(IStorage* storage,
+                                       const std::string& journalDirectory,
+                                       unsigned int threadsCount,
+                                       bool fsync)
+  : IStorage(storage->GetNameForLogs()),
+    storage_(storage),
+    journalDirectory_(journalDirectory),
+    fsync_(fsync),
+    continue_(true)
+{
+  Orthanc::SystemToolbox::MakeDirectory(journalDirectory_.string());
+  Replay();
+
+  if (threadsCount == 0)
+  {
+    threadsCount = 1;
+  }
+
+  for (unsigned int i = 0; i < threadsCount; i++)
+  {
+    uploaders_.push_back(new boost::thread(UploaderThread, this));
+  }
+
+  LOG(WARNING) << GetNameForLogs() << ": write-behind enabled, journal in " << journalDirectory_.string()
+               << " (" << pending_.size() << " pending uploads)";
+}
+
+
+WriteBehindStorage::~WriteBehindStorage()
+{
+  // the uploads that are not complete yet will be resumed at the next startup
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    continue_ = false;
+  }
+
+  for (size_t i = 0; i < uploaders_.size(); i++)
+  {
+    if (uploaders_[i]->joinable())
+    {
+      uploaders_[i]->join();
+    }
+
+    delete uploaders_[i];
+  }
+}
+
+
+std::string WriteBehindStorage::GetKey(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled)
+{
+  std::string key = std::string(uuid) + "." + boost::lexical_cast<std::string>(static_cast<int>(type));
+
+  if (encryptionEnabled)
+  {
+    key += ".enc";
+  }
+
+  return key;
+}
+
+
+bool WriteBehindStorage::ParseKey(std::string& uuid, OrthancPluginContentType& type, bool& encryptionEnabled, const std::string& key)
+{
+  std::vector<std::string> tokens;
+  Orthanc::Toolbox::TokenizeString(tokens, key, '.');
+
+  if (tokens.size() < 2 || tokens.size() > 3 ||
+      tokens[0].empty() ||
+      (tokens.size() == 3 && tokens[2] != "enc"))
+  {
+    return false;
+  }
+
+  try
+  {
+    uuid = tokens[0];
+    type = static_cast<OrthancPluginContentType>(boost::lexical_cast<int>(tokens[1]));
+    encryptionEnabled = (tokens.size() == 3);
+    return true;
+  }
+  catch (boost::bad_lexical_cast&)
+  {
+    return false;
+  }
+}
+
+
+fs::path WriteBehindStorage::GetJournalPath(const std::string& key) const
+{
+  fs::path path = journalDirectory_;
+
+  path /= key.substr(0, 2);
+  path /= key;
+
+  return path;
+}
+
+
+fs::path WriteBehindStorage::GetDeletionMarkerPath(const std::string& key) const
+{
+  fs::path path = GetJournalPath(key);
+  path += ".deleted";
+  return path;
+}
+
+
+void WriteBehindStorage::Replay()
+{
+  std::vector<fs::path> temporaryFiles;
+
+  for (fs::recursive_directory_iterator it(journalDirectory_); it != fs::recursive_directory_iterator(); ++it)
+  {
+    if (!fs::is_regular_file(it->status()))
+    {
+      continue;
+    }
+
+    std::string uuid;
+    OrthancPluginContentType type;
+    bool encryptionEnabled;
+    const std::string key = it->path().filename().string();
+
+    if (it->path().extension() == ".tmp")
+    {
+      // the directory is not modified while it is being iterated
+      temporaryFiles.push_back(it->path());
+    }
+    else if (it->path().extension() == ".deleted")
+    {
+      // an object that has been deleted while it was uploaded: it might be in the storage
+      if (ParseKey(uuid, type, encryptionEnabled, it->path().stem().string()))
+      {
+        deletedWhileUploading_.insert(it->path().stem().string());
+      }
+      else
+      {
+        LOG(WARNING) << GetNameForLogs() << ": ignoring unexpected file in the write-behind journal: " << it->path().string();
+      }
+    }
+    else if (ParseKey(uuid, type, encryptionEnabled, key))
+    {
+      pending_.insert(key);
+      Enqueue(key);
+    }
+    else
+    {
+      LOG(WARNING) << GetNameForLogs() << ": ignoring unexpected file in the write-behind journal: " << it->path().string();
+    }
+  }
+
+  for (size_t i = 0; i < temporaryFiles.size(); i++)
+  {
+    // "<key>.<size>.tmp": the complete files might have been acknowledged to Orthanc if their renaming was
+    // lost (e.g. power failure before the directory was synced), they are recovered.  The other ones have
+    // never been acknowledged.
+    const fs::path keyPath = temporaryFiles[i].parent_path() / temporaryFiles[i].stem().stem();
+    const std::string sizeExtension = temporaryFiles[i].stem().extension().string();
+
+    std::string uuid;
+    OrthancPluginContentType type;
+    bool encryptionEnabled;
+    const std::string key = keyPath.filename().string();
+
+    boost::system::error_code err;
+    bool isComplete = false;
+
+    try
+    {
+      isComplete = (ParseKey(uuid, type, encryptionEnabled, key) &&
+                    sizeExtension.size() > 1 &&
+                    boost::lexical_cast<uintmax_t>(sizeExtension.substr(1)) == fs::file_size(temporaryFiles[i]) &&
+                    pending_.find(key) == pending_.end());
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+    }
+    catch (fs::filesystem_error&)
+    {
+    }
+
+    if (!isComplete)
+    {
+      fs::remove(temporaryFiles[i], err);
+    }
+    else
+    {
+      fs::rename(temporaryFiles[i], keyPath, err);
+
+      if (err)
+      {
+        LOG(ERROR) << GetNameForLogs() << ": unable to recover " << temporaryFiles[i].string() << " in the write-behind journal: " << err.message();
+      }
+      else
+      {
+        LOG(WARNING) << GetNameForLogs() << ": recovered a complete write in the write-behind journal: " << key;
+        pending_.insert(key);
+        Enqueue(key);
+      }
+    }
+  }
+
+  for (std::set<std::string>::const_iterator it = deletedWhileUploading_.begin(); it != deletedWhileUploading_.end(); ++it)
+  {
+    // the deletion marker is written before the journal file is removed: both files can remain after a crash.
+    // The object has already been enqueued in this case, its upload is skipped and the deletion performed.
+    if (pending_.erase(*it) > 0)
+    {
+      boost::system::error_code err;
+      fs::remove(GetJournalPath(*it), err);
+    }
+    else
+    {
+      Enqueue(*it);
+    }
+  }
+}
+
+
+void WriteBehindStorage::Enqueue(const std::string& key)
+{
+  queue_.Enqueue(new PendingUpload(key));
+}
+
+
+bool WriteBehindStorage::IsPending(const std::string& key)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return pending_.find(key) != pending_.end();
+}
+
+
+bool WriteBehindStorage::IsDeletedWhileUploading(const std::string& key)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return deletedWhileUploading_.find(key) != deletedWhileUploading_.end();
+}
+
+
+bool WriteBehindStorage::Upload(const std::string& key)
+{
+  bool retryDeletion = false;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (pending_.find(key) == pending_.end())
+    {
+      if (deletedWhileUploading_.find(key) == deletedWhileUploading_.end())
+      {
+        return true;  // the object has been deleted in the meantime
+      }
+      else
+      {
+        retryDeletion = true;  // the object has been uploaded, but its deletion has failed
+      }
+    }
+    else
+    {
+      uploading_.insert(key);
+    }
+  }
+
+  if (retryDeletion)
+  {
+    return DeleteUploaded(key);
+  }
+
+  std::string uuid;
+  OrthancPluginContentType type;
+  bool encryptionEnabled = false;
+  bool success = false;
+
+  if (ParseKey(uuid, type, encryptionEnabled, key))
+  {
+    try
+    {
+      // the journal file is streamed to the storage, so that large objects are not loaded in memory
+      FileSystemStoragePlugin::FileSystemReader journalReader(GetJournalPath(key));
+      ReaderContentSource content(journalReader);
+
+      std::unique_ptr<IStorage::IWriter> writer(storage_->GetWriterForObject(uuid.c_str(), type, encryptionEnabled));
+      writer->WriteFromSource(content, journalReader.GetSize());
+
+      LOG(INFO) << GetNameForLogs() << ": write-behind: uploaded " << key;
+      success = true;
+    }
+    catch (StoragePluginException& ex)
+    {
+      LOG(WARNING) << GetNameForLogs() << ": write-behind: error while uploading " << key << ", will retry: " << ex.what();
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(WARNING) << GetNameForLogs() << ": write-behind: error while uploading " << key << ", will retry: " << e.What();
+    }
+  }
+
+  bool deleted;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    uploading_.erase(key);
+
+    // the key stays in "deletedWhileUploading_" until the object has been deleted from the storage, so that
+    // it is not reported as existing in the meantime
+    deleted = (deletedWhileUploading_.find(key) != deletedWhileUploading_.end());
+
+    if (success && !deleted)
+    {
+      pending_.erase(key);
+
+      boost::system::error_code err;
+      fs::remove(GetJournalPath(key), err);
+    }
+  }
+
+  if (deleted)
+  {
+    // the object might have reached the storage even if its upload has reported an error
+    return DeleteUploaded(key);
+  }
+
+  return success;
+}
+
+
+bool WriteBehindStorage::DeleteUploaded(const std::string& key)
+{
+  std::string uuid;
+  OrthancPluginContentType type;
+  bool encryptionEnabled;
+
+  if (ParseKey(uuid, type, encryptionEnabled, key))
+  {
+    try
+    {
+      storage_->DeleteObject(uuid.c_str(), type, encryptionEnabled);
+      LOG(INFO) << GetNameForLogs() << ": write-behind: deleted " << key << " that had been deleted while it was uploaded";
+    }
+    catch (StoragePluginException& ex)
+    {
+      // the key stays in "deletedWhileUploading_" and its deletion marker in the journal
+      LOG(WARNING) << GetNameForLogs() << ": write-behind: error while deleting " << key << ", will retry: " << ex.what();
+      return false;
+    }
+  }
+
+  boost::mutex::scoped_lock lock(mutex_);
+  deletedWhileUploading_.erase(key);
+
+  boost::system::error_code err;
+  fs::remove(GetDeletionMarkerPath(key), err);
+
+  return true;
+}
+
+
+bool WriteBehindStorage::IsRunning()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return continue_;
+}
+
+
+void WriteBehindStorage::ScheduleRetry(const std::string& key)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  std::map<std::string, unsigned int>::iterator delay = retryDelays_.find(key);
+
+  if (delay == retryDelays_.end())
+  {
+    delay = retryDelays_.insert(std::make_pair(key, 1u)).first;
+  }
+  else
+  {
+    delay->second = std::min(delay->second * 2, MAX_RETRY_DELAY_SECONDS);
+  }
+
+  retries_.insert(std::make_pair(boost::posix_time::microsec_clock::universal_time() + boost::posix_time::seconds(delay->second), key));
+}
+
+
+void WriteBehindStorage::EnqueueRetries()
+{
+  const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  while (!retries_.empty() &&
+         retries_.begin()->first <= now)
+  {
+    Enqueue(retries_.begin()->second);
+    retries_.erase(retries_.begin());
+  }
+}
+
+
+void WriteBehindStorage::UploaderThread(WriteBehindStorage* that)
+{
+  while (that->IsRunning())
+  {
+    that->EnqueueRetries();
+
+    std::unique_ptr<Orthanc::IDynamicObject> upload(that->queue_.Dequeue(100));
+
+    if (upload.get() != NULL)
+    {
+      const std::string& key = dynamic_cast<PendingUpload&>(*upload).GetKey();
+
+      if (that->Upload(key))
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+        that->retryDelays_.erase(key);
+      }
+      else
+      {
+        that->ScheduleRetry(key);
+      }
+    }
+  }
+}
+
+
+bool WriteBehindStorage::FileExists(const std::string& uuid, OrthancPluginContentType type, bool encryptionEnabled)
+{
+  const std::string key = GetKey(uuid.c_str(), type, encryptionEnabled);
+
+  return (IsPending(key) ||
+          (!IsDeletedWhileUploading(key) &&
+           storage_->FileExists(uuid, type, encryptionEnabled)));
+}
+
+
+IStorage::IWriter* WriteBehindStorage::GetWriterForObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled)
+{
+  return new JournalWriter(*this, GetKey(uuid, type, encryptionEnabled));
+}
+
+
+IStorage::IReader* WriteBehindStorage::GetReaderForObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled)
+{
+  const std::string key = GetKey(uuid, type, encryptionEnabled);
+
+  if (IsPending(key))
+  {
+    return new JournalReader(*this, key, uuid, type, encryptionEnabled);
+  }
+  else
+  {
+    return storage_->GetReaderForObject(uuid, type, encryptionEnabled);
+  }
+}
+
+
+bool WriteBehindStorage::RemoveFromJournal(const std::string& key)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (pending_.find(key) != pending_.end())
+  {
+    if (uploading_.find(key) != uploading_.end())
+    {
+      // the uploader will delete the object once its upload is complete.  The deletion is journaled before the
+      // journal file is removed, so that it is resumed at startup if the object has reached the storage.
+      const fs::path marker = GetDeletionMarkerPath(key);
+
+      try
+      {
+        Orthanc::SystemToolbox::WriteFile(std::string(), marker.string(), fsync_);
+
+        if (fsync_)
+        {
+          FileSystemStoragePlugin::SyncDirectory(marker.parent_path());
+        }
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        throw StoragePluginException("error while writing the deletion of " + key + " in the write-behind journal: " + e.What());
+      }
+
+      deletedWhileUploading_.insert(key);
+    }
+
+    pending_.erase(key);
+
+    boost::system::error_code err;
+    fs::remove(GetJournalPath(key), err);
+
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+void WriteBehindStorage::DeleteObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled)
+{
+  if (!RemoveFromJournal(GetKey(uuid, type, encryptionEnabled)))
+  {
+    storage_->DeleteObject(uuid, type, encryptionEnabled);
+  }
+}
+
+
+void WriteBehindStorage::DeleteObjects(const std::vector<ObjectIdentifier>& objects, bool encryptionEnabled)
+{
+  std::vector<ObjectIdentifier> uploadedObjects;
+
+  for (size_t i = 0; i < objects.size(); i++)
+  {
+    if (!RemoveFromJournal(GetKey(objects[i].uuid_.c_str(), objects[i].type_, encryptionEnabled)))
+    {
+      uploadedObjects.push_back(objects[i]);
+    }
+  }
+
+  if (!uploadedObjects.empty())
+  {
+    storage_->DeleteObjects(uploadedObjects, encryptionEnabled);
+  }
+}
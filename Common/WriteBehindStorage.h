@@ -0,0 +1,120 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "IStorage.h"
+
+#include <MultiThreading/SharedMessageQueue.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+#include <map>
+#include <set>
+
+namespace fs = boost::filesystem;
+
+
+// Objects are first written (and fsynced) in a local journal directory and the write is acknowledged
+// immediately.  A pool of threads then uploads them to the underlying storage.  Until they are uploaded,
+// the objects are read from the journal.  The pending uploads are resumed at startup.
+class WriteBehindStorage : public IStorage
+{
+public:
+  class JournalWriter;
+  class JournalReader;
+
+private:
+  std::unique_ptr<IStorage>     storage_;
+  fs::path                      journalDirectory_;
+  bool                          fsync_;
+
+  boost::mutex                  mutex_;
+  std::set<std::string>         pending_;               // objects that are in the journal
+  std::set<std::string>         uploading_;             // objects that are being uploaded right now
+  std::set<std::string>         deletedWhileUploading_; // until they are deleted from the storage, journaled by a ".deleted" marker
+  bool                          continue_;
+
+  // the failed uploads are requeued once their delay has elapsed, so that they do not block the other uploads
+  std::map<std::string, unsigned int>                     retryDelays_;   // in seconds, doubled after each failure
+  std::multimap<boost::posix_time::ptime, std::string>   retries_;
+
+  Orthanc::SharedMessageQueue   queue_;
+  std::vector<boost::thread*>   uploaders_;
+
+  static std::string GetKey(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled);
+
+  static bool ParseKey(std::string& uuid, OrthancPluginContentType& type, bool& encryptionEnabled, const std::string& key);
+
+  fs::path GetJournalPath(const std::string& key) const;
+
+  fs::path GetDeletionMarkerPath(const std::string& key) const;
+
+  void Replay();
+
+  void Enqueue(const std::string& key);
+
+  bool IsPending(const std::string& key);
+
+  bool IsDeletedWhileUploading(const std::string& key);
+
+  bool Upload(const std::string& key);
+
+  // deletes an object that has been deleted while it was uploaded, returns false if the deletion must be retried
+  bool DeleteUploaded(const std::string& key);
+
+  bool IsRunning();
+
+  void ScheduleRetry(const std::string& key);
+
+  void EnqueueRetries();
+
+  // returns true if the object has never reached the underlying storage
+  bool RemoveFromJournal(const std::string& key);
+
+  static void UploaderThread(WriteBehindStorage* that);
+
+public:
+  WriteBehindStorage(IStorage* storage /* takes ownership */,
+                     const std::string& journalDirectory,
+                     unsigned int threadsCount,
+                     bool fsync);
+
+  virtual ~WriteBehindStorage();
+
+  virtual void SetRootPath(const std::string& rootPath) ORTHANC_OVERRIDE
+  {
+    storage_->SetRootPath(rootPath);
+  }
+
+  virtual IWriter* GetWriterForObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE;
+  virtual IReader* GetReaderForObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE;
+  virtual void DeleteObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE;
+  virtual void DeleteObjects(const std::vector<ObjectIdentifier>& objects, bool encryptionEnabled) ORTHANC_OVERRIDE;
+
+  virtual bool HasFileExists() ORTHANC_OVERRIDE
+  {
+    return storage_->HasFileExists();
+  }
+
+  virtual bool FileExists(const std::string& uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE;
+};
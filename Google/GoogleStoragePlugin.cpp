@@ -20,14 +20,19 @@
 
 
 #include "GoogleStoragePlugin.h"
+#include "../Common/ParallelRangeReader.h"
 
 #include "google/cloud/storage/client.h"
 
 #include <Logging.h>
 
+#include <boost/thread.hpp>
+
 // Create aliases to make the code easier to read.
 namespace gcs = google::cloud::storage;
 
+static const size_t UPLOAD_CHUNK_SIZE = 8 * 1024 * 1024;   // the objects produced by a source are streamed by chunks
+
 
 class GoogleStoragePlugin : public BaseStorage
 {
@@ -36,6 +41,7 @@ public:
   std::string         bucketName_;
   google::cloud::storage::Client mainClient_; // the client that is created at startup.  Each thread should copy it when it needs it. (from the doc: Instances of this class created via copy-construction or copy-assignment share the underlying pool of connections. Access to these copies via multiple threads is guaranteed to work. Two threads operating on the same instance of this class is not guaranteed to work.)
   bool                storageContainsUnknownFiles_;
+  ParallelRangeReader parallelReader_;
 
 public:
 
@@ -43,12 +49,14 @@ public:
                       const std::string& bucketName,
                       google::cloud::storage::Client& mainClient,
                       bool enableLegacyStorageStructure,
-                      bool storageContainsUnknownFiles
+                      bool storageContainsUnknownFiles,
+                      const ParallelRangeReader& parallelReader
                       );
 
   virtual IWriter* GetWriterForObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE;
   virtual IReader* GetReaderForObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE;
   virtual void DeleteObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE;
+  virtual void DeleteObjects(const std::vector<ObjectIdentifier>& objects, bool encryptionEnabled) ORTHANC_OVERRIDE;
   virtual bool HasFileExists() ORTHANC_OVERRIDE {return false;};
 };
 
@@ -90,6 +98,46 @@ public:
       throw StoragePluginException("GoogleCloudStorage: error while opening/writing file " + std::string(path_) + ": " + stream_.metadata().status().message());
     }
   }
+
+  virtual void WriteFromSource(IStorage::IContentSource& source, size_t size) ORTHANC_OVERRIDE
+  {
+    stream_ = client_.WriteObject(bucketName_, path_);
+
+    if (!stream_)
+    {
+      throw StoragePluginException("GoogleCloudStorage: error while opening/writing file " + std::string(path_) + ": " + stream_.metadata().status().message());
+    }
+
+    try
+    {
+      std::unique_ptr<char[]> chunk(new char[std::min(size, UPLOAD_CHUNK_SIZE)]);
+
+      for (size_t offset = 0; offset < size; offset += UPLOAD_CHUNK_SIZE)
+      {
+        const size_t chunkSize = std::min(size - offset, UPLOAD_CHUNK_SIZE);
+        source.Read(chunk.get(), chunkSize, offset);
+        stream_.write(chunk.get(), chunkSize);
+      }
+    }
+    catch (...)
+    {
+      // the upload must not be finalized with a truncated content (that's what the destructor of the stream would do)
+      std::move(stream_).Suspend();
+      throw;
+    }
+
+    stream_.Close();
+
+    if (!stream_.metadata())
+    {
+      throw StoragePluginException("GoogleCloudStorage: error while writing file " + std::string(path_) + ": " + stream_.metadata().status().message());
+    }
+  }
+
+  virtual size_t GetBufferingSize(size_t size) const ORTHANC_OVERRIDE
+  {
+    return std::min(size, UPLOAD_CHUNK_SIZE);
+  }
 };
 
 
@@ -98,12 +146,14 @@ class Reader : public IStorage::IReader
   std::list<std::string>  paths_;
   gcs::Client             client_;
   std::string             bucketName_;
+  ParallelRangeReader     parallelReader_;
 
 public:
-  Reader(const std::string& bucketName, const std::list<std::string>& paths, gcs::Client& client)
+  Reader(const std::string& bucketName, const std::list<std::string>& paths, gcs::Client& client, const ParallelRangeReader& parallelReader)
     : paths_(paths),
       client_(client),
-      bucketName_(bucketName)
+      bucketName_(bucketName),
+      parallelReader_(parallelReader)
   {
   }
 
@@ -115,6 +165,7 @@ public:
   virtual size_t GetSize() ORTHANC_OVERRIDE
   {
     std::string firstExceptionMessage;
+    bool notFound = true;  // whether the object has been confirmed to be missing at all the paths
 
     for (auto& path: paths_)
     {
@@ -122,15 +173,30 @@ public:
       {
         return _GetSize(path);
       }
+      catch (StoragePluginNotFoundException& ex)
+      {
+        if (firstExceptionMessage.empty())
+        {
+          firstExceptionMessage = ex.what();
+        }
+        //ignore to retry
+      }
       catch (StoragePluginException& ex)
       {
         if (firstExceptionMessage.empty())
         {
           firstExceptionMessage = ex.what();
         }
+        notFound = false;
         //ignore to retry
       }
     }
+
+    if (notFound)
+    {
+      throw StoragePluginNotFoundException(firstExceptionMessage);
+    }
+
     throw StoragePluginException(firstExceptionMessage);
   }
 
@@ -142,6 +208,11 @@ public:
     {
       try
       {
+        if (parallelReader_.IsParallel(size))
+        {
+          return _ReadRangeParallel(path, data, size, 0);
+        }
+
         return _ReadWhole(path, data, size);
       }
       catch (StoragePluginException& ex)
@@ -164,7 +235,7 @@ public:
     {
       try
       {
-        return _ReadRange(path, data, size, fromOffset);
+        return _ReadRangeParallel(path, data, size, fromOffset);
       }
       catch (StoragePluginException& ex)
       {
@@ -196,9 +267,18 @@ private:
     }
   }
 
-  void _ReadRange(const std::string& path, char* data, size_t size, size_t fromOffset)
+  void _ReadRangeParallel(const std::string& path, char* data, size_t size, size_t fromOffset)
   {
-    auto reader = client_.ReadObject(bucketName_, path, gcs::ReadRange(fromOffset, fromOffset + size));
+    parallelReader_.Read([this, &path](char* rangeData, size_t rangeSize, size_t rangeOffset)
+                         {
+                           gcs::Client client(client_);  // a client instance must not be shared between threads
+                           _ReadRange(client, path, rangeData, rangeSize, rangeOffset);
+                         }, data, size, fromOffset);
+  }
+
+  void _ReadRange(gcs::Client& client, const std::string& path, char* data, size_t size, size_t fromOffset)
+  {
+    auto reader = client.ReadObject(bucketName_, path, gcs::ReadRange(fromOffset, fromOffset + size));
 
     if (!reader)
     {
@@ -223,6 +303,10 @@ private:
 
       return fileSize;
     }
+    else if (objectMetadata.status().code() == google::cloud::StatusCode::kNotFound)
+    {
+      throw StoragePluginNotFoundException("error while getting the size of " + std::string(path) + ": " + objectMetadata.status().message());
+    }
     else
     {
       throw StoragePluginException("error while getting the size of " + std::string(path) + ": " + objectMetadata.status().message());
@@ -294,14 +378,18 @@ IStorage* GoogleStoragePluginFactory::CreateStorage(const std::string& nameForLo
     return nullptr;
   }
 
-  return new GoogleStoragePlugin(nameForLogs, googleBucketName, mainClient.value(), enableLegacyStorageStructure, storageContainsUnknownFiles);
+  ParallelRangeReader parallelReader(static_cast<size_t>(pluginSection.GetUnsignedIntegerValue("ParallelDownloadChunkSize", 16)) * 1024 * 1024,  // in MB
+                                     pluginSection.GetUnsignedIntegerValue("ParallelDownloadConcurrency", 4));                                // 1 to disable
+
+  return new GoogleStoragePlugin(nameForLogs, googleBucketName, mainClient.value(), enableLegacyStorageStructure, storageContainsUnknownFiles, parallelReader);
 }
 
-GoogleStoragePlugin::GoogleStoragePlugin(const std::string& nameForLogs, const std::string &bucketName, google::cloud::storage::Client& mainClient, bool enableLegacyStorageStructure, bool storageContainsUnknownFiles)
+GoogleStoragePlugin::GoogleStoragePlugin(const std::string& nameForLogs, const std::string &bucketName, google::cloud::storage::Client& mainClient, bool enableLegacyStorageStructure, bool storageContainsUnknownFiles, const ParallelRangeReader& parallelReader)
   : BaseStorage(nameForLogs, enableLegacyStorageStructure),
     bucketName_(bucketName),
     mainClient_(mainClient),
-    storageContainsUnknownFiles_(storageContainsUnknownFiles)
+    storageContainsUnknownFiles_(storageContainsUnknownFiles),
+    parallelReader_(parallelReader)
 {
 
 }
@@ -320,7 +408,7 @@ IStorage::IReader* GoogleStoragePlugin::GetReaderForObject(const char* uuid, Ort
     paths.push_back(GetPath(uuid, type, encryptionEnabled, true));
   }
 
-  return new Reader(bucketName_, paths, mainClient_);
+  return new Reader(bucketName_, paths, mainClient_, parallelReader_);
 }
 
 void GoogleStoragePlugin::DeleteObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled)
@@ -336,3 +424,60 @@ void GoogleStoragePlugin::DeleteObject(const char* uuid, OrthancPluginContentTyp
     throw StoragePluginException("GoogleCloudStorage: error while deleting file " + std::string(path) + ": " + deletionStatus.message());
   }
 }
+
+// The C++ client does not expose the JSON batch endpoint -> the deletions are issued concurrently on a few threads
+void GoogleStoragePlugin::DeleteObjects(const std::vector<ObjectIdentifier>& objects, bool encryptionEnabled)
+{
+  static const size_t MAX_CONCURRENT_DELETIONS = 16;
+
+  boost::mutex mutex;
+  size_t nextObject = 0;
+  std::string firstExceptionMessage;
+
+  auto deleteObjects = [&]()
+  {
+    gcs::Client client(mainClient_);  // a client instance must not be shared between threads
+
+    for (;;)
+    {
+      size_t i;
+
+      {
+        boost::mutex::scoped_lock lock(mutex);
+        if (nextObject >= objects.size())
+        {
+          return;
+        }
+
+        i = nextObject++;
+      }
+
+      std::string path = GetPath(objects[i].uuid_.c_str(), objects[i].type_, encryptionEnabled);
+
+      auto deletionStatus = client.DeleteObject(bucketName_, path);
+
+      if (!deletionStatus.ok() &&
+          deletionStatus.code() != google::cloud::StatusCode::kNotFound)
+      {
+        boost::mutex::scoped_lock lock(mutex);
+        if (firstExceptionMessage.empty())
+        {
+          firstExceptionMessage = "GoogleCloudStorage: error while deleting file " + path + ": " + deletionStatus.message();
+        }
+      }
+    }
+  };
+
+  boost::thread_group threads;
+  for (size_t i = 0; i < std::min(objects.size(), MAX_CONCURRENT_DELETIONS); i++)
+  {
+    threads.create_thread(deleteObjects);
+  }
+
+  threads.join_all();
+
+  if (!firstExceptionMessage.empty())
+  {
+    throw StoragePluginException(firstExceptionMessage);
+  }
+}
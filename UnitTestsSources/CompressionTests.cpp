@@ -0,0 +1,487 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "gtest/gtest.h"
+
+#include "../Common/CompressionHelpers.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <map>
+#include <stdlib.h>
+
+
+static std::string GenerateCompressibleContent(size_t size)
+{
+  std::string content;
+
+  for (size_t i = 0; i < size; i++)
+  {
+    content.push_back(static_cast<char>('a' + (i / 7) % 5));
+  }
+
+  return content;
+}
+
+static std::string GenerateIncompressibleContent(size_t size)
+{
+  std::string content;
+
+  for (size_t i = 0; i < size; i++)
+  {
+    content.push_back(static_cast<char>(rand() % 256));
+  }
+
+  return content;
+}
+
+
+TEST(CompressionHelpers, CompressDecompress)
+{
+  CompressionHelpers compression;
+  compression.SetLevel(OrthancPluginContentType_DicomAsJson, 6);
+  compression.SetFrameSize(1000);
+
+  const size_t sizes[] = { 1, 999, 1000, 1001, 12345 };
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(size_t); i++)
+  {
+    std::string content = GenerateCompressibleContent(sizes[i]);
+    std::string compressed;
+
+    if (sizes[i] < 100)
+    {
+      // the overhead of the header is larger than the gain
+      ASSERT_FALSE(compression.Compress(compressed, content.data(), content.size(), OrthancPluginContentType_DicomAsJson));
+      continue;
+    }
+
+    ASSERT_TRUE(compression.Compress(compressed, content.data(), content.size(), OrthancPluginContentType_DicomAsJson));
+    ASSERT_LT(compressed.size(), content.size());
+    ASSERT_TRUE(CompressionHelpers::IsCompressed(compressed.data(), compressed.size()));
+    ASSERT_EQ(content.size(), CompressionHelpers::GetUncompressedSize(compressed.data(), compressed.size()));
+
+    std::string decompressed(content.size(), '\0');
+    compression.Decompress(&decompressed[0], decompressed.size(), compressed.data(), compressed.size());
+    ASSERT_EQ(content, decompressed);
+
+    // truncated objects are detected
+    ASSERT_THROW(compression.Decompress(&decompressed[0], decompressed.size(), compressed.data(), compressed.size() - 1), StoragePluginException);
+  }
+
+  // the content types that are not configured are not compressed
+  std::string content = GenerateCompressibleContent(10000);
+  std::string compressed;
+  ASSERT_TRUE(compression.IsCompressionEnabled(OrthancPluginContentType_DicomAsJson));
+  ASSERT_FALSE(compression.IsCompressionEnabled(OrthancPluginContentType_Dicom));
+  ASSERT_FALSE(compression.Compress(compressed, content.data(), content.size(), OrthancPluginContentType_Dicom));
+  ASSERT_FALSE(compression.Compress(compressed, content.data(), 0, OrthancPluginContentType_DicomAsJson));
+
+  // the uncompressed objects are not detected as compressed
+  ASSERT_FALSE(CompressionHelpers::IsCompressed(content.data(), content.size()));
+  ASSERT_FALSE(CompressionHelpers::IsCompressed("{}", 2));
+}
+
+
+TEST(CompressionHelpers, Incompressible)
+{
+  CompressionHelpers compression;
+  compression.SetLevel(OrthancPluginContentType_Dicom, 1);
+  compression.SetFrameSize(1000);
+
+  std::string compressed;
+
+  {
+    std::string content = GenerateIncompressibleContent(10000);
+    ASSERT_FALSE(compression.Compress(compressed, content.data(), content.size(), OrthancPluginContentType_Dicom));
+  }
+
+  {
+    // compressible header followed by incompressible data (e.g. DICOM with a compressed transfer syntax):
+    // the incompressible frames are stored as is
+    std::string content = GenerateCompressibleContent(5000) + GenerateIncompressibleContent(2000);
+
+    ASSERT_TRUE(compression.Compress(compressed, content.data(), content.size(), OrthancPluginContentType_Dicom));
+
+    std::string decompressed(content.size(), '\0');
+    compression.Decompress(&decompressed[0], decompressed.size(), compressed.data(), compressed.size());
+    ASSERT_EQ(content, decompressed);
+
+    // with a stricter ratio, the object is not compressed anymore
+    compression.SetMaxRatio(10);
+    ASSERT_FALSE(compression.Compress(compressed, content.data(), content.size(), OrthancPluginContentType_Dicom));
+  }
+}
+
+
+TEST(CompressionHelpers, Wrap)
+{
+  CompressionHelpers compression;
+
+  // the objects that start with the magic are wrapped, even if they are too small to contain a header
+  const size_t sizes[] = { 4, 10, 100000, 200000 };
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(size_t); i++)
+  {
+    std::string content = CompressionHelpers::MAGIC + GenerateIncompressibleContent(sizes[i] - CompressionHelpers::MAGIC_SIZE);
+    ASSERT_TRUE(CompressionHelpers::NeedsWrapping(content.data(), content.size()));
+    ASSERT_FALSE(CompressionHelpers::IsCompressed(content.data(), content.size()));
+
+    std::string wrapped;
+    CompressionHelpers::Wrap(wrapped, content.data(), content.size());
+    ASSERT_TRUE(CompressionHelpers::IsCompressed(wrapped.data(), wrapped.size()));
+    ASSERT_EQ(content.size(), CompressionHelpers::GetUncompressedSize(wrapped.data(), wrapped.size()));
+
+    std::string unwrapped(content.size(), '\0');
+    compression.Decompress(&unwrapped[0], unwrapped.size(), wrapped.data(), wrapped.size());
+    ASSERT_EQ(content, unwrapped);
+  }
+
+  ASSERT_FALSE(CompressionHelpers::NeedsWrapping("{}", 2));
+  ASSERT_FALSE(CompressionHelpers::NeedsWrapping(CompressionHelpers::MAGIC.data(), 3));
+
+  // a compressed object followed by other data is not a compressed object anymore
+  compression.SetLevel(OrthancPluginContentType_DicomAsJson, 6);
+
+  std::string content = GenerateCompressibleContent(10000);
+  std::string compressed;
+  ASSERT_TRUE(compression.Compress(compressed, content.data(), content.size(), OrthancPluginContentType_DicomAsJson));
+
+  compressed += "trailer";
+  ASSERT_FALSE(CompressionHelpers::IsCompressed(compressed.data(), compressed.size()));
+}
+
+
+TEST(CompressionHelpers, DecompressRange)
+{
+  CompressionHelpers compression;
+  compression.SetLevel(OrthancPluginContentType_DicomUntilPixelData, 9);
+  compression.SetFrameSize(100);
+
+  std::string content = GenerateCompressibleContent(1234);
+  std::string compressed;
+  ASSERT_TRUE(compression.Compress(compressed, content.data(), content.size(), OrthancPluginContentType_DicomUntilPixelData));
+
+  CompressionHelpers::FramesIndex index;
+  ASSERT_TRUE(CompressionHelpers::ParseHeader(index, compressed.data(), CompressionHelpers::HEADER_SIZE));
+  ASSERT_EQ(content.size(), index.GetUncompressedSize());
+  ASSERT_EQ(13u, index.GetFramesCount());
+
+  ASSERT_TRUE(CompressionHelpers::ParseFramesTable(index, compressed.data() + CompressionHelpers::HEADER_SIZE, index.GetIndexSize() - CompressionHelpers::HEADER_SIZE));
+  ASSERT_EQ(compressed.size(), index.GetCompressedSize());
+
+  const size_t ranges[][2] = { { 0, 0 }, { 0, 1 }, { 0, 100 }, { 99, 2 }, { 150, 700 }, { 1200, 34 }, { 0, 1234 } };
+
+  for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++)
+  {
+    uint64_t compressedOffset;
+    size_t compressedSize;
+    index.GetCompressedRange(compressedOffset, compressedSize, ranges[i][0], ranges[i][1]);
+
+    std::string range(ranges[i][1], '\0');
+    compression.DecompressRange(&range[0], range.size(), ranges[i][0], index, compressed.data() + compressedOffset, compressedSize);
+    ASSERT_EQ(content.substr(ranges[i][0], ranges[i][1]), range);
+  }
+
+  {
+    uint64_t compressedOffset;
+    size_t compressedSize;
+    ASSERT_THROW(index.GetCompressedRange(compressedOffset, compressedSize, 1200, 35), StoragePluginException);
+  }
+}
+
+
+// small objects that share most of their content, like the DICOM headers of a series
+static std::string GenerateHeader(size_t i)
+{
+  const std::string index = boost::lexical_cast<std::string>(i);
+
+  return ("{\"0008,0016\":{\"Name\":\"SOPClassUID\",\"Type\":\"String\",\"Value\":\"1.2.840.10008.5.1.4.1.1.2\"},"
+          "\"0008,0018\":{\"Name\":\"SOPInstanceUID\",\"Type\":\"String\",\"Value\":\"1.2.276.0.7230010.3.1.4." + index + "\"},"
+          "\"0008,0060\":{\"Name\":\"Modality\",\"Type\":\"String\",\"Value\":\"CT\"},"
+          "\"0010,0010\":{\"Name\":\"PatientName\",\"Type\":\"String\",\"Value\":\"Patient^" + index + "\"},"
+          "\"0020,0013\":{\"Name\":\"InstanceNumber\",\"Type\":\"String\",\"Value\":\"" + index + "\"},"
+          "\"0028,0010\":{\"Name\":\"Rows\",\"Type\":\"String\",\"Value\":\"512\"},"
+          "\"0028,0011\":{\"Name\":\"Columns\",\"Type\":\"String\",\"Value\":\"512\"}}");
+}
+
+
+TEST(CompressionHelpers, Dictionary)
+{
+  std::vector<std::string> samples;
+  for (size_t i = 0; i < 100; i++)
+  {
+    samples.push_back(GenerateHeader(i));
+  }
+
+  std::string dictionary;
+  CompressionHelpers::TrainDictionary(dictionary, samples, 4096);
+  ASSERT_FALSE(dictionary.empty());
+  ASSERT_LE(dictionary.size(), 4096u);
+
+  CompressionHelpers compression;
+  compression.SetLevel(OrthancPluginContentType_DicomAsJson, 6);
+  compression.SetMaxRatio(100);
+
+  const std::string content = GenerateHeader(1000);
+
+  std::string withoutDictionary;
+  ASSERT_TRUE(compression.Compress(withoutDictionary, content.data(), content.size(), OrthancPluginContentType_DicomAsJson));
+
+  ASSERT_EQ(0u, compression.GetActiveDictionary(OrthancPluginContentType_DicomAsJson));
+  compression.AddDictionary(1, OrthancPluginContentType_DicomAsJson, dictionary);
+  ASSERT_EQ(1u, compression.GetActiveDictionary(OrthancPluginContentType_DicomAsJson));
+  ASSERT_EQ(0u, compression.GetActiveDictionary(OrthancPluginContentType_DicomUntilPixelData));
+
+  std::string withDictionary;
+  ASSERT_TRUE(compression.Compress(withDictionary, content.data(), content.size(), OrthancPluginContentType_DicomAsJson));
+  ASSERT_LT(withDictionary.size() * 2, withoutDictionary.size());
+
+  CompressionHelpers::FramesIndex index;
+  ASSERT_TRUE(CompressionHelpers::ParseHeader(index, withDictionary.data(), withDictionary.size()));
+  ASSERT_EQ(1u, index.GetDictionaryId());
+
+  std::string decompressed(content.size(), '\0');
+  compression.Decompress(&decompressed[0], decompressed.size(), withDictionary.data(), withDictionary.size());
+  ASSERT_EQ(content, decompressed);
+
+  // the objects compressed with an older dictionary remain readable
+  compression.AddDictionary(2, OrthancPluginContentType_DicomAsJson, "other dictionary");
+  ASSERT_EQ(2u, compression.GetActiveDictionary(OrthancPluginContentType_DicomAsJson));
+  compression.Decompress(&decompressed[0], decompressed.size(), withDictionary.data(), withDictionary.size());
+  ASSERT_EQ(content, decompressed);
+
+  // the dictionary is required to decompress the object
+  CompressionHelpers other;
+  ASSERT_THROW(other.Decompress(&decompressed[0], decompressed.size(), withDictionary.data(), withDictionary.size()), StoragePluginException);
+  other.Decompress(&decompressed[0], decompressed.size(), withoutDictionary.data(), withoutDictionary.size());
+  ASSERT_EQ(content, decompressed);
+
+  // dictionaries that do not match the object are detected by zlib
+  other.AddDictionary(1, OrthancPluginContentType_DicomAsJson, "wrong dictionary");
+  ASSERT_THROW(other.Decompress(&decompressed[0], decompressed.size(), withDictionary.data(), withDictionary.size()), StoragePluginException);
+
+  // samples without common content
+  std::vector<std::string> incompressibleSamples;
+  incompressibleSamples.push_back(GenerateIncompressibleContent(1000));
+  ASSERT_THROW(CompressionHelpers::TrainDictionary(dictionary, incompressibleSamples, 4096), StoragePluginException);
+}
+
+
+TEST(CompressionHelpers, StoreDictionaries)
+{
+  const boost::filesystem::path directory = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+
+  std::string compressed;
+  const std::string content = GenerateHeader(1);
+
+  {
+    CompressionHelpers compression;
+    compression.SetLevel(OrthancPluginContentType_DicomAsJson, 6);
+    ASSERT_FALSE(compression.HasDictionariesDirectory());
+    ASSERT_THROW(compression.StoreDictionary(OrthancPluginContentType_DicomAsJson, "dictionary"), StoragePluginException);
+
+    compression.LoadDictionaries(directory.string());
+    ASSERT_TRUE(compression.HasDictionariesDirectory());
+    ASSERT_EQ(1u, compression.StoreDictionary(OrthancPluginContentType_DicomAsJson, GenerateHeader(2)));
+    ASSERT_EQ(2u, compression.StoreDictionary(OrthancPluginContentType_DicomUntilPixelData, "dictionary"));
+    ASSERT_TRUE(compression.Compress(compressed, content.data(), content.size(), OrthancPluginContentType_DicomAsJson));
+  }
+
+  {
+    CompressionHelpers compression;
+    compression.LoadDictionaries(directory.string());
+    ASSERT_EQ(1u, compression.GetActiveDictionary(OrthancPluginContentType_DicomAsJson));
+    ASSERT_EQ(2u, compression.GetActiveDictionary(OrthancPluginContentType_DicomUntilPixelData));
+    ASSERT_EQ(3u, compression.StoreDictionary(OrthancPluginContentType_DicomAsJson, "dictionary"));
+
+    std::string decompressed(content.size(), '\0');
+    compression.Decompress(&decompressed[0], decompressed.size(), compressed.data(), compressed.size());
+    ASSERT_EQ(content, decompressed);
+  }
+
+  boost::filesystem::remove_all(directory);
+}
+
+
+namespace
+{
+  // the dictionaries of several instances that share the same storage
+  class SharedDictionariesStorage : public CompressionHelpers::IDictionariesStorage
+  {
+    std::map<uint32_t, std::pair<OrthancPluginContentType, std::string> >&  dictionaries_;
+
+  public:
+    explicit SharedDictionariesStorage(std::map<uint32_t, std::pair<OrthancPluginContentType, std::string> >& dictionaries)
+      : dictionaries_(dictionaries)
+    {
+    }
+
+    virtual bool ReadDictionary(OrthancPluginContentType& type, std::string& dictionary, uint32_t id) ORTHANC_OVERRIDE
+    {
+      std::map<uint32_t, std::pair<OrthancPluginContentType, std::string> >::const_iterator found = dictionaries_.find(id);
+
+      if (found == dictionaries_.end())
+      {
+        return false;
+      }
+
+      type = found->second.first;
+      dictionary = found->second.second;
+      return true;
+    }
+
+    virtual void WriteDictionary(uint32_t id, OrthancPluginContentType type, const std::string& dictionary) ORTHANC_OVERRIDE
+    {
+      dictionaries_[id] = std::make_pair(type, dictionary);
+    }
+  };
+
+  // another instance writes a dictionary with the same id right after the first write
+  class RacingDictionariesStorage : public SharedDictionariesStorage
+  {
+    bool  raced_;
+
+  public:
+    explicit RacingDictionariesStorage(std::map<uint32_t, std::pair<OrthancPluginContentType, std::string> >& dictionaries)
+      : SharedDictionariesStorage(dictionaries),
+        raced_(false)
+    {
+    }
+
+    virtual void WriteDictionary(uint32_t id, OrthancPluginContentType type, const std::string& dictionary) ORTHANC_OVERRIDE
+    {
+      SharedDictionariesStorage::WriteDictionary(id, type, dictionary);
+
+      if (!raced_)
+      {
+        raced_ = true;
+        SharedDictionariesStorage::WriteDictionary(id, OrthancPluginContentType_DicomUntilPixelData, "other dictionary");
+      }
+    }
+  };
+
+  class UnavailableDictionariesStorage : public CompressionHelpers::IDictionariesStorage
+  {
+  public:
+    virtual bool ReadDictionary(OrthancPluginContentType& type, std::string& dictionary, uint32_t id) ORTHANC_OVERRIDE
+    {
+      throw StoragePluginException("storage unavailable");
+    }
+
+    virtual void WriteDictionary(uint32_t id, OrthancPluginContentType type, const std::string& dictionary) ORTHANC_OVERRIDE
+    {
+      throw StoragePluginException("storage unavailable");
+    }
+  };
+}
+
+
+TEST(CompressionHelpers, SharedDictionaries)
+{
+  const boost::filesystem::path directory1 = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+  const boost::filesystem::path directory2 = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+
+  std::map<uint32_t, std::pair<OrthancPluginContentType, std::string> > shared;
+
+  CompressionHelpers compression1;
+  compression1.SetLevel(OrthancPluginContentType_DicomAsJson, 6);
+  compression1.LoadDictionaries(directory1.string());
+  compression1.SetDictionariesStorage(new SharedDictionariesStorage(shared));
+  compression1.SetVerificationDelay(100);
+
+  CompressionHelpers compression2;
+  compression2.SetLevel(OrthancPluginContentType_DicomAsJson, 6);
+  compression2.LoadDictionaries(directory2.string());
+  compression2.SetDictionariesStorage(new SharedDictionariesStorage(shared));
+  compression2.SetVerificationDelay(100);
+
+  // a dictionary trained by the first instance is stored in the shared storage
+  ASSERT_EQ(1u, compression1.StoreDictionary(OrthancPluginContentType_DicomAsJson, GenerateHeader(2)));
+  ASSERT_EQ(1u, shared.size());
+
+  const std::string content = GenerateHeader(1);
+  std::string compressed;
+  ASSERT_TRUE(compression1.Compress(compressed, content.data(), content.size(), OrthancPluginContentType_DicomAsJson));
+
+  // the second instance reads it when it needs it, and keeps a local copy
+  ASSERT_EQ(0u, compression2.GetActiveDictionary(OrthancPluginContentType_DicomAsJson));
+
+  std::string decompressed(content.size(), '\0');
+  compression2.Decompress(&decompressed[0], decompressed.size(), compressed.data(), compressed.size());
+  ASSERT_EQ(content, decompressed);
+  ASSERT_EQ(1u, compression2.GetActiveDictionary(OrthancPluginContentType_DicomAsJson));
+
+  {
+    CompressionHelpers restarted;
+    restarted.LoadDictionaries(directory2.string());
+    ASSERT_EQ(1u, restarted.GetActiveDictionary(OrthancPluginContentType_DicomAsJson));
+  }
+
+  // the ids that are used by the other instances are skipped
+  ASSERT_EQ(2u, compression2.StoreDictionary(OrthancPluginContentType_DicomUntilPixelData, "dictionary"));
+  ASSERT_EQ(3u, compression1.StoreDictionary(OrthancPluginContentType_DicomAsJson, "dictionary"));
+  ASSERT_EQ(2u, compression1.GetActiveDictionary(OrthancPluginContentType_DicomUntilPixelData));
+
+  compression2.SynchronizeDictionaries();
+  ASSERT_EQ(3u, compression2.GetActiveDictionary(OrthancPluginContentType_DicomAsJson));
+
+  boost::filesystem::remove_all(directory1);
+  boost::filesystem::remove_all(directory2);
+}
+
+
+TEST(CompressionHelpers, ConcurrentDictionaries)
+{
+  const boost::filesystem::path directory = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+
+  {
+    // the id that has been overwritten by another instance is given up
+    std::map<uint32_t, std::pair<OrthancPluginContentType, std::string> > shared;
+
+    CompressionHelpers compression;
+    compression.LoadDictionaries(directory.string());
+    compression.SetDictionariesStorage(new RacingDictionariesStorage(shared));
+    compression.SetVerificationDelay(100);
+
+    ASSERT_EQ(2u, compression.StoreDictionary(OrthancPluginContentType_DicomAsJson, "dictionary"));
+    ASSERT_EQ(2u, shared.size());
+    ASSERT_EQ("other dictionary", shared[1].second);
+    ASSERT_EQ("dictionary", shared[2].second);
+    ASSERT_EQ(1u, compression.GetActiveDictionary(OrthancPluginContentType_DicomUntilPixelData));
+    ASSERT_EQ(2u, compression.GetActiveDictionary(OrthancPluginContentType_DicomAsJson));
+  }
+
+  boost::filesystem::remove_all(directory);
+
+  {
+    // an error of the storage is not mistaken for a free id
+    CompressionHelpers compression;
+    compression.LoadDictionaries(directory.string());
+    compression.SetDictionariesStorage(new UnavailableDictionariesStorage);
+    compression.SetVerificationDelay(100);
+
+    ASSERT_THROW(compression.StoreDictionary(OrthancPluginContentType_DicomAsJson, "dictionary"), StoragePluginException);
+    ASSERT_EQ(0u, compression.GetActiveDictionary(OrthancPluginContentType_DicomAsJson));
+  }
+
+  boost::filesystem::remove_all(directory);
+}
@@ -0,0 +1,275 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "gtest/gtest.h"
+
+#include "StorageTestsHelpers.h"
+#include "../Common/DeletionQueue.h"
+#include "../Common/FileSystemStorage.h"
+
+#include <boost/thread.hpp>
+
+#include <algorithm>
+
+
+namespace
+{
+  // a file system storage whose deletions fail for the objects that are marked as failing
+  class FailingDeletionsStorage : public FileSystemStoragePlugin
+  {
+  private:
+    boost::mutex           mutex_;
+    std::set<std::string>  failingObjects_;
+    unsigned int           failuresCount_;
+
+  public:
+    explicit FailingDeletionsStorage(const std::string& root)
+      : FileSystemStoragePlugin("Test", root, false),
+        failuresCount_(0)
+    {
+    }
+
+    void SetFailing(const std::string& uuid, bool failing)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (failing)
+      {
+        failingObjects_.insert(uuid);
+      }
+      else
+      {
+        failingObjects_.erase(uuid);
+      }
+    }
+
+    unsigned int GetFailuresCount()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return failuresCount_;
+    }
+
+    virtual void DeleteObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if (failingObjects_.find(uuid) != failingObjects_.end())
+        {
+          failuresCount_++;
+          throw StoragePluginException(std::string("cannot delete ") + uuid);
+        }
+      }
+
+      FileSystemStoragePlugin::DeleteObject(uuid, type, encryptionEnabled);
+    }
+  };
+}
+
+
+static boost::filesystem::path GetJournalPath(const TemporaryDirectory& root)
+{
+  return root.GetPath() / "journal" / "deletions.journal";
+}
+
+
+static std::vector<std::string> ReadJournal(const TemporaryDirectory& root)
+{
+  std::vector<std::string> lines;
+
+  boost::filesystem::ifstream f(GetJournalPath(root));
+  std::string line;
+
+  while (std::getline(f, line))
+  {
+    lines.push_back(line);
+  }
+
+  return lines;
+}
+
+
+static bool Exists(IStorage& storage, const std::string& uuid)
+{
+  return storage.FileExists(uuid, OrthancPluginContentType_Dicom, false);
+}
+
+
+static bool WaitForDeletion(IStorage& storage, const std::string& uuid)
+{
+  for (unsigned int i = 0; i < 1000; i++)
+  {
+    if (!Exists(storage, uuid))
+    {
+      return true;
+    }
+
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  return false;
+}
+
+
+static bool WaitForJournalSize(const TemporaryDirectory& root, size_t maxSize)
+{
+  for (unsigned int i = 0; i < 1000; i++)
+  {
+    if (ReadJournal(root).size() <= maxSize)
+    {
+      return true;
+    }
+
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  return false;
+}
+
+
+TEST(DeletionQueue, DeleteAndTruncateJournal)
+{
+  TemporaryDirectory root;
+  FailingDeletionsStorage storage((root.GetPath() / "storage").string());
+
+  WriteObject(storage, "aaaa-1", "hello");
+  WriteObject(storage, "bbbb-1", "world");
+
+  DeletionQueue queue(storage, NULL, (root.GetPath() / "journal").string(), 2, 10);
+
+  queue.Enqueue("aaaa-1", OrthancPluginContentType_Dicom, false);
+  queue.Enqueue("bbbb-1", OrthancPluginContentType_Dicom, false);
+
+  ASSERT_TRUE(WaitForDeletion(storage, "aaaa-1"));
+  ASSERT_TRUE(WaitForDeletion(storage, "bbbb-1"));
+
+  // the journal is truncated once the queue has been drained
+  ASSERT_TRUE(WaitForJournalSize(root, 0));
+}
+
+
+TEST(DeletionQueue, ReplayAtStartup)
+{
+  TemporaryDirectory root;
+  FailingDeletionsStorage storage((root.GetPath() / "storage").string());
+
+  WriteObject(storage, "aaaa-1", "hello");
+  WriteObject(storage, "bbbb-1", "world");
+  WriteObject(storage, "cccc-1", "kept");
+
+  // the journal of an interrupted instance, whose last line has been truncated
+  const std::string dicomType = boost::lexical_cast<std::string>(static_cast<int>(OrthancPluginContentType_Dicom));
+  WriteLocalFile(GetJournalPath(root), ("aaaa-1 " + dicomType + " 0\n" +
+                                        "bbbb-1 " + dicomType + " 0\n" +
+                                        "cccc-1 " + dicomType));
+
+  {
+    DeletionQueue queue(storage, NULL, (root.GetPath() / "journal").string(), 1, 10);
+
+    ASSERT_TRUE(WaitForDeletion(storage, "aaaa-1"));
+    ASSERT_TRUE(WaitForDeletion(storage, "bbbb-1"));
+    ASSERT_TRUE(WaitForJournalSize(root, 0));
+  }
+
+  ASSERT_TRUE(Exists(storage, "cccc-1"));
+  ASSERT_FALSE(boost::filesystem::exists(root.GetPath() / "journal" / "deletions.journal.tmp"));
+}
+
+
+TEST(DeletionQueue, CompactJournal)
+{
+  TemporaryDirectory root;
+  FailingDeletionsStorage storage((root.GetPath() / "storage").string());
+  storage.SetFailing("failing-1", true);
+
+  const std::string dicomType = boost::lexical_cast<std::string>(static_cast<int>(OrthancPluginContentType_Dicom));
+
+  WriteObject(storage, "failing-1", "failing");
+
+  for (unsigned int i = 0; i < 20; i++)
+  {
+    WriteObject(storage, "object-" + boost::lexical_cast<std::string>(i), "hello");
+  }
+
+  {
+    DeletionQueue queue(storage, NULL, (root.GetPath() / "journal").string(), 1, 1);
+    queue.SetRetryDelays(10, 3600 * 1000);
+    queue.SetCompactionThreshold(10);
+
+    queue.Enqueue("failing-1", OrthancPluginContentType_Dicom, false);
+
+    for (unsigned int i = 0; i < 20; i++)
+    {
+      queue.Enqueue("object-" + boost::lexical_cast<std::string>(i), OrthancPluginContentType_Dicom, false);
+    }
+
+    for (unsigned int i = 0; i < 20; i++)
+    {
+      ASSERT_TRUE(WaitForDeletion(storage, "object-" + boost::lexical_cast<std::string>(i)));
+    }
+
+    // the queue is never drained because of the failing object, but the journal is compacted once it
+    // contains more than twice as many entries as pending deletions (and at least 10 entries)
+    ASSERT_TRUE(WaitForJournalSize(root, 9));
+
+    const std::vector<std::string> journal = ReadJournal(root);
+    ASSERT_FALSE(journal.empty());
+    ASSERT_NE(journal.end(), std::find(journal.begin(), journal.end(), "failing-1 " + dicomType + " 0"));
+    ASSERT_TRUE(Exists(storage, "failing-1"));
+  }
+
+  // the failing deletion is resumed at the next startup
+  storage.SetFailing("failing-1", false);
+
+  DeletionQueue queue(storage, NULL, (root.GetPath() / "journal").string(), 1, 1);
+  ASSERT_TRUE(WaitForDeletion(storage, "failing-1"));
+  ASSERT_TRUE(WaitForJournalSize(root, 0));
+}
+
+
+TEST(DeletionQueue, RetryFailedBatch)
+{
+  TemporaryDirectory root;
+  FailingDeletionsStorage storage((root.GetPath() / "storage").string());
+  storage.SetFailing("aaaa-1", true);
+
+  WriteObject(storage, "aaaa-1", "hello");
+
+  DeletionQueue queue(storage, NULL, (root.GetPath() / "journal").string(), 1, 10);
+  queue.SetRetryDelays(10, 200);
+
+  queue.Enqueue("aaaa-1", OrthancPluginContentType_Dicom, false);
+
+  // all the attempts of the first batch fail, the batch is kept in the journal and requeued
+  for (unsigned int i = 0; i < 1000 && storage.GetFailuresCount() < 3; i++)
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  ASSERT_LE(3u, storage.GetFailuresCount());
+  ASSERT_TRUE(Exists(storage, "aaaa-1"));
+  ASSERT_EQ(1u, ReadJournal(root).size());
+
+  storage.SetFailing("aaaa-1", false);
+
+  ASSERT_TRUE(WaitForDeletion(storage, "aaaa-1"));
+  ASSERT_TRUE(WaitForJournalSize(root, 0));
+}
@@ -0,0 +1,272 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "gtest/gtest.h"
+
+#include "StorageTestsHelpers.h"
+#include "../Common/DiskCacheStorage.h"
+#include "../Common/FileSystemStorage.h"
+
+
+// a disk cache in "<root>/cache" in front of a file system storage in "<root>/storage"
+static DiskCacheStorage* CreateCache(const TemporaryDirectory& root, uint64_t maxSize, bool admitOnFirstAccess)
+{
+  return new DiskCacheStorage(new FileSystemStoragePlugin("Test", (root.GetPath() / "storage").string(), false),
+                              (root.GetPath() / "cache").string(), maxSize, admitOnFirstAccess);
+}
+
+static boost::filesystem::path GetCachePath(const TemporaryDirectory& root, const std::string& uuid, bool encryptionEnabled = false)
+{
+  return GetLocalObjectPath(root.GetPath() / "cache", uuid, encryptionEnabled);
+}
+
+static bool IsCached(const TemporaryDirectory& root, const std::string& uuid, bool encryptionEnabled = false)
+{
+  return boost::filesystem::is_regular_file(GetCachePath(root, uuid, encryptionEnabled));
+}
+
+// removes the object from the storage only, the cache is not aware of it
+static void RemoveFromStorage(const TemporaryDirectory& root, const std::string& uuid)
+{
+  FileSystemStoragePlugin storage("Test", (root.GetPath() / "storage").string(), false);
+  storage.DeleteObject(uuid.c_str(), OrthancPluginContentType_Dicom, false);
+}
+
+
+TEST(DiskCacheStorage, AdmissionOnSecondAccess)
+{
+  TemporaryDirectory root;
+
+  std::unique_ptr<DiskCacheStorage> cache(CreateCache(root, 1000, false));
+
+  WriteObject(*cache, "aaaa-1", std::string(100, 'a'));
+
+  // the first miss only records the key in the ghost list
+  ASSERT_EQ(std::string(100, 'a'), ReadObject(*cache, "aaaa-1"));
+  ASSERT_FALSE(IsCached(root, "aaaa-1"));
+
+  ASSERT_EQ(std::string(100, 'a'), ReadObject(*cache, "aaaa-1"));
+  ASSERT_TRUE(IsCached(root, "aaaa-1"));
+
+  // the object is now served from the cache
+  RemoveFromStorage(root, "aaaa-1");
+  ASSERT_EQ(std::string(100, 'a'), ReadObject(*cache, "aaaa-1"));
+
+  // partial reads are never stored in the cache
+  WriteObject(*cache, "bbbb-1", std::string(100, 'b'));
+
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    std::unique_ptr<IStorage::IReader> reader(cache->GetReaderForObject("bbbb-1", OrthancPluginContentType_Dicom, false));
+    char range[10];
+    reader->ReadRange(range, sizeof(range), 20);
+    ASSERT_EQ(std::string(10, 'b'), std::string(range, sizeof(range)));
+  }
+
+  ASSERT_FALSE(IsCached(root, "bbbb-1"));
+}
+
+
+TEST(DiskCacheStorage, AdmissionOnFirstAccess)
+{
+  TemporaryDirectory root;
+
+  std::unique_ptr<DiskCacheStorage> cache(CreateCache(root, 1000, true));
+
+  WriteObject(*cache, "aaaa-1", std::string(100, 'a'));
+  ASSERT_FALSE(IsCached(root, "aaaa-1"));  // the writes do not populate the cache
+
+  ASSERT_EQ(std::string(100, 'a'), ReadObject(*cache, "aaaa-1"));
+  ASSERT_TRUE(IsCached(root, "aaaa-1"));
+
+  // overwriting or deleting the object invalidates the cached copy
+  WriteObject(*cache, "aaaa-1", std::string(50, 'c'));
+  ASSERT_FALSE(IsCached(root, "aaaa-1"));
+  ASSERT_EQ(std::string(50, 'c'), ReadObject(*cache, "aaaa-1"));
+  ASSERT_TRUE(IsCached(root, "aaaa-1"));
+
+  cache->DeleteObject("aaaa-1", OrthancPluginContentType_Dicom, false);
+  ASSERT_FALSE(IsCached(root, "aaaa-1"));
+}
+
+
+TEST(DiskCacheStorage, Eviction)
+{
+  TemporaryDirectory root;
+
+  std::unique_ptr<DiskCacheStorage> cache(CreateCache(root, 250, true));
+
+  WriteObject(*cache, "aaaa-1", std::string(100, 'a'));
+  WriteObject(*cache, "bbbb-1", std::string(100, 'b'));
+  WriteObject(*cache, "cccc-1", std::string(100, 'c'));
+  WriteObject(*cache, "dddd-1", std::string(300, 'd'));
+
+  ReadObject(*cache, "aaaa-1");
+  ReadObject(*cache, "bbbb-1");
+  ASSERT_TRUE(IsCached(root, "aaaa-1"));
+  ASSERT_TRUE(IsCached(root, "bbbb-1"));
+
+  // "aaaa-1" becomes the most recently used object -> "bbbb-1" is evicted
+  ReadObject(*cache, "aaaa-1");
+  ReadObject(*cache, "cccc-1");
+  ASSERT_TRUE(IsCached(root, "aaaa-1"));
+  ASSERT_FALSE(IsCached(root, "bbbb-1"));
+  ASSERT_TRUE(IsCached(root, "cccc-1"));
+
+  // the objects that are larger than the cache are never stored
+  ASSERT_EQ(std::string(300, 'd'), ReadObject(*cache, "dddd-1"));
+  ASSERT_FALSE(IsCached(root, "dddd-1"));
+  ASSERT_TRUE(IsCached(root, "aaaa-1"));
+  ASSERT_TRUE(IsCached(root, "cccc-1"));
+}
+
+
+TEST(DiskCacheStorage, ReindexAtStartup)
+{
+  TemporaryDirectory root;
+
+  {
+    std::unique_ptr<DiskCacheStorage> cache(CreateCache(root, 1000, true));
+    WriteObject(*cache, "aaaa-1", std::string(100, 'a'));
+    WriteObject(*cache, "bbbb-1", std::string(100, 'b'));
+    ReadObject(*cache, "aaaa-1");
+    ReadObject(*cache, "bbbb-1");
+  }
+
+  // leftover of an interrupted write
+  const boost::filesystem::path tmpPath = root.GetPath() / "cache" / "interrupted.tmp";
+  WriteLocalFile(tmpPath, "garbage");
+
+  RemoveFromStorage(root, "aaaa-1");
+  RemoveFromStorage(root, "bbbb-1");
+
+  {
+    // the objects are served from the files that are already in the cache
+    std::unique_ptr<DiskCacheStorage> cache(CreateCache(root, 1000, true));
+    ASSERT_FALSE(boost::filesystem::exists(tmpPath));
+    ASSERT_EQ(std::string(100, 'a'), ReadObject(*cache, "aaaa-1"));
+    ASSERT_EQ(std::string(100, 'b'), ReadObject(*cache, "bbbb-1"));
+  }
+
+  {
+    // a smaller cache evicts the objects that do not fit anymore
+    std::unique_ptr<DiskCacheStorage> cache(CreateCache(root, 150, true));
+    ASSERT_EQ(1, IsCached(root, "aaaa-1") + IsCached(root, "bbbb-1"));
+  }
+}
+
+
+TEST(DiskCacheStorage, TruncatedCachedFile)
+{
+  TemporaryDirectory root;
+
+  std::unique_ptr<DiskCacheStorage> cache(CreateCache(root, 1000, true));
+
+  WriteObject(*cache, "aaaa-1", std::string(100, 'a'));
+  ReadObject(*cache, "aaaa-1");
+  ASSERT_TRUE(IsCached(root, "aaaa-1"));
+
+  boost::filesystem::resize_file(GetCachePath(root, "aaaa-1"), 40);
+
+  // the truncated copy is detected and the object is read from the storage
+  ASSERT_EQ(std::string(100, 'a'), ReadObject(*cache, "aaaa-1"));
+  ASSERT_FALSE(IsCached(root, "aaaa-1"));
+
+  {
+    std::unique_ptr<IStorage::IReader> reader(cache->GetReaderForObject("aaaa-1", OrthancPluginContentType_Dicom, false));
+    std::vector<char> firstBytes;
+    ASSERT_EQ(100u, reader->ReadFirstBytes(firstBytes, 10));
+    ASSERT_EQ(std::string(10, 'a'), std::string(firstBytes.begin(), firstBytes.end()));
+  }
+}
+
+
+TEST(DiskCacheStorage, EncryptedWholeReads)
+{
+  TemporaryDirectory root;
+
+  std::unique_ptr<DiskCacheStorage> cache(CreateCache(root, 1000, true));
+
+  std::string content;
+  for (size_t i = 0; i < 300; i++)
+  {
+    content.push_back(static_cast<char>(i % 251));
+  }
+
+  WriteObject(*cache, "aaaa-1", content.substr(0, 100));
+  WriteObject(*cache, "bbbb-1", content);
+  WriteObject(*cache, "cccc-1", content);
+
+  // with encryption, the small objects are read at once by their first bytes
+  {
+    std::unique_ptr<IStorage::IReader> reader(cache->GetReaderForObject("aaaa-1", OrthancPluginContentType_Dicom, true));
+    std::vector<char> firstBytes;
+    ASSERT_EQ(100u, reader->ReadFirstBytes(firstBytes, 200));
+  }
+
+  ASSERT_TRUE(IsCached(root, "aaaa-1", true));
+
+  // the large objects are read by their first bytes, then by segments that might overlap them
+  {
+    std::unique_ptr<IStorage::IReader> reader(cache->GetReaderForObject("bbbb-1", OrthancPluginContentType_Dicom, true));
+    std::vector<char> firstBytes;
+    ASSERT_EQ(300u, reader->ReadFirstBytes(firstBytes, 100));
+
+    char segment[130];
+    reader->ReadRange(segment, 80, 90);
+    ASSERT_FALSE(IsCached(root, "bbbb-1", true));
+    reader->ReadRange(segment, 130, 170);
+    ASSERT_EQ(content.substr(170), std::string(segment, 130));
+  }
+
+  ASSERT_TRUE(IsCached(root, "bbbb-1", true));
+
+  // the range reads (that probe the first bytes) are not stored
+  {
+    std::unique_ptr<IStorage::IReader> reader(cache->GetReaderForObject("cccc-1", OrthancPluginContentType_Dicom, true));
+    std::vector<char> firstBytes;
+    ASSERT_EQ(300u, reader->ReadFirstBytes(firstBytes, 10));
+
+    char range[50];
+    reader->ReadRange(range, sizeof(range), 200);
+  }
+
+  ASSERT_FALSE(IsCached(root, "cccc-1", true));
+
+  // the objects are now served from the cache
+  RemoveFromStorage(root, "aaaa-1");
+  RemoveFromStorage(root, "bbbb-1");
+
+  {
+    std::unique_ptr<IStorage::IReader> reader(cache->GetReaderForObject("aaaa-1", OrthancPluginContentType_Dicom, true));
+    std::vector<char> firstBytes;
+    ASSERT_EQ(100u, reader->ReadFirstBytes(firstBytes, 200));
+    ASSERT_EQ(content.substr(0, 100), std::string(firstBytes.begin(), firstBytes.end()));
+  }
+
+  ASSERT_EQ(content, ReadObject(*cache, "bbbb-1", true));
+
+  // no temporary file is left behind
+  for (boost::filesystem::directory_iterator it(root.GetPath() / "cache"); it != boost::filesystem::directory_iterator(); ++it)
+  {
+    ASSERT_NE(".tmp", it->path().extension().string());
+  }
+}
@@ -22,8 +22,13 @@
 #include "gtest/gtest.h"
 
 #include "../Common/EncryptionHelpers.h"
+#include <algorithm>
 #include <boost/chrono/chrono.hpp>
 #include <boost/date_time.hpp>
+#include <boost/thread.hpp>
+
+#include <set>
+#include <vector>
 
 TEST(EncryptionHelpers, GenerateKey)
 {
@@ -40,6 +45,40 @@ TEST(EncryptionHelpers, GenerateKey)
   ASSERT_EQ(32u * 2u, EncryptionHelpers::ToHexString(key1).size());
 }
 
+TEST(EncryptionHelpers, GenerateKeyConcurrently)
+{
+  // each thread has its own generator, that is reseeded periodically: generate enough keys to cross the reseed interval
+  std::vector<std::vector<std::string> > keys(4);
+  std::vector<boost::thread*> threads;
+
+  for (size_t i = 0; i < keys.size(); i++)
+  {
+    std::vector<std::string>& threadKeys = keys[i];
+    threads.push_back(new boost::thread([&threadKeys]()
+                                        {
+                                          for (size_t j = 0; j < 40000; j++)
+                                          {
+                                            CryptoPP::SecByteBlock key;
+                                            EncryptionHelpers::GenerateKey(key);
+                                            threadKeys.push_back(EncryptionHelpers::ToString(key));
+                                          }
+                                        }));
+  }
+
+  std::set<std::string> uniqueKeys;
+
+  for (size_t i = 0; i < threads.size(); i++)
+  {
+    threads[i]->join();
+    delete threads[i];
+
+    ASSERT_EQ(40000u, keys[i].size());
+    uniqueKeys.insert(keys[i].begin(), keys[i].end());
+  }
+
+  ASSERT_EQ(4u * 40000u, uniqueKeys.size());
+}
+
 TEST(EncryptionHelpers, EncryptDecryptSimpleText)
 {
   CryptoPP::SecByteBlock masterKey;
@@ -192,6 +231,469 @@ TEST(EncryptionHelpers, EncryptDecrypt2TimesSameText)
   ASSERT_EQ(plainTextMessage, decryptedMessage2);
 }
 
+TEST(EncryptionHelpers, EncryptDecryptChunked)
+{
+  CryptoPP::SecByteBlock masterKey;
+  EncryptionHelpers::GenerateKey(masterKey);
+
+  EncryptionHelpers crypto;
+  crypto.SetCurrentMasterKey(1, masterKey);
+  crypto.SetChunkSize(16);
+
+  std::string plainText;
+  for (size_t i = 0; i < 100; i++)
+  {
+    plainText.push_back(static_cast<char>('a' + i % 26));
+  }
+
+  // empty object, single partial chunk, exact multiple of the chunk size, last chunk partial
+  const size_t sizes[] = { 0, 1, 15, 16, 32, 33, 100 };
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+  {
+    std::string plainTextMessage = plainText.substr(0, sizes[i]);
+    std::string encryptedMessage;
+
+    crypto.Encrypt(encryptedMessage, plainTextMessage);
+    ASSERT_EQ(EncryptionHelpers::CHUNKED_HEADER_VERSION, encryptedMessage.substr(0, EncryptionHelpers::HEADER_VERSION_SIZE));
+    ASSERT_EQ(sizes[i], EncryptionHelpers::GetPlainTextSize(encryptedMessage.data(), encryptedMessage.size()));
+
+    std::string decryptedMessage;
+    crypto.Decrypt(decryptedMessage, encryptedMessage);
+
+    ASSERT_EQ(plainTextMessage, decryptedMessage);
+  }
+}
+
+TEST(EncryptionHelpers, DecryptRange)
+{
+  CryptoPP::SecByteBlock masterKey;
+  EncryptionHelpers::GenerateKey(masterKey);
+
+  EncryptionHelpers crypto;
+  crypto.SetCurrentMasterKey(1, masterKey);
+  crypto.SetChunkSize(16);
+
+  std::string plainTextMessage;
+  for (size_t i = 0; i < 70; i++)
+  {
+    plainTextMessage.push_back(static_cast<char>('a' + i % 26));
+  }
+
+  std::string encryptedMessage;
+  crypto.Encrypt(encryptedMessage, plainTextMessage);
+
+  EncryptionHelpers::ChunkedHeader header;
+  ASSERT_TRUE(EncryptionHelpers::ParseChunkedHeader(header, encryptedMessage.data(), encryptedMessage.size()));
+  ASSERT_EQ(16u, header.GetChunkSize());
+  ASSERT_EQ(70u, header.GetPlainTextSize());
+  ASSERT_EQ(5u, header.GetChunksCount());
+  ASSERT_EQ(encryptedMessage.size(), header.GetEncryptedSize());
+
+  for (size_t from = 0; from <= plainTextMessage.size(); from++)
+  {
+    for (size_t to = from; to <= plainTextMessage.size(); to++)
+    {
+      uint64_t encryptedOffset;
+      size_t encryptedSize;
+      header.GetEncryptedRange(encryptedOffset, encryptedSize, from, to - from);
+
+      std::string range(to - from, '\0');
+      crypto.DecryptRange(&range[0], range.size(), from, header, encryptedMessage.data() + encryptedOffset, encryptedSize);
+
+      ASSERT_EQ(plainTextMessage.substr(from, to - from), range);
+    }
+  }
+
+  {
+    uint64_t encryptedOffset;
+    size_t encryptedSize;
+    ASSERT_THROW(header.GetEncryptedRange(encryptedOffset, encryptedSize, 60, 11), EncryptionException);
+  }
+
+  {
+    // tamper a chunk: only the ranges that involve this chunk are rejected
+    std::string tamperedEncryptedMessage = encryptedMessage;
+    tamperedEncryptedMessage[EncryptionHelpers::CHUNKED_HEADER_SIZE + 1 * (16 + EncryptionHelpers::INTEGRITY_CHECK_TAG_SIZE) + 2] ^= 0x01;
+
+    uint64_t encryptedOffset;
+    size_t encryptedSize;
+    std::string range(10, '\0');
+
+    header.GetEncryptedRange(encryptedOffset, encryptedSize, 20, range.size());
+    ASSERT_THROW(crypto.DecryptRange(&range[0], range.size(), 20, header, tamperedEncryptedMessage.data() + encryptedOffset, encryptedSize), EncryptionException);
+
+    header.GetEncryptedRange(encryptedOffset, encryptedSize, 40, range.size());
+    crypto.DecryptRange(&range[0], range.size(), 40, header, tamperedEncryptedMessage.data() + encryptedOffset, encryptedSize);
+    ASSERT_EQ(plainTextMessage.substr(40, 10), range);
+  }
+}
+
+TEST(EncryptionHelpers, EncryptDecryptChunkedTampering)
+{
+  CryptoPP::SecByteBlock masterKey;
+  EncryptionHelpers::GenerateKey(masterKey);
+
+  EncryptionHelpers crypto;
+  crypto.SetCurrentMasterKey(1, masterKey);
+  crypto.SetChunkSize(8);
+
+  std::string plainTextMessage = "Plain text message";
+  std::string encryptedMessage;
+  std::string decryptedMessage;
+
+  crypto.Encrypt(encryptedMessage, plainTextMessage);
+
+  {
+    std::string tamperedEncryptedMessage = encryptedMessage;
+    // tamper the chunk size:
+    tamperedEncryptedMessage[EncryptionHelpers::CHUNKED_HEADER_SIZE - EncryptionHelpers::PLAIN_TEXT_SIZE_SIZE - EncryptionHelpers::CHUNK_SIZE_SIZE] = 9;
+    ASSERT_THROW(crypto.Decrypt(decryptedMessage, tamperedEncryptedMessage), EncryptionException);
+  }
+
+  {
+    std::string tamperedEncryptedMessage = encryptedMessage;
+    // tamper the wrapped data key:
+    tamperedEncryptedMessage[EncryptionHelpers::HEADER_VERSION_SIZE + EncryptionHelpers::MASTER_KEY_ID_SIZE + EncryptionHelpers::KEYS_WRAPPING_NONCE_SIZE + EncryptionHelpers::IV_SIZE + 2] ^= 0x01;
+    ASSERT_THROW(crypto.Decrypt(decryptedMessage, tamperedEncryptedMessage), EncryptionException);
+  }
+
+  {
+    std::string tamperedEncryptedMessage = encryptedMessage;
+    // tamper the nonce of the wrapped keys:
+    tamperedEncryptedMessage[EncryptionHelpers::HEADER_VERSION_SIZE + EncryptionHelpers::MASTER_KEY_ID_SIZE] ^= 0x01;
+    ASSERT_THROW(crypto.Decrypt(decryptedMessage, tamperedEncryptedMessage), EncryptionException);
+  }
+
+  {
+    // the keys can not be unwrapped with another master key that would have the same id
+    CryptoPP::SecByteBlock otherMasterKey;
+    EncryptionHelpers::GenerateKey(otherMasterKey);
+
+    EncryptionHelpers otherCrypto;
+    otherCrypto.SetCurrentMasterKey(1, otherMasterKey);
+    ASSERT_THROW(otherCrypto.Decrypt(decryptedMessage, encryptedMessage), EncryptionException);
+  }
+
+  {
+    std::string tamperedEncryptedMessage = encryptedMessage;
+    // swap the first two chunks:
+    const size_t chunkSize = 8 + EncryptionHelpers::INTEGRITY_CHECK_TAG_SIZE;
+    std::string firstChunk = tamperedEncryptedMessage.substr(EncryptionHelpers::CHUNKED_HEADER_SIZE, chunkSize);
+    std::string secondChunk = tamperedEncryptedMessage.substr(EncryptionHelpers::CHUNKED_HEADER_SIZE + chunkSize, chunkSize);
+    tamperedEncryptedMessage.replace(EncryptionHelpers::CHUNKED_HEADER_SIZE, chunkSize, secondChunk);
+    tamperedEncryptedMessage.replace(EncryptionHelpers::CHUNKED_HEADER_SIZE + chunkSize, chunkSize, firstChunk);
+    ASSERT_THROW(crypto.Decrypt(decryptedMessage, tamperedEncryptedMessage), EncryptionException);
+  }
+
+  {
+    std::string tamperedEncryptedMessage = encryptedMessage;
+    // tamper the last mac:
+    tamperedEncryptedMessage[tamperedEncryptedMessage.size() - 2] ^= 0x01;
+    ASSERT_THROW(crypto.Decrypt(decryptedMessage, tamperedEncryptedMessage), EncryptionException);
+  }
+
+  {
+    std::string tamperedEncryptedMessage = encryptedMessage;
+    // reduce the file content
+    tamperedEncryptedMessage = tamperedEncryptedMessage.substr(0, tamperedEncryptedMessage.size() - 5);
+    ASSERT_THROW(crypto.Decrypt(decryptedMessage, tamperedEncryptedMessage), EncryptionException);
+  }
+}
+
+TEST(EncryptionHelpers, DecryptLegacyFormat)
+{
+  CryptoPP::SecByteBlock masterKey;
+  EncryptionHelpers::GenerateKey(masterKey);
+
+  EncryptionHelpers legacyCrypto;
+  legacyCrypto.SetCurrentMasterKey(1, masterKey);
+
+  std::string plainTextMessage = "Plain text message";
+  std::string encryptedMessage;
+
+  legacyCrypto.Encrypt(encryptedMessage, plainTextMessage);
+  ASSERT_EQ(EncryptionHelpers::HEADER_VERSION, encryptedMessage.substr(0, EncryptionHelpers::HEADER_VERSION_SIZE));
+
+  EncryptionHelpers::ChunkedHeader header;
+  ASSERT_FALSE(EncryptionHelpers::ParseChunkedHeader(header, encryptedMessage.data(), encryptedMessage.size()));
+
+  // objects in the legacy format can still be read when chunked encryption is enabled
+  EncryptionHelpers crypto;
+  crypto.SetCurrentMasterKey(1, masterKey);
+  crypto.SetChunkSize(64 * 1024);
+
+  std::string decryptedMessage;
+  crypto.Decrypt(decryptedMessage, encryptedMessage);
+
+  ASSERT_EQ(plainTextMessage, decryptedMessage);
+}
+
+TEST(EncryptionHelpers, EncryptInCallerBuffer)
+{
+  CryptoPP::SecByteBlock masterKey;
+  EncryptionHelpers::GenerateKey(masterKey);
+
+  const std::string plainTextMessage = "Plain text message";
+
+  for (size_t chunkSize = 0; chunkSize <= 8; chunkSize += 8)  // legacy and chunked formats
+  {
+    EncryptionHelpers crypto;
+    crypto.SetCurrentMasterKey(1, masterKey);
+    crypto.SetChunkSize(chunkSize);
+
+    std::vector<char> encrypted(crypto.GetEncryptedSize(plainTextMessage.size()));
+    crypto.Encrypt(encrypted.data(), plainTextMessage.data(), plainTextMessage.size());
+
+    ASSERT_EQ(plainTextMessage.size(), EncryptionHelpers::GetPlainTextSize(encrypted.data(), encrypted.size()));
+
+    std::vector<char> decrypted(plainTextMessage.size());
+    crypto.Decrypt(decrypted.data(), encrypted.data(), encrypted.size());
+
+    ASSERT_EQ(plainTextMessage, std::string(decrypted.data(), decrypted.size()));
+  }
+}
+
+TEST(EncryptionHelpers, EncryptDecryptParallel)
+{
+  CryptoPP::SecByteBlock masterKey;
+  EncryptionHelpers::GenerateKey(masterKey);
+
+  EncryptionHelpers sequentialCrypto;
+  sequentialCrypto.SetCurrentMasterKey(1, masterKey);
+  sequentialCrypto.SetChunkSize(16);
+
+  EncryptionHelpers parallelCrypto;
+  parallelCrypto.SetCurrentMasterKey(1, masterKey);
+  parallelCrypto.SetChunkSize(16);
+  parallelCrypto.SetParallelism(4, 0);
+
+  std::string plainTextMessage;
+  for (size_t i = 0; i < 1000; i++)
+  {
+    plainTextMessage.push_back(static_cast<char>(i % 251));
+  }
+
+  // the objects encrypted in parallel can be decrypted sequentially, and vice versa
+  std::string encryptedMessage;
+  std::string decryptedMessage;
+
+  parallelCrypto.Encrypt(encryptedMessage, plainTextMessage);
+  sequentialCrypto.Decrypt(decryptedMessage, encryptedMessage);
+  ASSERT_EQ(plainTextMessage, decryptedMessage);
+
+  sequentialCrypto.Encrypt(encryptedMessage, plainTextMessage);
+  parallelCrypto.Decrypt(decryptedMessage, encryptedMessage);
+  ASSERT_EQ(plainTextMessage, decryptedMessage);
+
+  {
+    EncryptionHelpers::ChunkedHeader header;
+    ASSERT_TRUE(EncryptionHelpers::ParseChunkedHeader(header, encryptedMessage.data(), encryptedMessage.size()));
+
+    uint64_t encryptedOffset;
+    size_t encryptedSize;
+    header.GetEncryptedRange(encryptedOffset, encryptedSize, 37, 500);
+
+    std::string range(500, '\0');
+    parallelCrypto.DecryptRange(&range[0], range.size(), 37, header, encryptedMessage.data() + encryptedOffset, encryptedSize);
+    ASSERT_EQ(plainTextMessage.substr(37, 500), range);
+  }
+
+  {
+    std::string tamperedEncryptedMessage = encryptedMessage;
+    // tamper a chunk in the middle of the object:
+    tamperedEncryptedMessage[EncryptionHelpers::CHUNKED_HEADER_SIZE + 30 * (16 + EncryptionHelpers::INTEGRITY_CHECK_TAG_SIZE) + 3] ^= 0x01;
+    ASSERT_THROW(parallelCrypto.Decrypt(decryptedMessage, tamperedEncryptedMessage), EncryptionException);
+  }
+}
+
+static void EncryptDecryptRepeatedly(EncryptionHelpers* crypto, const std::string* plainTextMessage, bool* success)
+{
+  *success = true;
+
+  for (unsigned int i = 0; i < 50; i++)
+  {
+    std::string encryptedMessage;
+    std::string decryptedMessage;
+    crypto->Encrypt(encryptedMessage, *plainTextMessage);
+    crypto->Decrypt(decryptedMessage, encryptedMessage);
+
+    if (decryptedMessage != *plainTextMessage)
+    {
+      *success = false;
+    }
+  }
+}
+
+TEST(EncryptionHelpers, EncryptDecryptParallelSharedPool)
+{
+  CryptoPP::SecByteBlock masterKey;
+  EncryptionHelpers::GenerateKey(masterKey);
+
+  EncryptionHelpers crypto;
+  crypto.SetCurrentMasterKey(1, masterKey);
+  crypto.SetChunkSize(16);
+  crypto.SetParallelism(3, 0);
+
+  std::string plainTextMessage;
+  for (size_t i = 0; i < 1000; i++)
+  {
+    plainTextMessage.push_back(static_cast<char>(i % 251));
+  }
+
+  // more callers than threads in the pool: each caller also processes its own chunks
+  static const size_t CALLERS_COUNT = 8;
+  bool success[CALLERS_COUNT];
+  std::vector<boost::thread*> callers;
+
+  for (size_t i = 0; i < CALLERS_COUNT; i++)
+  {
+    callers.push_back(new boost::thread(EncryptDecryptRepeatedly, &crypto, &plainTextMessage, &success[i]));
+  }
+
+  for (size_t i = 0; i < CALLERS_COUNT; i++)
+  {
+    callers[i]->join();
+    delete callers[i];
+    ASSERT_TRUE(success[i]);
+  }
+
+  // the pool can be replaced between two objects
+  crypto.SetParallelism(2, 0);
+  bool lastSuccess;
+  EncryptDecryptRepeatedly(&crypto, &plainTextMessage, &lastSuccess);
+  ASSERT_TRUE(lastSuccess);
+}
+
+TEST(EncryptionHelpers, EncryptRange)
+{
+  CryptoPP::SecByteBlock masterKey;
+  EncryptionHelpers::GenerateKey(masterKey);
+
+  EncryptionHelpers crypto;
+  crypto.SetCurrentMasterKey(1, masterKey);
+  crypto.SetChunkSize(16);
+  crypto.SetParallelism(4, 0);
+
+  std::string plainTextMessage;
+  for (size_t i = 0; i < 1000; i++)
+  {
+    plainTextMessage.push_back(static_cast<char>(i % 251));
+  }
+
+  std::unique_ptr<EncryptionHelpers::ChunkedEncryptor> encryptor(crypto.CreateChunkedEncryptor(plainTextMessage.data(), plainTextMessage.size()));
+  const size_t encryptedSize = static_cast<size_t>(encryptor->GetHeader().GetEncryptedSize());
+  ASSERT_EQ(crypto.GetEncryptedSize(plainTextMessage.size()), encryptedSize);
+
+  std::string wholeEncryptedMessage(encryptedSize, '\0');
+  crypto.EncryptRange(&wholeEncryptedMessage[0], encryptedSize, 0, *encryptor);
+
+  // the ranges do not need to be aligned on the chunks, nor to be encrypted in order
+  const size_t rangeSizes[] = { 1, 7, 32, 81, 100, 333 };
+
+  for (size_t i = 0; i < sizeof(rangeSizes) / sizeof(size_t); i++)
+  {
+    std::string encryptedMessage(encryptedSize, '\0');
+    std::vector<size_t> offsets;
+
+    for (size_t offset = 0; offset < encryptedSize; offset += rangeSizes[i])
+    {
+      offsets.push_back(offset);
+    }
+
+    std::reverse(offsets.begin(), offsets.end());
+
+    for (size_t j = 0; j < offsets.size(); j++)
+    {
+      const size_t rangeSize = std::min(rangeSizes[i], encryptedSize - offsets[j]);
+      crypto.EncryptRange(&encryptedMessage[offsets[j]], rangeSize, offsets[j], *encryptor);
+    }
+
+    ASSERT_EQ(wholeEncryptedMessage, encryptedMessage);
+  }
+
+  std::string decryptedMessage;
+  crypto.Decrypt(decryptedMessage, wholeEncryptedMessage);
+  ASSERT_EQ(plainTextMessage, decryptedMessage);
+
+  {
+    std::string tooLarge(10, '\0');
+    ASSERT_THROW(crypto.EncryptRange(&tooLarge[0], tooLarge.size(), encryptedSize - 5, *encryptor), EncryptionException);
+  }
+
+  crypto.SetChunkSize(0);
+  ASSERT_THROW(encryptor.reset(crypto.CreateChunkedEncryptor(plainTextMessage.data(), plainTextMessage.size())), EncryptionException);
+}
+
+#if defined(ORTHANC_ENABLE_SSL) && ORTHANC_ENABLE_SSL == 1
+TEST(EncryptionHelpers, OpenSslEngine)
+{
+  CryptoPP::SecByteBlock masterKey;
+  EncryptionHelpers::GenerateKey(masterKey);
+
+  EncryptionHelpers cryptoppCrypto;
+  cryptoppCrypto.SetCurrentMasterKey(1, masterKey);
+  ASSERT_EQ(std::string("Crypto++"), cryptoppCrypto.GetEngineName());
+
+  EncryptionHelpers openSslCrypto;
+  openSslCrypto.SetCurrentMasterKey(1, masterKey);
+  openSslCrypto.SetEngine(new OpenSslEncryptionEngine);
+  ASSERT_EQ(std::string("OpenSSL"), openSslCrypto.GetEngineName());
+
+  std::string plainTextMessage;
+  for (size_t i = 0; i < 1000; i++)
+  {
+    plainTextMessage.push_back(static_cast<char>(i % 251));
+  }
+
+  // both engines produce the same formats: the objects encrypted by one engine are decrypted by the other one
+  const size_t chunkSizes[] = { 0, 16, 1000, 4096 };
+
+  for (size_t i = 0; i < sizeof(chunkSizes) / sizeof(size_t); i++)
+  {
+    cryptoppCrypto.SetChunkSize(chunkSizes[i]);
+    openSslCrypto.SetChunkSize(chunkSizes[i]);
+
+    std::string encryptedMessage;
+    std::string decryptedMessage;
+
+    openSslCrypto.Encrypt(encryptedMessage, plainTextMessage);
+    cryptoppCrypto.Decrypt(decryptedMessage, encryptedMessage);
+    ASSERT_EQ(plainTextMessage, decryptedMessage);
+
+    openSslCrypto.Decrypt(decryptedMessage, encryptedMessage);
+    ASSERT_EQ(plainTextMessage, decryptedMessage);
+
+    cryptoppCrypto.Encrypt(encryptedMessage, plainTextMessage);
+    openSslCrypto.Decrypt(decryptedMessage, encryptedMessage);
+    ASSERT_EQ(plainTextMessage, decryptedMessage);
+
+    openSslCrypto.Encrypt(encryptedMessage, "");
+    cryptoppCrypto.Decrypt(decryptedMessage, encryptedMessage);
+    ASSERT_EQ(std::string(), decryptedMessage);
+
+    std::string tamperedEncryptedMessage = encryptedMessage;
+    tamperedEncryptedMessage[tamperedEncryptedMessage.size() - 1] ^= 0x01;
+    ASSERT_THROW(openSslCrypto.Decrypt(decryptedMessage, tamperedEncryptedMessage), EncryptionException);
+  }
+
+  {
+    // the same master key and data key must give the same AES results with both engines
+    CryptoPP::SecByteBlock dataKey;
+    EncryptionHelpers::GenerateKey(dataKey);
+
+    CryptoppEncryptionEngine cryptoppEngine;
+    OpenSslEncryptionEngine openSslEngine;
+
+    uint8_t cryptoppCtr[32];
+    uint8_t openSslCtr[32];
+    cryptoppEngine.ProcessCtr(cryptoppCtr, dataKey.data(), dataKey.size(), masterKey);
+    openSslEngine.ProcessCtr(openSslCtr, dataKey.data(), dataKey.size(), masterKey);
+    ASSERT_EQ(0, memcmp(cryptoppCtr, openSslCtr, sizeof(cryptoppCtr)));
+  }
+}
+#endif
+
 TEST(EncryptionHelpers, RotateMasterKeys)
 {
   std::string plainTextMessage = "Plain text message";
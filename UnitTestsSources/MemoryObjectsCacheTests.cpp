@@ -0,0 +1,110 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "gtest/gtest.h"
+
+#include "../Common/MemoryObjectsCache.h"
+
+
+static bool IsCached(MemoryObjectsCache& cache, const std::string& uuid, OrthancPluginContentType type)
+{
+  return cache.Lookup(uuid, type).get() != NULL;
+}
+
+
+TEST(MemoryObjectsCache, LruOrder)
+{
+  MemoryObjectsCache cache(250, 1);
+  cache.SetMaxObjectSize(OrthancPluginContentType_DicomAsJson, 100);
+
+  cache.Add("a", OrthancPluginContentType_DicomAsJson, std::string(100, 'a').data(), 100);
+  cache.Add("b", OrthancPluginContentType_DicomAsJson, std::string(100, 'b').data(), 100);
+
+  // "a" becomes the most recently used object -> "b" is evicted to make room for "c"
+  ASSERT_TRUE(IsCached(cache, "a", OrthancPluginContentType_DicomAsJson));
+  cache.Add("c", OrthancPluginContentType_DicomAsJson, std::string(100, 'c').data(), 100);
+
+  ASSERT_TRUE(IsCached(cache, "a", OrthancPluginContentType_DicomAsJson));
+  ASSERT_FALSE(IsCached(cache, "b", OrthancPluginContentType_DicomAsJson));
+  ASSERT_TRUE(IsCached(cache, "c", OrthancPluginContentType_DicomAsJson));
+
+  ASSERT_EQ(std::string(100, 'a'), *cache.Lookup("a", OrthancPluginContentType_DicomAsJson));
+  ASSERT_EQ(std::string(100, 'c'), *cache.Lookup("c", OrthancPluginContentType_DicomAsJson));
+
+  // replacing an object does not count twice
+  cache.Add("c", OrthancPluginContentType_DicomAsJson, std::string(50, 'd').data(), 50);
+  cache.Add("e", OrthancPluginContentType_DicomAsJson, std::string(100, 'e').data(), 100);
+  ASSERT_TRUE(IsCached(cache, "a", OrthancPluginContentType_DicomAsJson));
+  ASSERT_EQ(std::string(50, 'd'), *cache.Lookup("c", OrthancPluginContentType_DicomAsJson));
+  ASSERT_TRUE(IsCached(cache, "e", OrthancPluginContentType_DicomAsJson));
+}
+
+
+TEST(MemoryObjectsCache, MaxObjectSizePerType)
+{
+  MemoryObjectsCache cache(10000, 4);
+  cache.SetMaxObjectSize(OrthancPluginContentType_DicomAsJson, 100);
+  cache.SetMaxObjectSize(OrthancPluginContentType_DicomUntilPixelData, 1000);
+
+  ASSERT_TRUE(cache.IsCacheable(OrthancPluginContentType_DicomAsJson, 100));
+  ASSERT_FALSE(cache.IsCacheable(OrthancPluginContentType_DicomAsJson, 101));
+  ASSERT_TRUE(cache.IsCacheable(OrthancPluginContentType_DicomUntilPixelData, 1000));
+  ASSERT_FALSE(cache.IsCacheable(OrthancPluginContentType_Dicom, 1));  // no maximum size -> never cached
+
+  const std::string content(500, 'x');
+
+  cache.Add("a", OrthancPluginContentType_DicomAsJson, content.data(), 500);
+  cache.Add("a", OrthancPluginContentType_DicomUntilPixelData, content.data(), 500);
+  cache.Add("a", OrthancPluginContentType_Dicom, content.data(), 500);
+
+  ASSERT_FALSE(IsCached(cache, "a", OrthancPluginContentType_DicomAsJson));
+  ASSERT_TRUE(IsCached(cache, "a", OrthancPluginContentType_DicomUntilPixelData));
+  ASSERT_FALSE(IsCached(cache, "a", OrthancPluginContentType_Dicom));
+
+  // the objects that are larger than a shard are never cached
+  MemoryObjectsCache smallCache(1000, 4);
+  smallCache.SetMaxObjectSize(OrthancPluginContentType_DicomUntilPixelData, 1000);
+  smallCache.Add("a", OrthancPluginContentType_DicomUntilPixelData, content.data(), 500);
+  ASSERT_FALSE(IsCached(smallCache, "a", OrthancPluginContentType_DicomUntilPixelData));
+}
+
+
+TEST(MemoryObjectsCache, Invalidation)
+{
+  MemoryObjectsCache cache(10000, 4);
+  cache.SetMaxObjectSize(OrthancPluginContentType_DicomAsJson, 100);
+  cache.SetMaxObjectSize(OrthancPluginContentType_DicomUntilPixelData, 100);
+
+  cache.Add("a", OrthancPluginContentType_DicomAsJson, "json", 4);
+  cache.Add("a", OrthancPluginContentType_DicomUntilPixelData, "header", 6);
+  cache.Add("b", OrthancPluginContentType_DicomAsJson, "other", 5);
+
+  // the content that has already been looked up stays valid after the invalidation
+  boost::shared_ptr<std::string> content = cache.Lookup("a", OrthancPluginContentType_DicomAsJson);
+
+  cache.Invalidate("a", OrthancPluginContentType_DicomAsJson);
+  cache.Invalidate("c", OrthancPluginContentType_DicomAsJson);  // unknown objects are ignored
+
+  ASSERT_EQ("json", *content);
+  ASSERT_FALSE(IsCached(cache, "a", OrthancPluginContentType_DicomAsJson));
+  ASSERT_EQ("header", *cache.Lookup("a", OrthancPluginContentType_DicomUntilPixelData));
+  ASSERT_EQ("other", *cache.Lookup("b", OrthancPluginContentType_DicomAsJson));
+}
@@ -0,0 +1,100 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "../Common/IStorage.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/lexical_cast.hpp>
+
+
+// helpers of the tests of the storages that are layered on a file system storage
+
+// a directory that is removed with its content at the end of the test
+class TemporaryDirectory : public boost::noncopyable
+{
+private:
+  boost::filesystem::path  path_;
+
+public:
+  TemporaryDirectory()
+    : path_(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path())
+  {
+  }
+
+  ~TemporaryDirectory()
+  {
+    boost::system::error_code err;
+    boost::filesystem::remove_all(path_, err);
+  }
+
+  const boost::filesystem::path& GetPath() const
+  {
+    return path_;
+  }
+};
+
+
+// path of an object of type "Dicom" in the directories of the local cache and of the write-behind journal
+inline boost::filesystem::path GetLocalObjectPath(const boost::filesystem::path& directory,
+                                                  const std::string& uuid,
+                                                  bool encryptionEnabled = false)
+{
+  const std::string key = uuid + "." + boost::lexical_cast<std::string>(static_cast<int>(OrthancPluginContentType_Dicom)) +
+    (encryptionEnabled ? ".enc" : "");
+  return directory / key.substr(0, 2) / key;
+}
+
+
+inline void WriteLocalFile(const boost::filesystem::path& path,
+                           const std::string& content)
+{
+  boost::filesystem::create_directories(path.parent_path());
+  boost::filesystem::ofstream f(path, std::ios::binary);
+  f << content;
+}
+
+
+inline void WriteObject(IStorage& storage,
+                        const std::string& uuid,
+                        const std::string& content)
+{
+  std::unique_ptr<IStorage::IWriter> writer(storage.GetWriterForObject(uuid.c_str(), OrthancPluginContentType_Dicom, false));
+  writer->Write(content.data(), content.size());
+}
+
+
+inline std::string ReadObject(IStorage& storage,
+                              const std::string& uuid,
+                              bool encryptionEnabled = false)
+{
+  std::unique_ptr<IStorage::IReader> reader(storage.GetReaderForObject(uuid.c_str(), OrthancPluginContentType_Dicom, encryptionEnabled));
+
+  std::string content(reader->GetSize(), '\0');
+  if (!content.empty())
+  {
+    reader->ReadWhole(&content[0], content.size());
+  }
+
+  return content;
+}
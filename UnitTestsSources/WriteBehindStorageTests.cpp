@@ -0,0 +1,385 @@
+/**
+ * Cloud storage plugins for Orthanc
+ * Copyright (C) 2020-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "gtest/gtest.h"
+
+#include "StorageTestsHelpers.h"
+#include "../Common/FileSystemStorage.h"
+#include "../Common/WriteBehindStorage.h"
+
+#include <boost/thread.hpp>
+
+
+namespace
+{
+  // a file system storage whose writes and deletions can be made to fail, or whose writes can be blocked once
+  // the content has been written (i.e. the upload is complete but has not been acknowledged yet), to control
+  // the uploaders
+  class ControlledStorage : public FileSystemStoragePlugin
+  {
+  private:
+    class Writer : public IStorage::IWriter
+    {
+      ControlledStorage&                  that_;
+      std::unique_ptr<IStorage::IWriter>  writer_;
+
+    public:
+      Writer(ControlledStorage& that, IStorage::IWriter* writer)
+        : that_(that),
+          writer_(writer)
+      {
+      }
+
+      virtual void Write(const char* data, size_t size) ORTHANC_OVERRIDE
+      {
+        that_.EnterWrite();
+        writer_->Write(data, size);
+        that_.WaitUntilUnblocked();
+      }
+
+      virtual void WriteFromSource(IStorage::IContentSource& source, size_t size) ORTHANC_OVERRIDE
+      {
+        that_.EnterWrite();
+        writer_->WriteFromSource(source, size);
+        that_.WaitUntilUnblocked();
+      }
+    };
+
+    boost::mutex                mutex_;
+    boost::condition_variable   changed_;
+    bool                        blocked_;
+    unsigned int                writesCount_;
+    unsigned int                failuresCount_;
+    unsigned int                deleteFailuresCount_;
+    std::vector<std::string>    deletedObjects_;
+
+    void EnterWrite()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (failuresCount_ > 0)
+      {
+        failuresCount_--;
+        writesCount_++;
+        changed_.notify_all();
+        throw StoragePluginException("simulated failure");
+      }
+    }
+
+    void WaitUntilUnblocked()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      writesCount_++;
+      changed_.notify_all();
+
+      // bounded, so that a failed test does not hang while the storage is destroyed
+      while (blocked_)
+      {
+        if (!changed_.timed_wait(lock, boost::posix_time::seconds(10)))
+        {
+          break;
+        }
+      }
+    }
+
+  public:
+    explicit ControlledStorage(const std::string& rootPath)
+      : FileSystemStoragePlugin("Test", rootPath, false),
+        blocked_(false),
+        writesCount_(0),
+        failuresCount_(0),
+        deleteFailuresCount_(0)
+    {
+    }
+
+    void SetBlocked(bool blocked)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      blocked_ = blocked;
+      changed_.notify_all();
+    }
+
+    void SetFailuresCount(unsigned int count)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      failuresCount_ = count;
+    }
+
+    void SetDeleteFailuresCount(unsigned int count)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      deleteFailuresCount_ = count;
+    }
+
+    bool WaitForWrites(unsigned int count)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      while (writesCount_ < count)
+      {
+        if (!changed_.timed_wait(lock, boost::posix_time::seconds(10)))
+        {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    std::vector<std::string> GetDeletedObjects()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return deletedObjects_;
+    }
+
+    virtual IStorage::IWriter* GetWriterForObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE
+    {
+      return new Writer(*this, FileSystemStoragePlugin::GetWriterForObject(uuid, type, encryptionEnabled));
+    }
+
+    virtual void DeleteObject(const char* uuid, OrthancPluginContentType type, bool encryptionEnabled) ORTHANC_OVERRIDE
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if (deleteFailuresCount_ > 0)
+        {
+          deleteFailuresCount_--;
+          throw StoragePluginException("simulated failure");
+        }
+
+        deletedObjects_.push_back(uuid);
+      }
+
+      FileSystemStoragePlugin::DeleteObject(uuid, type, encryptionEnabled);
+    }
+  };
+}
+
+
+static boost::filesystem::path GetJournalPath(const TemporaryDirectory& root, const std::string& uuid)
+{
+  return GetLocalObjectPath(root.GetPath() / "journal", uuid);
+}
+
+static boost::filesystem::path GetDeletionMarkerPath(const TemporaryDirectory& root, const std::string& uuid)
+{
+  boost::filesystem::path path = GetJournalPath(root, uuid);
+  path += ".deleted";
+  return path;
+}
+
+// waits until the object has reached the underlying storage and has left the journal
+static bool WaitForUpload(const TemporaryDirectory& root, IStorage& storage, const std::string& uuid)
+{
+  for (unsigned int i = 0; i < 1000; i++)
+  {
+    if (storage.FileExists(uuid, OrthancPluginContentType_Dicom, false) &&
+        !boost::filesystem::exists(GetJournalPath(root, uuid)))
+    {
+      return true;
+    }
+
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  return false;
+}
+
+
+TEST(WriteBehindStorage, UploadAndRead)
+{
+  TemporaryDirectory root;
+
+  ControlledStorage* storage = new ControlledStorage((root.GetPath() / "storage").string());
+  storage->SetBlocked(true);
+
+  WriteBehindStorage writeBehind(storage, (root.GetPath() / "journal").string(), 2, false);
+
+  WriteObject(writeBehind, "aaaa-1", "hello");
+
+  // the object stays in the journal until its upload is acknowledged
+  ASSERT_TRUE(storage->WaitForWrites(1));
+  ASSERT_TRUE(boost::filesystem::exists(GetJournalPath(root, "aaaa-1")));
+  ASSERT_TRUE(writeBehind.FileExists("aaaa-1", OrthancPluginContentType_Dicom, false));
+  ASSERT_EQ("hello", ReadObject(writeBehind, "aaaa-1"));
+
+  storage->SetBlocked(false);
+  ASSERT_TRUE(WaitForUpload(root, *storage, "aaaa-1"));
+  ASSERT_EQ("hello", ReadObject(writeBehind, "aaaa-1"));
+  ASSERT_EQ("hello", ReadObject(*storage, "aaaa-1"));
+}
+
+
+TEST(WriteBehindStorage, RetryFailedUpload)
+{
+  TemporaryDirectory root;
+
+  ControlledStorage* storage = new ControlledStorage((root.GetPath() / "storage").string());
+  storage->SetFailuresCount(1);
+
+  WriteBehindStorage writeBehind(storage, (root.GetPath() / "journal").string(), 1, false);
+
+  WriteObject(writeBehind, "aaaa-1", "hello");
+
+  // the upload fails once, the object stays in the journal and is retried after 1 second
+  ASSERT_TRUE(storage->WaitForWrites(2));
+  ASSERT_TRUE(WaitForUpload(root, *storage, "aaaa-1"));
+  ASSERT_EQ("hello", ReadObject(*storage, "aaaa-1"));
+}
+
+
+TEST(WriteBehindStorage, DeleteWhileUploading)
+{
+  TemporaryDirectory root;
+
+  ControlledStorage* storage = new ControlledStorage((root.GetPath() / "storage").string());
+  storage->SetBlocked(true);
+
+  WriteBehindStorage writeBehind(storage, (root.GetPath() / "journal").string(), 1, false);
+
+  WriteObject(writeBehind, "aaaa-1", "uploading");
+  ASSERT_TRUE(storage->WaitForWrites(1));
+
+  // the only uploader is waiting for the acknowledgment of "aaaa-1": "bbbb-1" is still waiting in the journal
+  WriteObject(writeBehind, "bbbb-1", "pending");
+
+  writeBehind.DeleteObject("aaaa-1", OrthancPluginContentType_Dicom, false);
+  writeBehind.DeleteObject("bbbb-1", OrthancPluginContentType_Dicom, false);
+
+  ASSERT_FALSE(writeBehind.FileExists("aaaa-1", OrthancPluginContentType_Dicom, false));
+  ASSERT_FALSE(writeBehind.FileExists("bbbb-1", OrthancPluginContentType_Dicom, false));
+  ASSERT_FALSE(boost::filesystem::exists(GetJournalPath(root, "aaaa-1")));
+  ASSERT_FALSE(boost::filesystem::exists(GetJournalPath(root, "bbbb-1")));
+
+  // once its upload is complete, "aaaa-1" is deleted from the storage.  "bbbb-1" never reaches the storage.
+  storage->SetBlocked(false);
+
+  for (unsigned int i = 0; i < 1000 && storage->GetDeletedObjects().empty(); i++)
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  ASSERT_EQ(1u, storage->GetDeletedObjects().size());
+  ASSERT_EQ("aaaa-1", storage->GetDeletedObjects()[0]);
+  ASSERT_FALSE(storage->FileExists("aaaa-1", OrthancPluginContentType_Dicom, false));
+  ASSERT_FALSE(storage->FileExists("bbbb-1", OrthancPluginContentType_Dicom, false));
+}
+
+
+TEST(WriteBehindStorage, RetryDeleteAfterUpload)
+{
+  TemporaryDirectory root;
+
+  ControlledStorage* storage = new ControlledStorage((root.GetPath() / "storage").string());
+  storage->SetBlocked(true);
+  storage->SetDeleteFailuresCount(1);
+
+  WriteBehindStorage writeBehind(storage, (root.GetPath() / "journal").string(), 1, false);
+
+  WriteObject(writeBehind, "aaaa-1", "uploading");
+  ASSERT_TRUE(storage->WaitForWrites(1));
+
+  writeBehind.DeleteObject("aaaa-1", OrthancPluginContentType_Dicom, false);
+  ASSERT_TRUE(boost::filesystem::exists(GetDeletionMarkerPath(root, "aaaa-1")));
+
+  // the first deletion from the storage fails: the object stays hidden and its deletion is retried after 1 second
+  storage->SetBlocked(false);
+
+  for (unsigned int i = 0; i < 1000 && storage->GetDeletedObjects().empty(); i++)
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  ASSERT_EQ(1u, storage->GetDeletedObjects().size());
+  ASSERT_FALSE(storage->FileExists("aaaa-1", OrthancPluginContentType_Dicom, false));
+  ASSERT_FALSE(writeBehind.FileExists("aaaa-1", OrthancPluginContentType_Dicom, false));
+
+  for (unsigned int i = 0; i < 1000 && boost::filesystem::exists(GetDeletionMarkerPath(root, "aaaa-1")); i++)
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  ASSERT_FALSE(boost::filesystem::exists(GetDeletionMarkerPath(root, "aaaa-1")));
+}
+
+
+TEST(WriteBehindStorage, ReplayDeletionAtStartup)
+{
+  TemporaryDirectory root;
+
+  // an interrupted instance had uploaded "aaaa-1" but not deleted it yet.  The deletion of "bbbb-1" was
+  // journaled, but its journal file had not been removed yet.
+  ControlledStorage* storage = new ControlledStorage((root.GetPath() / "storage").string());
+  WriteObject(*storage, "aaaa-1", "uploaded");
+  WriteLocalFile(GetDeletionMarkerPath(root, "aaaa-1"), "");
+
+  WriteLocalFile(GetJournalPath(root, "bbbb-1"), "pending");
+  WriteLocalFile(GetDeletionMarkerPath(root, "bbbb-1"), "");
+
+  WriteBehindStorage writeBehind(storage, (root.GetPath() / "journal").string(), 1, false);
+
+  ASSERT_FALSE(writeBehind.FileExists("aaaa-1", OrthancPluginContentType_Dicom, false));
+  ASSERT_FALSE(writeBehind.FileExists("bbbb-1", OrthancPluginContentType_Dicom, false));
+  ASSERT_FALSE(boost::filesystem::exists(GetJournalPath(root, "bbbb-1")));
+
+  for (unsigned int i = 0; i < 1000 && (boost::filesystem::exists(GetDeletionMarkerPath(root, "aaaa-1")) ||
+                                        boost::filesystem::exists(GetDeletionMarkerPath(root, "bbbb-1"))); i++)
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  }
+
+  ASSERT_FALSE(boost::filesystem::exists(GetDeletionMarkerPath(root, "aaaa-1")));
+  ASSERT_FALSE(boost::filesystem::exists(GetDeletionMarkerPath(root, "bbbb-1")));
+  ASSERT_FALSE(storage->FileExists("aaaa-1", OrthancPluginContentType_Dicom, false));
+  ASSERT_FALSE(storage->FileExists("bbbb-1", OrthancPluginContentType_Dicom, false));
+}
+
+
+TEST(WriteBehindStorage, ReplayAtStartup)
+{
+  TemporaryDirectory root;
+
+  // the journal of an interrupted instance: a pending upload, a complete temporary file whose
+  // renaming has been lost, and a partial temporary file that has never been acknowledged
+  WriteLocalFile(GetJournalPath(root, "aaaa-1"), "pending");
+
+  boost::filesystem::path complete = GetJournalPath(root, "bbbb-1");
+  complete += ".8.tmp";
+  WriteLocalFile(complete, "complete");
+
+  boost::filesystem::path partial = GetJournalPath(root, "cccc-1");
+  partial += ".100.tmp";
+  WriteLocalFile(partial, "partial");
+
+  ControlledStorage* storage = new ControlledStorage((root.GetPath() / "storage").string());
+  WriteBehindStorage writeBehind(storage, (root.GetPath() / "journal").string(), 2, false);
+
+  ASSERT_FALSE(boost::filesystem::exists(complete));
+  ASSERT_FALSE(boost::filesystem::exists(partial));
+
+  ASSERT_TRUE(WaitForUpload(root, *storage, "aaaa-1"));
+  ASSERT_TRUE(WaitForUpload(root, *storage, "bbbb-1"));
+  ASSERT_EQ("pending", ReadObject(writeBehind, "aaaa-1"));
+  ASSERT_EQ("complete", ReadObject(writeBehind, "bbbb-1"));
+  ASSERT_FALSE(writeBehind.FileExists("cccc-1", OrthancPluginContentType_Dicom, false));
+}